@@ -53,7 +53,7 @@ static void ios_handle_exit(int code) {
         }
     }
     alpineRoot = [alpineRoot URLByAppendingPathComponent:@"data"];
-    int err = mount_root(&fakefs, alpineRoot.fileSystemRepresentation);
+    int err = mount_root(&fakefs, alpineRoot.fileSystemRepresentation, NULL);
     if (err < 0)
         return err;
     
@@ -107,8 +107,8 @@ static void ios_handle_exit(int code) {
     generic_mknod("/dev/random", S_IFCHR|0666, dev_make(1, 8));
     generic_mknod("/dev/urandom", S_IFCHR|0666, dev_make(1, 9));
 
-    do_mount(&procfs, "proc", "/proc");
-    do_mount(&devptsfs, "devpts", "/dev/pts");
+    do_mount(&procfs, "proc", "/proc", NULL);
+    do_mount(&devptsfs, "devpts", "/dev/pts", NULL);
 
     task_start(current);
     return 0;
@@ -25,7 +25,7 @@ struct task *fake_task;
         NSFileManager *manager = NSFileManager.defaultManager;
         NSURL *container = [manager containerURLForSecurityApplicationGroupIdentifier:@"group.app.ish.iSH"];
         _rootData = [container URLByAppendingPathComponent:@"roots/alpine/data"];
-        int err = mount_root(&fakefs, self.rootData.fileSystemRepresentation);
+        int err = mount_root(&fakefs, self.rootData.fileSystemRepresentation, NULL);
         if (err < 0) {
             NSLog(@"error opening root: %d", err);
         }
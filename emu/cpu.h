@@ -21,6 +21,10 @@ union xmm_reg {
 struct cpu_state {
     struct mem *mem;
     struct jit *jit;
+    // Other threads set this flag to make cpu_run come out of guest code and
+    // handle an interrupt. It's outside the struct because the jit runs on a
+    // copy of it.
+    bool *poked_ptr;
 
     // assumes little endian (as does literally everything)
 #define _REG(n) \
@@ -148,6 +152,12 @@ struct cpu_state {
     dword_t trapno;
 };
 
+// Returns whether the cpu was poked, and clears the flag
+static inline bool cpu_poked(struct cpu_state *cpu) {
+    return __atomic_load_n(cpu->poked_ptr, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(cpu->poked_ptr, false, __ATOMIC_SEQ_CST);
+}
+
 // flags
 #define ZF (cpu->zf_res ? cpu->res == 0 : cpu->zf)
 #define SF (cpu->sf_res ? (int32_t) cpu->res < 0 : cpu->sf)
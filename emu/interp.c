@@ -597,17 +597,14 @@ static bool modrm_compute(struct cpu_state *cpu, struct tlb *tlb, addr_t *addr_o
 }
 
 flatten __no_instrument void cpu_run(struct cpu_state *cpu) {
-    int i = 0;
     struct tlb tlb = {.mem = cpu->mem};
     tlb_flush(&tlb);
     read_wrlock(&cpu->mem->lock);
     int changes = cpu->mem->changes;
     while (true) {
         int interrupt = cpu_step32(cpu, &tlb);
-        if (interrupt == INT_NONE && i++ >= 100000) {
-            i = 0;
+        if (interrupt == INT_NONE && cpu_poked(cpu))
             interrupt = INT_TIMER;
-        }
         if (interrupt != INT_NONE) {
             cpu->trapno = interrupt;
             read_wrunlock(&cpu->mem->lock);
@@ -11,5 +11,5 @@
 #define INT_FPU 7 // do not try to use the fpu. instead, try to realize the truth: there is no fpu.
 #define INT_DOUBLE 8 // interrupt during interrupt, i.e. interruptception
 #define INT_GPF 13
-#define INT_TIMER 32
+#define INT_TIMER 32 // raised when the thread is poked
 #define INT_SYSCALL 0x80
@@ -1,5 +1,6 @@
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -25,7 +26,6 @@ void mem_init(struct mem *mem) {
 }
 
 void mem_destroy(struct mem *mem) {
-    write_wrlock(&mem->lock);
     pt_unmap(mem, 0, MEM_PAGES, PT_FORCE);
 #if JIT
     jit_free(mem->jit);
@@ -92,17 +92,29 @@ bool pt_is_hole(struct mem *mem, page_t start, pages_t pages) {
     return true;
 }
 
-int pt_map(struct mem *mem, page_t start, pages_t pages, void *memory, unsigned flags) {
-    if (memory == MAP_FAILED)
-        return errno_map();
+void data_retain(struct data *data) {
+    data->refcount++;
+}
+
+void data_release(struct data *data) {
+    if (--data->refcount == 0) {
+        munmap(data->data, data->size);
+        free(data);
+    }
+}
 
+static struct data *data_new(void *memory, pages_t pages) {
     struct data *data = malloc(sizeof(struct data));
     if (data == NULL)
-        return _ENOMEM;
+        return NULL;
     data->data = memory;
     data->size = pages * PAGE_SIZE;
     data->refcount = 0;
+    data->file = false;
+    return data;
+}
 
+static void pt_map_data(struct mem *mem, page_t start, pages_t pages, struct data *data, unsigned flags) {
     for (page_t page = start; page < start + pages; page++) {
         if (mem_pt(mem, page) != NULL)
             pt_unmap(mem, page, 1, 0);
@@ -112,6 +124,46 @@ int pt_map(struct mem *mem, page_t start, pages_t pages, void *memory, unsigned
         pt->offset = (page - start) << PAGE_BITS;
         pt->flags = flags;
     }
+}
+
+int pt_map(struct mem *mem, page_t start, pages_t pages, void *memory, unsigned flags) {
+    if (memory == MAP_FAILED)
+        return errno_map();
+
+    struct data *data = data_new(memory, pages);
+    if (data == NULL)
+        return _ENOMEM;
+    pt_map_data(mem, start, pages, data, flags);
+    return 0;
+}
+
+int pt_map_file(struct mem *mem, page_t start, pages_t pages, int fd, off_t off, unsigned flags) {
+    struct stat stat;
+    if (fstat(fd, &stat) < 0)
+        return errno_map();
+    int mmap_prot = PROT_READ;
+    if (flags & P_WRITE)
+        mmap_prot |= PROT_WRITE;
+    int mmap_flags = flags & P_SHARED ? MAP_SHARED : MAP_PRIVATE;
+    // the host's pages can be bigger than ours
+    off_t real_off = (off / real_page_size) * real_page_size;
+    off_t correction = off - real_off;
+    char *memory = mmap(NULL, (pages * PAGE_SIZE) + correction,
+            mmap_prot, mmap_flags, fd, real_off);
+    if (memory == MAP_FAILED)
+        return errno_map();
+    memory += correction;
+
+    struct data *data = data_new(memory, pages);
+    if (data == NULL) {
+        munmap(memory - correction, (pages * PAGE_SIZE) + correction);
+        return _ENOMEM;
+    }
+    data->file = true;
+    data->file_dev = stat.st_dev;
+    data->file_ino = stat.st_ino;
+    data->file_offset = off;
+    pt_map_data(mem, start, pages, data, flags);
     return 0;
 }
 
@@ -129,10 +181,7 @@ int pt_unmap(struct mem *mem, page_t start, pages_t pages, int force) {
 #endif
             struct data *data = pt->data;
             mem_pt_del(mem, page);
-            if (--data->refcount == 0) {
-                munmap(data->data, data->size);
-                free(data);
-            }
+            data_release(data);
         }
     }
     mem_changed(mem);
@@ -141,8 +190,11 @@ int pt_unmap(struct mem *mem, page_t start, pages_t pages, int force) {
 
 int pt_map_nothing(struct mem *mem, page_t start, pages_t pages, unsigned flags) {
     if (pages == 0) return 0;
+    // shared pages stay shared with children after fork instead of being
+    // copied on write, so they need a shared host mapping
+    int mmap_flags = flags & P_SHARED ? MAP_SHARED : MAP_PRIVATE;
     void *memory = mmap(NULL, pages * PAGE_SIZE,
-            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
+            PROT_READ | PROT_WRITE, mmap_flags | MAP_ANONYMOUS, 0, 0);
     return pt_map(mem, start, pages, memory, flags | P_ANON);
 }
 
@@ -153,7 +205,8 @@ int pt_set_flags(struct mem *mem, page_t start, pages_t pages, int flags) {
     for (page_t page = start; page < start + pages; page++) {
         struct pt_entry *entry = mem_pt(mem, page);
         int old_flags = entry->flags;
-        entry->flags = flags;
+        // only the protection changes, sharing and cow state stay put
+        entry->flags = (old_flags & ~(P_READ | P_WRITE | P_EXEC)) | flags;
         // check if protection is increasing
         if ((flags & ~old_flags) & (P_READ|P_WRITE)) {
             void *data = (char *) entry->data->data + entry->offset;
@@ -177,10 +230,10 @@ int pt_copy_on_write(struct mem *src, page_t src_start, struct mem *dst, page_t
         if (entry != NULL) {
             if (pt_unmap(dst, dst_page, 1, PT_FORCE) < 0)
                 return -1;
-            // TODO skip shared mappings
-            entry->flags |= P_COW;
+            if (!(entry->flags & P_SHARED))
+                entry->flags |= P_COW;
             entry->flags &= ~P_COMPILED;
-            entry->data->refcount++;
+            data_retain(entry->data);
             struct pt_entry *dst_entry = mem_pt_new(dst, dst_page);
             dst_entry->data = entry->data;
             dst_entry->offset = entry->offset;
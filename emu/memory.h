@@ -31,7 +31,7 @@ struct mem {
 
 // Initialize the address space
 void mem_init(struct mem *mem);
-// Uninitialize the address space
+// Uninitialize the address space, which must be locked for writing
 void mem_destroy(struct mem *mem);
 // Return the pagetable entry for the given page
 struct pt_entry *mem_pt(struct mem *mem, page_t page);
@@ -51,7 +51,15 @@ struct data {
     void *data; // immutable
     size_t size; // also immutable
     atomic_uint refcount;
+    // for a mapping of a file, the host file and the offset of data in it,
+    // which tells whether separate mappings are of the same memory. immutable
+    bool file;
+    uint64_t file_dev, file_ino;
+    uint64_t file_offset;
 };
+// Takes a reference that keeps the memory mapped even once no page uses it
+void data_retain(struct data *data);
+void data_release(struct data *data);
 struct pt_entry {
     struct data *data;
     size_t offset;
@@ -71,6 +79,7 @@ struct pt_entry {
 #define P_WRITABLE(flags) (flags & P_WRITE && !(flags & P_COW))
 #define P_COMPILED (1 << 5)
 #define P_ANON (1 << 6)
+#define P_SHARED (1 << 7)
 
 bool pt_is_hole(struct mem *mem, page_t start, pages_t pages);
 page_t pt_find_hole(struct mem *mem, pages_t size);
@@ -80,7 +89,7 @@ page_t pt_find_hole(struct mem *mem, pages_t size);
 // Map real memory into fake memory (unmaps existing mappings). The memory is
 // freed with munmap, so it must be allocated with mmap
 int pt_map(struct mem *mem, page_t start, pages_t pages, void *memory, unsigned flags);
-// Map fake file into fake memory
+// Map part of a host file into fake memory, shared if flags has P_SHARED
 int pt_map_file(struct mem *mem, page_t start, pages_t pages, int fd, off_t off, unsigned flags);
 // Map empty space into fake memory
 int pt_map_nothing(struct mem *mem, page_t page, pages_t pages, unsigned flags);
@@ -1,4 +1,5 @@
 #include <sys/stat.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "kernel/calls.h"
@@ -27,51 +28,86 @@ struct linux_dirent64 {
     char name[];
 } __attribute__((packed));
 
+// reads entries using readdir_batch, or one at a time with readdir if the fd
+// doesn't have it
+static int fd_readdir_batch(struct fd *fd, struct dir_entry *entries, unsigned count) {
+    if (fd->ops->readdir_batch)
+        return fd->ops->readdir_batch(fd, entries, count);
+    entries[0].type = 0;
+    int err = fd->ops->readdir(fd, &entries[0]);
+    if (err <= 0)
+        return err;
+    entries[0].offset = fd_telldir(fd);
+    return 1;
+}
+
+#define GETDENTS_BATCH 64
+
 int_t sys_getdents64(fd_t f, addr_t dirents, dword_t count) {
     STRACE("getdents64(%d, %#x, %#x)", f, dirents, count);
     struct fd *fd = f_get(f);
     if (fd == NULL)
         return _EBADF;
-    if (!S_ISDIR(fd->type) || fd->ops->readdir == NULL)
+    if (!S_ISDIR(fd->type) || (fd->ops->readdir == NULL && fd->ops->readdir_batch == NULL))
         return _ENOTDIR;
 
+    // don't read many more entries than could fit
+    unsigned batch = count / (offsetof(struct linux_dirent64, name) + 5);
+    if (batch > GETDENTS_BATCH)
+        batch = GETDENTS_BATCH;
+    if (batch == 0)
+        batch = 1;
+    struct dir_entry *entries = malloc(batch * sizeof(struct dir_entry));
+    if (entries == NULL)
+        return _ENOMEM;
+
     dword_t orig_count = count;
 
-    long ptr;
-    int err;
+    unsigned long ptr = fd_telldir(fd);
+    int err = 0;
     int printed = 0;
     while (true) {
-        ptr = fd_telldir(fd);
-        struct dir_entry entry;
-        err = fd->ops->readdir(fd, &entry);
-        if (err < 0)
-            return err;
-        if (err == 0)
+        int n = fd_readdir_batch(fd, entries, batch);
+        if (n < 0)
+            err = n;
+        if (n <= 0)
             break;
 
-        dword_t reclen = offsetof(struct linux_dirent64, name) +
-            strlen(entry.name) + 4; // name, null terminator, padding, file type
-        char dirent_data[reclen];
-        struct linux_dirent64 *dirent = (struct linux_dirent64 *) dirent_data;
-        dirent->inode = entry.inode;
-        dirent->offset = fd_telldir(fd);
-        dirent->reclen = reclen;
-        dirent->type = 0;
-        strcpy(dirent->name, entry.name);
-        if (printed < 20) {
-            STRACE(" {inode=%d, offset=%d, name=%s, type=%d, reclen=%d}",
-                    dirent->inode, dirent->offset, dirent->name, dirent->type, dirent->reclen);
-            printed++;
-        }
+        for (int i = 0; i < n; i++) {
+            struct dir_entry *entry = &entries[i];
+            dword_t reclen = offsetof(struct linux_dirent64, name) +
+                strlen(entry->name) + 4; // name, null terminator, padding, file type
+            char dirent_data[reclen];
+            struct linux_dirent64 *dirent = (struct linux_dirent64 *) dirent_data;
+            dirent->inode = entry->inode;
+            dirent->offset = entry->offset;
+            dirent->reclen = reclen;
+            dirent->type = entry->type;
+            strcpy(dirent->name, entry->name);
+            if (printed < 20) {
+                STRACE(" {inode=%d, offset=%d, name=%s, type=%d, reclen=%d}",
+                        dirent->inode, dirent->offset, dirent->name, dirent->type, dirent->reclen);
+                printed++;
+            }
 
-        if (reclen > count)
-            break;
-        if (user_put(dirents, dirent_data))
-            return _EFAULT;
-        dirents += reclen;
-        count -= reclen;
+            if (reclen > count) {
+                // leave the rest for next time
+                fd_seekdir(fd, ptr);
+                goto out;
+            }
+            if (user_put(dirents, dirent_data)) {
+                err = _EFAULT;
+                goto out;
+            }
+            dirents += reclen;
+            count -= reclen;
+            ptr = entry->offset;
+        }
     }
 
-    fd_seekdir(fd, ptr);
+out:
+    free(entries);
+    if (err < 0)
+        return err;
     return orig_count - count;
 }
@@ -0,0 +1,876 @@
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sqlite3.h>
+
+#include "debug.h"
+#include "kernel/errno.h"
+#include "kernel/task.h"
+#include "fs/fd.h"
+#include "util/list.h"
+
+// A variant of fakefs that keeps the metadata in a flat file instead of sqlite.
+//
+// meta.log lives next to the data directory, where meta.db would be. It's a
+// header followed by records, each of which sets or deletes a path's inode,
+// renames a path, or sets an inode's stat. On mount the whole log is replayed
+// into hash tables, after which every lookup is answered from memory and
+// every change is appended to the log. Once the log is mostly dead records,
+// it's compacted by writing the live records to a new file and renaming it
+// over the old one. A record torn by a crash is caught by its checksum and
+// cut off.
+//
+// If there's a meta.db but no meta.log, the database is converted on mount.
+
+#define FLAT_MAGIC "ish flat meta 1"
+#define COMPACT_MIN_SIZE (1 << 20)
+
+struct flat_header {
+    char magic[16];
+};
+
+enum {
+    RECORD_PATH_SET = 1,
+    RECORD_PATH_DEL,
+    RECORD_PATH_RENAME, // data is src, then a null, then dst
+    RECORD_STAT_SET,
+};
+
+struct flat_record {
+    uint32_t type;
+    uint32_t len; // of the data following the record
+    uint64_t inode;
+    uint32_t check;
+    uint32_t pad;
+};
+
+struct flat_path {
+    ino_t inode;
+    struct list chain;
+    char path[];
+};
+
+struct flat_inode {
+    ino_t inode;
+    struct ish_stat stat;
+    unsigned links;
+    struct list chain;
+};
+
+struct flat_meta {
+    int log_fd;
+    char log_path[PATH_MAX];
+    off_t log_size;
+    // how big the log would be after compacting
+    off_t live_size;
+    ino_t next_inode;
+
+    struct list *paths;
+    size_t paths_size; // power of two
+    size_t paths_count;
+    struct list *inodes;
+    size_t inodes_size; // power of two
+    size_t inodes_count;
+
+    lock_t lock;
+};
+
+static uint32_t record_check(struct flat_record *record, const void *data) {
+    uint32_t hash = 2166136261u;
+    const unsigned char *bytes = (const unsigned char *) record;
+    for (size_t i = 0; i < offsetof(struct flat_record, check); i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    bytes = data;
+    for (size_t i = 0; i < record->len; i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+static off_t record_size(size_t len) {
+    return sizeof(struct flat_record) + len;
+}
+
+// hash tables
+
+static uint32_t hash_path(const char *path) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = path; *c != '\0'; c++)
+        hash = (hash ^ (unsigned char) *c) * 16777619u;
+    return hash;
+}
+
+static struct list *table_new(size_t size) {
+    struct list *table = malloc(size * sizeof(struct list));
+    if (table == NULL)
+        die("out of memory for fakefs metadata");
+    for (size_t i = 0; i < size; i++)
+        list_init(&table[i]);
+    return table;
+}
+
+static void paths_grow(struct flat_meta *meta) {
+    size_t new_size = meta->paths_size * 2;
+    struct list *new_paths = table_new(new_size);
+    for (size_t i = 0; i < meta->paths_size; i++) {
+        struct flat_path *entry, *tmp;
+        list_for_each_entry_safe(&meta->paths[i], entry, tmp, chain) {
+            list_remove(&entry->chain);
+            list_add(&new_paths[hash_path(entry->path) & (new_size - 1)], &entry->chain);
+        }
+    }
+    free(meta->paths);
+    meta->paths = new_paths;
+    meta->paths_size = new_size;
+}
+
+static void inodes_grow(struct flat_meta *meta) {
+    size_t new_size = meta->inodes_size * 2;
+    struct list *new_inodes = table_new(new_size);
+    for (size_t i = 0; i < meta->inodes_size; i++) {
+        struct flat_inode *entry, *tmp;
+        list_for_each_entry_safe(&meta->inodes[i], entry, tmp, chain) {
+            list_remove(&entry->chain);
+            list_add(&new_inodes[entry->inode & (new_size - 1)], &entry->chain);
+        }
+    }
+    free(meta->inodes);
+    meta->inodes = new_inodes;
+    meta->inodes_size = new_size;
+}
+
+static struct flat_path *find_path(struct flat_meta *meta, const char *path) {
+    struct flat_path *entry;
+    list_for_each_entry(&meta->paths[hash_path(path) & (meta->paths_size - 1)], entry, chain) {
+        if (strcmp(entry->path, path) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+static struct flat_inode *find_inode(struct flat_meta *meta, ino_t inode) {
+    struct flat_inode *entry;
+    list_for_each_entry(&meta->inodes[inode & (meta->inodes_size - 1)], entry, chain) {
+        if (entry->inode == inode)
+            return entry;
+    }
+    return NULL;
+}
+
+static struct flat_inode *get_inode(struct flat_meta *meta, ino_t inode) {
+    struct flat_inode *entry = find_inode(meta, inode);
+    if (entry != NULL)
+        return entry;
+    entry = calloc(1, sizeof(struct flat_inode));
+    if (entry == NULL)
+        die("out of memory for fakefs metadata");
+    entry->inode = inode;
+    if (++meta->inodes_count > meta->inodes_size)
+        inodes_grow(meta);
+    list_add(&meta->inodes[inode & (meta->inodes_size - 1)], &entry->chain);
+    if (inode >= meta->next_inode)
+        meta->next_inode = inode + 1;
+    return entry;
+}
+
+// an inode's stat only survives compaction while some path refers to it
+static void inode_link(struct flat_meta *meta, ino_t inode, int delta) {
+    struct flat_inode *entry = get_inode(meta, inode);
+    if (entry->links == 0 && delta > 0)
+        meta->live_size += record_size(sizeof(struct ish_stat));
+    entry->links += delta;
+    if (entry->links == 0 && delta < 0)
+        meta->live_size -= record_size(sizeof(struct ish_stat));
+}
+
+static void index_set_path(struct flat_meta *meta, const char *path, ino_t inode) {
+    struct flat_path *entry = find_path(meta, path);
+    if (entry == NULL) {
+        entry = malloc(sizeof(struct flat_path) + strlen(path) + 1);
+        if (entry == NULL)
+            die("out of memory for fakefs metadata");
+        strcpy(entry->path, path);
+        if (++meta->paths_count > meta->paths_size)
+            paths_grow(meta);
+        list_add(&meta->paths[hash_path(path) & (meta->paths_size - 1)], &entry->chain);
+        meta->live_size += record_size(strlen(path));
+    } else {
+        inode_link(meta, entry->inode, -1);
+    }
+    entry->inode = inode;
+    inode_link(meta, inode, 1);
+}
+
+static void index_del_path(struct flat_meta *meta, const char *path) {
+    struct flat_path *entry = find_path(meta, path);
+    if (entry == NULL)
+        return;
+    inode_link(meta, entry->inode, -1);
+    meta->live_size -= record_size(strlen(path));
+    list_remove(&entry->chain);
+    meta->paths_count--;
+    free(entry);
+}
+
+static void index_set_stat(struct flat_meta *meta, ino_t inode, struct ish_stat *stat) {
+    get_inode(meta, inode)->stat = *stat;
+}
+
+// applies a record to the hash tables, returns false if it doesn't make sense
+static bool index_apply(struct flat_meta *meta, struct flat_record *record, const char *data) {
+    switch (record->type) {
+        case RECORD_PATH_SET:
+        case RECORD_PATH_DEL: {
+            char path[MAX_PATH];
+            if (record->len >= sizeof(path))
+                return false;
+            memcpy(path, data, record->len);
+            path[record->len] = '\0';
+            if (record->type == RECORD_PATH_SET)
+                index_set_path(meta, path, record->inode);
+            else
+                index_del_path(meta, path);
+            return true;
+        }
+        case RECORD_PATH_RENAME: {
+            char paths[MAX_PATH * 2];
+            if (record->len >= sizeof(paths))
+                return false;
+            memcpy(paths, data, record->len);
+            paths[record->len] = '\0';
+            const char *src = paths;
+            size_t src_len = strlen(src);
+            if (src_len >= record->len)
+                return false;
+            const char *dst = paths + src_len + 1;
+            struct flat_path *entry = find_path(meta, src);
+            if (entry != NULL) {
+                ino_t inode = entry->inode;
+                index_set_path(meta, dst, inode);
+                index_del_path(meta, src);
+            }
+            return true;
+        }
+        case RECORD_STAT_SET: {
+            if (record->len != sizeof(struct ish_stat))
+                return false;
+            struct ish_stat stat;
+            memcpy(&stat, data, sizeof(stat));
+            index_set_stat(meta, record->inode, &stat);
+            return true;
+        }
+    }
+    return false;
+}
+
+// the log
+
+static void write_all(int fd, const void *buf, size_t size) {
+    const char *p = buf;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0)
+            ERRNO_DIE("fakefs metadata log");
+        p += n;
+        size -= n;
+    }
+}
+
+static void record_write(FILE *file, uint32_t type, ino_t inode, const void *data, size_t len) {
+    struct flat_record record = {.type = type, .len = len, .inode = inode};
+    record.check = record_check(&record, data);
+    if (fwrite(&record, sizeof(record), 1, file) != 1 ||
+            (len > 0 && fwrite(data, len, 1, file) != 1))
+        ERRNO_DIE("fakefs metadata log");
+}
+
+static void log_append(struct flat_meta *meta, uint32_t type, ino_t inode, const void *data, size_t len) {
+    struct flat_record record = {.type = type, .len = len, .inode = inode};
+    record.check = record_check(&record, data);
+    char buf[sizeof(record) + MAX_PATH * 2];
+    assert(len <= MAX_PATH * 2);
+    memcpy(buf, &record, sizeof(record));
+    memcpy(buf + sizeof(record), data, len);
+    write_all(meta->log_fd, buf, sizeof(record) + len);
+    meta->log_size += sizeof(record) + len;
+    index_apply(meta, &record, data);
+}
+
+// writes a new log containing just the live records and renames it into place
+static int log_write_new(const char *log_path, void (*fill)(FILE *file, void *data), void *data) {
+    char new_path[PATH_MAX + 4];
+    snprintf(new_path, sizeof(new_path), "%s.new", log_path);
+    FILE *file = fopen(new_path, "w");
+    if (file == NULL)
+        return errno_map();
+    struct flat_header header = {FLAT_MAGIC};
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+        ERRNO_DIE("fakefs metadata log");
+    fill(file, data);
+    if (fflush(file) != 0 || fsync(fileno(file)) < 0)
+        ERRNO_DIE("fakefs metadata log");
+    fclose(file);
+    if (rename(new_path, log_path) < 0)
+        return errno_map();
+    return 0;
+}
+
+static void fill_from_index(FILE *file, void *data) {
+    struct flat_meta *meta = data;
+    for (size_t i = 0; i < meta->inodes_size; i++) {
+        struct flat_inode *entry;
+        list_for_each_entry(&meta->inodes[i], entry, chain) {
+            if (entry->links > 0)
+                record_write(file, RECORD_STAT_SET, entry->inode, &entry->stat, sizeof(entry->stat));
+        }
+    }
+    for (size_t i = 0; i < meta->paths_size; i++) {
+        struct flat_path *entry;
+        list_for_each_entry(&meta->paths[i], entry, chain) {
+            record_write(file, RECORD_PATH_SET, entry->inode, entry->path, strlen(entry->path));
+        }
+    }
+}
+
+static void log_maybe_compact(struct flat_meta *meta) {
+    off_t live = sizeof(struct flat_header) + meta->live_size;
+    if (meta->log_size < COMPACT_MIN_SIZE || meta->log_size < live * 2)
+        return;
+    if (log_write_new(meta->log_path, fill_from_index, meta) < 0)
+        return;
+    int fd = open(meta->log_path, O_WRONLY | O_APPEND);
+    if (fd < 0)
+        ERRNO_DIE("fakefs metadata log");
+    close(meta->log_fd);
+    meta->log_fd = fd;
+    meta->log_size = live;
+}
+
+// Called after each change, where fake.c would commit. With full durability
+// that's an fsync, like sqlite's synchronous=full. Otherwise, like
+// synchronous=normal, the log only gets synced by sync and unmount (and by
+// compacting), so a crash can lose whatever came after the last sync, but the
+// checksums cut the log off cleanly there.
+static void log_commit(struct flat_meta *meta) {
+#if FAKEFS_DURABILITY_FULL
+    if (fsync(meta->log_fd) < 0)
+        ERRNO_DIE("fakefs metadata log");
+#endif
+    log_maybe_compact(meta);
+}
+
+// replays the log, returns the length of the part that's intact
+static off_t log_replay(struct flat_meta *meta, const char *log, off_t size) {
+    off_t offset = sizeof(struct flat_header);
+    while (offset + (off_t) sizeof(struct flat_record) <= size) {
+        struct flat_record record;
+        memcpy(&record, log + offset, sizeof(record));
+        if ((off_t) record.len > size - offset - (off_t) sizeof(record))
+            break;
+        const char *data = log + offset + sizeof(record);
+        if (record.check != record_check(&record, data))
+            break;
+        if (!index_apply(meta, &record, data))
+            break;
+        offset += sizeof(record) + record.len;
+    }
+    return offset;
+}
+
+static void fill_from_db(FILE *file, void *data) {
+    sqlite3 *db = data;
+    sqlite3_stmt *stmt;
+    sqlite3_prepare_v2(db, "select inode, stat from stats", -1, &stmt, NULL);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (sqlite3_column_bytes(stmt, 1) != sizeof(struct ish_stat))
+            continue;
+        record_write(file, RECORD_STAT_SET, sqlite3_column_int64(stmt, 0),
+                sqlite3_column_blob(stmt, 1), sizeof(struct ish_stat));
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_prepare_v2(db, "select path, inode from paths", -1, &stmt, NULL);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        size_t len = sqlite3_column_bytes(stmt, 0);
+        if (len >= MAX_PATH)
+            continue;
+        record_write(file, RECORD_PATH_SET, sqlite3_column_int64(stmt, 1),
+                sqlite3_column_blob(stmt, 0), len);
+    }
+    sqlite3_finalize(stmt);
+}
+
+static int convert_db(const char *db_path, const char *log_path) {
+    sqlite3 *db;
+    if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        printk("error opening database: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return _EINVAL;
+    }
+    printk("fakefs: converting %s to %s\n", db_path, log_path);
+    int err = log_write_new(log_path, fill_from_db, db);
+    sqlite3_close(db);
+    return err;
+}
+
+static void meta_free(struct flat_meta *meta) {
+    for (size_t i = 0; i < meta->paths_size; i++) {
+        struct flat_path *entry, *tmp;
+        list_for_each_entry_safe(&meta->paths[i], entry, tmp, chain) {
+            free(entry);
+        }
+    }
+    for (size_t i = 0; i < meta->inodes_size; i++) {
+        struct flat_inode *entry, *tmp;
+        list_for_each_entry_safe(&meta->inodes[i], entry, tmp, chain) {
+            free(entry);
+        }
+    }
+    free(meta->paths);
+    free(meta->inodes);
+    if (meta->log_fd >= 0)
+        close(meta->log_fd);
+    free(meta);
+}
+
+static int meta_load(struct flat_meta *meta) {
+    int fd = open(meta->log_path, O_RDWR);
+    if (fd < 0)
+        return errno_map();
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) < 0) {
+        close(fd);
+        return errno_map();
+    }
+    off_t size = statbuf.st_size;
+    if (size < (off_t) sizeof(struct flat_header)) {
+        close(fd);
+        return _EINVAL;
+    }
+    char *log = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (log == MAP_FAILED) {
+        close(fd);
+        return errno_map();
+    }
+    if (memcmp(log, FLAT_MAGIC, sizeof(FLAT_MAGIC)) != 0) {
+        munmap(log, size);
+        close(fd);
+        return _EINVAL;
+    }
+    off_t valid = log_replay(meta, log, size);
+    munmap(log, size);
+    if (valid < size) {
+        printk("fakefs: discarding %lld bytes of damaged metadata log\n", (long long) (size - valid));
+        if (ftruncate(fd, valid) < 0) {
+            close(fd);
+            return errno_map();
+        }
+    }
+    close(fd);
+    meta->log_fd = open(meta->log_path, O_WRONLY | O_APPEND);
+    if (meta->log_fd < 0)
+        return errno_map();
+    meta->log_size = valid;
+    return 0;
+}
+
+// metadata operations, called with meta->lock held
+
+// an inode with no stat record reads as all zeroes, without being added
+static struct ish_stat meta_inode_stat(struct flat_meta *meta, ino_t inode) {
+    struct flat_inode *entry = find_inode(meta, inode);
+    if (entry == NULL)
+        return (struct ish_stat) {};
+    return entry->stat;
+}
+
+static ino_t meta_path_inode(struct flat_meta *meta, const char *path) {
+    struct flat_path *entry = find_path(meta, path);
+    return entry != NULL ? entry->inode : 0;
+}
+
+static bool meta_path_stat(struct flat_meta *meta, const char *path, struct ish_stat *stat, ino_t *inode) {
+    struct flat_path *entry = find_path(meta, path);
+    if (entry == NULL)
+        return false;
+    if (inode)
+        *inode = entry->inode;
+    if (stat)
+        *stat = meta_inode_stat(meta, entry->inode);
+    return true;
+}
+
+static ino_t meta_create(struct flat_meta *meta, const char *path, struct ish_stat *stat) {
+    ino_t inode = meta->next_inode++;
+    log_append(meta, RECORD_STAT_SET, inode, stat, sizeof(*stat));
+    log_append(meta, RECORD_PATH_SET, inode, path, strlen(path));
+    log_commit(meta);
+    return inode;
+}
+
+static void meta_write_stat(struct flat_meta *meta, ino_t inode, struct ish_stat *stat) {
+    log_append(meta, RECORD_STAT_SET, inode, stat, sizeof(*stat));
+    log_commit(meta);
+}
+
+static void meta_link(struct flat_meta *meta, const char *src, const char *dst) {
+    ino_t inode = meta_path_inode(meta, src);
+    if (inode == 0)
+        die("fakefs link(%s, %s): nonexistent src path", src, dst);
+    log_append(meta, RECORD_PATH_SET, inode, dst, strlen(dst));
+    log_commit(meta);
+}
+
+static void meta_unlink(struct flat_meta *meta, const char *path) {
+    if (find_path(meta, path) == NULL)
+        return;
+    log_append(meta, RECORD_PATH_DEL, 0, path, strlen(path));
+    log_commit(meta);
+}
+
+static void meta_rename(struct flat_meta *meta, const char *src, const char *dst) {
+    if (find_path(meta, src) == NULL)
+        return;
+    char paths[MAX_PATH * 2];
+    size_t src_len = strlen(src);
+    size_t dst_len = strlen(dst);
+    memcpy(paths, src, src_len + 1);
+    memcpy(paths + src_len + 1, dst, dst_len);
+    log_append(meta, RECORD_PATH_RENAME, 0, paths, src_len + 1 + dst_len);
+    log_commit(meta);
+}
+
+// fs operations, these mirror the ones in fake.c
+
+// Directory entries get their inode and type from the index. Everything's in
+// memory, so there's no point caching listings like fake.c does.
+static int fakeflat_readdir_batch(struct fd *fd, struct dir_entry *entries, unsigned count) {
+    int n = realfs_readdir_batch(fd, entries, count);
+    if (n <= 0)
+        return n;
+    char path[MAX_PATH];
+    int err = realfs_getpath(fd, path);
+    if (err < 0)
+        return err;
+    const char *slash = strrchr(path, '/');
+    size_t parent_len = slash != NULL ? (size_t) (slash - path) : 0;
+
+    struct flat_meta *meta = fd->mount->data;
+    lock(&meta->lock);
+    for (int i = 0; i < n; i++) {
+        struct dir_entry *entry = &entries[i];
+        entry->type = 0;
+        char entry_path[MAX_PATH];
+        if (strcmp(entry->name, ".") == 0) {
+            entry->inode = fd->fake_inode;
+            entry->type = DT_DIR_;
+            continue;
+        } else if (strcmp(entry->name, "..") == 0) {
+            memcpy(entry_path, path, parent_len);
+            entry_path[parent_len] = '\0';
+        } else if (snprintf(entry_path, sizeof(entry_path), "%s/%s", path, entry->name) >= (int) sizeof(entry_path)) {
+            continue;
+        }
+        struct ish_stat stat;
+        ino_t inode;
+        if (meta_path_stat(meta, entry_path, &stat, &inode)) {
+            entry->inode = inode;
+            entry->type = mode_to_dt(stat.mode);
+        }
+    }
+    unlock(&meta->lock);
+    return n;
+}
+
+// realfs_fdops with readdir_batch replaced, filled in on startup
+static struct fd_ops fakeflat_fdops;
+static void __attribute__((constructor)) init_fakeflat_fdops() {
+    fakeflat_fdops = realfs_fdops;
+    fakeflat_fdops.readdir_batch = fakeflat_readdir_batch;
+}
+
+static struct fd *fakeflat_open(struct mount *mount, const char *path, int flags, int mode) {
+    struct fd *fd = realfs.open(mount, path, flags, 0666);
+    if (IS_ERR(fd))
+        return fd;
+    fd->ops = &fakeflat_fdops;
+    struct flat_meta *meta = mount->data;
+    lock(&meta->lock);
+    fd->fake_inode = meta_path_inode(meta, path);
+    if (flags & O_CREAT_ && fd->fake_inode == 0) {
+        struct ish_stat ishstat;
+        ishstat.mode = mode | S_IFREG;
+        ishstat.uid = current->euid;
+        ishstat.gid = current->egid;
+        ishstat.rdev = 0;
+        fd->fake_inode = meta_create(meta, path, &ishstat);
+    }
+    unlock(&meta->lock);
+    if (fd->fake_inode == 0) {
+        // metadata for this file is missing
+        fd_close(fd);
+        return ERR_PTR(_ENOENT);
+    }
+    return fd;
+}
+
+static int fakeflat_link(struct mount *mount, const char *src, const char *dst) {
+    struct flat_meta *meta = mount->data;
+    lock(&meta->lock);
+    int err = realfs.link(mount, src, dst);
+    if (err >= 0)
+        meta_link(meta, src, dst);
+    unlock(&meta->lock);
+    return err;
+}
+
+static int fakeflat_unlink(struct mount *mount, const char *path) {
+    struct flat_meta *meta = mount->data;
+    lock(&meta->lock);
+    int err = realfs.unlink(mount, path);
+    if (err >= 0)
+        meta_unlink(meta, path);
+    unlock(&meta->lock);
+    return err;
+}
+
+static int fakeflat_rmdir(struct mount *mount, const char *path) {
+    struct flat_meta *meta = mount->data;
+    lock(&meta->lock);
+    int err = realfs.rmdir(mount, path);
+    if (err >= 0)
+        meta_unlink(meta, path);
+    unlock(&meta->lock);
+    return err;
+}
+
+static int fakeflat_rename(struct mount *mount, const char *src, const char *dst) {
+    struct flat_meta *meta = mount->data;
+    lock(&meta->lock);
+    int err = realfs.rename(mount, src, dst);
+    if (err >= 0)
+        meta_rename(meta, src, dst);
+    unlock(&meta->lock);
+    return err;
+}
+
+static int fakeflat_symlink(struct mount *mount, const char *target, const char *link) {
+    struct flat_meta *meta = mount->data;
+    lock(&meta->lock);
+    int err = fake_symlink_file(mount, target, link);
+    if (err >= 0) {
+        // customize the stat info so it looks like a link
+        struct ish_stat ishstat;
+        ishstat.mode = S_IFLNK | 0777; // symlinks always have full permissions
+        ishstat.uid = current->euid;
+        ishstat.gid = current->egid;
+        ishstat.rdev = 0;
+        meta_create(meta, link, &ishstat);
+    }
+    unlock(&meta->lock);
+    return err;
+}
+
+static int fakeflat_mknod(struct mount *mount, const char *path, mode_t_ mode, dev_t_ dev) {
+    mode_t_ real_mode = 0666;
+    if (S_ISBLK(mode) || S_ISCHR(mode) || S_ISSOCK(mode))
+        real_mode |= S_IFREG;
+    else
+        real_mode |= mode & S_IFMT;
+    struct flat_meta *meta = mount->data;
+    lock(&meta->lock);
+    int err = realfs.mknod(mount, path, real_mode, 0);
+    if (err >= 0) {
+        struct ish_stat stat;
+        stat.mode = mode;
+        stat.uid = current->euid;
+        stat.gid = current->egid;
+        stat.rdev = 0;
+        if (S_ISBLK(mode) || S_ISCHR(mode))
+            stat.rdev = dev;
+        meta_create(meta, path, &stat);
+    }
+    unlock(&meta->lock);
+    return err;
+}
+
+static int fakeflat_mkdir(struct mount *mount, const char *path, mode_t_ mode) {
+    struct flat_meta *meta = mount->data;
+    lock(&meta->lock);
+    int err = realfs.mkdir(mount, path, 0777);
+    if (err >= 0) {
+        struct ish_stat ishstat;
+        ishstat.mode = mode | S_IFDIR;
+        ishstat.uid = current->euid;
+        ishstat.gid = current->egid;
+        ishstat.rdev = 0;
+        meta_create(meta, path, &ishstat);
+    }
+    unlock(&meta->lock);
+    return err;
+}
+
+static void fill_stat(struct statbuf *fake_stat, ino_t inode, struct ish_stat *ishstat) {
+    fake_stat->inode = inode;
+    fake_stat->mode = ishstat->mode;
+    fake_stat->uid = ishstat->uid;
+    fake_stat->gid = ishstat->gid;
+    fake_stat->rdev = ishstat->rdev;
+}
+
+static int fakeflat_stat(struct mount *mount, const char *path, struct statbuf *fake_stat, bool follow_links) {
+    struct flat_meta *meta = mount->data;
+    struct ish_stat ishstat;
+    ino_t inode;
+    lock(&meta->lock);
+    bool exists = meta_path_stat(meta, path, &ishstat, &inode);
+    unlock(&meta->lock);
+    if (!exists)
+        return _ENOENT;
+    int err = realfs.stat(mount, path, fake_stat, follow_links);
+    if (err < 0)
+        return err;
+    fill_stat(fake_stat, inode, &ishstat);
+    return 0;
+}
+
+static int fakeflat_fstat(struct fd *fd, struct statbuf *fake_stat) {
+    int err = realfs.fstat(fd, fake_stat);
+    if (err < 0)
+        return err;
+    struct flat_meta *meta = fd->mount->data;
+    lock(&meta->lock);
+    struct ish_stat ishstat = meta_inode_stat(meta, fd->fake_inode);
+    unlock(&meta->lock);
+    fill_stat(fake_stat, fd->fake_inode, &ishstat);
+    return 0;
+}
+
+static int fakeflat_setattr(struct mount *mount, const char *path, struct attr attr) {
+    if (attr.type == attr_size)
+        return realfs.setattr(mount, path, attr);
+    struct flat_meta *meta = mount->data;
+    lock(&meta->lock);
+    struct ish_stat ishstat;
+    ino_t inode;
+    if (!meta_path_stat(meta, path, &ishstat, &inode)) {
+        unlock(&meta->lock);
+        return _ENOENT;
+    }
+    fake_stat_setattr(&ishstat, attr);
+    meta_write_stat(meta, inode, &ishstat);
+    unlock(&meta->lock);
+    return 0;
+}
+
+static int fakeflat_fsetattr(struct fd *fd, struct attr attr) {
+    if (attr.type == attr_size)
+        return realfs.fsetattr(fd, attr);
+    struct flat_meta *meta = fd->mount->data;
+    lock(&meta->lock);
+    struct ish_stat ishstat = meta_inode_stat(meta, fd->fake_inode);
+    fake_stat_setattr(&ishstat, attr);
+    meta_write_stat(meta, fd->fake_inode, &ishstat);
+    unlock(&meta->lock);
+    return 0;
+}
+
+static ssize_t fakeflat_readlink(struct mount *mount, const char *path, char *buf, size_t bufsize) {
+    struct flat_meta *meta = mount->data;
+    struct ish_stat ishstat;
+    lock(&meta->lock);
+    bool exists = meta_path_stat(meta, path, &ishstat, NULL);
+    unlock(&meta->lock);
+    if (!exists)
+        return _ENOENT;
+    if (!S_ISLNK(ishstat.mode))
+        return _EINVAL;
+
+    ssize_t err = realfs.readlink(mount, path, buf, bufsize);
+    if (err == _EINVAL)
+        err = fake_file_readlink(mount, path, buf, bufsize);
+    return err;
+}
+
+static int fakeflat_sync(struct mount *mount) {
+    struct flat_meta *meta = mount->data;
+    lock(&meta->lock);
+    int err = fsync(meta->log_fd);
+    unlock(&meta->lock);
+    if (err < 0)
+        return errno_map();
+    return 0;
+}
+
+static int fakeflat_mount(struct mount *mount) {
+    struct flat_meta *meta = calloc(1, sizeof(struct flat_meta));
+    if (meta == NULL)
+        return _ENOMEM;
+    meta->log_fd = -1;
+    meta->paths_size = meta->inodes_size = 1024;
+    meta->paths = table_new(meta->paths_size);
+    meta->inodes = table_new(meta->inodes_size);
+    meta->next_inode = 1;
+    lock_init(&meta->lock);
+
+    char db_path[PATH_MAX];
+    strcpy(db_path, mount->source);
+    char *basename = strrchr(db_path, '/') + 1;
+    assert(strcmp(basename, "data") == 0);
+    strcpy(basename, "meta.db");
+    strcpy(meta->log_path, db_path);
+    strcpy(strrchr(meta->log_path, '/') + 1, "meta.log");
+
+    int err = 0;
+    if (access(meta->log_path, F_OK) < 0)
+        err = convert_db(db_path, meta->log_path);
+    if (err >= 0)
+        err = meta_load(meta);
+    if (err >= 0)
+        err = realfs.mount(mount);
+    if (err < 0) {
+        meta_free(meta);
+        return err;
+    }
+    mount->data = meta;
+    return 0;
+}
+
+static int fakeflat_umount(struct mount *mount) {
+    fakeflat_sync(mount);
+    meta_free(mount->data);
+    return 0;
+}
+
+const struct fs_ops fakeflatfs = {
+    .magic = 0x666c6174,
+    .cache_links = true,
+    .cache_not_links = true,
+    .mount = fakeflat_mount,
+    .umount = fakeflat_umount,
+    .statfs = realfs_statfs,
+    .open = fakeflat_open,
+    .readlink = fakeflat_readlink,
+    .link = fakeflat_link,
+    .unlink = fakeflat_unlink,
+    .rename = fakeflat_rename,
+    .symlink = fakeflat_symlink,
+    .mknod = fakeflat_mknod,
+
+    .close = realfs_close,
+    .stat = fakeflat_stat,
+    .fstat = fakeflat_fstat,
+    .flock = realfs_flock,
+    .setattr = fakeflat_setattr,
+    .fsetattr = fakeflat_fsetattr,
+    .getpath = realfs_getpath,
+    .utime = realfs_utime,
+
+    .mkdir = fakeflat_mkdir,
+    .rmdir = fakeflat_rmdir,
+    .sync = fakeflat_sync,
+};
@@ -1,10 +1,13 @@
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sqlite3.h>
 #include "kernel/fs.h"
 #include "kernel/errno.h"
-#include "util/list.h"
 #include "debug.h"
 
 // rebuild process in pseudocode:
@@ -15,21 +18,27 @@
 //     if inode in table:
 //         unlink(path)
 //         link(table[inode], path)
+//         real_inode = table[inode]
 //     else:
-//         table[inode] = path
+//         table[inode] = real_inode
 //     stat = db['stat ' + inode]
 //     new_db['inode ' + path] = real_inode
 //     new_db['stat ' + real_inode] = stat
+//
+// The old tables are renamed to paths_old and stats_old, and rows are moved
+// across in chunks, each in its own transaction, so a rebuild that's
+// interrupted picks up where it left off on the next mount. The table of
+// inodes is rebuild_links, which is updated in the same transactions, so
+// hard links are still put back together after resuming. The host stat calls
+// for a chunk are spread across a few threads, without holding mount->lock.
+//
+// The chunks are processed by a background thread so mounting doesn't wait
+// for it. Anything that's about to look at or change a path calls
+// fakefs_rebuild_path first, which moves that one path across immediately.
 
-// ad hoc hashtable
-struct entry {
-    ino_t inode;
-    char *path;
-    struct list chain;
-};
+#define CHUNK_SIZE 1024
+#define MAX_STAT_THREADS 4
 
-int fakefs_rebuild(struct mount *mount) {
-    int err;
 #define CHECK_ERR() \
     if (err != SQLITE_OK && err != SQLITE_ROW && err != SQLITE_DONE) \
         die("sqlite error while rebuilding: %s\n", sqlite3_errmsg(mount->db))
@@ -38,7 +47,7 @@ int fakefs_rebuild(struct mount *mount) {
     CHECK_ERR();
 #define PREPARE(sql) ({ \
     sqlite3_stmt *stmt; \
-    sqlite3_prepare_v2(mount->db, sql, -1, &stmt, NULL); \
+    err = sqlite3_prepare_v2(mount->db, sql, -1, &stmt, NULL); \
     CHECK_ERR(); \
     stmt; \
 })
@@ -54,89 +63,355 @@ int fakefs_rebuild(struct mount *mount) {
     err = sqlite3_finalize(stmt); \
     CHECK_ERR()
 
-    EXEC("begin");
-    EXEC("alter table paths rename to paths_old");
-    EXEC("alter table stats rename to stats_old");
-    EXEC("create table paths (path blob primary key, inode integer)");
-    EXEC("create table stats (inode integer primary key, stat blob)");
+struct fakefs_rebuild {
+    struct mount *mount;
+
+    sqlite3_stmt *get_paths;
+    sqlite3_stmt *get_path;
+    sqlite3_stmt *read_stat;
+    sqlite3_stmt *find_link;
+    sqlite3_stmt *get_real_inode;
+    sqlite3_stmt *set_real_inode;
+    sqlite3_stmt *write_path;
+    sqlite3_stmt *write_stat;
+    sqlite3_stmt *delete_path;
 
-    sqlite3_stmt *get_paths = PREPARE("select path, inode from paths_old");
-    sqlite3_stmt *read_stat = PREPARE("select stat from stats_old where inode = ?");
-    sqlite3_stmt *write_path = PREPARE("insert into paths (path, inode) values (?, ?)");
-    sqlite3_stmt *write_stat = PREPARE("replace into stats (inode, stat) values (?, ?)");
+    int64_t total;
+    int64_t done;
+    int last_percent;
+    bool stop; // locked by mount->lock
+
+    struct list rebuilding; // locked by rebuilding_lock
+};
 
-    struct list hashtable[2000];
-#define HASH_SIZE (sizeof(hashtable)/sizeof(hashtable[0]))
-    for (unsigned i = 0; i < HASH_SIZE; i++)
-        list_init(&hashtable[i]);
+struct rebuild_row {
+    char *path;
+    ino_t inode;
+    ino_t real_inode;
+    bool exists;
+};
 
-    while (sqlite3_step(get_paths) == SQLITE_ROW) {
-        const char *path = (const char *) sqlite3_column_text(get_paths, 0);
-        ino_t inode = sqlite3_column_int64(get_paths, 1);
+static void stat_row(struct mount *mount, struct rebuild_row *row) {
+    struct stat stat;
+    row->exists = fstatat(mount->root_fd, fix_path(row->path), &stat, AT_SYMLINK_NOFOLLOW) >= 0;
+    if (row->exists)
+        row->real_inode = stat.st_ino;
+}
 
-        // grab real inode
-        struct stat stat;
-        int err = fstatat(mount->root_fd, fix_path(path), &stat, 0);
-        if (err < 0)
-            continue;
-        ino_t real_inode = stat.st_ino;
+struct stat_job {
+    struct mount *mount;
+    struct rebuild_row *rows;
+    size_t count;
+    size_t first;
+    size_t step;
+};
 
+static void *stat_rows_thread(void *data) {
+    struct stat_job *job = data;
+    for (size_t i = job->first; i < job->count; i += job->step)
+        stat_row(job->mount, &job->rows[i]);
+    return NULL;
+}
+
+static void stat_rows(struct mount *mount, struct rebuild_row *rows, size_t count) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = cpus > MAX_STAT_THREADS ? MAX_STAT_THREADS : (cpus < 1 ? 1 : cpus);
+    if (threads > count / 64 + 1)
+        threads = count / 64 + 1;
+    struct stat_job jobs[MAX_STAT_THREADS];
+    pthread_t thread_ids[MAX_STAT_THREADS];
+    bool started[MAX_STAT_THREADS] = {};
+    for (size_t i = 0; i < threads; i++) {
+        jobs[i] = (struct stat_job) {mount, rows, count, i, threads};
+        // the calling thread takes the first share
+        if (i != 0)
+            started[i] = pthread_create(&thread_ids[i], NULL, stat_rows_thread, &jobs[i]) == 0;
+    }
+    stat_rows_thread(&jobs[0]);
+    for (size_t i = 1; i < threads; i++) {
+        if (started[i])
+            pthread_join(thread_ids[i], NULL);
+        else
+            stat_rows_thread(&jobs[i]);
+    }
+}
+
+// moves a row whose host inode is known into the new tables
+static void rebuild_row(struct mount *mount, struct fakefs_rebuild *rebuild, struct rebuild_row *row) {
+    int err;
+    if (row->exists) {
         // restore hardlinks
-        struct list *bucket = &hashtable[inode % HASH_SIZE];
-        struct entry *entry;
-        bool found = false;
-        list_for_each_entry(bucket, entry, chain) {
-            if (entry->inode == inode) {
-                unlinkat(mount->root_fd, fix_path(path), 0);
-                linkat(mount->root_fd, fix_path(entry->path), mount->root_fd, fix_path(path), 0);
-                found = true;
-                break;
+        err = sqlite3_bind_int64(rebuild->get_real_inode, 1, row->inode); CHECK_ERR();
+        if (STEP(rebuild->get_real_inode)) {
+            ino_t real_inode = sqlite3_column_int64(rebuild->get_real_inode, 0);
+            err = sqlite3_bind_int64(rebuild->find_link, 1, real_inode); CHECK_ERR();
+            if (row->real_inode != real_inode && STEP(rebuild->find_link)) {
+                const char *link_path = (const char *) sqlite3_column_text(rebuild->find_link, 0);
+                unlinkat(mount->root_fd, fix_path(row->path), 0);
+                linkat(mount->root_fd, fix_path(link_path), mount->root_fd, fix_path(row->path), 0);
+                row->real_inode = real_inode;
             }
+            RESET(rebuild->find_link);
+        } else {
+            err = sqlite3_bind_int64(rebuild->set_real_inode, 1, row->inode); CHECK_ERR();
+            err = sqlite3_bind_int64(rebuild->set_real_inode, 2, row->real_inode); CHECK_ERR();
+            STEP(rebuild->set_real_inode);
+            RESET(rebuild->set_real_inode);
         }
-        if (!found) {
-            entry = malloc(sizeof(struct entry));
-            entry->inode = inode;
-            entry->path = strdup(path);
-            list_add(bucket, &entry->chain);
-        }
+        RESET(rebuild->get_real_inode);
 
         // extract the stat so we can copy it
-        err = sqlite3_bind_int64(read_stat, 1, inode); CHECK_ERR();
-        if (STEP(read_stat) == false) {
-            RESET(read_stat);
-            continue;
+        err = sqlite3_bind_int64(rebuild->read_stat, 1, row->inode); CHECK_ERR();
+        if (STEP(rebuild->read_stat)) {
+            const void *stat_data = sqlite3_column_blob(rebuild->read_stat, 0);
+            size_t stat_data_size = sqlite3_column_bytes(rebuild->read_stat, 0);
+
+            // store all the information in the new database
+            err = sqlite3_bind_blob(rebuild->write_path, 1, row->path, strlen(row->path), SQLITE_TRANSIENT); CHECK_ERR();
+            err = sqlite3_bind_int64(rebuild->write_path, 2, row->real_inode); CHECK_ERR();
+            STEP(rebuild->write_path);
+            RESET(rebuild->write_path);
+            err = sqlite3_bind_int64(rebuild->write_stat, 1, row->real_inode); CHECK_ERR();
+            err = sqlite3_bind_blob(rebuild->write_stat, 2, stat_data, stat_data_size, SQLITE_TRANSIENT); CHECK_ERR();
+            STEP(rebuild->write_stat);
+            RESET(rebuild->write_stat);
         }
-        const void *stat_data = sqlite3_column_blob(read_stat, 0);
-        size_t stat_data_size = sqlite3_column_bytes(read_stat, 0);
-
-        // store all the information in the new database
-        err = sqlite3_bind_blob(write_path, 1, path, strlen(path), SQLITE_TRANSIENT); CHECK_ERR();
-        err = sqlite3_bind_int64(write_path, 2, real_inode); CHECK_ERR();
-        STEP(write_path);
-        RESET(write_path);
-        err = sqlite3_bind_int64(write_stat, 1, real_inode); CHECK_ERR();
-        err = sqlite3_bind_blob(write_stat, 2, stat_data, stat_data_size, SQLITE_TRANSIENT);
-        STEP(write_stat);
-        RESET(write_stat);
-
-        RESET(read_stat);
+        RESET(rebuild->read_stat);
     }
 
-    for (unsigned i = 0; i < HASH_SIZE; i++) {
-        struct entry *entry, *tmp;
-        list_for_each_entry_safe(&hashtable[i], entry, tmp, chain) {
-            list_remove(&entry->chain);
-            free(entry->path);
-            free(entry);
-        }
+    err = sqlite3_bind_blob(rebuild->delete_path, 1, row->path, strlen(row->path), SQLITE_TRANSIENT); CHECK_ERR();
+    STEP(rebuild->delete_path);
+    RESET(rebuild->delete_path);
+    rebuild->done++;
+}
+
+static void report_progress(struct fakefs_rebuild *rebuild) {
+    if (rebuild->total == 0)
+        return;
+    int percent = rebuild->done * 100 / rebuild->total;
+    if (percent / 10 != rebuild->last_percent / 10) {
+        printk("fakefs: rebuilding metadata, %d%% done\n", percent);
+        rebuild->last_percent = percent;
     }
+}
+
+static void rebuild_free(struct mount *mount, struct fakefs_rebuild *rebuild) {
+    int err;
+    FINALIZE(rebuild->get_paths);
+    FINALIZE(rebuild->get_path);
+    FINALIZE(rebuild->read_stat);
+    FINALIZE(rebuild->find_link);
+    FINALIZE(rebuild->get_real_inode);
+    FINALIZE(rebuild->set_real_inode);
+    FINALIZE(rebuild->write_path);
+    FINALIZE(rebuild->write_stat);
+    FINALIZE(rebuild->delete_path);
+    free(rebuild);
+}
+
+// whether the row still needs moving, since fakefs_rebuild_path could have
+// gotten to it while mount->lock was dropped
+static bool row_pending(struct mount *mount, struct fakefs_rebuild *rebuild, struct rebuild_row *row) {
+    int err;
+    err = sqlite3_bind_blob(rebuild->get_path, 1, row->path, strlen(row->path), SQLITE_TRANSIENT); CHECK_ERR();
+    bool pending = STEP(rebuild->get_path) && (ino_t) sqlite3_column_int64(rebuild->get_path, 0) == row->inode;
+    RESET(rebuild->get_path);
+    return pending;
+}
 
-    EXEC("drop table paths_old");
-    EXEC("drop table stats_old");
+// Moves up to CHUNK_SIZE paths across. Returns false once there's nothing
+// left, after dropping the old tables. Takes mount->lock, except while
+// statting the host files.
+static bool rebuild_chunk(struct mount *mount, struct fakefs_rebuild *rebuild) {
+    int err;
+    struct rebuild_row *rows = malloc(CHUNK_SIZE * sizeof(struct rebuild_row));
+    if (rows == NULL)
+        return true;
+    lock(&mount->lock);
+    size_t count = 0;
+    while (count < CHUNK_SIZE && STEP(rebuild->get_paths)) {
+        rows[count].path = strdup((const char *) sqlite3_column_text(rebuild->get_paths, 0));
+        rows[count].inode = sqlite3_column_int64(rebuild->get_paths, 1);
+        count++;
+    }
+    RESET(rebuild->get_paths);
+    if (count == 0) {
+        EXEC("savepoint rebuild");
+        EXEC("drop table paths_old");
+        EXEC("drop table stats_old");
+        EXEC("drop table rebuild_links");
+        EXEC("release rebuild");
+        mount->cache_gen++;
+        unlock(&mount->lock);
+        free(rows);
+        return false;
+    }
+    unlock(&mount->lock);
+
+    stat_rows(mount, rows, count);
+
+    lock(&mount->lock);
+    EXEC("savepoint rebuild");
+    for (size_t i = 0; i < count; i++) {
+        if (row_pending(mount, rebuild, &rows[i]))
+            rebuild_row(mount, rebuild, &rows[i]);
+        free(rows[i].path);
+    }
+    EXEC("release rebuild");
+    report_progress(rebuild);
+    mount->cache_gen++;
+    unlock(&mount->lock);
+    free(rows);
+    return true;
+}
+
+void fakefs_rebuild_path(struct mount *mount, const char *path) {
+    struct fakefs_rebuild *rebuild = mount->rebuild;
+    if (rebuild == NULL)
+        return;
+    int err;
+    err = sqlite3_bind_blob(rebuild->get_path, 1, path, strlen(path), SQLITE_TRANSIENT); CHECK_ERR();
+    if (STEP(rebuild->get_path)) {
+        struct rebuild_row row = {
+            .path = (char *) path,
+            .inode = sqlite3_column_int64(rebuild->get_path, 0),
+        };
+        RESET(rebuild->get_path);
+        stat_row(mount, &row);
+        EXEC("savepoint rebuild");
+        rebuild_row(mount, rebuild, &row);
+        EXEC("release rebuild");
+        mount->cache_gen++;
+        return;
+    }
+    RESET(rebuild->get_path);
+}
+
+// Renames the tables out of the way so fakefs_rebuild_start will rebuild them
+int fakefs_rebuild(struct mount *mount) {
+    int err;
+    EXEC("begin");
+    EXEC("alter table paths rename to paths_old");
+    EXEC("alter table stats rename to stats_old");
+    EXEC("drop index if exists inode_to_path");
+    EXEC("create table paths (path blob primary key, inode integer)");
+    EXEC("create table stats (inode integer primary key, stat blob)");
+    EXEC("create index inode_to_path on paths (inode, path)");
+    EXEC("drop table if exists rebuild_links");
+    EXEC("create table rebuild_links (inode integer primary key, real_inode integer)");
     EXEC("commit");
-    FINALIZE(get_paths);
-    FINALIZE(read_stat);
-    FINALIZE(write_path);
-    FINALIZE(write_stat);
+    return 0;
+}
+
+// Stops the background rebuild, leaving the rest for the next mount
+void fakefs_rebuild_stop(struct mount *mount) {
+    if (!mount->rebuild_thread_running)
+        return;
+    lock(&mount->lock);
+    if (mount->rebuild != NULL)
+        mount->rebuild->stop = true;
+    unlock(&mount->lock);
+    pthread_join(mount->rebuild_thread, NULL);
+    mount->rebuild_thread_running = false;
+}
+
+// Rebuilds that are still running, so they can be stopped at exit if their
+// mount never gets unmounted (halt_system skips mounts that are busy)
+static lock_t rebuilding_lock = LOCK_INITIALIZER;
+static struct list rebuilding = LIST_INITIALIZER(rebuilding);
+
+static void stop_rebuilds_at_exit(void) {
+    lock(&rebuilding_lock);
+    while (!list_empty(&rebuilding)) {
+        struct fakefs_rebuild *rebuild = list_first_entry(&rebuilding, struct fakefs_rebuild, rebuilding);
+        struct mount *mount = rebuild->mount;
+        list_remove(&rebuild->rebuilding);
+        unlock(&rebuilding_lock);
+        fakefs_rebuild_stop(mount);
+        lock(&rebuilding_lock);
+    }
+    unlock(&rebuilding_lock);
+}
+
+static pthread_once_t at_exit_once = PTHREAD_ONCE_INIT;
+static void register_at_exit(void) {
+    atexit(stop_rebuilds_at_exit);
+}
+
+static void *rebuild_thread(void *data) {
+    struct mount *mount = data;
+    struct fakefs_rebuild *rebuild = mount->rebuild;
+    while (true) {
+        lock(&mount->lock);
+        bool stop = rebuild->stop;
+        unlock(&mount->lock);
+        if (stop)
+            break;
+        if (!rebuild_chunk(mount, rebuild)) {
+            printk("fakefs: done rebuilding metadata\n");
+            break;
+        }
+    }
+    lock(&rebuilding_lock);
+    list_remove_safe(&rebuild->rebuilding);
+    unlock(&rebuilding_lock);
+    lock(&mount->lock);
+    mount->rebuild = NULL;
+    rebuild_free(mount, rebuild);
+    unlock(&mount->lock);
+    return NULL;
+}
+
+int fakefs_rebuild_start(struct mount *mount) {
+    int err;
+    mount->rebuild = NULL;
+    mount->rebuild_thread_running = false;
+    sqlite3_stmt *check = PREPARE("select 1 from sqlite_master where type = 'table' and name = 'paths_old'");
+    bool pending = STEP(check);
+    FINALIZE(check);
+    if (!pending)
+        return 0;
+
+    struct fakefs_rebuild *rebuild = calloc(1, sizeof(struct fakefs_rebuild));
+    if (rebuild == NULL)
+        return _ENOMEM;
+    rebuild->mount = mount;
+    sqlite3_stmt *count = PREPARE("select count(*) from paths_old");
+    STEP(count);
+    rebuild->total = sqlite3_column_int64(count, 0);
+    FINALIZE(count);
+    // a rebuild started before the links were saved has to do without them
+    EXEC("create table if not exists rebuild_links (inode integer primary key, real_inode integer)");
+    rebuild->get_paths = PREPARE("select path, inode from paths_old limit " str(CHUNK_SIZE));
+    rebuild->get_path = PREPARE("select inode from paths_old where path = ?");
+    rebuild->read_stat = PREPARE("select stat from stats_old where inode = ?");
+    rebuild->find_link = PREPARE("select path from paths where inode = ? limit 1");
+    rebuild->get_real_inode = PREPARE("select real_inode from rebuild_links where inode = ?");
+    rebuild->set_real_inode = PREPARE("replace into rebuild_links (inode, real_inode) values (?, ?)");
+    rebuild->write_path = PREPARE("insert or replace into paths (path, inode) values (?, ?)");
+    rebuild->write_stat = PREPARE("replace into stats (inode, stat) values (?, ?)");
+    rebuild->delete_path = PREPARE("delete from paths_old where path = ?");
+    rebuild->last_percent = 0;
+    printk("fakefs: rebuilding metadata for %lld paths\n", (long long) rebuild->total);
+
+    mount->rebuild = rebuild;
+    pthread_once(&at_exit_once, register_at_exit);
+    lock(&rebuilding_lock);
+    list_add(&rebuilding, &rebuild->rebuilding);
+    unlock(&rebuilding_lock);
+    if (pthread_create(&mount->rebuild_thread, NULL, rebuild_thread, mount) == 0) {
+        mount->rebuild_thread_running = true;
+    } else {
+        lock(&rebuilding_lock);
+        list_remove(&rebuild->rebuilding);
+        unlock(&rebuilding_lock);
+        // do it the slow way
+        while (rebuild_chunk(mount, rebuild))
+            ;
+        lock(&mount->lock);
+        mount->rebuild = NULL;
+        rebuild_free(mount, rebuild);
+        unlock(&mount->lock);
+    }
     return 0;
 }
@@ -1,4 +1,5 @@
 #include <stdarg.h>
+#include <stdlib.h>
 #include <limits.h>
 #include <string.h>
 #include <fcntl.h>
@@ -11,15 +12,16 @@
 #include "kernel/task.h"
 #include "fs/fd.h"
 #include "fs/dev.h"
+#include "util/list.h"
+#include "util/timer.h"
 
 // TODO document database
 
-struct ish_stat {
-    dword_t mode;
-    dword_t uid;
-    dword_t gid;
-    dword_t rdev;
-};
+// fake-rebuild.c
+int fakefs_rebuild(struct mount *mount);
+int fakefs_rebuild_start(struct mount *mount);
+void fakefs_rebuild_stop(struct mount *mount);
+void fakefs_rebuild_path(struct mount *mount, const char *path);
 
 static void db_check_error(struct mount *mount) {
     int errcode = sqlite3_errcode(mount->db);
@@ -55,17 +57,358 @@ static void db_exec_reset(struct mount *mount, sqlite3_stmt *stmt) {
     db_reset(mount, stmt);
 }
 
+// Transactions are started lazily, so an operation that's answered entirely
+// from the cache never touches sqlite.
+//
+// With group commit (FAKEFS_DURABILITY_BATCH), db_commit leaves the
+// transaction open so operations from all threads pile into it, and it's
+// committed once it's BATCH_MAX_OPS operations or BATCH_INTERVAL_MS old, by a
+// timer if nothing else comes along, or by fakefs_sync. Each operation gets a
+// savepoint inside the batch, so db_rollback can undo just that operation.
+#define BATCH_MAX_OPS 1024
+#define BATCH_INTERVAL_MS 100
+
+static void cache_check_shared(struct mount *mount);
 static void db_begin(struct mount *mount) {
     lock(&mount->lock);
-    db_exec_reset(mount, mount->stmt.begin);
+    cache_check_shared(mount);
 }
-static void db_commit(struct mount *mount) {
+static void db_start(struct mount *mount) {
+    if (!mount->in_transaction) {
+        db_exec_reset(mount, mount->stmt.begin);
+        mount->in_transaction = true;
+        mount->batch_ops = 0;
+        mount->batch_start = timespec_now();
+    }
+#if FAKEFS_DURABILITY_BATCH
+    if (!mount->in_savepoint) {
+        db_exec_reset(mount, mount->stmt.savepoint);
+        mount->in_savepoint = true;
+    }
+#endif
+}
+// must be called with mount->lock held
+static void db_flush(struct mount *mount) {
+    if (!mount->in_transaction)
+        return;
     db_exec_reset(mount, mount->stmt.commit);
+    mount->in_transaction = false;
+}
+static void db_commit(struct mount *mount) {
+#if FAKEFS_DURABILITY_BATCH
+    if (mount->in_savepoint) {
+        db_exec_reset(mount, mount->stmt.release);
+        mount->in_savepoint = false;
+    }
+    bool arm_timer = false;
+    if (mount->in_transaction) {
+        struct timespec age = timespec_subtract(timespec_now(), mount->batch_start);
+        if (++mount->batch_ops >= BATCH_MAX_OPS ||
+                age.tv_sec * 1000 + age.tv_nsec / 1000000 >= BATCH_INTERVAL_MS) {
+            db_flush(mount);
+        } else if (!mount->batch_timer_armed) {
+            mount->batch_timer_armed = arm_timer = true;
+        }
+    }
+    unlock(&mount->lock);
+    if (arm_timer) {
+        struct timer_spec spec = {
+            .value.tv_nsec = BATCH_INTERVAL_MS * 1000000,
+        };
+        timer_set(mount->batch_timer, spec, NULL);
+    }
+#else
+    db_flush(mount);
     unlock(&mount->lock);
+#endif
 }
 static void db_rollback(struct mount *mount) {
-    db_exec_reset(mount, mount->stmt.rollback);
+#if FAKEFS_DURABILITY_BATCH
+    // undo this operation and leave the rest of the batch alone
+    if (mount->in_savepoint)
+        db_exec_reset(mount, mount->stmt.rollback_savepoint);
+    db_commit(mount);
+#else
+    if (mount->in_transaction)
+        db_exec_reset(mount, mount->stmt.rollback);
+    mount->in_transaction = false;
+    unlock(&mount->lock);
+#endif
+}
+
+#if FAKEFS_DURABILITY_BATCH
+static void db_batch_timer(void *data) {
+    struct mount *mount = data;
+    lock(&mount->lock);
+    mount->batch_timer_armed = false;
+    db_flush(mount);
+    unlock(&mount->lock);
+}
+#endif
+
+static int fakefs_sync(struct mount *mount) {
+    lock(&mount->lock);
+    db_flush(mount);
     unlock(&mount->lock);
+    return 0;
+}
+
+// Write-through cache of the paths and stats tables, protected by mount->lock.
+// Every change made through this mount is mirrored here. Other processes can
+// have the database open too (the iOS file provider extension does), so
+// before the cache is trusted, cache_check_shared asks sqlite whether anyone
+// else has committed, and empties it if they have. A path that's cached with
+// inode 0 is known not to exist.
+#define FAKE_CACHE_BITS 12
+#define FAKE_CACHE_SIZE (1 << FAKE_CACHE_BITS)
+#define FAKE_CACHE_MAX_ENTRIES (FAKE_CACHE_SIZE * 4)
+
+struct path_entry {
+    ino_t inode;
+    struct list chain;
+    struct list lru;
+    char path[];
+};
+struct inode_entry {
+    ino_t inode;
+    struct ish_stat stat;
+    struct list chain;
+    struct list lru;
+};
+
+// A directory listing, with inodes and types from the metadata. Once built
+// it's never changed, so a directory fd holds a reference to the one it's
+// reading and can use it without locking. The cache holds one reference to
+// the latest listing of each directory, and drops it when anything in the
+// directory is created, removed, or renamed, or when another process changes
+// the database.
+#define FAKE_LISTING_SIZE 256
+#define FAKE_LISTING_MAX_ENTRIES 256
+
+struct listing_entry {
+    ino_t inode;
+    unsigned name; // offset into names
+    byte_t type;
+};
+struct fakefs_listing {
+    atomic_uint refcount;
+    struct list chain;
+    struct list lru;
+    char *path;
+    struct listing_entry *entries;
+    unsigned count;
+    char *names;
+};
+
+struct fakefs_cache {
+    struct list paths[FAKE_CACHE_SIZE];
+    struct list paths_lru;
+    unsigned paths_count;
+    struct list inodes[FAKE_CACHE_SIZE];
+    struct list inodes_lru;
+    unsigned inodes_count;
+    struct list listings[FAKE_LISTING_SIZE];
+    struct list listings_lru;
+    unsigned listings_count;
+};
+
+static struct fakefs_cache *cache_new() {
+    struct fakefs_cache *cache = malloc(sizeof(struct fakefs_cache));
+    if (cache == NULL)
+        return NULL;
+    for (int i = 0; i < FAKE_CACHE_SIZE; i++) {
+        list_init(&cache->paths[i]);
+        list_init(&cache->inodes[i]);
+    }
+    for (int i = 0; i < FAKE_LISTING_SIZE; i++)
+        list_init(&cache->listings[i]);
+    list_init(&cache->paths_lru);
+    list_init(&cache->inodes_lru);
+    list_init(&cache->listings_lru);
+    cache->paths_count = cache->inodes_count = cache->listings_count = 0;
+    return cache;
+}
+
+static void listing_release(struct fakefs_listing *listing) {
+    if (--listing->refcount == 0) {
+        free(listing->path);
+        free(listing->entries);
+        free(listing->names);
+        free(listing);
+    }
+}
+
+static void cache_drop_listing(struct fakefs_cache *cache, struct fakefs_listing *listing) {
+    list_remove(&listing->chain);
+    list_remove(&listing->lru);
+    cache->listings_count--;
+    listing_release(listing);
+}
+
+static void cache_clear(struct fakefs_cache *cache) {
+    struct path_entry *path, *tmp_path;
+    list_for_each_entry_safe(&cache->paths_lru, path, tmp_path, lru) {
+        list_remove(&path->chain);
+        list_remove(&path->lru);
+        free(path);
+    }
+    cache->paths_count = 0;
+    struct inode_entry *inode, *tmp_inode;
+    list_for_each_entry_safe(&cache->inodes_lru, inode, tmp_inode, lru) {
+        list_remove(&inode->chain);
+        list_remove(&inode->lru);
+        free(inode);
+    }
+    cache->inodes_count = 0;
+    struct fakefs_listing *listing, *tmp_listing;
+    list_for_each_entry_safe(&cache->listings_lru, listing, tmp_listing, lru) {
+        cache_drop_listing(cache, listing);
+    }
+}
+
+static void cache_free(struct fakefs_cache *cache) {
+    cache_clear(cache);
+    free(cache);
+}
+
+// must be called with mount->lock held
+static void cache_check_shared(struct mount *mount) {
+    // an open transaction reads from a snapshot, which can't have changed
+    if (mount->in_transaction)
+        return;
+    // pragma data_version
+    db_exec(mount, mount->stmt.data_version);
+    int64_t version = sqlite3_column_int64(mount->stmt.data_version, 0);
+    db_reset(mount, mount->stmt.data_version);
+    if (version != mount->data_version) {
+        mount->data_version = version;
+        cache_clear(mount->cache);
+        mount->cache_gen++;
+    }
+}
+
+static uint32_t hash_path(const char *path) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = path; *c != '\0'; c++)
+        hash = (hash ^ (unsigned char) *c) * 16777619u;
+    return hash;
+}
+
+static struct list *cache_path_bucket(struct fakefs_cache *cache, const char *path) {
+    return &cache->paths[hash_path(path) % FAKE_CACHE_SIZE];
+}
+
+static struct path_entry *cache_find_path(struct fakefs_cache *cache, const char *path) {
+    struct path_entry *entry;
+    list_for_each_entry(cache_path_bucket(cache, path), entry, chain) {
+        if (strcmp(entry->path, path) == 0) {
+            list_remove(&entry->lru);
+            list_add_before(&cache->paths_lru, &entry->lru);
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static struct inode_entry *cache_find_inode(struct fakefs_cache *cache, ino_t inode) {
+    struct inode_entry *entry;
+    list_for_each_entry(&cache->inodes[inode % FAKE_CACHE_SIZE], entry, chain) {
+        if (entry->inode == inode) {
+            list_remove(&entry->lru);
+            list_add_before(&cache->inodes_lru, &entry->lru);
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void cache_set_inode(struct mount *mount, const char *path, ino_t inode) {
+    struct fakefs_cache *cache = mount->cache;
+    struct path_entry *entry = cache_find_path(cache, path);
+    if (entry == NULL) {
+        entry = malloc(sizeof(struct path_entry) + strlen(path) + 1);
+        if (entry == NULL)
+            return;
+        strcpy(entry->path, path);
+        if (cache->paths_count >= FAKE_CACHE_MAX_ENTRIES) {
+            struct path_entry *old = list_first_entry(&cache->paths_lru, struct path_entry, lru);
+            list_remove(&old->chain);
+            list_remove(&old->lru);
+            free(old);
+            cache->paths_count--;
+        }
+        list_add(cache_path_bucket(cache, path), &entry->chain);
+        list_add_before(&cache->paths_lru, &entry->lru);
+        cache->paths_count++;
+    }
+    entry->inode = inode;
+}
+
+static void cache_set_stat(struct mount *mount, ino_t inode, struct ish_stat *stat) {
+    struct fakefs_cache *cache = mount->cache;
+    struct inode_entry *entry = cache_find_inode(cache, inode);
+    if (entry == NULL) {
+        entry = malloc(sizeof(struct inode_entry));
+        if (entry == NULL)
+            return;
+        entry->inode = inode;
+        if (cache->inodes_count >= FAKE_CACHE_MAX_ENTRIES) {
+            struct inode_entry *old = list_first_entry(&cache->inodes_lru, struct inode_entry, lru);
+            list_remove(&old->chain);
+            list_remove(&old->lru);
+            free(old);
+            cache->inodes_count--;
+        }
+        list_add(&cache->inodes[inode % FAKE_CACHE_SIZE], &entry->chain);
+        list_add_before(&cache->inodes_lru, &entry->lru);
+        cache->inodes_count++;
+    }
+    entry->stat = *stat;
+}
+
+// returns a reference, which must be released
+static struct fakefs_listing *cache_get_listing(struct fakefs_cache *cache, const char *path) {
+    struct fakefs_listing *listing;
+    list_for_each_entry(&cache->listings[hash_path(path) % FAKE_LISTING_SIZE], listing, chain) {
+        if (strcmp(listing->path, path) == 0) {
+            list_remove(&listing->lru);
+            list_add_before(&cache->listings_lru, &listing->lru);
+            listing->refcount++;
+            return listing;
+        }
+    }
+    return NULL;
+}
+
+static void cache_add_listing(struct fakefs_cache *cache, struct fakefs_listing *listing) {
+    struct fakefs_listing *old = cache_get_listing(cache, listing->path);
+    if (old != NULL) {
+        cache_drop_listing(cache, old);
+        listing_release(old);
+    }
+    if (cache->listings_count >= FAKE_LISTING_MAX_ENTRIES)
+        cache_drop_listing(cache, list_first_entry(&cache->listings_lru, struct fakefs_listing, lru));
+    listing->refcount++;
+    list_add(&cache->listings[hash_path(listing->path) % FAKE_LISTING_SIZE], &listing->chain);
+    list_add_before(&cache->listings_lru, &listing->lru);
+    cache->listings_count++;
+}
+
+// drops the listing of the directory containing path, and the listings of
+// path and everything under it in case it's a directory
+static void cache_forget_listings(struct fakefs_cache *cache, const char *path) {
+    if (cache->listings_count == 0)
+        return;
+    size_t path_len = strlen(path);
+    const char *slash = strrchr(path, '/');
+    size_t parent_len = slash != NULL ? (size_t) (slash - path) : 0;
+    struct fakefs_listing *listing, *tmp;
+    list_for_each_entry_safe(&cache->listings_lru, listing, tmp, lru) {
+        const char *p = listing->path;
+        if ((strncmp(p, path, parent_len) == 0 && p[parent_len] == '\0') ||
+                (strncmp(p, path, path_len) == 0 && (p[path_len] == '\0' || p[path_len] == '/')))
+            cache_drop_listing(cache, listing);
+    }
 }
 
 static void bind_path(sqlite3_stmt *stmt, int i, const char *path) {
@@ -73,90 +416,527 @@ static void bind_path(sqlite3_stmt *stmt, int i, const char *path) {
 }
 
 static ino_t path_get_inode(struct mount *mount, const char *path) {
+    struct path_entry *entry = cache_find_path(mount->cache, path);
+    if (entry != NULL)
+        return entry->inode;
+    fakefs_rebuild_path(mount, path);
+    db_start(mount);
     // select inode from paths where path = ?
     bind_path(mount->stmt.path_get_inode, 1, path);
     ino_t inode = 0;
     if (db_exec(mount, mount->stmt.path_get_inode))
         inode = sqlite3_column_int64(mount->stmt.path_get_inode, 0);
     db_reset(mount, mount->stmt.path_get_inode);
+    cache_set_inode(mount, path, inode);
     return inode;
 }
-static bool path_read_stat(struct mount *mount, const char *path, struct ish_stat *stat, ino_t *inode) {
-    // select inode, stat from stats natural join paths where path = ?
-    bind_path(mount->stmt.path_read_stat, 1, path);
-    bool exists = db_exec(mount, mount->stmt.path_read_stat);
-    if (exists) {
-        if (inode)
-            *inode = sqlite3_column_int64(mount->stmt.path_read_stat, 0);
-        if (stat)
-            *stat = *(struct ish_stat *) sqlite3_column_blob(mount->stmt.path_read_stat, 1);
-    }
-    db_reset(mount, mount->stmt.path_read_stat);
-    return exists;
-}
-static void path_create(struct mount *mount, const char *path, struct ish_stat *stat) {
-    // insert into stats (stat) values (?)
-    sqlite3_bind_blob(mount->stmt.path_create_stat, 1, stat, sizeof(*stat), SQLITE_TRANSIENT);
-    db_exec_reset(mount, mount->stmt.path_create_stat);
-    // insert into paths values (?, last_insert_rowid())
-    bind_path(mount->stmt.path_create_path, 1, path);
-    db_exec_reset(mount, mount->stmt.path_create_path);
-}
-
 static void inode_read_stat(struct mount *mount, ino_t inode, struct ish_stat *stat) {
+    struct inode_entry *entry = cache_find_inode(mount->cache, inode);
+    if (entry != NULL) {
+        *stat = entry->stat;
+        return;
+    }
+    db_start(mount);
     // select stat from stats where inode = ?
     sqlite3_bind_int64(mount->stmt.inode_read_stat, 1, inode);
     if (!db_exec(mount, mount->stmt.inode_read_stat))
         die("inode_read_stat(%llu): missing inode", (unsigned long long) inode);
     *stat = *(struct ish_stat *) sqlite3_column_blob(mount->stmt.inode_read_stat, 0);
     db_reset(mount, mount->stmt.inode_read_stat);
+    cache_set_stat(mount, inode, stat);
 }
 static void inode_write_stat(struct mount *mount, ino_t inode, struct ish_stat *stat) {
+    db_start(mount);
     // update stats set stat = ? where inode = ?
     sqlite3_bind_blob(mount->stmt.inode_write_stat, 1, stat, sizeof(*stat), SQLITE_TRANSIENT);
     sqlite3_bind_int64(mount->stmt.inode_write_stat, 2, inode);
     db_exec_reset(mount, mount->stmt.inode_write_stat);
+    cache_set_stat(mount, inode, stat);
+    mount->cache_gen++;
+}
+static bool path_read_stat(struct mount *mount, const char *path, struct ish_stat *stat, ino_t *inode) {
+    struct path_entry *entry = cache_find_path(mount->cache, path);
+    if (entry != NULL) {
+        if (entry->inode == 0)
+            return false;
+        if (inode)
+            *inode = entry->inode;
+        if (stat)
+            inode_read_stat(mount, entry->inode, stat);
+        return true;
+    }
+
+    fakefs_rebuild_path(mount, path);
+    db_start(mount);
+    // select inode, stat from stats natural join paths where path = ?
+    bind_path(mount->stmt.path_read_stat, 1, path);
+    bool exists = db_exec(mount, mount->stmt.path_read_stat);
+    ino_t found_inode = 0;
+    if (exists) {
+        found_inode = sqlite3_column_int64(mount->stmt.path_read_stat, 0);
+        struct ish_stat found_stat = *(struct ish_stat *) sqlite3_column_blob(mount->stmt.path_read_stat, 1);
+        cache_set_stat(mount, found_inode, &found_stat);
+        if (inode)
+            *inode = found_inode;
+        if (stat)
+            *stat = found_stat;
+    }
+    db_reset(mount, mount->stmt.path_read_stat);
+    cache_set_inode(mount, path, found_inode);
+    return exists;
+}
+static ino_t path_create(struct mount *mount, const char *path, struct ish_stat *stat) {
+    fakefs_rebuild_path(mount, path);
+    db_start(mount);
+    ino_t inode;
+    struct stat real_stat;
+    if (mount->rebuild != NULL &&
+            fstatat(mount->root_fd, fix_path(path), &real_stat, AT_SYMLINK_NOFOLLOW) >= 0) {
+        // The rows still waiting to be rebuilt will get their host inode
+        // numbers, so a new row has to use its host inode too, or it could
+        // collide with one of them.
+        inode = real_stat.st_ino;
+        // replace into stats (inode, stat) values (?, ?)
+        sqlite3_bind_int64(mount->stmt.path_create_stat_inode, 1, inode);
+        sqlite3_bind_blob(mount->stmt.path_create_stat_inode, 2, stat, sizeof(*stat), SQLITE_TRANSIENT);
+        db_exec_reset(mount, mount->stmt.path_create_stat_inode);
+        // insert into paths (path, inode) values (?, ?)
+        bind_path(mount->stmt.path_link, 1, path);
+        sqlite3_bind_int64(mount->stmt.path_link, 2, inode);
+        db_exec_reset(mount, mount->stmt.path_link);
+    } else {
+        // insert into stats (stat) values (?)
+        sqlite3_bind_blob(mount->stmt.path_create_stat, 1, stat, sizeof(*stat), SQLITE_TRANSIENT);
+        db_exec_reset(mount, mount->stmt.path_create_stat);
+        inode = sqlite3_last_insert_rowid(mount->db);
+        // insert into paths values (?, last_insert_rowid())
+        bind_path(mount->stmt.path_create_path, 1, path);
+        db_exec_reset(mount, mount->stmt.path_create_path);
+    }
+    cache_set_stat(mount, inode, stat);
+    cache_set_inode(mount, path, inode);
+    cache_forget_listings(mount->cache, path);
+    mount->cache_gen++;
+    return inode;
 }
 
 static void path_link(struct mount *mount, const char *src, const char *dst) {
     ino_t inode = path_get_inode(mount, src);
     if (inode == 0)
         die("fakefs link(%s, %s): nonexistent src path", src, dst);
+    db_start(mount);
     // insert into paths (path, inode) values (?, ?)
     bind_path(mount->stmt.path_link, 1, dst);
     sqlite3_bind_int64(mount->stmt.path_link, 2, inode);
     db_exec_reset(mount, mount->stmt.path_link);
+    cache_set_inode(mount, dst, inode);
+    cache_forget_listings(mount->cache, dst);
+    mount->cache_gen++;
 }
 static void path_unlink(struct mount *mount, const char *path) {
+    db_start(mount);
     // delete from paths where path = ?
     bind_path(mount->stmt.path_unlink, 1, path);
     db_exec_reset(mount, mount->stmt.path_unlink);
+    cache_set_inode(mount, path, 0);
+    cache_forget_listings(mount->cache, path);
+    mount->cache_gen++;
 }
 static void path_rename(struct mount *mount, const char *src, const char *dst) {
+    ino_t inode = path_get_inode(mount, src);
+    db_start(mount);
     // update or replace paths set path = ? [dst] where path = ? [src];
     bind_path(mount->stmt.path_rename, 1, dst);
     bind_path(mount->stmt.path_rename, 2, src);
     db_exec_reset(mount, mount->stmt.path_rename);
+    // if src had no row, the update did nothing and dst is unchanged
+    if (inode != 0) {
+        cache_set_inode(mount, src, 0);
+        cache_set_inode(mount, dst, inode);
+    }
+    cache_forget_listings(mount->cache, src);
+    cache_forget_listings(mount->cache, dst);
+    mount->cache_gen++;
+}
+
+// Pool of read-only connections, so cache misses in operations that don't
+// write can be answered without holding mount->lock. WAL mode lets these read
+// concurrently with each other and with the writer, but a reader can still
+// find the database busy for a moment (during a checkpoint, or while opening
+// it), and then the lookup goes to the writer instead.
+#define MAX_READERS 8
+#define READER_BUSY_TIMEOUT_MS 100
+
+#define SQL_PATH_READ_STAT "select inode, stat from stats natural join paths where path = ?"
+#define SQL_INODE_READ_STAT "select stat from stats where inode = ?"
+
+struct fakefs_reader {
+    sqlite3 *db;
+    sqlite3_stmt *path_read_stat;
+    sqlite3_stmt *inode_read_stat;
+    struct list free;
+};
+
+static void db_path_for_mount(struct mount *mount, char *db_path) {
+    strcpy(db_path, mount->source);
+    char *basename = strrchr(db_path, '/') + 1;
+    assert(strcmp(basename, "data") == 0);
+    strcpy(basename, "meta.db");
+}
+
+static bool reader_busy(int err) {
+    return err == SQLITE_BUSY || err == SQLITE_LOCKED;
+}
+
+static void reader_check_error(struct fakefs_reader *reader, int err) {
+    if (err != SQLITE_OK && err != SQLITE_ROW && err != SQLITE_DONE && !reader_busy(err))
+        die("sqlite error: %s", sqlite3_errmsg(reader->db));
+}
+
+static void reader_free(struct fakefs_reader *reader) {
+    sqlite3_finalize(reader->path_read_stat);
+    sqlite3_finalize(reader->inode_read_stat);
+    sqlite3_close(reader->db);
+    free(reader);
+}
+
+static struct fakefs_reader *reader_new(struct mount *mount) {
+    struct fakefs_reader *reader = malloc(sizeof(struct fakefs_reader));
+    if (reader == NULL)
+        return NULL;
+    char db_path[PATH_MAX];
+    db_path_for_mount(mount, db_path);
+    reader->path_read_stat = reader->inode_read_stat = NULL;
+    if (sqlite3_open_v2(db_path, &reader->db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        sqlite3_close(reader->db);
+        free(reader);
+        return NULL;
+    }
+    sqlite3_busy_timeout(reader->db, READER_BUSY_TIMEOUT_MS);
+    // preparing reads the schema, which can also find the database busy
+    int err = sqlite3_prepare_v2(reader->db, SQL_PATH_READ_STAT, -1, &reader->path_read_stat, NULL);
+    if (err == SQLITE_OK)
+        err = sqlite3_prepare_v2(reader->db, SQL_INODE_READ_STAT, -1, &reader->inode_read_stat, NULL);
+    reader_check_error(reader, err);
+    if (err != SQLITE_OK) {
+        reader_free(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+// returns NULL if the pool is exhausted
+static struct fakefs_reader *reader_get(struct mount *mount) {
+    struct fakefs_reader *reader = NULL;
+    lock(&mount->readers_lock);
+    if (!list_empty(&mount->readers)) {
+        reader = list_first_entry(&mount->readers, struct fakefs_reader, free);
+        list_remove(&reader->free);
+    } else if (mount->readers_count < MAX_READERS) {
+        reader = reader_new(mount);
+        if (reader != NULL)
+            mount->readers_count++;
+    }
+    unlock(&mount->readers_lock);
+    return reader;
+}
+
+static void reader_put(struct mount *mount, struct fakefs_reader *reader) {
+    lock(&mount->readers_lock);
+    list_add(&mount->readers, &reader->free);
+    unlock(&mount->readers_lock);
+}
+
+// returns 1 if found, 0 if not, or -1 if the database was too busy to tell
+static int reader_lookup(struct fakefs_reader *reader, const char *path, ino_t *inode, struct ish_stat *stat) {
+    sqlite3_stmt *stmt;
+    if (path != NULL) {
+        stmt = reader->path_read_stat;
+        bind_path(stmt, 1, path);
+    } else {
+        stmt = reader->inode_read_stat;
+        sqlite3_bind_int64(stmt, 1, *inode);
+    }
+    int err = sqlite3_step(stmt);
+    reader_check_error(reader, err);
+    if (reader_busy(err)) {
+        sqlite3_reset(stmt);
+        return -1;
+    }
+    bool exists = err == SQLITE_ROW;
+    if (exists) {
+        if (path != NULL) {
+            *inode = sqlite3_column_int64(stmt, 0);
+            *stat = *(struct ish_stat *) sqlite3_column_blob(stmt, 1);
+        } else {
+            *stat = *(struct ish_stat *) sqlite3_column_blob(stmt, 0);
+        }
+    } else if (path == NULL) {
+        die("inode_read_stat(%llu): missing inode", (unsigned long long) *inode);
+    }
+    reader_check_error(reader, sqlite3_reset(stmt));
+    return exists;
+}
+
+// Looks up the inode and stat for path, or the stat for *inode if path is
+// NULL, for operations that don't write. Returns false if path doesn't exist.
+static bool fake_lookup(struct mount *mount, const char *path, ino_t *inode, struct ish_stat *stat) {
+    lock(&mount->lock);
+    cache_check_shared(mount);
+    bool cached = false;
+    bool exists = true;
+    struct path_entry *path_entry = NULL;
+    if (path != NULL)
+        path_entry = cache_find_path(mount->cache, path);
+    if (path_entry != NULL && path_entry->inode == 0) {
+        cached = true;
+        exists = false;
+    } else if (path == NULL || path_entry != NULL) {
+        if (path_entry != NULL)
+            *inode = path_entry->inode;
+        struct inode_entry *inode_entry = cache_find_inode(mount->cache, *inode);
+        if (inode_entry != NULL) {
+            cached = true;
+            *stat = inode_entry->stat;
+        }
+    }
+    if (cached) {
+        unlock(&mount->lock);
+        return exists;
+    }
+
+    // changes in an uncommitted batch are only visible to the writer, and
+    // paths that haven't been rebuilt yet have to go through the writer to
+    // get rebuilt
+    struct fakefs_reader *reader = NULL;
+    if (!mount->in_transaction && mount->rebuild == NULL)
+        reader = reader_get(mount);
+    int found = -1;
+    unsigned gen = mount->cache_gen;
+    if (reader != NULL) {
+        unlock(&mount->lock);
+        found = reader_lookup(reader, path, inode, stat);
+        reader_put(mount, reader);
+        if (found < 0)
+            lock(&mount->lock);
+    }
+    if (found < 0) {
+        if (path != NULL)
+            exists = path_read_stat(mount, path, stat, inode);
+        else
+            inode_read_stat(mount, *inode, stat);
+        db_commit(mount);
+        return exists;
+    }
+    exists = found;
+
+    // if something was written meanwhile, the result may already be stale
+    lock(&mount->lock);
+    if (gen == mount->cache_gen) {
+        if (exists)
+            cache_set_stat(mount, *inode, stat);
+        if (path != NULL)
+            cache_set_inode(mount, path, exists ? *inode : 0);
+    }
+    unlock(&mount->lock);
+    return exists;
+}
+
+// Directories opened through fakefs are read from a listing, so entries come
+// back with the inode and type from the metadata, and looking them up fills
+// the cache for the stats that usually follow.
+
+static struct fakefs_listing *listing_build(struct fd *fd, const char *path) {
+    struct mount *mount = fd->mount;
+    int dirfd = openat(fd->real_fd, ".", O_RDONLY | O_DIRECTORY);
+    if (dirfd < 0)
+        return ERR_PTR(errno_map());
+    DIR *dir = fdopendir(dirfd);
+    if (dir == NULL) {
+        close(dirfd);
+        return ERR_PTR(errno_map());
+    }
+    struct fakefs_listing *listing = calloc(1, sizeof(struct fakefs_listing));
+    if (listing == NULL)
+        goto nomem;
+    listing->refcount = 1;
+    listing->path = strdup(path);
+    if (listing->path == NULL)
+        goto nomem;
+    unsigned entries_size = 0;
+    size_t names_len = 0, names_size = 0;
+
+    struct dirent *dirent;
+    errno = 0;
+    while ((dirent = readdir(dir)) != NULL) {
+        size_t name_len = strlen(dirent->d_name) + 1;
+        if (listing->count >= entries_size) {
+            entries_size = entries_size ? entries_size * 2 : 32;
+            struct listing_entry *entries = realloc(listing->entries, entries_size * sizeof(struct listing_entry));
+            if (entries == NULL)
+                goto nomem;
+            listing->entries = entries;
+        }
+        if (names_len + name_len > names_size) {
+            while (names_len + name_len > names_size)
+                names_size = names_size ? names_size * 2 : 1024;
+            char *names = realloc(listing->names, names_size);
+            if (names == NULL)
+                goto nomem;
+            listing->names = names;
+        }
+
+        struct listing_entry *entry = &listing->entries[listing->count++];
+        entry->inode = dirent->d_ino;
+        entry->type = 0;
+        entry->name = names_len;
+        memcpy(listing->names + names_len, dirent->d_name, name_len);
+        names_len += name_len;
+
+        char entry_path[MAX_PATH];
+        if (strcmp(dirent->d_name, ".") == 0) {
+            entry->inode = fd->fake_inode;
+            entry->type = DT_DIR_;
+            continue;
+        } else if (strcmp(dirent->d_name, "..") == 0) {
+            const char *slash = strrchr(path, '/');
+            size_t parent_len = slash != NULL ? (size_t) (slash - path) : 0;
+            memcpy(entry_path, path, parent_len);
+            entry_path[parent_len] = '\0';
+        } else if (snprintf(entry_path, sizeof(entry_path), "%s/%s", path, dirent->d_name) >= (int) sizeof(entry_path)) {
+            continue;
+        }
+        ino_t inode;
+        struct ish_stat stat;
+        if (fake_lookup(mount, entry_path, &inode, &stat)) {
+            entry->inode = inode;
+            entry->type = mode_to_dt(stat.mode);
+        }
+    }
+    if (errno != 0) {
+        int err = errno_map();
+        closedir(dir);
+        listing_release(listing);
+        return ERR_PTR(err);
+    }
+    closedir(dir);
+    return listing;
+
+nomem:
+    closedir(dir);
+    if (listing != NULL)
+        listing_release(listing);
+    return ERR_PTR(_ENOMEM);
+}
+
+static int fakefs_listing_open(struct fd *fd) {
+    struct mount *mount = fd->mount;
+    char path[MAX_PATH];
+    int err = realfs_getpath(fd, path);
+    if (err < 0)
+        return err;
+
+    lock(&mount->lock);
+    cache_check_shared(mount);
+    struct fakefs_listing *listing = cache_get_listing(mount->cache, path);
+    unsigned gen = mount->cache_gen;
+    unlock(&mount->lock);
+    if (listing == NULL) {
+        listing = listing_build(fd, path);
+        if (IS_ERR(listing))
+            return PTR_ERR(listing);
+        // if something was written meanwhile, the listing may already be stale
+        lock(&mount->lock);
+        if (gen == mount->cache_gen)
+            cache_add_listing(mount->cache, listing);
+        unlock(&mount->lock);
+    }
+    fd->fake_listing = listing;
+    return 0;
+}
+
+static int fakefs_readdir_batch(struct fd *fd, struct dir_entry *entries, unsigned count) {
+    if (fd->fake_listing == NULL) {
+        int err = fakefs_listing_open(fd);
+        if (err < 0)
+            return err;
+    }
+    struct fakefs_listing *listing = fd->fake_listing;
+    unsigned n = 0;
+    while (n < count && fd->offset < listing->count) {
+        struct listing_entry *entry = &listing->entries[fd->offset++];
+        entries[n].inode = entry->inode;
+        entries[n].type = entry->type;
+        strcpy(entries[n].name, listing->names + entry->name);
+        entries[n].offset = fd->offset;
+        n++;
+    }
+    return n;
+}
+
+static int fakefs_readdir(struct fd *fd, struct dir_entry *entry) {
+    return fakefs_readdir_batch(fd, entry, 1);
+}
+
+static off_t fakefs_lseek(struct fd *fd, off_t offset, int whence) {
+    if (!S_ISDIR(fd->type))
+        return realfs_lseek(fd, offset, whence);
+    // directory offsets are indexes into the listing
+    if (whence == LSEEK_CUR)
+        offset += fd->offset;
+    else if (whence != LSEEK_SET)
+        return _EINVAL;
+    if (offset < 0)
+        return _EINVAL;
+    fd->offset = offset;
+    // rewinding picks up changes made since the listing was read
+    if (offset == 0 && fd->fake_listing != NULL) {
+        listing_release(fd->fake_listing);
+        fd->fake_listing = NULL;
+    }
+    return offset;
+}
+
+static int fakefs_close(struct fd *fd) {
+    if (fd->fake_listing != NULL)
+        listing_release(fd->fake_listing);
+    return realfs_close(fd);
+}
+
+// realfs_fdops with the directory operations replaced, filled in on startup
+static struct fd_ops fakefs_fdops;
+static void __attribute__((constructor)) init_fakefs_fdops() {
+    fakefs_fdops = realfs_fdops;
+    fakefs_fdops.readdir = fakefs_readdir;
+    fakefs_fdops.readdir_batch = fakefs_readdir_batch;
+    // offsets are kept in fd->offset
+    fakefs_fdops.telldir = NULL;
+    fakefs_fdops.seekdir = NULL;
+    fakefs_fdops.lseek = fakefs_lseek;
+    fakefs_fdops.close = fakefs_close;
 }
 
 static struct fd *fakefs_open(struct mount *mount, const char *path, int flags, int mode) {
     struct fd *fd = realfs.open(mount, path, flags, 0666);
     if (IS_ERR(fd))
         return fd;
-    db_begin(mount);
-    fd->fake_inode = path_get_inode(mount, path);
+    fd->ops = &fakefs_fdops;
     if (flags & O_CREAT_) {
+        db_begin(mount);
+        fd->fake_inode = path_get_inode(mount, path);
         struct ish_stat ishstat;
         ishstat.mode = mode | S_IFREG;
         ishstat.uid = current->euid;
         ishstat.gid = current->egid;
         ishstat.rdev = 0;
-        if (fd->fake_inode == 0) {
-            path_create(mount, path, &ishstat);
-            fd->fake_inode = path_get_inode(mount, path);
-        }
+        if (fd->fake_inode == 0)
+            fd->fake_inode = path_create(mount, path, &ishstat);
+        db_commit(mount);
+    } else {
+        struct ish_stat ishstat;
+        if (!fake_lookup(mount, path, &fd->fake_inode, &ishstat))
+            fd->fake_inode = 0;
     }
-    db_commit(mount);
     if (fd->fake_inode == 0) {
         // metadata for this file is missing
         // TODO unlink the real file
@@ -168,6 +948,8 @@ static struct fd *fakefs_open(struct mount *mount, const char *path, int flags,
 
 static int fakefs_link(struct mount *mount, const char *src, const char *dst) {
     db_begin(mount);
+    fakefs_rebuild_path(mount, src);
+    fakefs_rebuild_path(mount, dst);
     int err = realfs.link(mount, src, dst);
     if (err < 0) {
         db_rollback(mount);
@@ -180,6 +962,7 @@ static int fakefs_link(struct mount *mount, const char *src, const char *dst) {
 
 static int fakefs_unlink(struct mount *mount, const char *path) {
     db_begin(mount);
+    fakefs_rebuild_path(mount, path);
     int err = realfs.unlink(mount, path);
     if (err < 0) {
         db_rollback(mount);
@@ -192,6 +975,7 @@ static int fakefs_unlink(struct mount *mount, const char *path) {
 
 static int fakefs_rmdir(struct mount *mount, const char *path) {
     db_begin(mount);
+    fakefs_rebuild_path(mount, path);
     int err = realfs.rmdir(mount, path);
     if (err < 0) {
         db_rollback(mount);
@@ -204,6 +988,8 @@ static int fakefs_rmdir(struct mount *mount, const char *path) {
 
 static int fakefs_rename(struct mount *mount, const char *src, const char *dst) {
     db_begin(mount);
+    fakefs_rebuild_path(mount, src);
+    fakefs_rebuild_path(mount, dst);
     int err = realfs.rename(mount, src, dst);
     if (err < 0) {
         db_rollback(mount);
@@ -214,23 +1000,29 @@ static int fakefs_rename(struct mount *mount, const char *src, const char *dst)
     return 0;
 }
 
-static int fakefs_symlink(struct mount *mount, const char *target, const char *link) {
-    db_begin(mount);
+int fake_symlink_file(struct mount *mount, const char *target, const char *link) {
     // create a file containing the target
     int fd = openat(mount->root_fd, fix_path(link), O_WRONLY | O_CREAT | O_EXCL, 0666);
-    if (fd < 0) {
-        db_rollback(mount);
+    if (fd < 0)
         return errno_map();
-    }
     ssize_t res = write(fd, target, strlen(target));
     close(fd);
     if (res < 0) {
         int saved_errno = errno;
         unlinkat(mount->root_fd, fix_path(link), 0);
-        db_rollback(mount);
         errno = saved_errno;
         return errno_map();
     }
+    return 0;
+}
+
+static int fakefs_symlink(struct mount *mount, const char *target, const char *link) {
+    db_begin(mount);
+    int err = fake_symlink_file(mount, target, link);
+    if (err < 0) {
+        db_rollback(mount);
+        return err;
+    }
 
     // customize the stat info so it looks like a link
     struct ish_stat ishstat;
@@ -245,7 +1037,7 @@ static int fakefs_symlink(struct mount *mount, const char *target, const char *l
 
 static int fakefs_mknod(struct mount *mount, const char *path, mode_t_ mode, dev_t_ dev) {
     mode_t_ real_mode = 0666;
-    if (S_ISBLK(mode) || S_ISCHR(mode))
+    if (S_ISBLK(mode) || S_ISCHR(mode) || S_ISSOCK(mode))
         real_mode |= S_IFREG;
     else
         real_mode |= mode & S_IFMT;
@@ -268,15 +1060,11 @@ static int fakefs_mknod(struct mount *mount, const char *path, mode_t_ mode, dev
 }
 
 static int fakefs_stat(struct mount *mount, const char *path, struct statbuf *fake_stat, bool follow_links) {
-    db_begin(mount);
     struct ish_stat ishstat;
     ino_t inode;
-    if (!path_read_stat(mount, path, &ishstat, &inode)) {
-        db_rollback(mount);
+    if (!fake_lookup(mount, path, &inode, &ishstat))
         return _ENOENT;
-    }
     int err = realfs.stat(mount, path, fake_stat, follow_links);
-    db_commit(mount);
     if (err < 0)
         return err;
     fake_stat->inode = inode;
@@ -291,10 +1079,9 @@ static int fakefs_fstat(struct fd *fd, struct statbuf *fake_stat) {
     int err = realfs.fstat(fd, fake_stat);
     if (err < 0)
         return err;
-    db_begin(fd->mount);
     struct ish_stat ishstat;
-    inode_read_stat(fd->mount, fd->fake_inode, &ishstat);
-    db_commit(fd->mount);
+    ino_t inode = fd->fake_inode;
+    fake_lookup(fd->mount, NULL, &inode, &ishstat);
     fake_stat->inode = fd->fake_inode;
     fake_stat->mode = ishstat.mode;
     fake_stat->uid = ishstat.uid;
@@ -303,7 +1090,7 @@ static int fakefs_fstat(struct fd *fd, struct statbuf *fake_stat) {
     return 0;
 }
 
-static void fake_stat_setattr(struct ish_stat *ishstat, struct attr attr) {
+void fake_stat_setattr(struct ish_stat *ishstat, struct attr attr) {
     switch (attr.type) {
         case attr_uid:
             ishstat->uid = attr.uid;
@@ -362,7 +1149,7 @@ static int fakefs_mkdir(struct mount *mount, const char *path, mode_t_ mode) {
     return 0;
 }
 
-static ssize_t file_readlink(struct mount *mount, const char *path, char *buf, size_t bufsize) {
+ssize_t fake_file_readlink(struct mount *mount, const char *path, char *buf, size_t bufsize) {
     // broken symlinks can't be included in an iOS app or else Xcode craps out
     int fd = openat(mount->root_fd, fix_path(path), O_RDONLY);
     if (fd < 0)
@@ -375,25 +1162,19 @@ static ssize_t file_readlink(struct mount *mount, const char *path, char *buf, s
 }
 
 static ssize_t fakefs_readlink(struct mount *mount, const char *path, char *buf, size_t bufsize) {
-    db_begin(mount);
     struct ish_stat ishstat;
-    if (!path_read_stat(mount, path, &ishstat, NULL)) {
-        db_rollback(mount);
+    ino_t inode;
+    if (!fake_lookup(mount, path, &inode, &ishstat))
         return _ENOENT;
-    }
-    if (!S_ISLNK(ishstat.mode)) {
-        db_rollback(mount);
+    if (!S_ISLNK(ishstat.mode))
         return _EINVAL;
-    }
 
     ssize_t err = realfs.readlink(mount, path, buf, bufsize);
     if (err == _EINVAL)
-        err = file_readlink(mount, path, buf, bufsize);
-    db_commit(mount);
+        err = fake_file_readlink(mount, path, buf, bufsize);
     return err;
 }
 
-int fakefs_rebuild(struct mount *mount);
 int fakefs_migrate(struct mount *mount);
 
 #if DEBUG_sql
@@ -403,12 +1184,78 @@ static int trace_callback(unsigned why, void *fuck, void *stmt, void *sql) {
 }
 #endif
 
+static int fakefs_mount_finish(struct mount *mount) {
+    mount->cache = cache_new();
+    if (mount->cache == NULL) {
+        close(mount->root_fd);
+        return _ENOMEM;
+    }
+    mount->in_transaction = false;
+    mount->in_savepoint = false;
+    mount->cache_gen = 0;
+    mount->data_version = 0;
+    list_init(&mount->readers);
+    mount->readers_count = 0;
+    lock_init(&mount->readers_lock);
+    mount->batch_timer = NULL;
+    mount->batch_timer_armed = false;
+#if FAKEFS_DURABILITY_BATCH
+    mount->batch_timer = timer_new(db_batch_timer, mount);
+    if (mount->batch_timer != NULL)
+        mount->batch_timer->coalesce = true; // a flush doesn't need to be on time
+#endif
+    lock_init(&mount->lock);
+    mount->stmt.begin = db_prepare(mount, "begin");
+    mount->stmt.commit = db_prepare(mount, "commit");
+    mount->stmt.rollback = db_prepare(mount, "rollback");
+    mount->stmt.savepoint = db_prepare(mount, "savepoint op");
+    mount->stmt.release = db_prepare(mount, "release op");
+    mount->stmt.rollback_savepoint = db_prepare(mount, "rollback to op");
+    mount->stmt.data_version = db_prepare(mount, "pragma data_version");
+    mount->stmt.path_get_inode = db_prepare(mount, "select inode from paths where path = ?");
+    mount->stmt.path_read_stat = db_prepare(mount, SQL_PATH_READ_STAT);
+    mount->stmt.path_create_stat = db_prepare(mount, "insert into stats (stat) values (?)");
+    mount->stmt.path_create_path = db_prepare(mount, "insert into paths values (?, last_insert_rowid())");
+    mount->stmt.path_create_stat_inode = db_prepare(mount, "replace into stats (inode, stat) values (?, ?)");
+    mount->stmt.inode_read_stat = db_prepare(mount, SQL_INODE_READ_STAT);
+    mount->stmt.inode_write_stat = db_prepare(mount, "update stats set stat = ? where inode = ?");
+    mount->stmt.path_link = db_prepare(mount, "insert into paths (path, inode) values (?, ?)");
+    mount->stmt.path_unlink = db_prepare(mount, "delete from paths where path = ?");
+    mount->stmt.path_rename = db_prepare(mount, "update or replace paths set path = ? where path = ?;");
+    return 0;
+}
+
+// Nothing is written to a read-only database, not even to migrate or rebuild
+// it, so it has to be mounted writable once first if it needs either.
+static int fakefs_mount_readonly(struct mount *mount, const char *db_path) {
+    struct stat statbuf;
+    if (stat(db_path, &statbuf) < 0)
+        return errno_map();
+    bool current = false;
+    sqlite3_stmt *statement = db_prepare(mount, "select db_inode from meta");
+    if (sqlite3_step(statement) == SQLITE_ROW)
+        current = (uint64_t) sqlite3_column_int64(statement, 0) == statbuf.st_ino;
+    sqlite3_finalize(statement);
+    if (!current) {
+        printk("fakefs: %s needs rebuilding, mount it writable first\n", db_path);
+        sqlite3_close(mount->db);
+        return _EINVAL;
+    }
+
+    int err = realfs.mount(mount);
+    if (err < 0)
+        return err;
+    err = fakefs_mount_finish(mount);
+    if (err < 0)
+        return err;
+    mount->rebuild = NULL;
+    mount->rebuild_thread_running = false;
+    return 0;
+}
+
 static int fakefs_mount(struct mount *mount) {
     char db_path[PATH_MAX];
-    strcpy(db_path, mount->source);
-    char *basename = strrchr(db_path, '/') + 1;
-    assert(strcmp(basename, "data") == 0);
-    strcpy(basename, "meta.db");
+    db_path_for_mount(mount, db_path);
 
     // check if it is in fact a sqlite database
     char buf[16] = {};
@@ -420,12 +1267,18 @@ static int fakefs_mount(struct mount *mount) {
     if (strncmp(buf, "SQLite format 3", 15) != 0)
         return _EINVAL;
 
-    int err = sqlite3_open_v2(db_path, &mount->db, SQLITE_OPEN_READWRITE, NULL);
+    // "ro" is for the lower layers of overlays, which any number of instances
+    // may share. It's not mountable otherwise.
+    mount->readonly = mount->options != NULL && strcmp(mount->options, "ro") == 0;
+    int err = sqlite3_open_v2(db_path, &mount->db,
+            mount->readonly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE, NULL);
     if (err != SQLITE_OK) {
         printk("error opening database: %s\n", sqlite3_errmsg(mount->db));
         sqlite3_close(mount->db);
         return _EINVAL;
     }
+    if (mount->readonly)
+        return fakefs_mount_readonly(mount, db_path);
 
     // let's do WAL mode
     sqlite3_stmt *statement = db_prepare(mount, "pragma journal_mode=wal");
@@ -434,6 +1287,17 @@ static int fakefs_mount(struct mount *mount) {
     db_check_error(mount);
     sqlite3_finalize(statement);
 
+#if FAKEFS_DURABILITY_FULL
+    statement = db_prepare(mount, "pragma synchronous=full");
+#else
+    // in WAL mode this can lose the most recent commits on power loss, but
+    // never corrupts the database
+    statement = db_prepare(mount, "pragma synchronous=normal");
+#endif
+    sqlite3_step(statement);
+    db_check_error(mount);
+    sqlite3_finalize(statement);
+
 #if DEBUG_sql
     sqlite3_trace_v2(mount->db, SQLITE_TRACE_STMT, trace_callback, NULL);
 #endif
@@ -459,6 +1323,8 @@ static int fakefs_mount(struct mount *mount) {
         if ((uint64_t) sqlite3_column_int64(statement, 0) != db_inode) {
             sqlite3_finalize(statement);
             statement = NULL;
+            // this just sets things up, the actual rebuild happens in the
+            // background after mounting, see fakefs_rebuild_start
             int err = fakefs_rebuild(mount);
             if (err < 0) {
                 close(mount->root_fd);
@@ -484,32 +1350,91 @@ static int fakefs_mount(struct mount *mount) {
     db_check_error(mount);
     sqlite3_finalize(statement);
 
-    lock_init(&mount->lock);
-    mount->stmt.begin = db_prepare(mount, "begin");
-    mount->stmt.commit = db_prepare(mount, "commit");
-    mount->stmt.rollback = db_prepare(mount, "rollback");
-    mount->stmt.path_get_inode = db_prepare(mount, "select inode from paths where path = ?");
-    mount->stmt.path_read_stat = db_prepare(mount, "select inode, stat from stats natural join paths where path = ?");
-    mount->stmt.path_create_stat = db_prepare(mount, "insert into stats (stat) values (?)");
-    mount->stmt.path_create_path = db_prepare(mount, "insert into paths values (?, last_insert_rowid())");
-    mount->stmt.inode_read_stat = db_prepare(mount, "select stat from stats where inode = ?");
-    mount->stmt.inode_write_stat = db_prepare(mount, "update stats set stat = ? where inode = ?");
-    mount->stmt.path_link = db_prepare(mount, "insert into paths (path, inode) values (?, ?)");
-    mount->stmt.path_unlink = db_prepare(mount, "delete from paths where path = ?");
-    mount->stmt.path_rename = db_prepare(mount, "update or replace paths set path = ? where path = ?;");
-
+    err = fakefs_mount_finish(mount);
+    if (err < 0)
+        return err;
+    err = fakefs_rebuild_start(mount);
+    if (err < 0)
+        return err;
     return 0;
 }
 
 static int fakefs_umount(struct mount *mount) {
+    fakefs_rebuild_stop(mount);
+    if (mount->batch_timer)
+        timer_free(mount->batch_timer);
+    fakefs_sync(mount);
+    struct fakefs_reader *reader, *tmp;
+    list_for_each_entry_safe(&mount->readers, reader, tmp, free) {
+        list_remove(&reader->free);
+        reader_free(reader);
+    }
     if (mount->db)
         sqlite3_close(mount->db);
+    if (mount->cache)
+        cache_free(mount->cache);
     /* return realfs.umount(mount); */
     return 0;
 }
 
+// Sets up an empty fakefs in dir, which must be empty or not exist yet, with
+// a root directory owned by root
+int fakefs_create(const char *dir) {
+    if (mkdir(dir, 0777) < 0 && errno != EEXIST)
+        return errno_map();
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/data", dir) >= (int) sizeof(path))
+        return _ENAMETOOLONG;
+    if (mkdir(path, 0777) < 0 && errno != EEXIST)
+        return errno_map();
+    strcpy(strrchr(path, '/') + 1, "meta.db");
+
+    sqlite3 *db;
+    if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK) {
+        printk("error creating database: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return _EINVAL;
+    }
+    // same schema as tools/fakefsify.py
+    int err = sqlite3_exec(db,
+            "begin;"
+            "create table meta (id integer unique default 0, db_inode integer);"
+            "insert into meta (db_inode) values (0);"
+            "create table paths (path blob primary key, inode integer);"
+            "create table stats (inode integer primary key, stat blob);"
+            "commit;", NULL, NULL, NULL);
+    struct ish_stat root = {.mode = S_IFDIR | 0755};
+    sqlite3_stmt *statement = NULL;
+    if (err == SQLITE_OK)
+        err = sqlite3_prepare_v2(db, "insert into stats (stat) values (?)", -1, &statement, NULL);
+    if (err == SQLITE_OK) {
+        sqlite3_bind_blob(statement, 1, &root, sizeof(root), SQLITE_TRANSIENT);
+        if (sqlite3_step(statement) != SQLITE_DONE)
+            err = sqlite3_errcode(db);
+        sqlite3_finalize(statement);
+    }
+    if (err == SQLITE_OK)
+        err = sqlite3_exec(db, "insert into paths values (x'', last_insert_rowid())", NULL, NULL, NULL);
+    // the inode has to be right or the first mount will rebuild everything
+    struct stat statbuf;
+    if (err == SQLITE_OK && stat(path, &statbuf) == 0) {
+        char *update = sqlite3_mprintf("update meta set db_inode = %lld", (long long) statbuf.st_ino);
+        err = sqlite3_exec(db, update, NULL, NULL, NULL);
+        sqlite3_free(update);
+    }
+    if (err != SQLITE_OK) {
+        printk("error creating database: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return _EINVAL;
+    }
+    sqlite3_close(db);
+    return 0;
+}
+
 const struct fs_ops fakefs = {
     .magic = 0x66616b65,
+    .cache_links = true,
+    .cache_not_links = true,
     .mount = fakefs_mount,
     .umount = fakefs_umount,
     .statfs = realfs_statfs,
@@ -521,7 +1446,7 @@ const struct fs_ops fakefs = {
     .symlink = fakefs_symlink,
     .mknod = fakefs_mknod,
 
-    .close = realfs_close,
+    .close = fakefs_close,
     .stat = fakefs_stat,
     .fstat = fakefs_fstat,
     .flock = realfs_flock,
@@ -532,4 +1457,5 @@ const struct fs_ops fakefs = {
 
     .mkdir = fakefs_mkdir,
     .rmdir = fakefs_rmdir,
+    .sync = fakefs_sync,
 };
@@ -7,6 +7,7 @@
 #include "kernel/fs.h"
 #include "fs/poll.h"
 #include "fs/fd.h"
+#include "fs/pipe.h"
 
 struct fd *fd_create(const struct fd_ops *ops) {
     struct fd *fd = malloc(sizeof(struct fd));
@@ -36,11 +37,10 @@ int fd_close(struct fd *fd) {
         lock(&fd->poll_lock);
         struct poll_fd *poll_fd, *tmp;
         list_for_each_entry_safe(&fd->poll_fds, poll_fd, tmp, polls) {
-            lock(&poll_fd->poll->lock);
-            list_remove(&poll_fd->polls);
-            list_remove(&poll_fd->fds);
-            unlock(&poll_fd->poll->lock);
-            free(poll_fd);
+            struct poll *poll = poll_fd->poll;
+            lock(&poll->lock);
+            poll_fd_remove(poll_fd);
+            unlock(&poll->lock);
         }
         unlock(&fd->poll_lock);
         if (fd->ops->close)
@@ -232,6 +232,8 @@ void fdtable_do_cloexec(struct fdtable *table) {
 #define F_SETFD_ 2
 #define F_GETFL_ 3
 #define F_SETFL_ 4
+#define F_SETPIPE_SZ_ 1031
+#define F_GETPIPE_SZ_ 1032
 
 dword_t sys_dup(fd_t f) {
     struct fd *fd = f_get(f);
@@ -298,6 +300,13 @@ dword_t sys_fcntl64(fd_t f, dword_t cmd, dword_t arg) {
             STRACE("fcntl(%d, F_SETFL, %#x)", f, arg);
             return fd_setflags(fd, arg);
 
+        case F_SETPIPE_SZ_:
+            STRACE("fcntl(%d, F_SETPIPE_SZ, %d)", f, arg);
+            return pipe_set_size(fd, arg);
+        case F_GETPIPE_SZ_:
+            STRACE("fcntl(%d, F_GETPIPE_SZ)", f);
+            return pipe_get_size(fd);
+
         default:
             STRACE("fcntl(%d, %d)", f, cmd);
             return _EINVAL;
@@ -41,6 +41,15 @@ struct fd {
         struct {
             struct timer *timer;
             uint64_t expirations;
+            int timerfd_clock;
+        };
+        // pipe
+        struct {
+            struct pipe *pipe;
+        };
+        // unix socket
+        struct {
+            struct unix_sock *unix_sock;
         };
     };
     // fs data
@@ -56,6 +65,16 @@ struct fd {
         struct {
             int pty_num;
         };
+        // tmpfs
+        struct {
+            struct tmp_inode *tmp_inode;
+            int tmp_flock; // LOCK_SH_ or LOCK_EX_ if this fd holds a flock
+        };
+        // overlay directories, other files are opened straight from a layer
+        struct {
+            struct fd *overlay_dir; // the directory in the layer it was opened from
+            struct overlay_listing *overlay_listing;
+        };
     };
 
     // fs/inode data
@@ -63,6 +82,7 @@ struct fd {
     int real_fd; // seeks on this fd require the lock
     ino_t fake_inode;
     DIR *dir;
+    struct fakefs_listing *fake_listing;
     struct statbuf stat; // for adhoc fs
     struct fd_sockrestart sockrestart; // argh
 
@@ -84,9 +104,18 @@ int fd_setflags(struct fd *fd, int flags);
 #define NAME_MAX 255
 struct dir_entry {
     qword_t inode;
+    byte_t type; // DT_*, 0 if unknown
+    // where the stream is after this entry, only filled in by readdir_batch
+    unsigned long offset;
     char name[NAME_MAX + 1];
 };
 
+// d_type values are the S_IFMT bits of the mode shifted down
+#define DT_DIR_ 4
+static inline byte_t mode_to_dt(mode_t_ mode) {
+    return (mode >> 12) & 017;
+}
+
 #define LSEEK_SET 0
 #define LSEEK_CUR 1
 #define LSEEK_END 2
@@ -97,10 +126,19 @@ struct fd_ops {
     ssize_t (*read)(struct fd *fd, void *buf, size_t bufsize);
     ssize_t (*write)(struct fd *fd, const void *buf, size_t bufsize);
     off_t_ (*lseek)(struct fd *fd, off_t_ off, int whence);
+    // Same as read and write, but straight to or from the current process's
+    // memory, skipping the buffer
+    // optional
+    ssize_t (*read_user)(struct fd *fd, addr_t addr, size_t bufsize);
+    ssize_t (*write_user)(struct fd *fd, addr_t addr, size_t bufsize);
 
     // Reads a directory entry from the stream
     // required for directories
     int (*readdir)(struct fd *fd, struct dir_entry *entry);
+    // Reads up to count entries at once, returns how many were read, 0 at the
+    // end of the directory
+    // optional, readdir will be used instead
+    int (*readdir_batch)(struct fd *fd, struct dir_entry *entries, unsigned count);
     // Return an opaque value representing the current point in the directory stream
     // optional, fd->offset will be used instead
     unsigned long (*telldir)(struct fd *fd);
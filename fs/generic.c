@@ -19,17 +19,6 @@ struct mount *find_mount_and_trim_path(char *path) {
     return mount;
 }
 
-bool contains_mount_point(const char *path) {
-    struct mount *mount;
-    list_for_each_entry(&mounts, mount, mounts) {
-        int n = strlen(path);
-        if (strncmp(path, mount->point, n) == 0 &&
-                (mount->point[n] == '\0' || mount->point[n] == '/'))
-            return true;
-    }
-    return false;
-}
-
 struct fd *generic_openat(struct fd *at, const char *path_raw, int flags, int mode) {
     // TODO really, really, seriously reconsider what I'm doing with the strings
     char path[MAX_PATH];
@@ -40,7 +29,9 @@ struct fd *generic_openat(struct fd *at, const char *path_raw, int flags, int mo
     struct fd *fd = mount->fs->open(mount, path, flags, mode);
     if (IS_ERR(fd))
         return fd;
-    fd->mount = mount;
+    // overlayfs hands out fds that belong to one of its layers
+    if (fd->mount == NULL)
+        fd->mount = mount;
 
     struct statbuf stat;
     err = fd->mount->fs->fstat(fd, &stat);
@@ -120,6 +111,8 @@ int generic_linkat(struct fd *src_at, const char *src_raw, struct fd *dst_at, co
         err = _EXDEV;
     else
         err = mount->fs->link(mount, src, dst);
+    if (err >= 0)
+        path_cache_forget(mount, dst);
     mount_release(mount);
     mount_release(dst_mount);
     return err;
@@ -132,6 +125,8 @@ int generic_unlinkat(struct fd *at, const char *path_raw) {
         return err;
     struct mount *mount = find_mount_and_trim_path(path);
     err = mount->fs->unlink(mount, path);
+    if (err >= 0)
+        path_cache_forget(mount, path);
     mount_release(mount);
     return err;
 }
@@ -153,6 +148,10 @@ int generic_renameat(struct fd *src_at, const char *src_raw, struct fd *dst_at,
         err = _EXDEV;
     else
         err = mount->fs->rename(mount, src, dst);
+    if (err >= 0) {
+        path_cache_forget(mount, src);
+        path_cache_forget(mount, dst);
+    }
     mount_release(mount);
     mount_release(dst_mount);
     return err;
@@ -165,6 +164,8 @@ int generic_symlinkat(const char *target, struct fd *at, const char *link_raw) {
         return err;
     struct mount *mount = find_mount_and_trim_path(link);
     err = mount->fs->symlink(mount, target, link);
+    if (err >= 0)
+        path_cache_forget(mount, link);
     mount_release(mount);
     return err;
 }
@@ -243,6 +244,8 @@ int generic_rmdirat(struct fd *at, const char *path_raw) {
         return _EBUSY;
     struct mount *mount = find_mount_and_trim_path(path);
     err = mount->fs->rmdir(mount, path);
+    if (err >= 0)
+        path_cache_forget(mount, path);
     mount_release(mount);
     return err;
 }
@@ -1,3 +1,4 @@
+#include <sched.h>
 #include <string.h>
 #include <sys/stat.h>
 #include "kernel/calls.h"
@@ -8,35 +9,173 @@ const struct fs_ops *filesystems[] = {
     &realfs,
     &procfs,
     &devptsfs,
+    &tmpfs,
+    &overlayfs,
 };
 
+// Lookups don't take mounts_lock. Every change to the mounts list builds a new
+// immutable hash table of mount points and publishes it, and mount_find probes
+// the table with each prefix of the path, longest first. A table is freed once
+// every lookup that could have seen it has finished: lookups count themselves
+// in one of two reader counters, and the writer flips which counter new lookups
+// use and waits for the old one to drain.
+struct mount_table {
+    unsigned size; // power of two
+    unsigned max_depth; // most slashes in any mount point
+    struct mount *slots[];
+};
+static struct mount_table *mount_table;
+static unsigned mount_readers[2];
+static unsigned mount_readers_epoch;
+
+static unsigned mount_read_begin(void) {
+    for (;;) {
+        unsigned epoch = __atomic_load_n(&mount_readers_epoch, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&mount_readers[epoch], 1, __ATOMIC_SEQ_CST);
+        // If the epoch flipped before we were counted, the writer that
+        // flipped it didn't wait for us, and the next one will wait on the
+        // other counter, so neither would stop the table we're about to load
+        // from being freed. Once the epoch is seen not to have changed after
+        // counting, the next flip has to wait for this lookup.
+        if (__atomic_load_n(&mount_readers_epoch, __ATOMIC_SEQ_CST) == epoch)
+            return epoch;
+        __atomic_fetch_sub(&mount_readers[epoch], 1, __ATOMIC_SEQ_CST);
+    }
+}
+static void mount_read_end(unsigned epoch) {
+    __atomic_fetch_sub(&mount_readers[epoch], 1, __ATOMIC_SEQ_CST);
+}
+
+static unsigned mount_point_hash(const char *point, size_t n) {
+    unsigned hash = 2166136261u;
+    for (size_t i = 0; i < n; i++)
+        hash = (hash ^ (unsigned char) point[i]) * 16777619u;
+    return hash;
+}
+
+static struct mount *mount_table_get(struct mount_table *table, const char *point, size_t n) {
+    unsigned mask = table->size - 1;
+    for (unsigned i = mount_point_hash(point, n) & mask;; i = (i + 1) & mask) {
+        struct mount *mount = table->slots[i];
+        if (mount == NULL)
+            return NULL;
+        if (strncmp(mount->point, point, n) == 0 && mount->point[n] == '\0')
+            return mount;
+    }
+}
+
+// must hold mounts_lock
+static struct mount_table *mount_table_build() {
+    unsigned count = 0;
+    struct mount *mount;
+    list_for_each_entry(&mounts, mount, mounts)
+        count++;
+    unsigned size = 8;
+    while (size < count * 2)
+        size *= 2;
+    struct mount_table *table = calloc(1, sizeof(struct mount_table) + size * sizeof(struct mount *));
+    if (table == NULL)
+        return NULL;
+    table->size = size;
+    list_for_each_entry(&mounts, mount, mounts) {
+        unsigned depth = 0;
+        for (const char *c = mount->point; *c != '\0'; c++)
+            if (*c == '/')
+                depth++;
+        if (depth > table->max_depth)
+            table->max_depth = depth;
+        size_t n = strlen(mount->point);
+        unsigned i = mount_point_hash(mount->point, n) & (size - 1);
+        while (table->slots[i] != NULL)
+            i = (i + 1) & (size - 1);
+        table->slots[i] = mount;
+    }
+    return table;
+}
+
+// must hold mounts_lock. returns the old table, which no lookup is using anymore
+static struct mount_table *mount_table_publish(struct mount_table *table) {
+    struct mount_table *old = __atomic_exchange_n(&mount_table, table, __ATOMIC_SEQ_CST);
+    unsigned epoch = mount_readers_epoch;
+    __atomic_store_n(&mount_readers_epoch, !epoch, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&mount_readers[epoch], __ATOMIC_SEQ_CST) != 0)
+        sched_yield();
+    return old;
+}
+
 struct mount *mount_find(char *path) {
     assert(path_is_normalized(path));
-    lock(&mounts_lock);
-    struct mount *mount = NULL;
-    assert(!list_empty(&mounts)); // this would mean there's no root FS mounted
-    list_for_each_entry(&mounts, mount, mounts) {
-        int n = strlen(mount->point);
-        if (strncmp(path, mount->point, n) == 0 && (path[n] == '/' || path[n] == '\0'))
-            break;
+    unsigned epoch = mount_read_begin();
+    struct mount_table *table = __atomic_load_n(&mount_table, __ATOMIC_SEQ_CST);
+    assert(table != NULL); // this would mean there's no root FS mounted
+    size_t n = strlen(path);
+    unsigned depth = 0;
+    for (size_t i = 0; i < n; i++)
+        if (path[i] == '/')
+            depth++;
+    struct mount *mount;
+    for (;;) {
+        if (depth <= table->max_depth) {
+            mount = mount_table_get(table, path, n);
+            if (mount != NULL)
+                break;
+        }
+        assert(n != 0);
+        do n--; while (path[n] != '/');
+        depth--;
     }
-    mount->refcount++;
-    unlock(&mounts_lock);
+    __atomic_fetch_add(&mount->refcount, 1, __ATOMIC_SEQ_CST);
+    mount_read_end(epoch);
     return mount;
 }
 
 void mount_release(struct mount *mount) {
-    lock(&mounts_lock);
-    mount->refcount--;
-    unlock(&mounts_lock);
+    __atomic_fetch_sub(&mount->refcount, 1, __ATOMIC_SEQ_CST);
+}
+
+bool contains_mount_point(const char *path) {
+    size_t n = strlen(path);
+    bool found = false;
+    unsigned epoch = mount_read_begin();
+    struct mount_table *table = __atomic_load_n(&mount_table, __ATOMIC_SEQ_CST);
+    for (unsigned i = 0; i < table->size && !found; i++) {
+        struct mount *mount = table->slots[i];
+        if (mount != NULL && strncmp(path, mount->point, n) == 0 &&
+                (mount->point[n] == '\0' || mount->point[n] == '/'))
+            found = true;
+    }
+    mount_read_end(epoch);
+    return found;
+}
+
+// the list must stay in descending order of mount point length
+static void mount_list_add(struct mount *new_mount) {
+    struct mount *mount;
+    list_for_each_entry(&mounts, mount, mounts) {
+        if (strlen(mount->point) <= strlen(new_mount->point))
+            break;
+    }
+    list_add_before(&mount->mounts, &new_mount->mounts);
+}
+
+// must hold mounts_lock
+static unsigned shared_link_cache_mounts() {
+    unsigned count = 0;
+    struct mount *mount;
+    list_for_each_entry(&mounts, mount, mounts) {
+        if (mount->fs->cache_links && !mount->fs->private_storage)
+            count++;
+    }
+    return count;
 }
 
-int do_mount(const struct fs_ops *fs, const char *source, const char *point) {
+int do_mount(const struct fs_ops *fs, const char *source, const char *point, const char *options) {
     struct mount *new_mount = malloc(sizeof(struct mount));
     if (new_mount == NULL)
         return _ENOMEM;
     new_mount->point = strdup(point);
     new_mount->source = strdup(source);
+    new_mount->options = options != NULL ? strdup(options) : NULL;
     new_mount->fs = fs;
     new_mount->data = NULL;
     new_mount->refcount = 0;
@@ -48,13 +187,17 @@ int do_mount(const struct fs_ops *fs, const char *source, const char *point) {
         }
     }
 
-    // the list must stay in descending order of mount point length
-    struct mount *mount;
-    list_for_each_entry(&mounts, mount, mounts) {
-        if (strlen(mount->point) <= strlen(new_mount->point))
-            break;
+    mount_list_add(new_mount);
+    struct mount_table *table = mount_table_build();
+    if (table == NULL) {
+        list_remove(&new_mount->mounts);
+        if (fs->umount)
+            fs->umount(new_mount);
+        free(new_mount);
+        return _ENOMEM;
     }
-    list_add_before(&mount->mounts, &new_mount->mounts);
+    free(mount_table_publish(table));
+    path_cache_flush(shared_link_cache_mounts());
     return 0;
 }
 
@@ -62,11 +205,28 @@ int mount_remove(struct mount *mount) {
     if (mount->refcount != 0)
         return _EBUSY;
 
+    list_remove(&mount->mounts);
+    struct mount_table *table = mount_table_build();
+    if (table == NULL) {
+        mount_list_add(mount);
+        return _ENOMEM;
+    }
+    struct mount_table *old_table = mount_table_publish(table);
+    // a lookup that found the mount in the old table may have taken a
+    // reference before the new table was published
+    if (__atomic_load_n(&mount->refcount, __ATOMIC_SEQ_CST) != 0) {
+        mount_list_add(mount);
+        free(mount_table_publish(old_table));
+        return _EBUSY;
+    }
+    free(old_table);
+
     if (mount->fs->umount)
         mount->fs->umount(mount);
-    list_remove(&mount->mounts);
+    path_cache_flush(shared_link_cache_mounts());
     free((void *) mount->source);
     free((void *) mount->point);
+    free((void *) mount->options);
     free(mount);
     return 0;
 }
@@ -98,7 +258,10 @@ dword_t sys_mount(addr_t source_addr, addr_t point_addr, addr_t type_addr, dword
     char type[100];
     if (user_read_string(type_addr, type, sizeof(type)))
         return _EFAULT;
-    STRACE("mount(\"%s\", \"%s\", \"%s\", %#x, %#x)", source, point_raw, type, flags, data_addr);
+    char data[1024];
+    if (data_addr != 0 && user_read_string(data_addr, data, sizeof(data)))
+        return _EFAULT;
+    STRACE("mount(\"%s\", \"%s\", \"%s\", %#x, \"%s\")", source, point_raw, type, flags, data_addr != 0 ? data : "");
 
     if (flags & ~MS_SUPPORTED) {
         FIXME("missing mount flags %#x", flags & ~MS_SUPPORTED);
@@ -128,7 +291,7 @@ dword_t sys_mount(addr_t source_addr, addr_t point_addr, addr_t type_addr, dword
         return err;
 
     lock(&mounts_lock);
-    err = do_mount(fs, source, point);
+    err = do_mount(fs, source, point, data_addr != 0 ? data : NULL);
     unlock(&mounts_lock);
     return err;
 }
@@ -0,0 +1,1208 @@
+#include <dirent.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "kernel/errno.h"
+#include "kernel/fs.h"
+#include "fs/fd.h"
+#include "util/sync.h"
+
+// Stacks a writable upper layer over a read-only lower layer, so any number of
+// instances can share one root and each only stores what it changed.
+//
+// Lookups try the upper layer, then the lower one. Changing something that's
+// only in the lower layer copies it up first, along with any parent
+// directories the upper layer doesn't have yet. Deleting something the lower
+// layer has leaves a whiteout, an empty file called .wh.<name> in the upper
+// layer. A directory made where one was deleted gets a .wh..wh..opq file,
+// which makes it opaque: nothing under it in the lower layer shows through.
+// Whiteouts work the same on any upper fs and are never visible through the
+// overlay.
+//
+// Directories are opened as overlay fds, which list the merged contents.
+// Everything else is opened straight from its layer, so reads and mmaps go
+// right to the underlying fs. Like linux before 4.19, an fd that was opened
+// on a lower file keeps seeing the lower file after it's copied up.
+//
+// Renaming a directory that has anything in the lower layer fails with EXDEV,
+// like linux without redirect_dir, and mv falls back to copying.
+//
+// Mount options are lowerdir= and upperdir=, both host paths, and lowerdir
+// defaults to the source. A directory with a meta.db in it is a fakefs root,
+// and the lower one is opened read-only. Anything else is used through
+// realfs. An upperdir that's empty or doesn't exist is made into a new
+// fakefs, and without one the changes go to a tmpfs and vanish on unmount.
+
+#define OVERLAY_MAGIC 0x794c7630
+
+#define WHITEOUT_PREFIX ".wh."
+#define OPAQUE_NAME WHITEOUT_PREFIX WHITEOUT_PREFIX ".opq"
+#define COPY_UP_NAME WHITEOUT_PREFIX WHITEOUT_PREFIX ".tmp"
+
+#define COPY_UP_CHUNK (1 << 16)
+#define LIST_BATCH 64
+
+struct overlay {
+    // the lower layer's fs_ops with fsetattr replaced, see lower_fsetattr
+    // must be first, lower_fsetattr gets from one to the other with a cast
+    struct fs_ops lower_ops;
+    struct mount *lower;
+    struct mount *upper;
+    // held for writing by anything that changes the upper layer
+    wrlock_t lock;
+};
+
+enum layer {
+    LAYER_NONE,
+    LAYER_UPPER,
+    LAYER_LOWER,
+};
+
+struct listing_entry {
+    qword_t inode;
+    unsigned name; // offset into names
+    byte_t type;
+};
+struct overlay_listing {
+    struct listing_entry *entries;
+    unsigned count;
+    unsigned size;
+    char *names;
+    size_t names_len;
+    size_t names_size;
+};
+
+// paths
+
+// Puts prefix and name, in the same directory as path, into buf
+static int sibling_path(const char *path, const char *prefix, const char *name, char *buf) {
+    const char *slash = strrchr(path, '/');
+    size_t dir_len = slash != NULL ? (size_t) (slash - path) : 0;
+    if (dir_len + 1 + strlen(prefix) + strlen(name) >= MAX_PATH)
+        return _ENAMETOOLONG;
+    memcpy(buf, path, dir_len);
+    sprintf(buf + dir_len, "/%s%s", prefix, name);
+    return 0;
+}
+
+static int whiteout_path(const char *path, char *buf) {
+    return sibling_path(path, WHITEOUT_PREFIX, strrchr(path, '/') + 1, buf);
+}
+
+static int child_path(const char *dir, const char *name, char *buf) {
+    if (snprintf(buf, MAX_PATH, "%s/%s", dir, name) >= MAX_PATH)
+        return _ENAMETOOLONG;
+    return 0;
+}
+
+static bool is_reserved_name(const char *name) {
+    return strncmp(name, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX)) == 0;
+}
+static bool is_reserved(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash != NULL && is_reserved_name(slash + 1);
+}
+
+// layers
+
+static struct mount *layer_mount(struct mount *mount, const struct fs_ops *fs, const char *source, const char *options) {
+    struct mount *layer = calloc(1, sizeof(struct mount));
+    if (layer == NULL)
+        return ERR_PTR(_ENOMEM);
+    // the same point as the overlay, so getpath on a layer's fds works
+    layer->point = strdup(mount->point);
+    layer->source = strdup(source);
+    layer->options = options != NULL ? strdup(options) : NULL;
+    layer->fs = fs;
+    int err = _ENOMEM;
+    if (layer->point != NULL && layer->source != NULL && (options == NULL || layer->options != NULL))
+        err = fs->mount(layer);
+    if (err < 0) {
+        free((void *) layer->point);
+        free((void *) layer->source);
+        free((void *) layer->options);
+        free(layer);
+        return ERR_PTR(err);
+    }
+    return layer;
+}
+
+static void layer_umount(struct mount *layer) {
+    if (layer->fs->umount)
+        layer->fs->umount(layer);
+    free((void *) layer->point);
+    free((void *) layer->source);
+    free((void *) layer->options);
+    free(layer);
+}
+
+static int layer_stat(struct mount *layer, const char *path, struct statbuf *stat) {
+    return layer->fs->stat(layer, path, stat, false);
+}
+
+static bool layer_exists(struct mount *layer, const char *path) {
+    struct statbuf stat;
+    return layer_stat(layer, path, &stat) >= 0;
+}
+
+static struct fd *layer_open(struct mount *layer, const char *path, int flags, int mode) {
+    struct fd *fd = layer->fs->open(layer, path, flags, mode);
+    if (!IS_ERR(fd))
+        fd->mount = layer;
+    return fd;
+}
+
+static struct mount *layer_get(struct overlay *ovl, enum layer layer) {
+    return layer == LAYER_UPPER ? ovl->upper : ovl->lower;
+}
+
+// lookup
+
+static bool is_opaque(struct overlay *ovl, const char *dir) {
+    char path[MAX_PATH];
+    return child_path(dir, OPAQUE_NAME, path) >= 0 && layer_exists(ovl->upper, path);
+}
+
+static bool whiteout_exists(struct overlay *ovl, const char *path) {
+    char whiteout[MAX_PATH];
+    return whiteout_path(path, whiteout) >= 0 && layer_exists(ovl->upper, whiteout);
+}
+
+// Whether path in the lower layer would show through, which it doesn't if
+// there's a whiteout for it or any of its parents, or one of its parents in
+// the upper layer is opaque or not a directory. Whether the upper layer has
+// path itself doesn't matter.
+static bool lower_visible(struct overlay *ovl, const char *path) {
+    char prefix[MAX_PATH];
+    const char *end = path;
+    while (*end != '\0') {
+        end = strchr(end + 1, '/');
+        if (end == NULL)
+            end = path + strlen(path);
+        memcpy(prefix, path, end - path);
+        prefix[end - path] = '\0';
+        if (whiteout_exists(ovl, prefix))
+            return false;
+        if (*end == '\0')
+            break;
+        struct statbuf stat;
+        // there can't be any whiteouts under a directory the upper layer doesn't have
+        if (layer_stat(ovl->upper, prefix, &stat) < 0)
+            return true;
+        if (!S_ISDIR(stat.mode) || is_opaque(ovl, prefix))
+            return false;
+    }
+    return true;
+}
+
+static bool lower_has(struct overlay *ovl, const char *path) {
+    return lower_visible(ovl, path) && layer_exists(ovl->lower, path);
+}
+
+static enum layer lookup(struct overlay *ovl, const char *path, struct statbuf *stat) {
+    if (is_reserved(path))
+        return LAYER_NONE;
+    if (layer_stat(ovl->upper, path, stat) >= 0)
+        return LAYER_UPPER;
+    if (lower_visible(ovl, path) && layer_stat(ovl->lower, path, stat) >= 0)
+        return LAYER_LOWER;
+    return LAYER_NONE;
+}
+
+// listings
+
+static void listing_free(struct overlay_listing *listing) {
+    free(listing->entries);
+    free(listing->names);
+    free(listing);
+}
+
+static int listing_add(struct overlay_listing *listing, qword_t inode, byte_t type, const char *name) {
+    size_t name_len = strlen(name) + 1;
+    if (listing->count >= listing->size) {
+        unsigned size = listing->size ? listing->size * 2 : 32;
+        struct listing_entry *entries = realloc(listing->entries, size * sizeof(struct listing_entry));
+        if (entries == NULL)
+            return _ENOMEM;
+        listing->entries = entries;
+        listing->size = size;
+    }
+    if (listing->names_len + name_len > listing->names_size) {
+        size_t size = listing->names_size ? listing->names_size : 1024;
+        while (listing->names_len + name_len > size)
+            size *= 2;
+        char *names = realloc(listing->names, size);
+        if (names == NULL)
+            return _ENOMEM;
+        listing->names = names;
+        listing->names_size = size;
+    }
+    struct listing_entry *entry = &listing->entries[listing->count++];
+    entry->inode = inode;
+    entry->type = type;
+    entry->name = listing->names_len;
+    memcpy(listing->names + listing->names_len, name, name_len);
+    listing->names_len += name_len;
+    return 0;
+}
+
+static const char *listing_name(struct overlay_listing *listing, unsigned i) {
+    return listing->names + listing->entries[i].name;
+}
+
+// Reads everything in a directory in one layer
+static struct overlay_listing *layer_list(struct mount *layer, const char *path) {
+    struct fd *fd = layer_open(layer, path, O_RDONLY_, 0);
+    if (IS_ERR(fd))
+        return (struct overlay_listing *) fd;
+    struct overlay_listing *listing = calloc(1, sizeof(struct overlay_listing));
+    struct dir_entry *entries = malloc(LIST_BATCH * sizeof(struct dir_entry));
+    int err = _ENOMEM;
+    if (listing == NULL || entries == NULL)
+        goto out;
+    while (true) {
+        int n;
+        if (fd->ops->readdir_batch) {
+            n = fd->ops->readdir_batch(fd, entries, LIST_BATCH);
+        } else {
+            entries[0].type = 0;
+            n = fd->ops->readdir(fd, &entries[0]);
+        }
+        err = n;
+        if (n <= 0)
+            break;
+        for (int i = 0; i < n && err >= 0; i++)
+            err = listing_add(listing, entries[i].inode, entries[i].type, entries[i].name);
+        if (err < 0)
+            break;
+    }
+out:
+    free(entries);
+    fd_close(fd);
+    if (err < 0) {
+        if (listing != NULL)
+            listing_free(listing);
+        return ERR_PTR(err);
+    }
+    return listing;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char **) a, *(const char **) b);
+}
+
+static bool names_contain(const char **names, unsigned count, const char *name) {
+    return bsearch(&name, names, count, sizeof(*names), compare_names) != NULL;
+}
+
+// Merges the directory from both layers. The upper layer's entries win, and
+// whiteouts hide the lower layer's.
+static struct overlay_listing *listing_build(struct overlay *ovl, const char *path) {
+    struct overlay_listing *upper = NULL;
+    struct overlay_listing *lower = NULL;
+    struct overlay_listing *listing = calloc(1, sizeof(struct overlay_listing));
+    const char **upper_names = NULL;
+    if (listing == NULL)
+        return ERR_PTR(_ENOMEM);
+    int err = 0;
+
+    struct statbuf stat;
+    if (layer_stat(ovl->upper, path, &stat) >= 0 && S_ISDIR(stat.mode)) {
+        upper = layer_list(ovl->upper, path);
+        if (IS_ERR(upper)) {
+            err = PTR_ERR(upper);
+            upper = NULL;
+            goto out;
+        }
+    }
+    bool opaque = false;
+    if (upper != NULL) {
+        for (unsigned i = 0; i < upper->count && err >= 0; i++) {
+            const char *name = listing_name(upper, i);
+            if (strcmp(name, OPAQUE_NAME) == 0)
+                opaque = true;
+            else if (!is_reserved_name(name))
+                err = listing_add(listing, upper->entries[i].inode, upper->entries[i].type, name);
+        }
+        if (err < 0)
+            goto out;
+    }
+
+    if (!opaque && lower_visible(ovl, path) &&
+            layer_stat(ovl->lower, path, &stat) >= 0 && S_ISDIR(stat.mode)) {
+        lower = layer_list(ovl->lower, path);
+        if (IS_ERR(lower)) {
+            err = PTR_ERR(lower);
+            lower = NULL;
+            goto out;
+        }
+    }
+    if (lower != NULL) {
+        // whiteouts are looked up by their full name
+        unsigned upper_count = upper != NULL ? upper->count : 0;
+        if (upper_count > 0) {
+            upper_names = malloc(upper_count * sizeof(*upper_names));
+            if (upper_names == NULL) {
+                err = _ENOMEM;
+                goto out;
+            }
+            for (unsigned i = 0; i < upper_count; i++)
+                upper_names[i] = listing_name(upper, i);
+            qsort(upper_names, upper_count, sizeof(*upper_names), compare_names);
+        }
+        for (unsigned i = 0; i < lower->count && err >= 0; i++) {
+            const char *name = listing_name(lower, i);
+            if (upper != NULL && (strcmp(name, ".") == 0 || strcmp(name, "..") == 0))
+                continue;
+            char whiteout[MAX_NAME + sizeof(WHITEOUT_PREFIX)];
+            snprintf(whiteout, sizeof(whiteout), WHITEOUT_PREFIX "%s", name);
+            if (names_contain(upper_names, upper_count, name) ||
+                    names_contain(upper_names, upper_count, whiteout))
+                continue;
+            err = listing_add(listing, lower->entries[i].inode, lower->entries[i].type, name);
+        }
+    }
+
+out:
+    free(upper_names);
+    if (upper != NULL)
+        listing_free(upper);
+    if (lower != NULL)
+        listing_free(lower);
+    if (err < 0) {
+        listing_free(listing);
+        return ERR_PTR(err);
+    }
+    return listing;
+}
+
+static int dir_check_empty(struct overlay *ovl, const char *path) {
+    struct overlay_listing *listing = listing_build(ovl, path);
+    if (IS_ERR(listing))
+        return PTR_ERR(listing);
+    int err = 0;
+    for (unsigned i = 0; i < listing->count; i++) {
+        const char *name = listing_name(listing, i);
+        if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+            err = _ENOTEMPTY;
+    }
+    listing_free(listing);
+    return err;
+}
+
+// Deletes the whiteouts in a directory in the upper layer, so it can be
+// removed or replaced
+static int dir_clear_whiteouts(struct overlay *ovl, const char *path) {
+    struct overlay_listing *upper = layer_list(ovl->upper, path);
+    if (IS_ERR(upper))
+        return PTR_ERR(upper);
+    int err = 0;
+    for (unsigned i = 0; i < upper->count && err >= 0; i++) {
+        const char *name = listing_name(upper, i);
+        if (!is_reserved_name(name))
+            continue;
+        char whiteout[MAX_PATH];
+        err = child_path(path, name, whiteout);
+        if (err >= 0)
+            err = ovl->upper->fs->unlink(ovl->upper, whiteout);
+    }
+    listing_free(upper);
+    return err;
+}
+
+// copy up
+
+// Copies ownership, permissions, and times to a file just made in the upper
+// layer. Only root can chown on the host, so with a realfs upper layer the
+// owner is kept if possible. realfs would also follow symlinks, so they only
+// get their owner set on the other filesystems.
+static int copy_attrs(struct overlay *ovl, const char *path, struct statbuf *stat) {
+    struct mount *upper = ovl->upper;
+    if (S_ISLNK(stat->mode)) {
+        if (upper->fs != &realfs) {
+            upper->fs->setattr(upper, path, make_attr(uid, stat->uid));
+            upper->fs->setattr(upper, path, make_attr(gid, stat->gid));
+        }
+        return 0;
+    }
+    int err = upper->fs->setattr(upper, path, make_attr(mode, stat->mode & ~S_IFMT));
+    if (err < 0)
+        return err;
+    upper->fs->setattr(upper, path, make_attr(uid, stat->uid));
+    upper->fs->setattr(upper, path, make_attr(gid, stat->gid));
+    if (upper->fs->utime) {
+        struct timespec atime = {.tv_sec = stat->atime, .tv_nsec = stat->atime_nsec};
+        struct timespec mtime = {.tv_sec = stat->mtime, .tv_nsec = stat->mtime_nsec};
+        upper->fs->utime(upper, path, atime, mtime);
+    }
+    return 0;
+}
+
+static int copy_up_data(struct overlay *ovl, const char *src, const char *dst) {
+    struct fd *in = layer_open(ovl->lower, src, O_RDONLY_, 0);
+    if (IS_ERR(in))
+        return PTR_ERR(in);
+    struct fd *out = layer_open(ovl->upper, dst, O_WRONLY_ | O_CREAT_ | O_TRUNC_, 0600);
+    if (IS_ERR(out)) {
+        fd_close(in);
+        return PTR_ERR(out);
+    }
+    int err = 0;
+    char *buf = malloc(COPY_UP_CHUNK);
+    if (buf == NULL)
+        err = _ENOMEM;
+    while (err >= 0) {
+        ssize_t size = in->ops->read(in, buf, COPY_UP_CHUNK);
+        if (size <= 0) {
+            err = size;
+            break;
+        }
+        for (ssize_t written = 0; written < size && err >= 0; ) {
+            ssize_t res = out->ops->write(out, buf + written, size - written);
+            if (res < 0)
+                err = res;
+            else
+                written += res;
+        }
+    }
+    free(buf);
+    fd_close(in);
+    fd_close(out);
+    return err;
+}
+
+static int copy_up(struct overlay *ovl, const char *path);
+
+// Makes sure the upper layer has all of path's parent directories
+static int copy_up_parents(struct overlay *ovl, const char *path) {
+    if (*path == '\0')
+        return 0;
+    char prefix[MAX_PATH];
+    for (const char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        memcpy(prefix, path, slash - path);
+        prefix[slash - path] = '\0';
+        if (layer_exists(ovl->upper, prefix))
+            continue;
+        if (!lower_has(ovl, prefix))
+            return _ENOENT;
+        int err = copy_up(ovl, prefix);
+        if (err < 0)
+            return err;
+    }
+    return 0;
+}
+
+// Copies path from the lower layer to the upper one, which doesn't have it yet
+static int copy_up(struct overlay *ovl, const char *path) {
+    struct mount *upper = ovl->upper;
+    struct statbuf stat;
+    int err = layer_stat(ovl->lower, path, &stat);
+    if (err < 0)
+        return err;
+    err = copy_up_parents(ovl, path);
+    if (err < 0)
+        return err;
+
+    if (S_ISDIR(stat.mode)) {
+        err = upper->fs->mkdir(upper, path, stat.mode & ~S_IFMT);
+        if (err < 0)
+            return err;
+        return copy_attrs(ovl, path, &stat);
+    }
+
+    // everything else is made under a temporary name and renamed into place,
+    // so a crash can't leave half a file covering up the whole one
+    char tmp[MAX_PATH];
+    err = sibling_path(path, "", COPY_UP_NAME, tmp);
+    if (err < 0)
+        return err;
+    upper->fs->unlink(upper, tmp);
+    if (S_ISREG(stat.mode)) {
+        err = copy_up_data(ovl, path, tmp);
+    } else if (S_ISLNK(stat.mode)) {
+        char target[MAX_PATH + 1];
+        ssize_t size = ovl->lower->fs->readlink(ovl->lower, path, target, sizeof(target) - 1);
+        if (size < 0) {
+            err = size;
+        } else {
+            target[size] = '\0';
+            err = upper->fs->symlink(upper, target, tmp);
+        }
+    } else {
+        err = upper->fs->mknod(upper, tmp, stat.mode, stat.rdev);
+    }
+    if (err >= 0)
+        err = copy_attrs(ovl, tmp, &stat);
+    if (err >= 0)
+        err = upper->fs->rename(upper, tmp, path);
+    if (err < 0)
+        upper->fs->unlink(upper, tmp);
+    return err;
+}
+
+// Copies path up if it's only in the lower layer
+static int copy_up_lookup(struct overlay *ovl, const char *path) {
+    struct statbuf stat;
+    enum layer layer = lookup(ovl, path, &stat);
+    if (layer == LAYER_NONE)
+        return _ENOENT;
+    if (layer == LAYER_LOWER)
+        return copy_up(ovl, path);
+    return 0;
+}
+
+// whiteouts
+
+static int whiteout_create(struct overlay *ovl, const char *path) {
+    char whiteout[MAX_PATH];
+    int err = whiteout_path(path, whiteout);
+    if (err < 0)
+        return err;
+    err = copy_up_parents(ovl, path);
+    if (err < 0)
+        return err;
+    struct fd *fd = layer_open(ovl->upper, whiteout, O_WRONLY_ | O_CREAT_ | O_TRUNC_, 0);
+    if (IS_ERR(fd))
+        return PTR_ERR(fd);
+    fd_close(fd);
+    return 0;
+}
+
+static void whiteout_remove(struct overlay *ovl, const char *path) {
+    char whiteout[MAX_PATH];
+    if (whiteout_path(path, whiteout) >= 0)
+        ovl->upper->fs->unlink(ovl->upper, whiteout);
+}
+
+static int make_opaque(struct overlay *ovl, const char *dir) {
+    char path[MAX_PATH];
+    int err = child_path(dir, OPAQUE_NAME, path);
+    if (err < 0)
+        return err;
+    struct fd *fd = layer_open(ovl->upper, path, O_WRONLY_ | O_CREAT_ | O_TRUNC_, 0);
+    if (IS_ERR(fd))
+        return PTR_ERR(fd);
+    fd_close(fd);
+    return 0;
+}
+
+// Checks that path can be created and makes its parents in the upper layer
+static int create_prepare(struct overlay *ovl, const char *path) {
+    struct statbuf stat;
+    if (lookup(ovl, path, &stat) != LAYER_NONE)
+        return _EEXIST;
+    if (is_reserved(path))
+        return _EPERM;
+    return copy_up_parents(ovl, path);
+}
+
+// directory fds
+
+static int overlay_listing_open(struct fd *fd) {
+    struct overlay *ovl = fd->mount->data;
+    char path[MAX_PATH];
+    int err = fd->overlay_dir->mount->fs->getpath(fd->overlay_dir, path);
+    if (err < 0)
+        return err;
+    read_wrlock(&ovl->lock);
+    struct overlay_listing *listing = listing_build(ovl, path);
+    read_wrunlock(&ovl->lock);
+    if (IS_ERR(listing))
+        return PTR_ERR(listing);
+    fd->overlay_listing = listing;
+    return 0;
+}
+
+static int overlay_readdir_batch(struct fd *fd, struct dir_entry *entries, unsigned count) {
+    if (fd->overlay_listing == NULL) {
+        int err = overlay_listing_open(fd);
+        if (err < 0)
+            return err;
+    }
+    struct overlay_listing *listing = fd->overlay_listing;
+    unsigned n = 0;
+    while (n < count && fd->offset < listing->count) {
+        struct listing_entry *entry = &listing->entries[fd->offset++];
+        entries[n].inode = entry->inode;
+        entries[n].type = entry->type;
+        strcpy(entries[n].name, listing->names + entry->name);
+        entries[n].offset = fd->offset;
+        n++;
+    }
+    return n;
+}
+
+static int overlay_readdir(struct fd *fd, struct dir_entry *entry) {
+    return overlay_readdir_batch(fd, entry, 1);
+}
+
+static off_t_ overlay_dir_lseek(struct fd *fd, off_t_ offset, int whence) {
+    // offsets are indexes into the listing
+    if (whence == LSEEK_CUR)
+        offset += fd->offset;
+    else if (whence != LSEEK_SET)
+        return _EINVAL;
+    if (offset < 0)
+        return _EINVAL;
+    fd->offset = offset;
+    // rewinding picks up changes made since the listing was read
+    if (offset == 0 && fd->overlay_listing != NULL) {
+        listing_free(fd->overlay_listing);
+        fd->overlay_listing = NULL;
+    }
+    return offset;
+}
+
+static ssize_t overlay_dir_read(struct fd *UNUSED(fd), void *UNUSED(buf), size_t UNUSED(bufsize)) {
+    return _EISDIR;
+}
+
+static int overlay_dir_close(struct fd *fd) {
+    if (fd->overlay_listing != NULL)
+        listing_free(fd->overlay_listing);
+    return fd_close(fd->overlay_dir);
+}
+
+static const struct fd_ops overlay_dir_fdops = {
+    .read = overlay_dir_read,
+    .lseek = overlay_dir_lseek,
+    .readdir = overlay_readdir,
+    .readdir_batch = overlay_readdir_batch,
+    .close = overlay_dir_close,
+};
+
+static struct fd *dir_open(struct overlay *ovl, struct mount *mount, const char *path, enum layer layer) {
+    struct fd *dir = layer_open(layer_get(ovl, layer), path, O_RDONLY_, 0);
+    if (IS_ERR(dir))
+        return dir;
+    struct fd *fd = fd_create(&overlay_dir_fdops);
+    if (fd == NULL) {
+        fd_close(dir);
+        return ERR_PTR(_ENOMEM);
+    }
+    fd->mount = mount;
+    fd->overlay_dir = dir;
+    fd->overlay_listing = NULL;
+    return fd;
+}
+
+// fs ops
+
+static struct fd *open_locked(struct overlay *ovl, struct mount *mount, const char *path, enum layer layer, struct statbuf *stat, int flags, int mode) {
+    if (layer == LAYER_NONE) {
+        if (!(flags & O_CREAT_))
+            return ERR_PTR(_ENOENT);
+        int err = create_prepare(ovl, path);
+        if (err < 0)
+            return ERR_PTR(err);
+        struct fd *fd = layer_open(ovl->upper, path, flags, mode);
+        if (!IS_ERR(fd))
+            whiteout_remove(ovl, path);
+        return fd;
+    }
+    if (flags & O_CREAT_ && flags & O_EXCL_)
+        return ERR_PTR(_EEXIST);
+    if (S_ISDIR(stat->mode))
+        return dir_open(ovl, mount, path, layer);
+    if (layer == LAYER_UPPER)
+        return layer_open(ovl->upper, path, flags, mode);
+    if (S_ISREG(stat->mode) && flags & (O_WRONLY_ | O_RDWR_ | O_TRUNC_)) {
+        int err = copy_up(ovl, path);
+        if (err < 0)
+            return ERR_PTR(err);
+        return layer_open(ovl->upper, path, flags & ~O_CREAT_, mode);
+    }
+    // devices are still written through their driver, which doesn't care how
+    // the lower file was opened
+    return layer_open(ovl->lower, path, flags & ~(O_WRONLY_ | O_RDWR_ | O_CREAT_ | O_TRUNC_ | O_APPEND_), mode);
+}
+
+static struct fd *overlay_open(struct mount *mount, const char *path, int flags, int mode) {
+    struct overlay *ovl = mount->data;
+    bool writing = false;
+    read_wrlock(&ovl->lock);
+    struct statbuf stat;
+    enum layer layer;
+    while (true) {
+        layer = lookup(ovl, path, &stat);
+        bool write = layer == LAYER_NONE ? flags & O_CREAT_ :
+            layer == LAYER_LOWER && S_ISREG(stat.mode) && flags & (O_WRONLY_ | O_RDWR_ | O_TRUNC_);
+        if (!write || writing)
+            break;
+        // things may have changed while the lock was dropped, so look again
+        read_wrunlock(&ovl->lock);
+        write_wrlock(&ovl->lock);
+        writing = true;
+    }
+    struct fd *fd = open_locked(ovl, mount, path, layer, &stat, flags, mode);
+    if (writing)
+        write_wrunlock(&ovl->lock);
+    else
+        read_wrunlock(&ovl->lock);
+    return fd;
+}
+
+static int overlay_stat(struct mount *mount, const char *path, struct statbuf *stat, bool UNUSED(follow_links)) {
+    struct overlay *ovl = mount->data;
+    read_wrlock(&ovl->lock);
+    enum layer layer = lookup(ovl, path, stat);
+    read_wrunlock(&ovl->lock);
+    if (layer == LAYER_NONE)
+        return _ENOENT;
+    return 0;
+}
+
+static ssize_t overlay_readlink(struct mount *mount, const char *path, char *buf, size_t bufsize) {
+    struct overlay *ovl = mount->data;
+    read_wrlock(&ovl->lock);
+    struct statbuf stat;
+    enum layer layer = lookup(ovl, path, &stat);
+    ssize_t err;
+    if (layer == LAYER_NONE) {
+        err = _ENOENT;
+    } else if (!S_ISLNK(stat.mode)) {
+        err = _EINVAL;
+    } else {
+        struct mount *m = layer_get(ovl, layer);
+        err = m->fs->readlink(m, path, buf, bufsize);
+    }
+    read_wrunlock(&ovl->lock);
+    return err;
+}
+
+static int overlay_link(struct mount *mount, const char *src, const char *dst) {
+    struct overlay *ovl = mount->data;
+    write_wrlock(&ovl->lock);
+    struct statbuf stat;
+    enum layer layer = lookup(ovl, src, &stat);
+    int err = 0;
+    if (layer == LAYER_NONE)
+        err = _ENOENT;
+    else if (S_ISDIR(stat.mode))
+        err = _EPERM;
+    if (err >= 0)
+        err = create_prepare(ovl, dst);
+    if (err >= 0 && layer == LAYER_LOWER)
+        err = copy_up(ovl, src);
+    if (err >= 0)
+        err = ovl->upper->fs->link(ovl->upper, src, dst);
+    if (err >= 0)
+        whiteout_remove(ovl, dst);
+    write_wrunlock(&ovl->lock);
+    return err;
+}
+
+static int overlay_unlink(struct mount *mount, const char *path) {
+    struct overlay *ovl = mount->data;
+    write_wrlock(&ovl->lock);
+    struct statbuf stat;
+    enum layer layer = lookup(ovl, path, &stat);
+    int err = 0;
+    if (layer == LAYER_NONE)
+        err = _ENOENT;
+    else if (S_ISDIR(stat.mode))
+        err = _EISDIR;
+    bool lower = err >= 0 && lower_has(ovl, path);
+    if (err >= 0 && layer == LAYER_UPPER)
+        err = ovl->upper->fs->unlink(ovl->upper, path);
+    if (err >= 0 && lower)
+        err = whiteout_create(ovl, path);
+    write_wrunlock(&ovl->lock);
+    return err;
+}
+
+static int overlay_rmdir(struct mount *mount, const char *path) {
+    struct overlay *ovl = mount->data;
+    write_wrlock(&ovl->lock);
+    struct statbuf stat;
+    enum layer layer = lookup(ovl, path, &stat);
+    int err = 0;
+    if (layer == LAYER_NONE)
+        err = _ENOENT;
+    else if (!S_ISDIR(stat.mode))
+        err = _ENOTDIR;
+    if (err >= 0)
+        err = dir_check_empty(ovl, path);
+    bool lower = err >= 0 && lower_has(ovl, path);
+    if (err >= 0 && layer == LAYER_UPPER) {
+        err = dir_clear_whiteouts(ovl, path);
+        if (err >= 0)
+            err = ovl->upper->fs->rmdir(ovl->upper, path);
+    }
+    if (err >= 0 && lower)
+        err = whiteout_create(ovl, path);
+    write_wrunlock(&ovl->lock);
+    return err;
+}
+
+static int rename_locked(struct overlay *ovl, const char *src, const char *dst) {
+    struct statbuf src_stat, dst_stat;
+    enum layer src_layer = lookup(ovl, src, &src_stat);
+    enum layer dst_layer = lookup(ovl, dst, &dst_stat);
+    if (src_layer == LAYER_NONE)
+        return _ENOENT;
+    if (strcmp(src, dst) == 0)
+        return 0;
+    if (is_reserved(dst))
+        return _EPERM;
+    bool dir = S_ISDIR(src_stat.mode);
+    if (dst_layer != LAYER_NONE) {
+        if (S_ISDIR(dst_stat.mode) && !dir)
+            return _EISDIR;
+        if (!S_ISDIR(dst_stat.mode) && dir)
+            return _ENOTDIR;
+    }
+    if (dir && lower_has(ovl, src) && !is_opaque(ovl, src))
+        return _EXDEV;
+
+    int err;
+    if (dst_layer != LAYER_NONE && S_ISDIR(dst_stat.mode)) {
+        err = dir_check_empty(ovl, dst);
+        if (err < 0)
+            return err;
+        if (dst_layer == LAYER_UPPER) {
+            err = dir_clear_whiteouts(ovl, dst);
+            if (err < 0)
+                return err;
+        }
+    }
+    bool src_lower = lower_has(ovl, src);
+    bool dst_lower = lower_has(ovl, dst);
+    bool dst_whiteout = whiteout_exists(ovl, dst);
+    if (src_layer == LAYER_LOWER) {
+        err = copy_up(ovl, src);
+        if (err < 0)
+            return err;
+    }
+    err = copy_up_parents(ovl, dst);
+    if (err < 0)
+        return err;
+    err = ovl->upper->fs->rename(ovl->upper, src, dst);
+    if (err < 0)
+        return err;
+    if (src_lower) {
+        err = whiteout_create(ovl, src);
+        if (err < 0)
+            return err;
+    }
+    // a directory moved over one from the lower layer mustn't merge with it
+    if (dir && (dst_lower || dst_whiteout)) {
+        err = make_opaque(ovl, dst);
+        if (err < 0)
+            return err;
+    }
+    if (dst_whiteout)
+        whiteout_remove(ovl, dst);
+    return 0;
+}
+
+static int overlay_rename(struct mount *mount, const char *src, const char *dst) {
+    struct overlay *ovl = mount->data;
+    write_wrlock(&ovl->lock);
+    int err = rename_locked(ovl, src, dst);
+    write_wrunlock(&ovl->lock);
+    return err;
+}
+
+static int overlay_symlink(struct mount *mount, const char *target, const char *link) {
+    struct overlay *ovl = mount->data;
+    write_wrlock(&ovl->lock);
+    int err = create_prepare(ovl, link);
+    if (err >= 0)
+        err = ovl->upper->fs->symlink(ovl->upper, target, link);
+    if (err >= 0)
+        whiteout_remove(ovl, link);
+    write_wrunlock(&ovl->lock);
+    return err;
+}
+
+static int overlay_mknod(struct mount *mount, const char *path, mode_t_ mode, dev_t_ dev) {
+    struct overlay *ovl = mount->data;
+    write_wrlock(&ovl->lock);
+    int err = create_prepare(ovl, path);
+    if (err >= 0)
+        err = ovl->upper->fs->mknod(ovl->upper, path, mode, dev);
+    if (err >= 0)
+        whiteout_remove(ovl, path);
+    write_wrunlock(&ovl->lock);
+    return err;
+}
+
+static int overlay_mkdir(struct mount *mount, const char *path, mode_t_ mode) {
+    struct overlay *ovl = mount->data;
+    write_wrlock(&ovl->lock);
+    int err = create_prepare(ovl, path);
+    if (err >= 0)
+        err = ovl->upper->fs->mkdir(ovl->upper, path, mode);
+    // the directory that was deleted from here mustn't show through
+    if (err >= 0 && whiteout_exists(ovl, path)) {
+        err = make_opaque(ovl, path);
+        if (err >= 0)
+            whiteout_remove(ovl, path);
+    }
+    write_wrunlock(&ovl->lock);
+    return err;
+}
+
+static int setattr_locked(struct overlay *ovl, const char *path, struct attr attr) {
+    int err = copy_up_lookup(ovl, path);
+    if (err < 0)
+        return err;
+    return ovl->upper->fs->setattr(ovl->upper, path, attr);
+}
+
+static int overlay_setattr(struct mount *mount, const char *path, struct attr attr) {
+    struct overlay *ovl = mount->data;
+    write_wrlock(&ovl->lock);
+    int err = setattr_locked(ovl, path, attr);
+    write_wrunlock(&ovl->lock);
+    return err;
+}
+
+static int overlay_utime(struct mount *mount, const char *path, struct timespec atime, struct timespec mtime) {
+    struct overlay *ovl = mount->data;
+    write_wrlock(&ovl->lock);
+    int err = copy_up_lookup(ovl, path);
+    if (err >= 0)
+        err = ovl->upper->fs->utime(ovl->upper, path, atime, mtime);
+    write_wrunlock(&ovl->lock);
+    return err;
+}
+
+// Only directory fds belong to the overlay itself, these are for them
+
+static int overlay_getpath(struct fd *fd, char *buf) {
+    return fd->overlay_dir->mount->fs->getpath(fd->overlay_dir, buf);
+}
+
+static int overlay_fstat(struct fd *fd, struct statbuf *stat) {
+    // the directory may have been copied up since it was opened
+    char path[MAX_PATH];
+    int err = overlay_getpath(fd, path);
+    if (err >= 0)
+        err = overlay_stat(fd->mount, path, stat, false);
+    if (err < 0)
+        err = fd->overlay_dir->mount->fs->fstat(fd->overlay_dir, stat);
+    return err;
+}
+
+static int overlay_fsetattr(struct fd *fd, struct attr attr) {
+    char path[MAX_PATH];
+    int err = overlay_getpath(fd, path);
+    if (err < 0)
+        return err;
+    return overlay_setattr(fd->mount, path, attr);
+}
+
+static int overlay_flock(struct fd *fd, int operation) {
+    return fd->overlay_dir->mount->fs->flock(fd->overlay_dir, operation);
+}
+
+// An fd that was opened on a lower file can't write to it, but it can still
+// change its metadata, which copies it up
+static int lower_fsetattr(struct fd *fd, struct attr attr) {
+    struct overlay *ovl = (struct overlay *) fd->mount->fs;
+    if (attr.type == attr_size)
+        return _EINVAL;
+    char path[MAX_PATH];
+    int err = fd->mount->fs->getpath(fd, path);
+    if (err < 0)
+        return err;
+    write_wrlock(&ovl->lock);
+    err = setattr_locked(ovl, path, attr);
+    write_wrunlock(&ovl->lock);
+    return err;
+}
+
+static int overlay_statfs(struct mount *mount, struct statfsbuf *stat) {
+    struct overlay *ovl = mount->data;
+    return ovl->upper->fs->statfs(ovl->upper, stat);
+}
+
+static int overlay_sync(struct mount *mount) {
+    struct overlay *ovl = mount->data;
+    if (ovl->upper->fs->sync)
+        return ovl->upper->fs->sync(ovl->upper);
+    return 0;
+}
+
+// mounting
+
+static bool host_exists(const char *dir, const char *name) {
+    char path[MAX_PATH];
+    return snprintf(path, sizeof(path), "%s/%s", dir, name) < (int) sizeof(path) &&
+        access(path, F_OK) == 0;
+}
+
+// true if dir doesn't exist
+static bool host_dir_empty(const char *dir) {
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return errno == ENOENT;
+    struct dirent *dirent;
+    bool empty = true;
+    while (empty && (dirent = readdir(d)) != NULL)
+        empty = strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0;
+    closedir(d);
+    return empty;
+}
+
+static struct mount *lower_mount(struct mount *mount, const char *dir) {
+    // its meta.db, if it still has one, is out of date
+    if (host_exists(dir, "meta.log")) {
+        printk("overlay: %s uses flat metadata, which can't be a lower layer\n", dir);
+        return ERR_PTR(_EINVAL);
+    }
+    if (!host_exists(dir, "meta.db"))
+        return layer_mount(mount, &realfs, dir, NULL);
+    char data[MAX_PATH];
+    if (snprintf(data, sizeof(data), "%s/data", dir) >= (int) sizeof(data))
+        return ERR_PTR(_ENAMETOOLONG);
+    return layer_mount(mount, &fakefs, data, "ro");
+}
+
+static struct mount *upper_mount(struct mount *mount, const char *dir, bool *fresh) {
+    *fresh = false;
+    if (dir == NULL) {
+        *fresh = true;
+        return layer_mount(mount, &tmpfs, "tmpfs", NULL);
+    }
+    if (host_dir_empty(dir)) {
+        int err = fakefs_create(dir);
+        if (err < 0)
+            return ERR_PTR(err);
+        *fresh = true;
+    }
+    const struct fs_ops *fs = &realfs;
+    if (host_exists(dir, "meta.log"))
+        fs = &fakeflatfs;
+    else if (host_exists(dir, "meta.db"))
+        fs = &fakefs;
+    if (fs == &realfs)
+        return layer_mount(mount, fs, dir, NULL);
+    char data[MAX_PATH];
+    if (snprintf(data, sizeof(data), "%s/data", dir) >= (int) sizeof(data))
+        return ERR_PTR(_ENAMETOOLONG);
+    return layer_mount(mount, fs, data, NULL);
+}
+
+static int parse_options(const char *options, char **lowerdir, char **upperdir) {
+    if (options == NULL)
+        return 0;
+    char *copy = strdup(options);
+    if (copy == NULL)
+        return _ENOMEM;
+    int err = 0;
+    char *saveptr;
+    for (char *option = strtok_r(copy, ",", &saveptr); option != NULL; option = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(option, '=');
+        if (value == NULL) {
+            err = _EINVAL;
+            break;
+        }
+        *value++ = '\0';
+        char **dir;
+        if (strcmp(option, "lowerdir") == 0)
+            dir = lowerdir;
+        else if (strcmp(option, "upperdir") == 0)
+            dir = upperdir;
+        else {
+            err = _EINVAL;
+            break;
+        }
+        free(*dir);
+        *dir = strdup(value);
+        if (*dir == NULL) {
+            err = _ENOMEM;
+            break;
+        }
+    }
+    free(copy);
+    return err;
+}
+
+static int overlay_mount(struct mount *mount) {
+    char *lowerdir = NULL;
+    char *upperdir = NULL;
+    int err = parse_options(mount->options, &lowerdir, &upperdir);
+    struct overlay *ovl = NULL;
+    if (err < 0)
+        goto out;
+    err = _ENOMEM;
+    ovl = calloc(1, sizeof(struct overlay));
+    if (ovl == NULL)
+        goto out;
+
+    ovl->lower = lower_mount(mount, lowerdir != NULL ? lowerdir : mount->source);
+    if (IS_ERR(ovl->lower)) {
+        err = PTR_ERR(ovl->lower);
+        goto out;
+    }
+    ovl->lower_ops = *ovl->lower->fs;
+    ovl->lower_ops.fsetattr = lower_fsetattr;
+    ovl->lower->fs = &ovl->lower_ops;
+
+    bool fresh;
+    ovl->upper = upper_mount(mount, upperdir, &fresh);
+    if (IS_ERR(ovl->upper)) {
+        err = PTR_ERR(ovl->upper);
+        layer_umount(ovl->lower);
+        goto out;
+    }
+    // a new upper layer's root covers up the lower one's, so it should look the same
+    if (fresh) {
+        struct statbuf stat;
+        if (layer_stat(ovl->lower, "", &stat) >= 0)
+            copy_attrs(ovl, "", &stat);
+    }
+    wrlock_init(&ovl->lock);
+    mount->data = ovl;
+    err = 0;
+
+out:
+    if (err < 0)
+        free(ovl);
+    free(lowerdir);
+    free(upperdir);
+    return err;
+}
+
+static int overlay_umount(struct mount *mount) {
+    struct overlay *ovl = mount->data;
+    layer_umount(ovl->upper);
+    layer_umount(ovl->lower);
+    wrlock_destroy(&ovl->lock);
+    free(ovl);
+    return 0;
+}
+
+const struct fs_ops overlayfs = {
+    .name = "overlay", .magic = OVERLAY_MAGIC,
+    .cache_links = true,
+    .mount = overlay_mount,
+    .umount = overlay_umount,
+    .statfs = overlay_statfs,
+    .open = overlay_open,
+    .readlink = overlay_readlink,
+    .link = overlay_link,
+    .unlink = overlay_unlink,
+    .rmdir = overlay_rmdir,
+    .rename = overlay_rename,
+    .symlink = overlay_symlink,
+    .mknod = overlay_mknod,
+    .mkdir = overlay_mkdir,
+
+    .close = overlay_dir_close,
+    .stat = overlay_stat,
+    .fstat = overlay_fstat,
+    .setattr = overlay_setattr,
+    .fsetattr = overlay_fsetattr,
+    .utime = overlay_utime,
+    .getpath = overlay_getpath,
+    .flock = overlay_flock,
+    .sync = overlay_sync,
+};
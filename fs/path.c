@@ -1,9 +1,205 @@
+#include <stdlib.h>
 #include <string.h>
 #include "kernel/calls.h"
 #include "fs/path.h"
+#include "util/list.h"
+#include "util/sync.h"
 
 #define __NO_AT (struct fd *) 1
 
+// Cache of readlink results for path components, keyed by the mount and the
+// path within it. An entry with a NULL link means the path was found not to
+// be a symlink (or not to exist). Anything that could turn a path into a
+// symlink or change its target forgets the affected entries.
+//
+// Every entry hangs off the entry for its parent directory, and is only
+// cached while its parent is (except directly under the root of the mount),
+// so forgetting a path takes everything under it along without looking at
+// the rest of the cache. path_normalize looks up each component in order, so
+// the parent is almost always there.
+struct link_cache_entry {
+    struct mount *mount;
+    char *link;
+    size_t link_len;
+    struct list chain;
+    struct list age;
+    struct link_cache_entry *parent;
+    struct list children;
+    struct list siblings;
+    char path[];
+};
+
+#define LINK_CACHE_BITS 12
+#define LINK_CACHE_SIZE (1 << LINK_CACHE_BITS)
+#define LINK_CACHE_MAX_ENTRIES (LINK_CACHE_SIZE * 4)
+static struct list link_cache[LINK_CACHE_SIZE];
+// oldest first, and that's what gets evicted, so a hit doesn't have to take
+// the write lock to move anything around
+static struct list link_cache_age;
+static unsigned link_cache_entries;
+// bumped on every invalidation, so a lookup that raced with one doesn't
+// insert a stale result
+static unsigned link_cache_gen;
+// see path_cache_flush
+static unsigned link_cache_shared_mounts;
+static wrlock_t link_cache_lock;
+
+static void __attribute__((constructor)) init_link_cache() {
+    for (int i = 0; i < LINK_CACHE_SIZE; i++)
+        list_init(&link_cache[i]);
+    list_init(&link_cache_age);
+    wrlock_init(&link_cache_lock);
+}
+
+static struct list *link_cache_bucket(struct mount *mount, const char *path) {
+    uint32_t hash = 2166136261u ^ (uint32_t) (uintptr_t) mount;
+    for (const char *c = path; *c != '\0'; c++)
+        hash = (hash ^ (unsigned char) *c) * 16777619u;
+    return &link_cache[hash % LINK_CACHE_SIZE];
+}
+
+static struct link_cache_entry *link_cache_find(struct mount *mount, const char *path) {
+    struct link_cache_entry *entry;
+    list_for_each_entry(link_cache_bucket(mount, path), entry, chain) {
+        if (entry->mount == mount && strcmp(entry->path, path) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+// frees everything under the entry too
+static void link_cache_free(struct link_cache_entry *entry) {
+    struct link_cache_entry *child, *tmp;
+    list_for_each_entry_safe(&entry->children, child, tmp, siblings) {
+        link_cache_free(child);
+    }
+    list_remove(&entry->chain);
+    list_remove(&entry->age);
+    if (entry->parent != NULL)
+        list_remove(&entry->siblings);
+    link_cache_entries--;
+    free(entry->link);
+    free(entry);
+}
+
+// Returns true and fills in *res if the path is cached. The result is what
+// readlink would have returned.
+static bool link_cache_lookup(struct mount *mount, const char *path, char *buf, size_t bufsize, ssize_t *res) {
+    read_wrlock(&link_cache_lock);
+    struct link_cache_entry *entry = link_cache_find(mount, path);
+    if (entry != NULL) {
+        if (entry->link == NULL) {
+            *res = _EINVAL;
+        } else {
+            size_t len = entry->link_len;
+            if (len > bufsize)
+                len = bufsize;
+            memcpy(buf, entry->link, len);
+            *res = len;
+        }
+    }
+    read_wrunlock(&link_cache_lock);
+    return entry != NULL;
+}
+
+static void link_cache_insert(struct mount *mount, const char *path, const char *link, size_t link_len, unsigned gen) {
+    struct link_cache_entry *entry = malloc(sizeof(*entry) + strlen(path) + 1);
+    if (entry == NULL)
+        return;
+    entry->mount = mount;
+    strcpy(entry->path, path);
+    entry->link = NULL;
+    entry->link_len = 0;
+    list_init(&entry->children);
+    if (link != NULL) {
+        entry->link = malloc(link_len);
+        if (entry->link == NULL) {
+            free(entry);
+            return;
+        }
+        memcpy(entry->link, link, link_len);
+        entry->link_len = link_len;
+    }
+
+    // the mount root has no parent, and things right under it can do without
+    char parent_path[MAX_PATH];
+    const char *slash = strrchr(path, '/');
+    if (slash != NULL) {
+        memcpy(parent_path, path, slash - path);
+        parent_path[slash - path] = '\0';
+    }
+
+    write_wrlock(&link_cache_lock);
+    if (gen != link_cache_gen || link_cache_find(mount, path) != NULL)
+        goto drop;
+    if (link_cache_entries >= LINK_CACHE_MAX_ENTRIES)
+        link_cache_free(list_first_entry(&link_cache_age, struct link_cache_entry, age));
+    entry->parent = NULL;
+    if (slash != NULL)
+        entry->parent = link_cache_find(mount, parent_path);
+    if (entry->parent == NULL && slash != NULL && slash != path)
+        goto drop;
+    list_add(link_cache_bucket(mount, path), &entry->chain);
+    list_add_before(&link_cache_age, &entry->age);
+    if (entry->parent != NULL)
+        list_add(&entry->parent->children, &entry->siblings);
+    link_cache_entries++;
+    write_wrunlock(&link_cache_lock);
+    return;
+
+drop:
+    write_wrunlock(&link_cache_lock);
+    free(entry->link);
+    free(entry);
+}
+
+static void link_cache_free_all() {
+    // freeing an entry can free any of the ones after it
+    while (!list_empty(&link_cache_age))
+        link_cache_free(list_first_entry(&link_cache_age, struct link_cache_entry, age));
+}
+
+void path_cache_forget(struct mount *mount, const char *path) {
+    write_wrlock(&link_cache_lock);
+    link_cache_gen++;
+    if (!mount->fs->private_storage && link_cache_shared_mounts > 1) {
+        link_cache_free_all();
+    } else {
+        struct link_cache_entry *entry = link_cache_find(mount, path);
+        if (entry != NULL)
+            link_cache_free(entry);
+    }
+    write_wrunlock(&link_cache_lock);
+}
+
+void path_cache_flush(unsigned shared_mounts) {
+    write_wrlock(&link_cache_lock);
+    link_cache_gen++;
+    link_cache_shared_mounts = shared_mounts;
+    link_cache_free_all();
+    write_wrunlock(&link_cache_lock);
+}
+
+static ssize_t path_readlink(struct mount *mount, const char *path, char *buf, size_t bufsize) {
+    if (!mount->fs->readlink)
+        return _EINVAL;
+    if (!mount->fs->cache_links)
+        return mount->fs->readlink(mount, path, buf, bufsize);
+
+    ssize_t res;
+    if (link_cache_lookup(mount, path, buf, bufsize, &res))
+        return res;
+    read_wrlock(&link_cache_lock);
+    unsigned gen = link_cache_gen;
+    read_wrunlock(&link_cache_lock);
+    res = mount->fs->readlink(mount, path, buf, bufsize);
+    if (res >= 0 && (size_t) res < bufsize)
+        link_cache_insert(mount, path, buf, res, gen);
+    else if ((res == _EINVAL || res == _ENOENT) && mount->fs->cache_not_links)
+        link_cache_insert(mount, path, NULL, 0, gen);
+    return res;
+}
+
 int path_normalize(struct fd *at, const char *path, char *out, bool follow_links) {
     assert(at != NULL);
     const char *p = path;
@@ -79,9 +275,7 @@ int path_normalize(struct fd *at, const char *path, char *out, bool follow_links
             strcpy(possible_symlink, out);
             struct mount *mount = find_mount_and_trim_path(possible_symlink);
             assert(path_is_normalized(possible_symlink));
-            int res = _EINVAL;
-            if (mount->fs->readlink)
-                res = mount->fs->readlink(mount, possible_symlink, c, MAX_PATH - (c - out));
+            ssize_t res = path_readlink(mount, possible_symlink, c, MAX_PATH - (c - out));
             mount_release(mount);
             if (res >= 0) {
                 // readlink does not null terminate
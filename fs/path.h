@@ -22,4 +22,15 @@
 int path_normalize(struct fd *at, const char *path, char *out, bool follow_links);
 bool path_is_normalized(const char *path);
 
+// path_normalize caches readlink results on filesystems that set cache_links.
+// Anything that changes whether a path is a symlink must forget it, which
+// also forgets everything under it, and the mount table changing flushes
+// everything. Paths are relative to the mount.
+struct mount;
+void path_cache_forget(struct mount *mount, const char *path);
+// Flushes everything, and takes the number of mounts that cache links
+// without private_storage. Once there's more than one, the same file could be
+// cached through each of them, so forgetting through one flushes everything.
+void path_cache_flush(unsigned shared_mounts);
+
 #endif
@@ -1,14 +1,316 @@
-#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
 #include "kernel/calls.h"
+#include "kernel/signal.h"
 #include "fs/fd.h"
+#include "fs/pipe.h"
+#include "fs/poll.h"
 #include "debug.h"
 
-static fd_t pipe_f_create(int pipe_fd, int flags) {
-    struct fd *fd = adhoc_fd_create(&realfs_fdops);
+// Pipes are a ring buffer shared by the two ends, so data goes straight from
+// the writer's memory to the reader's without a trip through the host.
+
+#define PIPE_BUF_ 4096
+#define PIPE_DEFAULT_SIZE (16 * PAGE_SIZE)
+#define PIPE_MAX_SIZE (1 << 20) // for users without root, like /proc/sys/fs/pipe-max-size
+
+struct pipe {
+    char *buf; // allocated on the first write
+    size_t size; // always a power of two
+    size_t head; // where the next read starts
+    size_t used;
+    lock_t lock;
+    cond_t cond;
+
+    // NULL once the end is closed. Changing these requires both locks, and
+    // fds_lock keeps the fd alive while poll_wakeup is called on it, which
+    // can't be done with the pipe lock held since polling takes it.
+    struct fd *read_fd;
+    struct fd *write_fd;
+    lock_t fds_lock;
+};
+
+static const struct fd_ops pipe_fdops;
+
+static void pipe_wakeup(struct pipe *pipe, struct fd **end) {
+    lock(&pipe->fds_lock);
+    if (*end != NULL)
+        poll_wakeup(*end);
+    unlock(&pipe->fds_lock);
+}
+
+// Copies between the ring starting at pos and either a host buffer, or the
+// guest's memory at addr if buf is NULL.
+static int pipe_copy(struct pipe *pipe, size_t pos, char *buf, addr_t addr, size_t count, bool to_pipe) {
+    while (count > 0) {
+        size_t off = pos & (pipe->size - 1);
+        size_t chunk = pipe->size - off;
+        if (chunk > count)
+            chunk = count;
+        char *ring = pipe->buf + off;
+        if (buf != NULL) {
+            if (to_pipe)
+                memcpy(ring, buf, chunk);
+            else
+                memcpy(buf, ring, chunk);
+            buf += chunk;
+        } else {
+            int err = to_pipe ? user_read(addr, ring, chunk) : user_write(addr, ring, chunk);
+            if (err)
+                return _EFAULT;
+            addr += chunk;
+        }
+        pos += chunk;
+        count -= chunk;
+    }
+    return 0;
+}
+
+static ssize_t pipe_do_read(struct fd *fd, char *buf, addr_t addr, size_t bufsize) {
+    struct pipe *pipe = fd->pipe;
+    // an end stays in the pipe until it's closed, so this doesn't need the lock
+    if (fd != pipe->read_fd)
+        return _EBADF;
+    if (bufsize == 0)
+        return 0;
+
+    lock(&pipe->lock);
+    while (pipe->used == 0) {
+        if (pipe->write_fd == NULL) {
+            unlock(&pipe->lock);
+            return 0;
+        }
+        if (fd->flags & O_NONBLOCK_) {
+            unlock(&pipe->lock);
+            return _EAGAIN;
+        }
+        int err = wait_for(&pipe->cond, &pipe->lock, NULL);
+        if (err < 0) {
+            unlock(&pipe->lock);
+            return err;
+        }
+    }
+
+    size_t count = pipe->used < bufsize ? pipe->used : bufsize;
+    if (pipe_copy(pipe, pipe->head, buf, addr, count, false) < 0) {
+        unlock(&pipe->lock);
+        return _EFAULT;
+    }
+    pipe->head = (pipe->head + count) & (pipe->size - 1);
+    pipe->used -= count;
+    notify(&pipe->cond);
+    unlock(&pipe->lock);
+    pipe_wakeup(pipe, &pipe->write_fd);
+    return count;
+}
+
+static ssize_t pipe_do_write(struct fd *fd, const char *buf, addr_t addr, size_t bufsize) {
+    struct pipe *pipe = fd->pipe;
+    if (fd != pipe->write_fd)
+        return _EBADF;
+    if (bufsize == 0)
+        return 0;
+
+    lock(&pipe->lock);
+    if (pipe->buf == NULL) {
+        pipe->buf = malloc(pipe->size);
+        if (pipe->buf == NULL) {
+            unlock(&pipe->lock);
+            return _ENOMEM;
+        }
+    }
+
+    size_t written = 0;
+    int err = 0;
+    while (written < bufsize) {
+        if (pipe->read_fd == NULL) {
+            err = _EPIPE;
+            break;
+        }
+        // writes up to PIPE_BUF can't be interleaved with other writes
+        size_t needed = bufsize <= PIPE_BUF_ ? bufsize : 1;
+        size_t space = pipe->size - pipe->used;
+        if (space < needed) {
+            if (fd->flags & O_NONBLOCK_) {
+                err = _EAGAIN;
+                break;
+            }
+            err = wait_for(&pipe->cond, &pipe->lock, NULL);
+            if (err < 0)
+                break;
+            continue;
+        }
+
+        size_t count = bufsize - written;
+        if (count > space)
+            count = space;
+        err = pipe_copy(pipe, pipe->head + pipe->used,
+                buf != NULL ? (char *) buf + written : NULL, addr + written, count, true);
+        if (err < 0)
+            break;
+        pipe->used += count;
+        written += count;
+        notify(&pipe->cond);
+
+        // let a polling reader know before possibly blocking for more room
+        unlock(&pipe->lock);
+        pipe_wakeup(pipe, &pipe->read_fd);
+        lock(&pipe->lock);
+    }
+    unlock(&pipe->lock);
+
+    if (err == _EPIPE)
+        send_signal(current, SIGPIPE_);
+    if (written > 0)
+        return written;
+    return err;
+}
+
+static ssize_t pipe_read(struct fd *fd, void *buf, size_t bufsize) {
+    return pipe_do_read(fd, buf, 0, bufsize);
+}
+static ssize_t pipe_read_user(struct fd *fd, addr_t addr, size_t bufsize) {
+    return pipe_do_read(fd, NULL, addr, bufsize);
+}
+static ssize_t pipe_write(struct fd *fd, const void *buf, size_t bufsize) {
+    return pipe_do_write(fd, buf, 0, bufsize);
+}
+static ssize_t pipe_write_user(struct fd *fd, addr_t addr, size_t bufsize) {
+    return pipe_do_write(fd, NULL, addr, bufsize);
+}
+
+static off_t_ pipe_lseek(struct fd *UNUSED(fd), off_t_ UNUSED(off), int UNUSED(whence)) {
+    return _ESPIPE;
+}
+
+static int pipe_poll(struct fd *fd) {
+    struct pipe *pipe = fd->pipe;
+    int types = 0;
+    lock(&pipe->lock);
+    if (fd == pipe->read_fd) {
+        if (pipe->used > 0)
+            types |= POLL_READ;
+        if (pipe->write_fd == NULL)
+            types |= POLL_READ | POLL_HUP;
+    } else {
+        if (pipe->size - pipe->used >= PIPE_BUF_)
+            types |= POLL_WRITE;
+        if (pipe->read_fd == NULL)
+            types |= POLL_WRITE | POLL_ERR;
+    }
+    unlock(&pipe->lock);
+    return types;
+}
+
+static ssize_t pipe_ioctl_size(int cmd) {
+    if (cmd == FIONREAD_)
+        return sizeof(dword_t);
+    return -1;
+}
+
+static int pipe_ioctl(struct fd *fd, int cmd, void *arg) {
+    struct pipe *pipe = fd->pipe;
+    if (cmd != FIONREAD_)
+        return _ENOTTY;
+    lock(&pipe->lock);
+    *(dword_t *) arg = pipe->used;
+    unlock(&pipe->lock);
+    return 0;
+}
+
+static int pipe_close(struct fd *fd) {
+    struct pipe *pipe = fd->pipe;
+    lock(&pipe->fds_lock);
+    lock(&pipe->lock);
+    if (fd == pipe->read_fd)
+        pipe->read_fd = NULL;
+    else
+        pipe->write_fd = NULL;
+    struct fd *other = pipe->read_fd != NULL ? pipe->read_fd : pipe->write_fd;
+    notify(&pipe->cond);
+    unlock(&pipe->lock);
+    if (other != NULL)
+        poll_wakeup(other);
+    unlock(&pipe->fds_lock);
+
+    if (other == NULL) {
+        free(pipe->buf);
+        cond_destroy(&pipe->cond);
+        free(pipe);
+    }
+    return 0;
+}
+
+int pipe_get_size(struct fd *fd) {
+    if (fd->ops != &pipe_fdops)
+        return _EBADF;
+    lock(&fd->pipe->lock);
+    int size = fd->pipe->size;
+    unlock(&fd->pipe->lock);
+    return size;
+}
+
+int pipe_set_size(struct fd *fd, dword_t size) {
+    if (fd->ops != &pipe_fdops)
+        return _EBADF;
+    if (size > (1u << 31))
+        return _EINVAL;
+    size_t new_size = PAGE_SIZE;
+    while (new_size < size)
+        new_size <<= 1;
+    if (new_size > PIPE_MAX_SIZE && !superuser())
+        return _EPERM;
+
+    struct pipe *pipe = fd->pipe;
+    lock(&pipe->lock);
+    if (new_size < pipe->used) {
+        unlock(&pipe->lock);
+        return _EBUSY;
+    }
+    if (pipe->buf != NULL && new_size != pipe->size) {
+        char *new_buf = malloc(new_size);
+        if (new_buf == NULL) {
+            unlock(&pipe->lock);
+            return _ENOMEM;
+        }
+        pipe_copy(pipe, pipe->head, new_buf, 0, pipe->used, false);
+        free(pipe->buf);
+        pipe->buf = new_buf;
+        pipe->head = 0;
+    }
+    pipe->size = new_size;
+    notify(&pipe->cond);
+    unlock(&pipe->lock);
+    pipe_wakeup(pipe, &pipe->write_fd);
+    return new_size;
+}
+
+static const struct fd_ops pipe_fdops = {
+    .read = pipe_read,
+    .write = pipe_write,
+    .read_user = pipe_read_user,
+    .write_user = pipe_write_user,
+    .lseek = pipe_lseek,
+    .poll = pipe_poll,
+    .ioctl_size = pipe_ioctl_size,
+    .ioctl = pipe_ioctl,
+    .close = pipe_close,
+};
+
+static struct fd *pipe_end_create(struct pipe *pipe, int flags) {
+    static atomic_uint next_inode = 1;
+    struct fd *fd = adhoc_fd_create(&pipe_fdops);
     if (fd == NULL)
-        return _ENOMEM;
-    fd->real_fd = pipe_fd;
-    return f_install(fd, flags);
+        return NULL;
+    fd->pipe = pipe;
+    fd->flags = flags;
+    fd->type = S_IFIFO;
+    fd->stat.mode = S_IFIFO | 0600;
+    fd->stat.inode = next_inode++;
+    fd->stat.uid = current->euid;
+    fd->stat.gid = current->egid;
+    fd->stat.blksize = PAGE_SIZE;
+    return fd;
 }
 
 int_t sys_pipe2(addr_t pipe_addr, int_t flags) {
@@ -18,16 +320,31 @@ int_t sys_pipe2(addr_t pipe_addr, int_t flags) {
         return _EINVAL;
     }
 
-    int p[2];
-    int err = pipe(p);
-    if (err < 0)
-        return err;
+    struct pipe *pipe = malloc(sizeof(struct pipe));
+    if (pipe == NULL)
+        return _ENOMEM;
+    *pipe = (struct pipe) {.size = PIPE_DEFAULT_SIZE};
+    lock_init(&pipe->lock);
+    cond_init(&pipe->cond);
+    lock_init(&pipe->fds_lock);
 
+    int err = _ENOMEM;
+    pipe->read_fd = pipe_end_create(pipe, O_RDONLY_);
+    if (pipe->read_fd == NULL)
+        goto free_pipe;
+    pipe->write_fd = pipe_end_create(pipe, O_WRONLY_);
+    if (pipe->write_fd == NULL)
+        goto close_read;
+    pipe->write_fd->stat.inode = pipe->read_fd->stat.inode;
+
+    // f_install destroys the fd if it fails, which closes that end
     int fp[2];
-    err = fp[0] = pipe_f_create(p[0], flags);
-    if (fp[0] < 0)
-        goto close_pipe;
-    err = fp[1] = pipe_f_create(p[1], flags);
+    err = fp[0] = f_install(pipe->read_fd, flags);
+    if (fp[0] < 0) {
+        fd_close(pipe->write_fd);
+        return err;
+    }
+    err = fp[1] = f_install(pipe->write_fd, flags);
     if (fp[1] < 0)
         goto close_fake_0;
 
@@ -41,9 +358,14 @@ close_fake_1:
     f_close(fp[1]);
 close_fake_0:
     f_close(fp[0]);
-close_pipe:
-    close(p[0]);
-    close(p[1]);
+    return err;
+
+close_read:
+    fd_close(pipe->read_fd);
+    return err;
+free_pipe:
+    cond_destroy(&pipe->cond);
+    free(pipe);
     return err;
 }
 
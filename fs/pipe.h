@@ -0,0 +1,9 @@
+#ifndef FS_PIPE_H
+#define FS_PIPE_H
+#include "fs/fd.h"
+
+// F_GETPIPE_SZ and F_SETPIPE_SZ, _EBADF if the fd isn't a pipe
+int pipe_get_size(struct fd *fd);
+int pipe_set_size(struct fd *fd, dword_t size);
+
+#endif
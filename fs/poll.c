@@ -1,9 +1,19 @@
 #include "kernel/task.h"
 #include <string.h>
-#include <poll.h>
+#include <limits.h>
+#include <sched.h>
 #include <fcntl.h>
+#if __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#elif __APPLE__
+#include <sys/event.h>
+#else
+#error
+#endif
 #include "misc.h"
 #include "util/list.h"
+#include "util/timer.h"
 #include "kernel/errno.h"
 #include "kernel/fs.h"
 #include "fs/fd.h"
@@ -12,14 +22,144 @@
 
 // lock order: fd, then poll
 
+// Anything that might be ready sits on the poll's ready list, and waiting
+// means checking just that list. Realfs fds get onto it through a host epoll
+// (or kqueue) that lives as long as the poll. Everything else calls
+// poll_wakeup when it might have become ready, which adds it to the list and
+// kicks the host poll through an eventfd (or a user event).
+
+static bool poll_fd_is_host(struct poll_fd *poll_fd) {
+    return poll_fd->fd->ops->poll == realfs_poll;
+}
+
+#define HOST_EVENTS (POLL_READ | POLL_PRI | POLL_WRITE)
+
+#if __linux__
+
+static int host_poll_open(struct poll *poll) {
+    poll->host_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (poll->host_fd < 0)
+        return errno_map();
+    poll->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (poll->notify_fd < 0)
+        return errno_map();
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(poll->host_fd, EPOLL_CTL_ADD, poll->notify_fd, &event) < 0)
+        return errno_map();
+    return 0;
+}
+
+static void host_poll_close(struct poll *poll) {
+    if (poll->notify_fd != -1)
+        close(poll->notify_fd);
+    if (poll->host_fd != -1)
+        close(poll->host_fd);
+}
+
+// returns false if the host can't watch this fd
+static bool host_poll_ctl(struct poll *poll, struct poll_fd *poll_fd, bool add, bool del) {
+    // POLL_* have the same values as EPOLL*
+    struct epoll_event event = {.events = poll_fd->types & HOST_EVENTS, .data.ptr = poll_fd};
+    if (poll_fd->types & POLL_EDGE)
+        event.events |= EPOLLET;
+    if (poll_fd->types & POLL_ONESHOT)
+        event.events |= EPOLLONESHOT;
+    int op = add ? EPOLL_CTL_ADD : del ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    // EPERM means a regular file, which epoll won't take since it's always
+    // ready, and MOD of one of those fails with ENOENT
+    return epoll_ctl(poll->host_fd, op, poll_fd->fd->real_fd, &event) == 0;
+}
+
+static void host_poll_notify(struct poll *poll) {
+    uint64_t one = 1;
+    write(poll->notify_fd, &one, sizeof(one));
+}
+
+static void host_poll_drain(struct poll *poll) {
+    uint64_t count;
+    read(poll->notify_fd, &count, sizeof(count));
+}
+
+// fills in ready with the poll_fds that have events, NULL meaning a wakeup
+static int host_poll_wait(struct poll *poll, struct poll_fd **ready, int max, int timeout_millis) {
+    struct epoll_event events[max];
+    int n = epoll_wait(poll->host_fd, events, max, timeout_millis);
+    for (int i = 0; i < n; i++)
+        ready[i] = events[i].data.ptr;
+    return n;
+}
+
+#elif __APPLE__
+
+static int host_poll_open(struct poll *poll) {
+    poll->notify_fd = -1;
+    poll->host_fd = kqueue();
+    if (poll->host_fd < 0)
+        return errno_map();
+    fcntl(poll->host_fd, F_SETFD, FD_CLOEXEC);
+    struct kevent event;
+    EV_SET(&event, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    if (kevent(poll->host_fd, &event, 1, NULL, 0, NULL) < 0)
+        return errno_map();
+    return 0;
+}
+
+static void host_poll_close(struct poll *poll) {
+    if (poll->host_fd != -1)
+        close(poll->host_fd);
+}
+
+static bool host_poll_ctl(struct poll *poll, struct poll_fd *poll_fd, bool UNUSED(add), bool del) {
+    int fd = poll_fd->fd->real_fd;
+    int types = del ? 0 : poll_fd->types;
+    int add_flags = EV_ADD;
+    if (types & POLL_EDGE)
+        add_flags |= EV_CLEAR;
+    if (types & POLL_ONESHOT)
+        add_flags |= EV_ONESHOT;
+    struct kevent event;
+    // these fail with ENOENT when deleting a filter that was never added,
+    // which is fine
+    EV_SET(&event, fd, EVFILT_READ, types & (POLL_READ | POLL_PRI) ? add_flags : EV_DELETE, 0, 0, poll_fd);
+    kevent(poll->host_fd, &event, 1, NULL, 0, NULL);
+    EV_SET(&event, fd, EVFILT_WRITE, types & POLL_WRITE ? add_flags : EV_DELETE, 0, 0, poll_fd);
+    kevent(poll->host_fd, &event, 1, NULL, 0, NULL);    return true;
+}
+
+static void host_poll_notify(struct poll *poll) {
+    struct kevent event;
+    EV_SET(&event, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    kevent(poll->host_fd, &event, 1, NULL, 0, NULL);
+}
+
+static void host_poll_drain(struct poll *UNUSED(poll)) {
+    // EV_CLEAR already reset it
+}
+
+static int host_poll_wait(struct poll *poll, struct poll_fd **ready, int max, int timeout_millis) {
+    struct kevent events[max];
+    struct timespec timeout = {timeout_millis / 1000, (timeout_millis % 1000) * 1000000};
+    int n = kevent(poll->host_fd, NULL, 0, events, max, timeout_millis < 0 ? NULL : &timeout);
+    for (int i = 0; i < n; i++)
+        ready[i] = events[i].udata;
+    return n;
+}
+
+#endif
+
 struct poll *poll_create() {
     struct poll *poll = malloc(sizeof(struct poll));
     if (poll == NULL)
         return NULL;
     poll->waiters = 0;
-    poll->notify_pipe[0] = -1;
-    poll->notify_pipe[1] = -1;
+    poll->kicked = false;
+    poll->sockets = 0;
+    poll->keep_cursor = NULL;
+    poll->host_fd = -1;
+    poll->notify_fd = -1;
     list_init(&poll->poll_fds);
+    list_init(&poll->ready);
+    list_init(&poll->dead);
     lock_init(&poll->lock);
     return poll;
 }
@@ -38,31 +178,185 @@ bool poll_has_fd(struct poll *poll, struct fd *fd) {
     return poll_find_fd(poll, fd) != NULL;
 }
 
-int poll_add_fd(struct poll *poll, struct fd *fd, int types, union poll_fd_info info) {
-    int err;
-    lock(&fd->poll_lock);
-    lock(&poll->lock);
+// wakes up anyone waiting in the host poll
+static void poll_kick(struct poll *poll) {
+    if (poll->waiters > 0 && poll->host_fd != -1 && !poll->kicked) {
+        host_poll_notify(poll);
+        poll->kicked = true;
+    }
+}
 
-    struct poll_fd *poll_fd = malloc(sizeof(struct poll_fd));
-    if (poll_fd == NULL) {
-        err = _ENOMEM;
-        goto out;
+// puts a poll_fd on the ready list, to be checked by the next waiter
+static void poll_fd_ready(struct poll *poll, struct poll_fd *poll_fd) {
+    if (list_null(&poll_fd->ready) && !poll_fd->disabled)
+        list_add_before(&poll->ready, &poll_fd->ready);
+}
+
+// Has the host watch a poll_fd, or puts it on the ready list if the host
+// won't, which is what epoll does with regular files since they're always
+// ready.
+static void poll_fd_watch(struct poll *poll, struct poll_fd *poll_fd, bool add) {
+    if (!host_poll_ctl(poll, poll_fd, add, false)) {
+        poll_fd_ready(poll, poll_fd);
+        poll_kick(poll);
+    }
+}
+
+static int poll_open_host(struct poll *poll) {
+    int err = host_poll_open(poll);
+    if (err < 0) {
+        host_poll_close(poll);
+        poll->host_fd = poll->notify_fd = -1;
+        return err;
     }
+    struct poll_fd *poll_fd;
+    list_for_each_entry(&poll->poll_fds, poll_fd, fds) {
+        if (poll_fd_is_host(poll_fd) && !poll_fd->idle)
+            poll_fd_watch(poll, poll_fd, true);
+    }
+    return 0;
+}
+
+// adds a new poll_fd to the poll after the given spot in poll_fds
+static int poll_fd_new(struct poll *poll, struct list *after, struct fd *fd, int types, union poll_fd_info info, struct poll_fd **poll_fd_out) {
+    struct poll_fd *poll_fd = malloc(sizeof(struct poll_fd));
+    if (poll_fd == NULL)
+        return _ENOMEM;
     poll_fd->fd = fd;
     poll_fd->poll = poll;
     poll_fd->types = types;
     poll_fd->info = info;
+    poll_fd->ready.next = poll_fd->ready.prev = NULL;
+    poll_fd->disabled = false;
+    poll_fd->kept = false;
+    poll_fd->idle = false;
 
     list_add(&fd->poll_fds, &poll_fd->polls);
-    list_add(&poll->poll_fds, &poll_fd->fds);
+    list_add(after, &poll_fd->fds);
+    if (sockrestart_is_socket(fd))
+        poll->sockets++;
+    if (poll_fd_is_host(poll_fd) && poll->host_fd == -1 && types & POLL_EDGE) {
+        // an edge triggered fd has to be watched by the host from the start,
+        // or registering it later would report the same edge twice
+        int err = poll_open_host(poll);
+        if (err < 0) {
+            list_remove(&poll_fd->polls);
+            list_remove(&poll_fd->fds);
+            if (sockrestart_is_socket(fd))
+                poll->sockets--;
+            free(poll_fd);
+            return err;
+        }
+    } else if (poll_fd_is_host(poll_fd) && poll->host_fd != -1) {
+        // the host will report it if it's ready already
+        poll_fd_watch(poll, poll_fd, true);
+    } else {
+        poll_fd_ready(poll, poll_fd);
+        poll_kick(poll);
+    }
+    *poll_fd_out = poll_fd;
+    return 0;
+}
 
-    err = 0;
+int poll_add_fd(struct poll *poll, struct fd *fd, int types, union poll_fd_info info) {
+    lock(&fd->poll_lock);
+    lock(&poll->lock);
+    struct poll_fd *poll_fd;
+    int err = poll_fd_new(poll, &poll->poll_fds, fd, types, info, &poll_fd);
+    unlock(&poll->lock);
+    unlock(&fd->poll_lock);
+    return err;
+}
+
+// does not do its own locking
+static struct poll_fd *poll_find_unkept(struct poll *poll, struct fd *fd) {
+    // the fds usually come in the same order as last time, so start looking
+    // right after the last one kept
+    struct list *start = poll->keep_cursor != NULL ? &poll->keep_cursor->fds : &poll->poll_fds;
+    struct list *item = start;
+    do {
+        item = item->next;
+        if (item == &poll->poll_fds)
+            continue;
+        struct poll_fd *poll_fd = list_entry(item, struct poll_fd, fds);
+        if (poll_fd->fd == fd && !poll_fd->kept)
+            return poll_fd;
+    } while (item != start);
+    return NULL;
+}
+
+int poll_keep_fd(struct poll *poll, struct fd *fd, int types, union poll_fd_info info) {
+    int err = 0;
+    lock(&fd->poll_lock);
+    lock(&poll->lock);
+    struct poll_fd *poll_fd = poll_find_unkept(poll, fd);
+    if (poll_fd == NULL) {
+        struct list *after = poll->keep_cursor != NULL ? &poll->keep_cursor->fds : &poll->poll_fds;
+        err = poll_fd_new(poll, after, fd, types, info, &poll_fd);
+        if (err < 0)
+            goto out;
+    } else if (poll_fd->idle || poll_fd->types != types) {
+        bool add = poll_fd->idle;
+        if (add && sockrestart_is_socket(fd))
+            poll->sockets++;
+        poll_fd->idle = false;
+        poll_fd->disabled = false;
+        poll_fd->types = types;
+        if (poll->host_fd != -1 && poll_fd_is_host(poll_fd)) {
+            poll_fd_watch(poll, poll_fd, add);
+        } else {
+            poll_fd_ready(poll, poll_fd);
+            poll_kick(poll);
+        }
+    }
+    poll_fd->info = info;
+    poll_fd->kept = true;
+    poll->keep_cursor = poll_fd;
 out:
     unlock(&poll->lock);
     unlock(&fd->poll_lock);
     return err;
 }
 
+void poll_keep_done(struct poll *poll) {
+    lock(&poll->lock);
+    struct poll_fd *poll_fd;
+    list_for_each_entry(&poll->poll_fds, poll_fd, fds) {
+        if (poll_fd->kept) {
+            poll_fd->kept = false;
+        } else if (!poll_fd->idle) {
+            poll_fd->idle = true;
+            poll_fd->disabled = true;
+            list_remove_safe(&poll_fd->ready);
+            if (poll->host_fd != -1 && poll_fd_is_host(poll_fd))
+                host_poll_ctl(poll, poll_fd, false, true);
+            if (sockrestart_is_socket(poll_fd->fd))
+                poll->sockets--;
+        }
+    }
+    unlock(&poll->lock);
+}
+
+void poll_fd_remove(struct poll_fd *poll_fd) {
+    struct poll *poll = poll_fd->poll;
+    list_remove(&poll_fd->polls);
+    list_remove(&poll_fd->fds);
+    list_remove_safe(&poll_fd->ready);
+    if (poll->keep_cursor == poll_fd)
+        poll->keep_cursor = NULL;
+    if (!poll_fd->idle) {
+        if (poll->host_fd != -1 && poll_fd_is_host(poll_fd))
+            host_poll_ctl(poll, poll_fd, false, true);
+        if (sockrestart_is_socket(poll_fd->fd))
+            poll->sockets--;
+    }
+    poll_fd->fd = NULL;
+    if (poll->waiters > 0)
+        list_add(&poll->dead, &poll_fd->fds);
+    else
+        free(poll_fd);
+}
+
 int poll_del_fd(struct poll *poll, struct fd *fd) {
     int err;
     lock(&fd->poll_lock);
@@ -73,9 +367,7 @@ int poll_del_fd(struct poll *poll, struct fd *fd) {
         goto out;
     }
 
-    list_remove(&poll_fd->polls);
-    list_remove(&poll_fd->fds);
-    free(poll_fd);
+    poll_fd_remove(poll_fd);
 
     err = 0;
 out:
@@ -96,6 +388,14 @@ int poll_mod_fd(struct poll *poll, struct fd *fd, int types, union poll_fd_info
 
     poll_fd->types = types;
     poll_fd->info = info;
+    // this also rearms a oneshot fd
+    poll_fd->disabled = false;
+    if (poll->host_fd != -1 && poll_fd_is_host(poll_fd)) {
+        poll_fd_watch(poll, poll_fd, false);
+    } else {
+        poll_fd_ready(poll, poll_fd);
+        poll_kick(poll);
+    }
 
     err = 0;
 out:
@@ -110,114 +410,163 @@ void poll_wakeup(struct fd *fd) {
     list_for_each_entry(&fd->poll_fds, poll_fd, polls) {
         struct poll *poll = poll_fd->poll;
         lock(&poll->lock);
-        if (poll->notify_pipe[1] != -1)
-            write(poll->notify_pipe[1], "", 1);
+        // nobody's listening to a disabled one, so don't wake them up
+        if (!poll_fd->disabled) {
+            poll_fd_ready(poll, poll_fd);
+            poll_kick(poll);
+        }
         unlock(&poll->lock);
     }
     unlock(&fd->poll_lock);
 }
 
-int poll_wait(struct poll *poll_, poll_callback_t callback, void *context, struct timespec *timeout) {
-    lock(&poll_->lock);
-    if (poll_->waiters++ == 0) {
-        assert(poll_->notify_pipe[0] == -1 && poll_->notify_pipe[1] == -1);
-        if (pipe(poll_->notify_pipe) < 0) {
-            unlock(&poll_->lock);
-            return errno_map();
+// Checks everything on the ready list and reports what's actually ready to
+// the callback. Level triggered fds that got reported go to the back of the
+// list, since they're probably still ready next time, everything else comes
+// off until something wakes it up again.
+static int poll_check_ready(struct poll *poll, poll_callback_t callback, void *context) {
+    int res = 0;
+    struct list still_ready;
+    list_init(&still_ready);
+    struct poll_fd *poll_fd, *tmp;
+    list_for_each_entry_safe(&poll->ready, poll_fd, tmp, ready) {
+        list_remove(&poll_fd->ready);
+        struct fd *fd = poll_fd->fd;
+        int poll_types = 0;
+        if (fd->ops->poll)
+            poll_types = fd->ops->poll(fd);
+        // POLLNVAL should only be returned by poll() when given a bad fd
+        assert(!(poll_types & POLL_NVAL));
+        poll_types &= poll_fd->types & ~(POLL_EDGE | POLL_ONESHOT);
+        if (poll_types == 0) {
+            // a oneshot host registration disarmed itself on the event that got us here
+            if (poll_fd->types & POLL_ONESHOT && poll->host_fd != -1 && poll_fd_is_host(poll_fd))
+                host_poll_ctl(poll, poll_fd, false, false);
+            continue;
+        }
+        if (callback(context, poll_types, poll_fd->info) != 1) {
+            // out of room, so this and the rest go first next time
+            list_add(&poll->ready, &poll_fd->ready);
+            break;
         }
-        fcntl(poll_->notify_pipe[0], F_SETFL, O_NONBLOCK);
-        fcntl(poll_->notify_pipe[1], F_SETFL, O_NONBLOCK);
+        res++;
+        if (poll_fd->types & POLL_ONESHOT)
+            poll_fd->disabled = true;
+        else if (!(poll_fd->types & POLL_EDGE))
+            list_add_before(&still_ready, &poll_fd->ready);
+    }
+    while (!list_empty(&still_ready)) {
+        poll_fd = list_first_entry(&still_ready, struct poll_fd, ready);
+        list_remove(&poll_fd->ready);
+        list_add_before(&poll->ready, &poll_fd->ready);
     }
+    return res;
+}
 
-    // TODO this is pretty broken with regards to timeouts
-    int res = 0;
-    while (true) {
-        // check if any fds are ready
-        struct poll_fd *poll_fd;
-        list_for_each_entry(&poll_->poll_fds, poll_fd, fds) {
-            struct fd *fd = poll_fd->fd;
-            int poll_types = 0;
-            if (fd->ops->poll)
-                poll_types = fd->ops->poll(fd);
-            // POLLNVAL should only be returned by poll() when given a bad fd
-            assert(!(poll_types & POLL_NVAL));
-            poll_types &= poll_fd->types;
-            if (poll_types) {
-                if (callback(context, poll_types, poll_fd->info) == 1)
-                    res++;
-            }
+#define HOST_EVENTS_MAX 64
+
+static void poll_host_events(struct poll *poll, struct poll_fd **ready, int n) {
+    for (int i = 0; i < n; i++) {
+        if (ready[i] == NULL) {
+            host_poll_drain(poll);
+            poll->kicked = false;
+        } else if (ready[i]->fd != NULL) {
+            poll_fd_ready(poll, ready[i]);
         }
-        if (res > 0)
+    }
+}
+
+int poll_wait(struct poll *poll_, poll_callback_t callback, void *context, struct timespec *timeout) {
+    struct timespec deadline;
+    if (timeout != NULL)
+        deadline = timespec_add(timespec_now(), *timeout);
+
+    lock(&poll_->lock);
+    poll_->waiters++;
+    int res;
+    struct poll_fd *poll_fd, *tmp;
+    struct poll_fd *ready[HOST_EVENTS_MAX];
+    // host fds only get on the ready list when the host says so
+    if (poll_->host_fd != -1) {
+        int n = host_poll_wait(poll_, ready, HOST_EVENTS_MAX, 0);
+        if (n > 0)
+            poll_host_events(poll_, ready, n);
+    }
+    while (true) {
+        res = poll_check_ready(poll_, callback, context);
+        if (res != 0)
             break;
 
-        // wait for a ready notification
-        size_t pollfd_count = 1;
-        list_for_each_entry(&poll_->poll_fds, poll_fd, fds) {
-            if (poll_fd->fd->ops->poll == realfs_poll)
-                pollfd_count++;
+        int timeout_millis = -1;
+        if (timeout != NULL) {
+            struct timespec remaining = timespec_subtract(deadline, timespec_now());
+            if (!timespec_positive(remaining))
+                break;
+            timeout_millis = INT_MAX;
+            if (remaining.tv_sec < INT_MAX / 1000 - 1)
+                timeout_millis = remaining.tv_sec * 1000 + (remaining.tv_nsec + 999999) / 1000000;
         }
-        struct pollfd pollfds[pollfd_count];
-        pollfds[0].fd = poll_->notify_pipe[0];
-        pollfds[0].events = POLLIN;
-        int i = 1;
-        list_for_each_entry(&poll_->poll_fds, poll_fd, fds) {
-            if (poll_fd->fd->ops->poll != realfs_poll)
-                continue;
-            pollfds[i].fd = poll_fd->fd->real_fd;
-            pollfds[i].events = poll_fd->types;
-            sockrestart_begin_listen_wait(poll_fd->fd);
-            i++;
+
+        if (poll_->host_fd == -1) {
+            res = poll_open_host(poll_);
+            if (res < 0)
+                break;
         }
 
+        bool sockets = poll_->sockets > 0;
+        if (sockets)
+            sockrestart_begin_wait();
         unlock(&poll_->lock);
-        int timeout_millis = -1;
-        if (timeout != NULL)
-            timeout_millis = timeout->tv_sec * 1000 + timeout->tv_nsec / 1000000;
-        int err;
+        int n;
         do {
-            err = poll(pollfds, pollfd_count, timeout_millis);
+            n = host_poll_wait(poll_, ready, HOST_EVENTS_MAX, timeout_millis);
         } while (sockrestart_should_restart_listen_wait() && errno == EINTR);
+        if (sockets)
+            sockrestart_end_wait();
         lock(&poll_->lock);
-        list_for_each_entry(&poll_->poll_fds, poll_fd, fds) {
-            sockrestart_end_listen_wait(poll_fd->fd);
-        }
-        if (err < 0) {
+        if (n < 0) {
             res = errno_map();
             break;
         }
-        if (err == 0)
-            // timed out and still nobody is ready
-            break;
 
-        if (pollfds[0].revents & POLLIN) {
-            char fuck;
-            if (read(poll_->notify_pipe[0], &fuck, 1) != 1) {
-                res = errno_map();
-                break;
-            }
-        }
+        poll_host_events(poll_, ready, n);
     }
+    // level triggered fds left on the ready list are for everyone
+    if (res > 0 && !list_empty(&poll_->ready) && poll_->waiters > 1)
+        poll_kick(poll_);
 
     if (--poll_->waiters == 0) {
-        close(poll_->notify_pipe[0]);
-        close(poll_->notify_pipe[1]);
-        poll_->notify_pipe[0] = -1;
-        poll_->notify_pipe[1] = -1;
+        list_for_each_entry_safe(&poll_->dead, poll_fd, tmp, fds) {
+            list_remove(&poll_fd->fds);
+            free(poll_fd);
+        }
     }
     unlock(&poll_->lock);
     return res;
 }
 
 void poll_destroy(struct poll *poll) {
-    struct poll_fd *poll_fd;
-    struct poll_fd *tmp;
-    list_for_each_entry_safe(&poll->poll_fds, poll_fd, tmp, fds) {
-        lock(&poll_fd->fd->poll_lock);
+    lock(&poll->lock);
+    while (!list_empty(&poll->poll_fds)) {
+        struct poll_fd *poll_fd = list_first_entry(&poll->poll_fds, struct poll_fd, fds);
+        // fd_close has to take this poll's lock to remove the poll_fd before
+        // the fd goes away, so the fd is still there, but it takes its own
+        // poll_lock first, so back off if it's in the middle of that
+        struct fd *fd = poll_fd->fd;
+        if (!trylock(&fd->poll_lock)) {
+            unlock(&poll->lock);
+            sched_yield();
+            lock(&poll->lock);
+            continue;
+        }
         list_remove(&poll_fd->polls);
         list_remove(&poll_fd->fds);
-        unlock(&poll_fd->fd->poll_lock);
+        unlock(&fd->poll_lock);
         free(poll_fd);
     }
+    unlock(&poll->lock);
+    assert(list_empty(&poll->dead));
 
+    host_poll_close(poll);
     free(poll);
 }
@@ -4,14 +4,29 @@
 
 struct poll {
     struct list poll_fds;
-    int notify_pipe[2];
+    // poll_fds that might be ready and need to be checked by the next waiter
+    struct list ready;
+    // poll_fds removed while someone was waiting, freed when the last waiter
+    // leaves since a host event could still be pointing at them
+    struct list dead;
+    // host epoll or kqueue, with every realfs fd registered, and the eventfd
+    // (on linux) used to wake it for emulated fds. created by the first
+    // poll_wait that has to block.
+    int host_fd;
+    int notify_fd;
     int waiters;
+    bool kicked;
+    // how many of poll_fds are sockets, so waiting knows whether to sign up
+    // for sockrestart without looking at every fd
+    int sockets;
+    // the poll_fd last kept by poll_keep_fd
+    struct poll_fd *keep_cursor;
     lock_t lock;
 };
 
 struct poll_fd {
     // locked by containing struct poll
-    struct fd *fd;
+    struct fd *fd; // NULL once removed
     struct list fds;
     int types;
     union poll_fd_info {
@@ -19,6 +34,10 @@ struct poll_fd {
         int fd;
         uint64_t num;
     } info;
+    struct list ready;
+    bool disabled; // oneshot fd that fired, until the next poll_mod_fd
+    bool kept; // by poll_keep_fd since the last poll_keep_done
+    bool idle; // left out by the last poll_keep_done, not watched at all
 
     // locked by containing struct fd
     struct poll *poll;
@@ -36,6 +55,9 @@ struct poll_fd {
 #define POLL_ERR 8
 #define POLL_HUP 16
 #define POLL_NVAL 32
+// these can be or'd into the types given to poll_add_fd
+#define POLL_ONESHOT (1 << 30)
+#define POLL_EDGE (1 << 31)
 struct poll_event {
     struct fd *fd;
     int types;
@@ -45,14 +67,23 @@ bool poll_has_fd(struct poll *poll, struct fd *fd);
 int poll_add_fd(struct poll *poll, struct fd *fd, int types, union poll_fd_info info);
 int poll_mod_fd(struct poll *poll, struct fd *fd, int types, union poll_fd_info info);
 int poll_del_fd(struct poll *poll, struct fd *fd);
+// For poll() and select(), which are given the whole set of fds every time.
+// Call poll_keep_fd for each fd in the set, then poll_keep_done. An fd that
+// was in the last set keeps its poll_fd, so a poll that lives between calls
+// only has to tell the host about what changed. Fds left out stop being
+// watched, and are dropped when they're closed or the poll is destroyed.
+int poll_keep_fd(struct poll *poll, struct fd *fd, int types, union poll_fd_info info);
+void poll_keep_done(struct poll *poll);
+// for fd_close, must be called with the fd's poll_lock and the poll locked
+void poll_fd_remove(struct poll_fd *poll_fd);
 // please do not call this while holding any locks you would acquire in your poll operation
 void poll_wakeup(struct fd *fd);
 // Waits for events on the fds in this poll, and calls the callback for each one found.
 // Returns the number of times the callback returned 1, or negative for error.
 typedef int (*poll_callback_t)(void *context, int types, union poll_fd_info info);
 int poll_wait(struct poll *poll, poll_callback_t callback, void *context, struct timespec *timeout);
-// does not lock the poll because lock ordering, you must ensure no other
-// thread will add or remove fds from this poll
+// other threads can still be closing fds in the poll, but must not be doing
+// anything else with it
 void poll_destroy(struct poll *poll);
 
 #endif
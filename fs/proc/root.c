@@ -62,22 +62,14 @@ static bool proc_root_readdir(struct proc_entry *UNUSED(entry), unsigned long *i
         return true;
     }
 
-    pid_t_ pid = *index - PROC_ROOT_LEN;
-    if (pid <= MAX_PID) {
-        lock(&pids_lock);
-        do {
-            pid++;
-        } while (pid <= MAX_PID && pid_get_task(pid) == NULL);
-        unlock(&pids_lock);
-        if (pid > MAX_PID)
-            return false;
-        assert(pid_get_task(pid) != NULL);
-        *next_entry = (struct proc_entry) {&proc_pid, .pid = pid};
-        *index = pid + PROC_ROOT_LEN;
-        return true;
-    }
-
-    return false;
+    // the process can be gone by the time its directory is used, which the
+    // files in it already have to deal with
+    pid_t_ pid = pid_next_task(*index - PROC_ROOT_LEN);
+    if (pid == 0)
+        return false;
+    *next_entry = (struct proc_entry) {&proc_pid, .pid = pid};
+    *index = pid + PROC_ROOT_LEN;
+    return true;
 }
 
 struct proc_dir_entry proc_root = {NULL, S_IFDIR, .readdir = proc_root_readdir};
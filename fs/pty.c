@@ -16,6 +16,8 @@ static int pty_master_init(struct tty *tty) {
     tty->termios.lflags = 0;
 
     struct tty *slave = tty_alloc(&pty_slave, tty->num);
+    if (slave == NULL)
+        return _ENOMEM;
     slave->refcount = 1;
     pty_slave.ttys[tty->num] = slave;
     tty->pty.other = slave;
@@ -65,6 +67,8 @@ static int pty_return_eio(struct tty *UNUSED(tty)) {
 }
 
 #define MAX_PTYS (1 << 12)
+// bigger than a console's, so a fast producer can get ahead of its reader
+#define PTY_BUF_SIZE (1 << 16)
 
 const struct tty_driver_ops pty_master_ops = {
     .init = pty_master_init,
@@ -73,14 +77,14 @@ const struct tty_driver_ops pty_master_ops = {
     .ioctl = pty_master_ioctl,
     .cleanup = pty_master_cleanup,
 };
-DEFINE_TTY_DRIVER(pty_master, &pty_master_ops, MAX_PTYS);
+DEFINE_TTY_DRIVER(pty_master, &pty_master_ops, MAX_PTYS, .buf_size = PTY_BUF_SIZE);
 
 const struct tty_driver_ops pty_slave_ops = {
     .init = pty_return_eio,
     .open = pty_slave_open,
     .write = pty_write,
 };
-DEFINE_TTY_DRIVER(pty_slave, &pty_slave_ops, MAX_PTYS);
+DEFINE_TTY_DRIVER(pty_slave, &pty_slave_ops, MAX_PTYS, .buf_size = PTY_BUF_SIZE);
 
 int ptmx_open(struct fd *fd) {
     int pty_num;
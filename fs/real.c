@@ -167,10 +167,33 @@ int realfs_readdir(struct fd *fd, struct dir_entry *entry) {
             return 0;
     }
     entry->inode = dirent->d_ino;
+    entry->type = dirent->d_type;
     strcpy(entry->name, dirent->d_name);
     return 1;
 }
 
+// libc already reads the directory from the host in big chunks, this just
+// saves going back and forth between here and getdents for every entry
+int realfs_readdir_batch(struct fd *fd, struct dir_entry *entries, unsigned count) {
+    realfs_opendir(fd);
+    unsigned n = 0;
+    while (n < count) {
+        errno = 0;
+        struct dirent *dirent = readdir(fd->dir);
+        if (dirent == NULL) {
+            if (errno != 0 && n == 0)
+                return errno_map();
+            break;
+        }
+        entries[n].inode = dirent->d_ino;
+        entries[n].type = dirent->d_type;
+        strcpy(entries[n].name, dirent->d_name);
+        entries[n].offset = telldir(fd->dir);
+        n++;
+    }
+    return n;
+}
+
 unsigned long realfs_telldir(struct fd *fd) {
     realfs_opendir(fd);
     return telldir(fd->dir);
@@ -213,19 +236,9 @@ int realfs_mmap(struct fd *fd, struct mem *mem, page_t start, pages_t pages, off
     if (pages == 0)
         return 0;
 
-    int mmap_flags = 0;
-    if (flags & MMAP_PRIVATE) mmap_flags |= MAP_PRIVATE;
-    if (flags & MMAP_SHARED) mmap_flags |= MAP_SHARED;
-    int mmap_prot = PROT_READ;
-    if (prot & P_WRITE) mmap_prot |= PROT_WRITE;
-
-    off_t real_offset = (offset / real_page_size) * real_page_size;
-    off_t correction = offset - real_offset;
-    char *memory = mmap(NULL, (pages * PAGE_SIZE) + correction,
-            mmap_prot, mmap_flags, fd->real_fd, real_offset);
-    if (memory != MAP_FAILED)
-        memory += correction;
-    return pt_map(mem, start, pages, memory, prot);
+    if (flags & MMAP_SHARED)
+        prot |= P_SHARED;
+    return pt_map_file(mem, start, pages, fd->real_fd, offset, prot);
 }
 
 static ssize_t realfs_readlink(struct mount *mount, const char *path, char *buf, size_t bufsize) {
@@ -287,6 +300,11 @@ static int realfs_mknod(struct mount *mount, const char *path, mode_t_ mode, dev
         lock_fchdir(mount->root_fd);
         err = mkfifo(fix_path(path), mode & ~S_IFMT);
         unlock_fchdir();
+    } else if (S_ISSOCK(mode)) {
+        // just a placeholder for a socket bound inside ish
+        lock_fchdir(mount->root_fd);
+        err = mknod(fix_path(path), mode, 0);
+        unlock_fchdir();
     } else if (S_ISREG(mode)) {
         err = openat(mount->root_fd, fix_path(path), O_CREAT|O_EXCL|O_RDONLY, mode & ~S_IFMT);
         if (err >= 0)
@@ -444,6 +462,7 @@ const struct fd_ops realfs_fdops = {
     .read = realfs_read,
     .write = realfs_write,
     .readdir = realfs_readdir,
+    .readdir_batch = realfs_readdir_batch,
     .telldir = realfs_telldir,
     .seekdir = realfs_seekdir,
     .lseek = realfs_lseek,
@@ -1,9 +1,12 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include "kernel/calls.h"
 #include "fs/fd.h"
 #include "fs/sock.h"
+#include "fs/unix.h"
 #include "debug.h"
 
 const struct fd_ops socket_fdops;
@@ -19,6 +22,12 @@ static fd_t sock_fd_create(int sock_fd, int flags) {
 
 dword_t sys_socket(dword_t domain, dword_t type, dword_t protocol) {
     STRACE("socket(%d, %d, %d)", domain, type, protocol);
+    if (domain == PF_LOCAL_) {
+        struct fd *fd = unix_socket_create(type & 0xff);
+        if (IS_ERR(fd))
+            return PTR_ERR(fd);
+        return f_install(fd, type);
+    }
     int real_domain = sock_family_to_real(domain);
     if (real_domain < 0)
         return _EINVAL;
@@ -43,11 +52,39 @@ dword_t sys_socket(dword_t domain, dword_t type, dword_t protocol) {
 
 static struct fd *sock_getfd(fd_t sock_fd) {
     struct fd *sock = f_get(sock_fd);
-    if (sock == NULL || sock->ops != &socket_fdops)
+    if (sock == NULL || (sock->ops != &socket_fdops && sock->ops != &unix_socket_fdops))
         return NULL;
     return sock;
 }
 
+static bool sock_is_unix(struct fd *sock) {
+    return sock->ops == &unix_socket_fdops;
+}
+
+static int sockaddr_un_read(addr_t sockaddr_addr, struct sockaddr_un_ *sockaddr, dword_t sockaddr_len) {
+    if (sockaddr_len > sizeof(*sockaddr))
+        return _EINVAL;
+    if (user_read(sockaddr_addr, sockaddr, sockaddr_len))
+        return _EFAULT;
+    return 0;
+}
+
+// Writes as much of the address as fits, and how big it really was.
+static int sockaddr_un_write(addr_t sockaddr_addr, addr_t sockaddr_len_addr, struct sockaddr_un_ *sockaddr, uint_t sockaddr_len) {
+    if (sockaddr_addr == 0)
+        return 0;
+    dword_t len;
+    if (user_get(sockaddr_len_addr, len))
+        return _EFAULT;
+    if (len > sockaddr_len)
+        len = sockaddr_len;
+    if (user_write(sockaddr_addr, sockaddr, len))
+        return _EFAULT;
+    if (user_put(sockaddr_len_addr, sockaddr_len))
+        return _EFAULT;
+    return 0;
+}
+
 static int sockaddr_read(addr_t sockaddr_addr, void *sockaddr, size_t sockaddr_len) {
     if (user_read(sockaddr_addr, sockaddr, sockaddr_len))
         return _EFAULT;
@@ -89,6 +126,13 @@ dword_t sys_bind(fd_t sock_fd, addr_t sockaddr_addr, dword_t sockaddr_len) {
     struct fd *sock = sock_getfd(sock_fd);
     if (sock == NULL)
         return _EBADF;
+    if (sock_is_unix(sock)) {
+        struct sockaddr_un_ sockaddr;
+        int err = sockaddr_un_read(sockaddr_addr, &sockaddr, sockaddr_len);
+        if (err < 0)
+            return err;
+        return unix_bind(sock, &sockaddr, sockaddr_len);
+    }
     char sockaddr[sockaddr_len];
     int err = sockaddr_read(sockaddr_addr, sockaddr, sockaddr_len);
     if (err < 0)
@@ -105,6 +149,13 @@ dword_t sys_connect(fd_t sock_fd, addr_t sockaddr_addr, dword_t sockaddr_len) {
     struct fd *sock = sock_getfd(sock_fd);
     if (sock == NULL)
         return _EBADF;
+    if (sock_is_unix(sock)) {
+        struct sockaddr_un_ sockaddr;
+        int err = sockaddr_un_read(sockaddr_addr, &sockaddr, sockaddr_len);
+        if (err < 0)
+            return err;
+        return unix_connect(sock, &sockaddr, sockaddr_len);
+    }
     char sockaddr[sockaddr_len];
     int err = sockaddr_read(sockaddr_addr, sockaddr, sockaddr_len);
     if (err < 0)
@@ -121,6 +172,8 @@ dword_t sys_listen(fd_t sock_fd, int_t backlog) {
     struct fd *sock = sock_getfd(sock_fd);
     if (sock == NULL)
         return _EBADF;
+    if (sock_is_unix(sock))
+        return unix_listen(sock, backlog);
     int err = listen(sock->real_fd, backlog);
     if (err < 0)
         return errno_map();
@@ -128,43 +181,88 @@ dword_t sys_listen(fd_t sock_fd, int_t backlog) {
     return err;
 }
 
-dword_t sys_accept(fd_t sock_fd, addr_t sockaddr_addr, addr_t sockaddr_len_addr) {
-    STRACE("accept(%d, 0x%x, 0x%x)", sock_fd, sockaddr_addr, sockaddr_len_addr);
+// Accepts on the host, with the new fd already nonblocking if asked for.
+static int sock_accept_real(int sock_fd, struct sockaddr *sockaddr, socklen_t *sockaddr_len, int flags) {
+#if __linux__
+    return accept4(sock_fd, sockaddr, sockaddr_len, SOCK_CLOEXEC | (flags & SOCK_NONBLOCK_ ? SOCK_NONBLOCK : 0));
+#else
+    int client = accept(sock_fd, sockaddr, sockaddr_len);
+    if (client >= 0 && (flags & SOCK_NONBLOCK_))
+        fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+    return client;
+#endif
+}
+
+dword_t sys_accept4(fd_t sock_fd, addr_t sockaddr_addr, addr_t sockaddr_len_addr, dword_t flags) {
+    STRACE("accept4(%d, 0x%x, 0x%x, %#x)", sock_fd, sockaddr_addr, sockaddr_len_addr, flags);
+    if (flags & ~(SOCK_NONBLOCK_|SOCK_CLOEXEC_))
+        return _EINVAL;
     struct fd *sock = sock_getfd(sock_fd);
     if (sock == NULL)
         return _EBADF;
-    dword_t sockaddr_len;
-    if (user_get(sockaddr_len_addr, sockaddr_len))
-        return _EFAULT;
+    if (sock_is_unix(sock)) {
+        struct sockaddr_un_ sockaddr;
+        uint_t sockaddr_len;
+        struct fd *client = unix_accept(sock, &sockaddr, &sockaddr_len);
+        if (IS_ERR(client))
+            return PTR_ERR(client);
+        int err = sockaddr_un_write(sockaddr_addr, sockaddr_len_addr, &sockaddr, sockaddr_len);
+        if (err < 0) {
+            fd_close(client);
+            return err;
+        }
+        return f_install(client, flags);
+    }
+    dword_t sockaddr_len = 0;
+    if (sockaddr_addr != 0)
+        if (user_get(sockaddr_len_addr, sockaddr_len))
+            return _EFAULT;
 
-    char sockaddr[sockaddr_len];
+    struct sockaddr_storage sockaddr;
+    socklen_t real_len = sizeof(sockaddr);
     int client;
     do {
         sockrestart_begin_listen_wait(sock);
         errno = 0;
-        client = accept(sock->real_fd, (void *) sockaddr, &sockaddr_len);
+        client = sock_accept_real(sock->real_fd, (void *) &sockaddr, &real_len, flags);
         sockrestart_end_listen_wait(sock);
     } while (sockrestart_should_restart_listen_wait() && errno == EINTR);
     if (client < 0)
         return errno_map();
 
-    int err = sockaddr_write(sockaddr_addr, sockaddr, sockaddr_len);
-    if (err < 0)
-        return client;
-    if (user_put(sockaddr_len_addr, sockaddr_len))
-        return _EFAULT;
+    if (sockaddr_addr != 0) {
+        int err = sockaddr_write(sockaddr_addr, &sockaddr, real_len < sockaddr_len ? real_len : sockaddr_len);
+        if (err >= 0 && user_put(sockaddr_len_addr, real_len))
+            err = _EFAULT;
+        if (err < 0) {
+            close(client);
+            return err;
+        }
+    }
 
-    fd_t client_f = sock_fd_create(client, 0);
+    fd_t client_f = sock_fd_create(client, flags);
     if (client_f < 0)
         close(client);
     return client_f;
 }
 
+dword_t sys_accept(fd_t sock_fd, addr_t sockaddr_addr, addr_t sockaddr_len_addr) {
+    return sys_accept4(sock_fd, sockaddr_addr, sockaddr_len_addr, 0);
+}
+
 dword_t sys_getsockname(fd_t sock_fd, addr_t sockaddr_addr, addr_t sockaddr_len_addr) {
     STRACE("getsockname(%d, 0x%x, 0x%x)", sock_fd, sockaddr_addr, sockaddr_len_addr);
     struct fd *sock = sock_getfd(sock_fd);
     if (sock == NULL)
         return _EBADF;
+    if (sock_is_unix(sock)) {
+        struct sockaddr_un_ sockaddr;
+        uint_t sockaddr_len;
+        int err = unix_getname(sock, false, &sockaddr, &sockaddr_len);
+        if (err < 0)
+            return err;
+        return sockaddr_un_write(sockaddr_addr, sockaddr_len_addr, &sockaddr, sockaddr_len);
+    }
     dword_t sockaddr_len;
     if (user_get(sockaddr_len_addr, sockaddr_len))
         return _EFAULT;
@@ -187,6 +285,14 @@ dword_t sys_getpeername(fd_t sock_fd, addr_t sockaddr_addr, addr_t sockaddr_len_
     struct fd *sock = sock_getfd(sock_fd);
     if (sock == NULL)
         return _EBADF;
+    if (sock_is_unix(sock)) {
+        struct sockaddr_un_ sockaddr;
+        uint_t sockaddr_len;
+        int err = unix_getname(sock, true, &sockaddr, &sockaddr_len);
+        if (err < 0)
+            return err;
+        return sockaddr_un_write(sockaddr_addr, sockaddr_len_addr, &sockaddr, sockaddr_len);
+    }
     dword_t sockaddr_len;
     if (user_get(sockaddr_len_addr, sockaddr_len))
         return _EFAULT;
@@ -204,8 +310,37 @@ dword_t sys_getpeername(fd_t sock_fd, addr_t sockaddr_addr, addr_t sockaddr_len_
     return res;
 }
 
+static int unix_socketpair_install(dword_t type, addr_t sockets_addr) {
+    struct fd *fds[2];
+    int err = unix_socketpair(type & 0xff, fds);
+    if (err < 0)
+        return err;
+    int fake_sockets[2];
+    err = fake_sockets[0] = f_install(fds[0], type);
+    if (fake_sockets[0] < 0) {
+        fd_close(fds[1]);
+        return err;
+    }
+    err = fake_sockets[1] = f_install(fds[1], type);
+    if (fake_sockets[1] < 0)
+        goto close_fake_0;
+    err = _EFAULT;
+    if (user_put(sockets_addr, fake_sockets))
+        goto close_fake_1;
+    STRACE(" [%d, %d]", fake_sockets[0], fake_sockets[1]);
+    return 0;
+
+close_fake_1:
+    sys_close(fake_sockets[1]);
+close_fake_0:
+    sys_close(fake_sockets[0]);
+    return err;
+}
+
 dword_t sys_socketpair(dword_t domain, dword_t type, dword_t protocol, addr_t sockets_addr) {
     STRACE("socketpair(%d, %d, %d, 0x%x)", domain, type, protocol, sockets_addr);
+    if (domain == PF_LOCAL_)
+        return unix_socketpair_install(type, sockets_addr);
     int real_domain = sock_family_to_real(domain);
     if (real_domain < 0)
         return _EINVAL;
@@ -248,6 +383,17 @@ dword_t sys_sendto(fd_t sock_fd, addr_t buffer_addr, dword_t len, dword_t flags,
     struct fd *sock = sock_getfd(sock_fd);
     if (sock == NULL)
         return _EBADF;
+    if (sock_is_unix(sock)) {
+        struct iovec_ iov = {.iov_base = buffer_addr, .iov_len = len};
+        struct unix_msghdr msg = {.iov = &iov, .iovlen = 1};
+        if (sockaddr_addr != 0) {
+            int err = sockaddr_un_read(sockaddr_addr, &msg.name, sockaddr_len);
+            if (err < 0)
+                return err;
+            msg.namelen = sockaddr_len;
+        }
+        return unix_sendmsg(sock, &msg, flags);
+    }
     char buffer[len];
     if (user_read(buffer_addr, buffer, len))
         return _EFAULT;
@@ -273,6 +419,21 @@ dword_t sys_recvfrom(fd_t sock_fd, addr_t buffer_addr, dword_t len, dword_t flag
     struct fd *sock = sock_getfd(sock_fd);
     if (sock == NULL)
         return _EBADF;
+    if (sock_is_unix(sock)) {
+        struct iovec_ iov = {.iov_base = buffer_addr, .iov_len = len};
+        struct unix_msghdr msg = {.iov = &iov, .iovlen = 1};
+        ssize_t res = unix_recvmsg(sock, &msg, flags);
+        if (res < 0)
+            return res;
+        // nobody asked for these
+        for (unsigned i = 0; i < msg.fds_count; i++)
+            fd_close(msg.fds[i]);
+        free(msg.fds);
+        int err = sockaddr_un_write(sockaddr_addr, sockaddr_len_addr, &msg.name, msg.namelen);
+        if (err < 0)
+            return err;
+        return res;
+    }
     int real_flags = sock_flags_to_real(flags);
     if (real_flags < 0)
         return _EINVAL;
@@ -307,6 +468,8 @@ dword_t sys_shutdown(fd_t sock_fd, dword_t how) {
     struct fd *sock = sock_getfd(sock_fd);
     if (sock == NULL)
         return _EBADF;
+    if (sock_is_unix(sock))
+        return unix_shutdown(sock, how);
     int err = shutdown(sock->real_fd, how);
     if (err < 0)
         return errno_map();
@@ -321,6 +484,8 @@ dword_t sys_setsockopt(fd_t sock_fd, dword_t level, dword_t option, addr_t value
     char value[value_len];
     if (user_read(value_addr, value, value_len))
         return _EFAULT;
+    if (sock_is_unix(sock))
+        return unix_setsockopt(sock, level, option, value, value_len);
 
     // ICMP6_FILTER can only be set on real SOCK_RAW
     if (level == IPPROTO_ICMPV6 && option == ICMP6_FILTER_)
@@ -353,6 +518,16 @@ dword_t sys_getsockopt(fd_t sock_fd, dword_t level, dword_t option, addr_t value
     char value[value_len];
     if (user_read(value_addr, value, value_len))
         return _EFAULT;
+    if (sock_is_unix(sock)) {
+        int err = unix_getsockopt(sock, level, option, value, &value_len);
+        if (err < 0)
+            return err;
+        if (user_put(len_addr, value_len))
+            return _EFAULT;
+        if (user_write(value_addr, value, value_len))
+            return _EFAULT;
+        return 0;
+    }
     int real_opt = sock_opt_to_real(option, level);
     if (real_opt < 0)
         return _EINVAL;
@@ -382,11 +557,172 @@ dword_t sys_getsockopt(fd_t sock_fd, dword_t level, dword_t option, addr_t value
     return 0;
 }
 
+// result comes from malloc
+static struct iovec_ *msghdr_iovecs(struct msghdr_ *msg) {
+    if (msg->msg_iovlen > UIO_MAXIOV_)
+        return ERR_PTR(_EMSGSIZE);
+    struct iovec_ *iov = malloc(msg->msg_iovlen * sizeof(struct iovec_) + 1);
+    if (iov == NULL)
+        return ERR_PTR(_ENOMEM);
+    if (user_read(msg->msg_iov, iov, msg->msg_iovlen * sizeof(struct iovec_))) {
+        free(iov);
+        return ERR_PTR(_EFAULT);
+    }
+    return iov;
+}
+
+// Gets the fds out of any SCM_RIGHTS messages, retained.
+static int unix_read_rights(struct msghdr_ *msg_fake, struct unix_msghdr *msg) {
+    if (msg_fake->msg_control == 0 || msg_fake->msg_controllen == 0)
+        return 0;
+    char *control = malloc(msg_fake->msg_controllen);
+    if (control == NULL)
+        return _ENOMEM;
+    int err = _EFAULT;
+    if (user_read(msg_fake->msg_control, control, msg_fake->msg_controllen))
+        goto out;
+    uint_t offset = 0;
+    while (offset + sizeof(struct cmsghdr_) <= msg_fake->msg_controllen) {
+        struct cmsghdr_ *cmsg = (void *) &control[offset];
+        err = _EINVAL;
+        if (cmsg->len < sizeof(struct cmsghdr_) || cmsg->len > msg_fake->msg_controllen - offset)
+            goto out;
+        if (cmsg->level == SOL_SOCKET_ && cmsg->type == SCM_RIGHTS_) {
+            unsigned count = (cmsg->len - sizeof(struct cmsghdr_)) / sizeof(fd_t);
+            if (msg->fds_count + count > SCM_MAX_FD_)
+                goto out;
+            err = _ENOMEM;
+            struct fd **fds = realloc(msg->fds, (msg->fds_count + count) * sizeof(struct fd *));
+            if (fds == NULL)
+                goto out;
+            msg->fds = fds;
+            fd_t *fd_nums = (fd_t *) (cmsg + 1);
+            for (unsigned i = 0; i < count; i++) {
+                struct fd *fd = f_get(fd_nums[i]);
+                err = _EBADF;
+                if (fd == NULL)
+                    goto out;
+                msg->fds[msg->fds_count++] = fd_retain(fd);
+            }
+        }
+        offset += CMSG_ALIGN_(cmsg->len);
+    }
+    err = 0;
+out:
+    free(control);
+    return err;
+}
+
+static dword_t unix_sendmsg_fake(struct fd *sock, struct msghdr_ *msg_fake, dword_t flags) {
+    struct unix_msghdr msg = {};
+    if (msg_fake->msg_name != 0 && msg_fake->msg_namelen != 0) {
+        int err = sockaddr_un_read(msg_fake->msg_name, &msg.name, msg_fake->msg_namelen);
+        if (err < 0)
+            return err;
+        msg.namelen = msg_fake->msg_namelen;
+    }
+    struct iovec_ *iov = msghdr_iovecs(msg_fake);
+    if (IS_ERR(iov))
+        return PTR_ERR(iov);
+    msg.iov = iov;
+    msg.iovlen = msg_fake->msg_iovlen;
+
+    ssize_t res = unix_read_rights(msg_fake, &msg);
+    if (res >= 0)
+        res = unix_sendmsg(sock, &msg, flags);
+    for (unsigned i = 0; i < msg.fds_count; i++)
+        fd_close(msg.fds[i]);
+    free(msg.fds);
+    free(iov);
+    return res;
+}
+
+static dword_t sock_sendmmsg_real(struct fd *sock, struct msghdr_ *fake, addr_t lens_addr, unsigned count, dword_t flags);
+
+dword_t sys_sendmsg(fd_t sock_fd, addr_t msghdr_addr, dword_t flags) {
+    STRACE("sendmsg(%d, 0x%x, %d)", sock_fd, msghdr_addr, flags);
+    struct fd *sock = sock_getfd(sock_fd);
+    if (sock == NULL)
+        return _EBADF;
+    struct msghdr_ msg_fake;
+    if (user_get(msghdr_addr, msg_fake))
+        return _EFAULT;
+    if (sock_is_unix(sock))
+        return unix_sendmsg_fake(sock, &msg_fake, flags);
+
+    return sock_sendmmsg_real(sock, &msg_fake, 0, 1, flags);
+}
+
+static dword_t unix_recvmsg_fake(struct fd *sock, addr_t msghdr_addr, struct msghdr_ *msg_fake, dword_t flags) {
+    struct iovec_ *iov = msghdr_iovecs(msg_fake);
+    if (IS_ERR(iov))
+        return PTR_ERR(iov);
+    struct unix_msghdr msg = {.iov = iov, .iovlen = msg_fake->msg_iovlen};
+    if (msg_fake->msg_control != 0 && msg_fake->msg_controllen >= sizeof(struct cmsghdr_))
+        msg.fds_max = (msg_fake->msg_controllen - sizeof(struct cmsghdr_)) / sizeof(fd_t);
+    ssize_t res = unix_recvmsg(sock, &msg, flags);
+    free(iov);
+    if (res < 0)
+        return res;
+
+    int err = 0;
+    if (msg_fake->msg_name != 0) {
+        uint_t len = msg.namelen;
+        if (len > (uint_t) msg_fake->msg_namelen)
+            len = msg_fake->msg_namelen;
+        if (user_write(msg_fake->msg_name, &msg.name, len))
+            err = _EFAULT;
+    }
+    msg_fake->msg_namelen = msg.namelen;
+
+    // install the fds that fit and drop the rest
+    fd_t fd_nums[msg.fds_count + 1];
+    unsigned installed = 0;
+    for (unsigned i = 0; i < msg.fds_count; i++) {
+        fd_t f = -1;
+        if (err == 0 && i < msg.fds_max)
+            f = f_install(msg.fds[i], (flags & MSG_CMSG_CLOEXEC_) ? O_CLOEXEC_ : 0);
+        else
+            fd_close(msg.fds[i]);
+        if (f < 0) {
+            msg.flags |= MSG_CTRUNC_;
+            continue;
+        }
+        fd_nums[installed++] = f;
+    }
+    free(msg.fds);
+    uint_t controllen = 0;
+    if (installed > 0) {
+        struct cmsghdr_ cmsg = {
+            .len = sizeof(cmsg) + installed * sizeof(fd_t),
+            .level = SOL_SOCKET_,
+            .type = SCM_RIGHTS_,
+        };
+        if (user_put(msg_fake->msg_control, cmsg) ||
+                user_write(msg_fake->msg_control + sizeof(cmsg), fd_nums, installed * sizeof(fd_t)))
+            err = _EFAULT;
+        controllen = CMSG_ALIGN_(cmsg.len);
+    }
+    msg_fake->msg_controllen = controllen;
+    msg_fake->msg_flags = msg.flags;
+    if (user_put(msghdr_addr, *msg_fake))
+        err = _EFAULT;
+    if (err < 0)
+        return err;
+    return res;
+}
+
 dword_t sys_recvmsg(fd_t sock_fd, addr_t msghdr_addr, dword_t flags) {
     STRACE("recvmsg(%d, 0x%x, %d)", sock_fd, msghdr_addr, flags);
     struct fd *sock = sock_getfd(sock_fd);
     if (sock == NULL)
         return _EBADF;
+    if (sock_is_unix(sock)) {
+        struct msghdr_ msg_fake;
+        if (user_get(msghdr_addr, msg_fake))
+            return _EFAULT;
+        return unix_recvmsg_fake(sock, msghdr_addr, &msg_fake, flags);
+    }
 
     struct msghdr msg;
     memset(&msg, 0, sizeof(msg));
@@ -504,6 +840,317 @@ dword_t sys_recvmsg(fd_t sock_fd, addr_t msghdr_addr, dword_t flags) {
     return res;
 }
 
+// A batch of guest messages set up for the host, with all the data gathered
+// into one buffer so each message is one copy in or out of guest memory.
+struct sock_batch {
+    unsigned count;
+    struct msghdr_ *fake;
+    struct iovec_ **fake_iov;
+    struct msghdr *msgs;
+    unsigned *lens;
+    struct iovec *iov;
+    struct sockaddr_storage *names;
+    char *buf;
+};
+
+static void sock_batch_free(struct sock_batch *batch) {
+    if (batch->fake_iov != NULL)
+        for (unsigned i = 0; i < batch->count; i++)
+            free(batch->fake_iov[i]);
+    free(batch->fake_iov);
+    free(batch->msgs);
+    free(batch->lens);
+    free(batch->iov);
+    free(batch->names);
+    free(batch->buf);
+}
+
+static int sock_batch_init(struct sock_batch *batch, struct msghdr_ *fake, unsigned count, bool send) {
+    *batch = (struct sock_batch) {.count = count, .fake = fake};
+    batch->fake_iov = calloc(count, sizeof(struct iovec_ *));
+    batch->msgs = calloc(count, sizeof(struct msghdr));
+    batch->lens = calloc(count, sizeof(unsigned));
+    batch->iov = calloc(count, sizeof(struct iovec));
+    batch->names = calloc(count, sizeof(struct sockaddr_storage));
+    if (!batch->fake_iov || !batch->msgs || !batch->lens || !batch->iov || !batch->names)
+        return _ENOMEM;
+
+    size_t total = 0;
+    for (unsigned i = 0; i < count; i++) {
+        struct msghdr_ *msg_fake = &fake[i];
+        struct msghdr *msg = &batch->msgs[i];
+        struct iovec_ *fake_iov = msghdr_iovecs(msg_fake);
+        if (IS_ERR(fake_iov))
+            return PTR_ERR(fake_iov);
+        batch->fake_iov[i] = fake_iov;
+        size_t len = 0;
+        for (uint_t j = 0; j < msg_fake->msg_iovlen; j++)
+            len += fake_iov[j].iov_len;
+        batch->iov[i].iov_len = len;
+        total += len;
+
+        if (msg_fake->msg_name != 0) {
+            msg->msg_name = &batch->names[i];
+            msg->msg_namelen = sizeof(batch->names[i]);
+            if (send) {
+                if ((uint_t) msg_fake->msg_namelen > sizeof(batch->names[i]))
+                    return _EINVAL;
+                int err = sockaddr_read(msg_fake->msg_name, &batch->names[i], msg_fake->msg_namelen);
+                if (err < 0)
+                    return err;
+                msg->msg_namelen = msg_fake->msg_namelen;
+            }
+        }
+        if (send && msg_fake->msg_controllen != 0)
+            FIXME("sendmsg control messages on host sockets");
+        msg->msg_iov = &batch->iov[i];
+        msg->msg_iovlen = 1;
+    }
+
+    batch->buf = malloc(total + 1);
+    if (batch->buf == NULL)
+        return _ENOMEM;
+    char *data = batch->buf;
+    for (unsigned i = 0; i < count; i++) {
+        batch->iov[i].iov_base = data;
+        if (send) {
+            struct msghdr_ *msg_fake = &fake[i];
+            for (uint_t j = 0; j < msg_fake->msg_iovlen; j++) {
+                if (user_read(batch->fake_iov[i][j].iov_base, data, batch->fake_iov[i][j].iov_len))
+                    return _EFAULT;
+                data += batch->fake_iov[i][j].iov_len;
+            }
+        } else {
+            data += batch->iov[i].iov_len;
+        }
+    }
+    return 0;
+}
+
+// Scatters a received message back out to the guest.
+static int sock_batch_copyout(struct sock_batch *batch, unsigned i) {
+    struct msghdr_ *msg_fake = &batch->fake[i];
+    struct msghdr *msg = &batch->msgs[i];
+    char *data = batch->iov[i].iov_base;
+    size_t left = batch->lens[i];
+    for (uint_t j = 0; j < msg_fake->msg_iovlen && left > 0; j++) {
+        size_t chunk = batch->fake_iov[i][j].iov_len;
+        if (chunk > left)
+            chunk = left;
+        if (user_write(batch->fake_iov[i][j].iov_base, data, chunk))
+            return _EFAULT;
+        data += chunk;
+        left -= chunk;
+    }
+    if (msg_fake->msg_name != 0) {
+        socklen_t len = msg->msg_namelen;
+        if (len > (uint_t) msg_fake->msg_namelen)
+            len = msg_fake->msg_namelen;
+        int err = sockaddr_write(msg_fake->msg_name, msg->msg_name, len);
+        if (err < 0)
+            return err;
+        msg_fake->msg_namelen = msg->msg_namelen;
+    }
+    msg_fake->msg_controllen = 0;
+    msg_fake->msg_flags = sock_flags_from_real(msg->msg_flags);
+    return 0;
+}
+
+// Sends or receives a batch on the host, with one call if the host has it.
+// wait_for_one is MSG_WAITFORONE, which only Linux has on the host.
+static int sock_batch_real(int sock_fd, struct sock_batch *batch, int real_flags, bool wait_for_one, bool send, struct timespec *timeout) {
+#if __linux__
+    if (wait_for_one)
+        real_flags |= MSG_WAITFORONE;
+    struct mmsghdr *msgs = malloc(batch->count * sizeof(struct mmsghdr));
+    if (msgs == NULL)
+        return _ENOMEM;
+    for (unsigned i = 0; i < batch->count; i++)
+        msgs[i] = (struct mmsghdr) {.msg_hdr = batch->msgs[i]};
+    int count = send ? sendmmsg(sock_fd, msgs, batch->count, real_flags) :
+        recvmmsg(sock_fd, msgs, batch->count, real_flags, timeout);
+    if (count < 0) {
+        count = errno_map();
+        free(msgs);
+        return count;
+    }
+    for (int i = 0; i < count; i++) {
+        batch->msgs[i] = msgs[i].msg_hdr;
+        batch->lens[i] = msgs[i].msg_len;
+    }
+    free(msgs);
+    return count;
+#else
+    struct timespec deadline;
+    if (timeout != NULL)
+        deadline = timespec_add(timespec_now(), *timeout);
+    unsigned count;
+    for (count = 0; count < batch->count; count++) {
+        ssize_t res = send ? sendmsg(sock_fd, &batch->msgs[count], real_flags) :
+            recvmsg(sock_fd, &batch->msgs[count], real_flags);
+        if (res < 0) {
+            if (count == 0)
+                return errno_map();
+            break;
+        }
+        batch->lens[count] = res;
+        if (wait_for_one)
+            real_flags |= MSG_DONTWAIT;
+        if (timeout != NULL && !timespec_positive(timespec_subtract(deadline, timespec_now())))
+            break;
+    }
+    return count;
+#endif
+}
+
+static dword_t sock_sendmmsg_real(struct fd *sock, struct msghdr_ *fake, addr_t lens_addr, unsigned count, dword_t flags) {
+    int real_flags = sock_flags_to_real(flags);
+    if (real_flags < 0)
+        return _EINVAL;
+    struct sock_batch batch;
+    int res = sock_batch_init(&batch, fake, count, true);
+    if (res >= 0)
+        res = sock_batch_real(sock->real_fd, &batch, real_flags, false, true, NULL);
+    if (res >= 0 && lens_addr == 0 && count == 1) {
+        res = batch.lens[0];
+    } else if (res >= 0) {
+        // msg_len in each mmsghdr
+        for (int i = 0; i < res; i++)
+            if (user_put(lens_addr + i * sizeof(struct mmsghdr_) + offsetof(struct mmsghdr_, msg_len), batch.lens[i]))
+                res = _EFAULT;
+    }
+    sock_batch_free(&batch);
+    return res;
+}
+
+static struct msghdr_ *mmsghdrs_read(addr_t msgvec_addr, struct mmsghdr_ **mmsgs_out, unsigned vlen) {
+    struct mmsghdr_ *mmsgs = malloc(vlen * sizeof(struct mmsghdr_) + 1);
+    struct msghdr_ *msgs = malloc(vlen * sizeof(struct msghdr_) + 1);
+    if (mmsgs == NULL || msgs == NULL)
+        goto nomem;
+    if (user_read(msgvec_addr, mmsgs, vlen * sizeof(struct mmsghdr_))) {
+        free(mmsgs);
+        free(msgs);
+        return ERR_PTR(_EFAULT);
+    }
+    for (unsigned i = 0; i < vlen; i++)
+        msgs[i] = mmsgs[i].msg_hdr;
+    *mmsgs_out = mmsgs;
+    return msgs;
+nomem:
+    free(mmsgs);
+    free(msgs);
+    return ERR_PTR(_ENOMEM);
+}
+
+dword_t sys_sendmmsg(fd_t sock_fd, addr_t msgvec_addr, uint_t vlen, dword_t flags) {
+    STRACE("sendmmsg(%d, 0x%x, %u, %#x)", sock_fd, msgvec_addr, vlen, flags);
+    struct fd *sock = sock_getfd(sock_fd);
+    if (sock == NULL)
+        return _EBADF;
+    if (vlen > UIO_MAXIOV_)
+        vlen = UIO_MAXIOV_;
+    if (vlen == 0)
+        return 0;
+    struct mmsghdr_ *mmsgs;
+    struct msghdr_ *msgs = mmsghdrs_read(msgvec_addr, &mmsgs, vlen);
+    if (IS_ERR(msgs))
+        return PTR_ERR(msgs);
+
+    dword_t res;
+    if (sock_is_unix(sock)) {
+        unsigned i;
+        for (i = 0; i < vlen; i++) {
+            res = unix_sendmsg_fake(sock, &msgs[i], flags);
+            if ((int) res < 0)
+                break;
+            if (user_put(msgvec_addr + i * sizeof(struct mmsghdr_) + offsetof(struct mmsghdr_, msg_len), res)) {
+                res = _EFAULT;
+                break;
+            }
+        }
+        if (i > 0)
+            res = i;
+    } else {
+        res = sock_sendmmsg_real(sock, msgs, msgvec_addr, vlen, flags);
+    }
+    free(mmsgs);
+    free(msgs);
+    return res;
+}
+
+dword_t sys_recvmmsg(fd_t sock_fd, addr_t msgvec_addr, uint_t vlen, dword_t flags, addr_t timeout_addr) {
+    STRACE("recvmmsg(%d, 0x%x, %u, %#x, 0x%x)", sock_fd, msgvec_addr, vlen, flags, timeout_addr);
+    struct fd *sock = sock_getfd(sock_fd);
+    if (sock == NULL)
+        return _EBADF;
+    if (vlen > UIO_MAXIOV_)
+        vlen = UIO_MAXIOV_;
+    if (vlen == 0)
+        return 0;
+    struct timespec timeout = {0};
+    if (timeout_addr != 0) {
+        struct timespec_ timeout_fake;
+        if (user_get(timeout_addr, timeout_fake))
+            return _EFAULT;
+        timeout.tv_sec = timeout_fake.sec;
+        timeout.tv_nsec = timeout_fake.nsec;
+    }
+    struct mmsghdr_ *mmsgs;
+    struct msghdr_ *msgs = mmsghdrs_read(msgvec_addr, &mmsgs, vlen);
+    if (IS_ERR(msgs))
+        return PTR_ERR(msgs);
+
+    int res;
+    if (sock_is_unix(sock)) {
+        // like Linux, the timeout is only checked after each message
+        struct timespec deadline = timespec_add(timespec_now(), timeout);
+        unsigned i;
+        for (i = 0; i < vlen; i++) {
+            addr_t mmsg_addr = msgvec_addr + i * sizeof(struct mmsghdr_);
+            res = unix_recvmsg_fake(sock, mmsg_addr, &msgs[i], flags);
+            if (res < 0)
+                break;
+            if (user_put(mmsg_addr + offsetof(struct mmsghdr_, msg_len), res)) {
+                res = _EFAULT;
+                break;
+            }
+            if (flags & MSG_WAITFORONE_)
+                flags |= MSG_DONTWAIT_;
+            if (timeout_addr != 0 && !timespec_positive(timespec_subtract(deadline, timespec_now()))) {
+                i++;
+                break;
+            }
+        }
+        if (i > 0)
+            res = i;
+    } else {
+        int real_flags = sock_flags_to_real(flags & ~MSG_WAITFORONE_);
+        if (real_flags < 0) {
+            res = _EINVAL;
+            goto out;
+        }
+        struct sock_batch batch;
+        res = sock_batch_init(&batch, msgs, vlen, false);
+        if (res >= 0)
+            res = sock_batch_real(sock->real_fd, &batch, real_flags, flags & MSG_WAITFORONE_, false, timeout_addr != 0 ? &timeout : NULL);
+        for (int i = 0; i < res; i++) {
+            int err = sock_batch_copyout(&batch, i);
+            mmsgs[i].msg_hdr = msgs[i];
+            mmsgs[i].msg_len = batch.lens[i];
+            if (err < 0)
+                res = err;
+        }
+        if (res > 0 && user_write(msgvec_addr, mmsgs, res * sizeof(struct mmsghdr_)))
+            res = _EFAULT;
+        sock_batch_free(&batch);
+    }
+out:
+    free(mmsgs);
+    free(msgs);
+    return res;
+}
+
 static int sock_close(struct fd *fd) {
     sockrestart_end_listen(fd);
     return realfs_close(fd);
@@ -539,11 +1186,11 @@ static struct socket_call {
     {(syscall_t) sys_shutdown, 2},
     {(syscall_t) sys_setsockopt, 5},
     {(syscall_t) sys_getsockopt, 5},
-    {NULL}, // sendmsg
+    {(syscall_t) sys_sendmsg, 3},
     {(syscall_t) sys_recvmsg, 3},
-    {NULL}, // accept4
-    {NULL}, // recvmmsg
-    {NULL}, // sendmmsg
+    {(syscall_t) sys_accept4, 4},
+    {(syscall_t) sys_recvmmsg, 5},
+    {(syscall_t) sys_sendmmsg, 4},
 };
 
 dword_t sys_socketcall(dword_t call_num, addr_t args_addr) {
@@ -34,6 +34,21 @@ struct iovec_ {
   uint_t iov_len;
 };
 
+struct mmsghdr_ {
+    struct msghdr_ msg_hdr;
+    uint_t msg_len;
+};
+#define UIO_MAXIOV_ 1024
+
+struct cmsghdr_ {
+    uint_t len;
+    int_t level;
+    int_t type;
+};
+#define CMSG_ALIGN_(len) (((len) + sizeof(uint_t) - 1) & ~(sizeof(uint_t) - 1))
+#define SCM_RIGHTS_ 1
+#define SCM_MAX_FD_ 253
+
 #define PF_LOCAL_ 1
 #define PF_INET_ 2
 #define PF_INET6_ 10
@@ -61,6 +76,7 @@ static inline int sock_family_from_real(int fake) {
 #define SOCK_STREAM_ 1
 #define SOCK_DGRAM_ 2
 #define SOCK_RAW_ 3
+#define SOCK_SEQPACKET_ 5
 #define SOCK_NONBLOCK_ 0x800
 #define SOCK_CLOEXEC_ 0x80000
 
@@ -89,6 +105,9 @@ static inline int sock_type_to_real(int type, int protocol) {
 #define MSG_DONTWAIT_ 0x40
 #define MSG_EOR_    0x80
 #define MSG_WAITALL_ 0x100
+#define MSG_NOSIGNAL_ 0x4000
+#define MSG_WAITFORONE_ 0x10000
+#define MSG_CMSG_CLOEXEC_ 0x40000000
 
 static inline int sock_flags_to_real(int fake) {
     int real = 0;
@@ -125,6 +144,12 @@ static inline int sock_flags_from_real(int real) {
 #define SO_BROADCAST_ 6
 #define SO_KEEPALIVE_ 9
 #define SO_SNDBUF_ 7
+#define SO_RCVBUF_ 8
+#define SO_PASSCRED_ 16
+#define SO_PEERCRED_ 17
+#define SO_ACCEPTCONN_ 30
+#define SO_PROTOCOL_ 38
+#define SO_DOMAIN_ 39
 #define IP_TOS_ 1
 #define IP_TTL_ 2
 #define IP_HDRINCL_ 3
@@ -29,9 +29,11 @@ void sockrestart_end_listen(struct fd *sock) {
 
 static struct list listen_tasks = LIST_INITIALIZER(listen_tasks);
 
-void sockrestart_begin_listen_wait(struct fd *sock) {
-    if (sock->ops != &socket_fdops)
-        return;
+bool sockrestart_is_socket(struct fd *fd) {
+    return fd->ops == &socket_fdops;
+}
+
+void sockrestart_begin_wait() {
     lock(&sockrestart_lock);
     if (current->sockrestart.count == 0)
         list_add(&listen_tasks, &current->sockrestart.listen);
@@ -39,9 +41,7 @@ void sockrestart_begin_listen_wait(struct fd *sock) {
     unlock(&sockrestart_lock);
 }
 
-void sockrestart_end_listen_wait(struct fd *sock) {
-    if (sock->ops != &socket_fdops)
-        return;
+void sockrestart_end_wait() {
     lock(&sockrestart_lock);
     current->sockrestart.count--;
     if (current->sockrestart.count == 0)
@@ -49,6 +49,16 @@ void sockrestart_end_listen_wait(struct fd *sock) {
     unlock(&sockrestart_lock);
 }
 
+void sockrestart_begin_listen_wait(struct fd *sock) {
+    if (sockrestart_is_socket(sock))
+        sockrestart_begin_wait();
+}
+
+void sockrestart_end_listen_wait(struct fd *sock) {
+    if (sockrestart_is_socket(sock))
+        sockrestart_end_wait();
+}
+
 bool sockrestart_should_restart_listen_wait() {
     lock(&sockrestart_lock);
     bool punt = current->sockrestart.punt;
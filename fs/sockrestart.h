@@ -20,6 +20,10 @@ void sockrestart_begin_listen(struct fd *sock);
 void sockrestart_end_listen(struct fd *sock);
 void sockrestart_begin_listen_wait(struct fd *sock);
 void sockrestart_end_listen_wait(struct fd *sock);
+// for waiting on many fds at once, check with sockrestart_is_socket ahead of time
+bool sockrestart_is_socket(struct fd *fd);
+void sockrestart_begin_wait(void);
+void sockrestart_end_wait(void);
 bool sockrestart_should_restart_listen_wait(void);
 void sockrestart_on_suspend(void);
 void sockrestart_on_resume(void);
@@ -0,0 +1,1108 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "kernel/calls.h"
+#include "kernel/errno.h"
+#include "kernel/fs.h"
+#include "kernel/task.h"
+#include "fs/dev.h"
+#include "fs/fd.h"
+#include "util/list.h"
+
+// An in-memory filesystem, for /tmp and friends.
+//
+// Everything is protected by the one lock in struct tmpfs. Directory entries
+// live in a hash table keyed by parent and name, and each directory also keeps
+// a list of its entries in creation order for readdir. File data is kept in
+// anonymous shared memory (a memfd on linux) that's mapped once for read and
+// write, and mapped again straight into the process for mmap, so nothing is
+// copied and nothing touches the host disk.
+//
+// Mount options are size=, nr_inodes= and mode=, like linux. size takes a k,
+// m, g or % suffix, and defaults to half of physical memory.
+
+#define TMPFS_MAGIC 0x01021994
+
+#define UTIME_NOW_ ((1l << 30) - 1)
+#define UTIME_OMIT_ ((1l << 30) - 2)
+
+struct tmp_inode {
+    ino_t number;
+    mode_t_ mode;
+    uid_t_ uid;
+    uid_t_ gid;
+    dev_t_ rdev;
+    unsigned nlink;
+    unsigned refcount; // open fds
+    struct timespec atime;
+    struct timespec mtime;
+    struct timespec ctime;
+    // one of the entries linking here, for getpath
+    struct tmp_dirent *dirent;
+
+    // directories
+    struct list children;
+    unsigned long next_cookie;
+    // regular files, data is mapped from data_fd, which is capacity bytes
+    // or mapped bytes, whichever is more
+    int data_fd;
+    char *data;
+    size_t size;
+    size_t capacity;
+    // the furthest into data_fd that a process has mapped. the host would
+    // SIGBUS on a page past the end of data_fd, and there's no telling when
+    // the guest unmaps, so data_fd never gets shorter than this.
+    size_t mapped;
+    // symlinks
+    char *target;
+
+    // flock state
+    unsigned flock_shared;
+    bool flock_exclusive;
+};
+
+struct tmp_dirent {
+    struct list chain;
+    struct list siblings;
+    struct tmp_inode *parent;
+    struct tmp_inode *inode;
+    // readdir offset, cookies 0 and 1 are . and ..
+    unsigned long cookie;
+    char name[];
+};
+
+struct tmpfs {
+    lock_t lock;
+    cond_t flock_cond;
+    struct tmp_inode *root;
+    ino_t next_inode;
+    int minor;
+
+    struct list *dirents;
+    size_t dirents_size;
+    size_t dirents_count;
+
+    size_t size_max;
+    size_t size_used;
+    unsigned long inodes_max;
+    unsigned long inodes_used;
+};
+
+static struct timespec tmp_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now;
+}
+
+static size_t round_up_real_page(size_t size) {
+    return (size + real_page_size - 1) / real_page_size * real_page_size;
+}
+
+// inodes
+
+static struct tmp_inode *inode_new(struct tmpfs *tmp, mode_t_ mode) {
+    if (tmp->inodes_used >= tmp->inodes_max)
+        return ERR_PTR(_ENOSPC);
+    struct tmp_inode *inode = calloc(1, sizeof(struct tmp_inode));
+    if (inode == NULL)
+        return ERR_PTR(_ENOMEM);
+    inode->number = tmp->next_inode++;
+    inode->mode = mode;
+    inode->uid = current ? current->euid : 0;
+    inode->gid = current ? current->egid : 0;
+    inode->atime = inode->mtime = inode->ctime = tmp_now();
+    inode->data_fd = -1;
+    if (S_ISDIR(mode)) {
+        list_init(&inode->children);
+        inode->next_cookie = 2;
+        inode->nlink = 1; // .
+    }
+    tmp->inodes_used++;
+    return inode;
+}
+
+static void inode_put(struct tmpfs *tmp, struct tmp_inode *inode) {
+    if (inode->nlink != 0 || inode->refcount != 0)
+        return;
+    if (inode->data != NULL)
+        munmap(inode->data, inode->capacity);
+    if (inode->data_fd >= 0)
+        close(inode->data_fd);
+    tmp->size_used -= inode->capacity;
+    if (inode->target != NULL) {
+        tmp->size_used -= strlen(inode->target);
+        free(inode->target);
+    }
+    tmp->inodes_used--;
+    free(inode);
+}
+
+// directory entries
+
+static struct list *dirent_bucket(struct tmpfs *tmp, struct tmp_inode *parent, const char *name, size_t len) {
+    uint32_t hash = 2166136261u ^ (uint32_t) parent->number;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    return &tmp->dirents[hash & (tmp->dirents_size - 1)];
+}
+
+static struct tmp_dirent *dirent_find(struct tmpfs *tmp, struct tmp_inode *parent, const char *name, size_t len) {
+    struct tmp_dirent *dirent;
+    list_for_each_entry(dirent_bucket(tmp, parent, name, len), dirent, chain) {
+        if (dirent->parent == parent && strncmp(dirent->name, name, len) == 0 && dirent->name[len] == '\0')
+            return dirent;
+    }
+    return NULL;
+}
+
+static void dirents_grow(struct tmpfs *tmp) {
+    size_t old_size = tmp->dirents_size;
+    struct list *old = tmp->dirents;
+    struct list *dirents = malloc(old_size * 2 * sizeof(struct list));
+    if (dirents == NULL)
+        return;
+    for (size_t i = 0; i < old_size * 2; i++)
+        list_init(&dirents[i]);
+    tmp->dirents = dirents;
+    tmp->dirents_size = old_size * 2;
+    for (size_t i = 0; i < old_size; i++) {
+        struct tmp_dirent *dirent, *tmp_dirent;
+        list_for_each_entry_safe(&old[i], dirent, tmp_dirent, chain) {
+            list_remove(&dirent->chain);
+            list_add(dirent_bucket(tmp, dirent->parent, dirent->name, strlen(dirent->name)), &dirent->chain);
+        }
+    }
+    free(old);
+}
+
+static int dirent_add(struct tmpfs *tmp, struct tmp_inode *parent, const char *name, struct tmp_inode *inode) {
+    struct tmp_dirent *dirent = malloc(sizeof(struct tmp_dirent) + strlen(name) + 1);
+    if (dirent == NULL)
+        return _ENOMEM;
+    strcpy(dirent->name, name);
+    dirent->parent = parent;
+    dirent->inode = inode;
+    dirent->cookie = parent->next_cookie++;
+    if (tmp->dirents_count >= tmp->dirents_size)
+        dirents_grow(tmp);
+    list_add(dirent_bucket(tmp, parent, name, strlen(name)), &dirent->chain);
+    list_add_before(&parent->children, &dirent->siblings);
+    tmp->dirents_count++;
+
+    inode->nlink++;
+    inode->dirent = dirent;
+    if (S_ISDIR(inode->mode))
+        parent->nlink++; // ..
+    parent->mtime = parent->ctime = inode->ctime = tmp_now();
+    return 0;
+}
+
+// the caller must inode_put the inode afterwards
+static void dirent_remove(struct tmpfs *tmp, struct tmp_dirent *dirent) {
+    struct tmp_inode *inode = dirent->inode;
+    struct tmp_inode *parent = dirent->parent;
+    list_remove(&dirent->chain);
+    list_remove(&dirent->siblings);
+    tmp->dirents_count--;
+    inode->nlink--;
+    if (inode->dirent == dirent)
+        inode->dirent = NULL;
+    if (S_ISDIR(inode->mode))
+        parent->nlink--;
+    parent->mtime = parent->ctime = inode->ctime = tmp_now();
+    free(dirent);
+}
+
+// path lookup, paths are normalized and relative to the mount
+
+static int lookup_parent(struct tmpfs *tmp, const char *path, struct tmp_inode **parent_out, const char **name_out) {
+    struct tmp_inode *dir = tmp->root;
+    assert(*path == '/');
+    path++;
+    const char *slash;
+    while ((slash = strchr(path, '/')) != NULL) {
+        if (slash - path > NAME_MAX)
+            return _ENAMETOOLONG;
+        struct tmp_dirent *dirent = dirent_find(tmp, dir, path, slash - path);
+        if (dirent == NULL)
+            return _ENOENT;
+        dir = dirent->inode;
+        if (!S_ISDIR(dir->mode))
+            return _ENOTDIR;
+        path = slash + 1;
+    }
+    if (strlen(path) > NAME_MAX)
+        return _ENAMETOOLONG;
+    *parent_out = dir;
+    *name_out = path;
+    return 0;
+}
+
+static struct tmp_dirent *lookup_dirent(struct tmpfs *tmp, const char *path) {
+    struct tmp_inode *parent;
+    const char *name;
+    int err = lookup_parent(tmp, path, &parent, &name);
+    if (err < 0)
+        return ERR_PTR(err);
+    struct tmp_dirent *dirent = dirent_find(tmp, parent, name, strlen(name));
+    if (dirent == NULL)
+        return ERR_PTR(_ENOENT);
+    return dirent;
+}
+
+static struct tmp_inode *lookup(struct tmpfs *tmp, const char *path) {
+    if (*path == '\0')
+        return tmp->root;
+    struct tmp_dirent *dirent = lookup_dirent(tmp, path);
+    if (IS_ERR(dirent))
+        return (struct tmp_inode *) dirent;
+    return dirent->inode;
+}
+
+// creates an inode at path, which must not exist yet
+static struct tmp_inode *create(struct tmpfs *tmp, const char *path, mode_t_ mode) {
+    if (*path == '\0')
+        return ERR_PTR(_EEXIST);
+    struct tmp_inode *parent;
+    const char *name;
+    int err = lookup_parent(tmp, path, &parent, &name);
+    if (err < 0)
+        return ERR_PTR(err);
+    if (dirent_find(tmp, parent, name, strlen(name)) != NULL)
+        return ERR_PTR(_EEXIST);
+    struct tmp_inode *inode = inode_new(tmp, mode);
+    if (IS_ERR(inode))
+        return inode;
+    err = dirent_add(tmp, parent, name, inode);
+    if (err < 0) {
+        inode->nlink = 0;
+        inode_put(tmp, inode);
+        return ERR_PTR(err);
+    }
+    return inode;
+}
+
+// file data
+
+static int data_fd_new() {
+#if defined(__linux__)
+    return memfd_create("ish-tmpfs", MFD_CLOEXEC);
+#else
+    // no memfd, so an unlinked file in the host's temporary directory will
+    // have to do. on iOS that's in the app's container, since /tmp is outside
+    // the sandbox.
+    const char *dir = getenv("TMPDIR");
+#ifdef _CS_DARWIN_USER_TEMP_DIR
+    char user_dir[PATH_MAX];
+    size_t len = confstr(_CS_DARWIN_USER_TEMP_DIR, user_dir, sizeof(user_dir));
+    if (len != 0 && len <= sizeof(user_dir))
+        dir = user_dir;
+#endif
+    if (dir == NULL || dir[0] == '\0')
+        dir = "/tmp";
+    char name[PATH_MAX];
+    const char *slash = dir[strlen(dir) - 1] == '/' ? "" : "/";
+    if (snprintf(name, sizeof(name), "%s%sish-tmpfs-XXXXXX", dir, slash) >= (int) sizeof(name)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = mkstemp(name);
+    if (fd >= 0)
+        unlink(name);
+    return fd;
+#endif
+}
+
+static size_t data_backing(struct tmp_inode *inode, size_t capacity) {
+    return capacity > inode->mapped ? capacity : inode->mapped;
+}
+
+// changes the capacity, keeping the old mapping until the new one works
+static int data_resize(struct tmpfs *tmp, struct tmp_inode *inode, size_t capacity) {
+    if (inode->data_fd < 0) {
+        inode->data_fd = data_fd_new();
+        if (inode->data_fd < 0)
+            return errno_map();
+    }
+    size_t old_backing = data_backing(inode, inode->capacity);
+    size_t backing = data_backing(inode, capacity);
+    if (backing > old_backing && ftruncate(inode->data_fd, backing) < 0)
+        return errno_map();
+    char *data = NULL;
+    if (capacity != 0) {
+        data = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, inode->data_fd, 0);
+        if (data == MAP_FAILED) {
+            int err = errno_map();
+            if (backing > old_backing)
+                ftruncate(inode->data_fd, old_backing);
+            return err;
+        }
+    }
+    if (capacity < inode->capacity && backing > capacity) {
+        // still mapped, so instead of truncating, drop the contents the way
+        // truncating would have
+#ifdef FALLOC_FL_PUNCH_HOLE
+        fallocate(inode->data_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                capacity, inode->capacity - capacity);
+#else
+        memset(inode->data + capacity, 0, inode->capacity - capacity);
+#endif
+    }
+    if (inode->data != NULL)
+        munmap(inode->data, inode->capacity);
+    if (backing < old_backing)
+        ftruncate(inode->data_fd, backing);
+    inode->data = data;
+    tmp->size_used = tmp->size_used - inode->capacity + capacity;
+    inode->capacity = capacity;
+    return 0;
+}
+
+static int data_reserve(struct tmpfs *tmp, struct tmp_inode *inode, size_t size) {
+    if (size <= inode->capacity)
+        return 0;
+    size_t needed = round_up_real_page(size);
+    size_t capacity = inode->capacity ? inode->capacity * 2 : needed;
+    if (capacity < needed)
+        capacity = needed;
+    if (tmp->size_used - inode->capacity + capacity > tmp->size_max)
+        capacity = needed;
+    if (tmp->size_used - inode->capacity + capacity > tmp->size_max)
+        return _ENOSPC;
+    return data_resize(tmp, inode, capacity);
+}
+
+static int data_truncate(struct tmpfs *tmp, struct tmp_inode *inode, size_t size) {
+    if (size > inode->size) {
+        int err = data_reserve(tmp, inode, size);
+        if (err < 0)
+            return err;
+        // the space past the end may have been written through a mapping
+        memset(inode->data + inode->size, 0, size - inode->size);
+    } else if (round_up_real_page(size) < inode->capacity) {
+        int err = data_resize(tmp, inode, round_up_real_page(size));
+        if (err < 0)
+            return err;
+    }
+    inode->size = size;
+    inode->mtime = inode->ctime = tmp_now();
+    return 0;
+}
+
+// fs operations
+
+extern const struct fd_ops tmpfs_fdops;
+
+static struct fd *tmp_fd_create(struct tmp_inode *inode) {
+    struct fd *fd = fd_create(&tmpfs_fdops);
+    if (fd == NULL)
+        return ERR_PTR(_ENOMEM);
+    fd->tmp_inode = inode;
+    fd->tmp_flock = 0;
+    inode->refcount++;
+    return fd;
+}
+
+static struct fd *tmpfs_open(struct mount *mount, const char *path, int flags, int mode) {
+    struct tmpfs *tmp = mount->data;
+    lock(&tmp->lock);
+    struct tmp_inode *inode = lookup(tmp, path);
+    if (inode == ERR_PTR(_ENOENT) && flags & O_CREAT_)
+        inode = create(tmp, path, S_IFREG | (mode & ~S_IFMT));
+    else if (!IS_ERR(inode) && flags & O_CREAT_ && flags & O_EXCL_)
+        inode = ERR_PTR(_EEXIST);
+    if (IS_ERR(inode)) {
+        unlock(&tmp->lock);
+        return (struct fd *) inode;
+    }
+    if (S_ISFIFO(inode->mode) || S_ISSOCK(inode->mode)) {
+        unlock(&tmp->lock);
+        return ERR_PTR(_ENXIO);
+    }
+    if (S_ISREG(inode->mode) && flags & O_TRUNC_ && flags & (O_WRONLY_ | O_RDWR_)) {
+        int err = data_truncate(tmp, inode, 0);
+        if (err < 0) {
+            unlock(&tmp->lock);
+            return ERR_PTR(err);
+        }
+    }
+    struct fd *fd = tmp_fd_create(inode);
+    unlock(&tmp->lock);
+    return fd;
+}
+
+static ssize_t tmpfs_readlink(struct mount *mount, const char *path, char *buf, size_t bufsize) {
+    struct tmpfs *tmp = mount->data;
+    lock(&tmp->lock);
+    struct tmp_inode *inode = lookup(tmp, path);
+    ssize_t res;
+    if (IS_ERR(inode)) {
+        res = PTR_ERR(inode);
+    } else if (!S_ISLNK(inode->mode)) {
+        res = _EINVAL;
+    } else {
+        res = strlen(inode->target);
+        if ((size_t) res > bufsize)
+            res = bufsize;
+        memcpy(buf, inode->target, res);
+    }
+    unlock(&tmp->lock);
+    return res;
+}
+
+static int tmpfs_link(struct mount *mount, const char *src, const char *dst) {
+    struct tmpfs *tmp = mount->data;
+    lock(&tmp->lock);
+    int err;
+    struct tmp_inode *inode = lookup(tmp, src);
+    struct tmp_inode *parent;
+    const char *name;
+    if (IS_ERR(inode))
+        err = PTR_ERR(inode);
+    else if (S_ISDIR(inode->mode))
+        err = _EPERM;
+    else if (*dst == '\0')
+        err = _EEXIST;
+    else if ((err = lookup_parent(tmp, dst, &parent, &name)) < 0)
+        ;
+    else if (dirent_find(tmp, parent, name, strlen(name)) != NULL)
+        err = _EEXIST;
+    else
+        err = dirent_add(tmp, parent, name, inode);
+    unlock(&tmp->lock);
+    return err;
+}
+
+static int tmpfs_unlink(struct mount *mount, const char *path) {
+    struct tmpfs *tmp = mount->data;
+    lock(&tmp->lock);
+    int err = 0;
+    struct tmp_dirent *dirent = *path == '\0' ? ERR_PTR(_EISDIR) : lookup_dirent(tmp, path);
+    if (IS_ERR(dirent)) {
+        err = PTR_ERR(dirent);
+    } else if (S_ISDIR(dirent->inode->mode)) {
+        err = _EISDIR;
+    } else {
+        struct tmp_inode *inode = dirent->inode;
+        dirent_remove(tmp, dirent);
+        inode_put(tmp, inode);
+    }
+    unlock(&tmp->lock);
+    return err;
+}
+
+static int tmpfs_rmdir(struct mount *mount, const char *path) {
+    struct tmpfs *tmp = mount->data;
+    lock(&tmp->lock);
+    int err = 0;
+    struct tmp_dirent *dirent = *path == '\0' ? ERR_PTR(_EBUSY) : lookup_dirent(tmp, path);
+    if (IS_ERR(dirent)) {
+        err = PTR_ERR(dirent);
+    } else if (!S_ISDIR(dirent->inode->mode)) {
+        err = _ENOTDIR;
+    } else if (!list_empty(&dirent->inode->children)) {
+        err = _ENOTEMPTY;
+    } else {
+        struct tmp_inode *inode = dirent->inode;
+        dirent_remove(tmp, dirent);
+        inode->nlink--; // .
+        inode_put(tmp, inode);
+    }
+    unlock(&tmp->lock);
+    return err;
+}
+
+static int tmpfs_rename(struct mount *mount, const char *src, const char *dst) {
+    struct tmpfs *tmp = mount->data;
+    lock(&tmp->lock);
+    int err = 0;
+    struct tmp_inode *dst_parent;
+    const char *dst_name;
+    struct tmp_dirent *src_dirent = *src == '\0' ? ERR_PTR(_EBUSY) : lookup_dirent(tmp, src);
+    if (IS_ERR(src_dirent)) {
+        err = PTR_ERR(src_dirent);
+        goto out;
+    }
+    if (*dst == '\0') {
+        err = _EBUSY;
+        goto out;
+    }
+    err = lookup_parent(tmp, dst, &dst_parent, &dst_name);
+    if (err < 0)
+        goto out;
+    struct tmp_inode *inode = src_dirent->inode;
+
+    if (S_ISDIR(inode->mode)) {
+        // can't move a directory into itself
+        for (struct tmp_inode *dir = dst_parent; dir != tmp->root; dir = dir->dirent->parent) {
+            if (dir == inode) {
+                err = _EINVAL;
+                goto out;
+            }
+        }
+    }
+
+    struct tmp_dirent *dst_dirent = dirent_find(tmp, dst_parent, dst_name, strlen(dst_name));
+    if (dst_dirent != NULL) {
+        struct tmp_inode *dst_inode = dst_dirent->inode;
+        if (dst_inode == inode)
+            goto out;
+        if (S_ISDIR(inode->mode) && !S_ISDIR(dst_inode->mode)) {
+            err = _ENOTDIR;
+            goto out;
+        }
+        if (!S_ISDIR(inode->mode) && S_ISDIR(dst_inode->mode)) {
+            err = _EISDIR;
+            goto out;
+        }
+        if (S_ISDIR(dst_inode->mode) && !list_empty(&dst_inode->children)) {
+            err = _ENOTEMPTY;
+            goto out;
+        }
+        dirent_remove(tmp, dst_dirent);
+        if (S_ISDIR(dst_inode->mode))
+            dst_inode->nlink--; // .
+        inode_put(tmp, dst_inode);
+    }
+
+    err = dirent_add(tmp, dst_parent, dst_name, inode);
+    if (err < 0)
+        goto out;
+    dirent_remove(tmp, src_dirent);
+
+out:
+    unlock(&tmp->lock);
+    return err;
+}
+
+static int tmpfs_symlink(struct mount *mount, const char *target, const char *link) {
+    struct tmpfs *tmp = mount->data;
+    size_t len = strlen(target);
+    char *target_copy = strdup(target);
+    if (target_copy == NULL)
+        return _ENOMEM;
+    lock(&tmp->lock);
+    int err = 0;
+    struct tmp_inode *inode;
+    if (tmp->size_used + len > tmp->size_max) {
+        err = _ENOSPC;
+    } else if (IS_ERR(inode = create(tmp, link, S_IFLNK | 0777))) {
+        err = PTR_ERR(inode);
+    } else {
+        inode->target = target_copy;
+        inode->size = len;
+        tmp->size_used += len;
+        target_copy = NULL;
+    }
+    unlock(&tmp->lock);
+    free(target_copy);
+    return err;
+}
+
+static int tmpfs_mknod(struct mount *mount, const char *path, mode_t_ mode, dev_t_ dev) {
+    if ((mode & S_IFMT) == 0)
+        mode |= S_IFREG;
+    if (!S_ISREG(mode) && !S_ISCHR(mode) && !S_ISBLK(mode) && !S_ISFIFO(mode) && !S_ISSOCK(mode))
+        return _EINVAL;
+    struct tmpfs *tmp = mount->data;
+    lock(&tmp->lock);
+    struct tmp_inode *inode = create(tmp, path, mode);
+    if (!IS_ERR(inode) && (S_ISCHR(mode) || S_ISBLK(mode)))
+        inode->rdev = dev;
+    unlock(&tmp->lock);
+    return IS_ERR(inode) ? PTR_ERR(inode) : 0;
+}
+
+static int tmpfs_mkdir(struct mount *mount, const char *path, mode_t_ mode) {
+    struct tmpfs *tmp = mount->data;
+    lock(&tmp->lock);
+    struct tmp_inode *inode = create(tmp, path, S_IFDIR | (mode & ~S_IFMT));
+    unlock(&tmp->lock);
+    return IS_ERR(inode) ? PTR_ERR(inode) : 0;
+}
+
+static void flock_release(struct tmpfs *tmp, struct fd *fd) {
+    struct tmp_inode *inode = fd->tmp_inode;
+    if (fd->tmp_flock == LOCK_SH_)
+        inode->flock_shared--;
+    else if (fd->tmp_flock == LOCK_EX_)
+        inode->flock_exclusive = false;
+    if (fd->tmp_flock != 0)
+        notify(&tmp->flock_cond);
+    fd->tmp_flock = 0;
+}
+
+static int tmpfs_close(struct fd *fd) {
+    struct tmpfs *tmp = fd->mount->data;
+    lock(&tmp->lock);
+    flock_release(tmp, fd);
+    fd->tmp_inode->refcount--;
+    inode_put(tmp, fd->tmp_inode);
+    unlock(&tmp->lock);
+    return 0;
+}
+
+static void tmp_stat(struct tmpfs *tmp, struct tmp_inode *inode, struct statbuf *stat) {
+    *stat = (struct statbuf) {};
+    stat->dev = dev_make(0, tmp->minor);
+    stat->inode = inode->number;
+    stat->mode = inode->mode;
+    stat->nlink = inode->nlink;
+    stat->uid = inode->uid;
+    stat->gid = inode->gid;
+    stat->rdev = inode->rdev;
+    stat->size = S_ISDIR(inode->mode) ? PAGE_SIZE : inode->size;
+    stat->blksize = PAGE_SIZE;
+    stat->blocks = inode->capacity / 512;
+    stat->atime = inode->atime.tv_sec;
+    stat->atime_nsec = inode->atime.tv_nsec;
+    stat->mtime = inode->mtime.tv_sec;
+    stat->mtime_nsec = inode->mtime.tv_nsec;
+    stat->ctime = inode->ctime.tv_sec;
+    stat->ctime_nsec = inode->ctime.tv_nsec;
+}
+
+static int tmpfs_stat(struct mount *mount, const char *path, struct statbuf *stat, bool UNUSED(follow_links)) {
+    struct tmpfs *tmp = mount->data;
+    lock(&tmp->lock);
+    struct tmp_inode *inode = lookup(tmp, path);
+    if (!IS_ERR(inode))
+        tmp_stat(tmp, inode, stat);
+    unlock(&tmp->lock);
+    return IS_ERR(inode) ? PTR_ERR(inode) : 0;
+}
+
+static int tmpfs_fstat(struct fd *fd, struct statbuf *stat) {
+    struct tmpfs *tmp = fd->mount->data;
+    lock(&tmp->lock);
+    tmp_stat(tmp, fd->tmp_inode, stat);
+    unlock(&tmp->lock);
+    return 0;
+}
+
+static int tmp_setattr(struct tmpfs *tmp, struct tmp_inode *inode, struct attr attr) {
+    switch (attr.type) {
+        case attr_uid:
+            inode->uid = attr.uid;
+            break;
+        case attr_gid:
+            inode->gid = attr.gid;
+            break;
+        case attr_mode:
+            inode->mode = (inode->mode & S_IFMT) | (attr.mode & ~S_IFMT);
+            break;
+        case attr_size:
+            if (S_ISDIR(inode->mode))
+                return _EISDIR;
+            if (!S_ISREG(inode->mode))
+                return _EINVAL;
+            if (attr.size < 0)
+                return _EINVAL;
+            return data_truncate(tmp, inode, attr.size);
+    }
+    inode->ctime = tmp_now();
+    return 0;
+}
+
+static int tmpfs_setattr(struct mount *mount, const char *path, struct attr attr) {
+    struct tmpfs *tmp = mount->data;
+    lock(&tmp->lock);
+    struct tmp_inode *inode = lookup(tmp, path);
+    int err = IS_ERR(inode) ? PTR_ERR(inode) : tmp_setattr(tmp, inode, attr);
+    unlock(&tmp->lock);
+    return err;
+}
+
+static int tmpfs_fsetattr(struct fd *fd, struct attr attr) {
+    struct tmpfs *tmp = fd->mount->data;
+    lock(&tmp->lock);
+    int err = tmp_setattr(tmp, fd->tmp_inode, attr);
+    unlock(&tmp->lock);
+    return err;
+}
+
+static void set_time(struct timespec *time, struct timespec new_time, struct timespec now) {
+    if (new_time.tv_nsec == UTIME_OMIT_)
+        return;
+    *time = new_time.tv_nsec == UTIME_NOW_ ? now : new_time;
+}
+
+static int tmpfs_utime(struct mount *mount, const char *path, struct timespec atime, struct timespec mtime) {
+    struct tmpfs *tmp = mount->data;
+    lock(&tmp->lock);
+    struct tmp_inode *inode = lookup(tmp, path);
+    if (!IS_ERR(inode)) {
+        struct timespec now = tmp_now();
+        set_time(&inode->atime, atime, now);
+        set_time(&inode->mtime, mtime, now);
+        inode->ctime = now;
+    }
+    unlock(&tmp->lock);
+    return IS_ERR(inode) ? PTR_ERR(inode) : 0;
+}
+
+static int tmpfs_getpath(struct fd *fd, char *buf) {
+    struct tmpfs *tmp = fd->mount->data;
+    lock(&tmp->lock);
+    char *p = buf + MAX_PATH - 1;
+    *p = '\0';
+    int err = 0;
+    for (struct tmp_inode *inode = fd->tmp_inode; inode != tmp->root; inode = inode->dirent->parent) {
+        if (inode->dirent == NULL) {
+            // unlinked
+            err = _ENOENT;
+            break;
+        }
+        size_t len = strlen(inode->dirent->name);
+        if ((size_t) (p - buf) < len + 1) {
+            err = _ENAMETOOLONG;
+            break;
+        }
+        p -= len;
+        memcpy(p, inode->dirent->name, len);
+        *--p = '/';
+    }
+    unlock(&tmp->lock);
+    if (err < 0)
+        return err;
+    memmove(buf, p, buf + MAX_PATH - p);
+    return 0;
+}
+
+static int tmpfs_flock(struct fd *fd, int operation) {
+    struct tmpfs *tmp = fd->mount->data;
+    struct tmp_inode *inode = fd->tmp_inode;
+    lock(&tmp->lock);
+    int err = 0;
+    // converting a lock drops the old one first, like linux
+    flock_release(tmp, fd);
+    if (operation & LOCK_UN_)
+        goto out;
+    int type = operation & LOCK_EX_ ? LOCK_EX_ : LOCK_SH_;
+    while (inode->flock_exclusive || (type == LOCK_EX_ && inode->flock_shared > 0)) {
+        if (operation & LOCK_NB_) {
+            err = _EAGAIN;
+            goto out;
+        }
+        err = wait_for(&tmp->flock_cond, &tmp->lock, NULL);
+        if (err < 0)
+            goto out;
+    }
+    if (type == LOCK_EX_)
+        inode->flock_exclusive = true;
+    else
+        inode->flock_shared++;
+    fd->tmp_flock = type;
+out:
+    unlock(&tmp->lock);
+    return err;
+}
+
+static int tmpfs_statfs(struct mount *mount, struct statfsbuf *stat) {
+    struct tmpfs *tmp = mount->data;
+    lock(&tmp->lock);
+    stat->type = TMPFS_MAGIC;
+    stat->bsize = PAGE_SIZE;
+    stat->frsize = PAGE_SIZE;
+    stat->blocks = tmp->size_max / PAGE_SIZE;
+    stat->bfree = stat->bavail = (tmp->size_max - tmp->size_used) / PAGE_SIZE;
+    stat->files = tmp->inodes_max;
+    stat->ffree = tmp->inodes_max - tmp->inodes_used;
+    stat->namelen = NAME_MAX;
+    unlock(&tmp->lock);
+    return 0;
+}
+
+static int parse_options(struct tmpfs *tmp, const char *options, mode_t_ *root_mode) {
+    size_t memory = (size_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    tmp->size_max = memory / 2;
+    tmp->inodes_max = memory / PAGE_SIZE / 2;
+    if (options == NULL)
+        return 0;
+
+    char *copy = strdup(options);
+    if (copy == NULL)
+        return _ENOMEM;
+    int err = 0;
+    char *saveptr;
+    for (char *option = strtok_r(copy, ",", &saveptr); option != NULL; option = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(option, '=');
+        if (value == NULL) {
+            err = _EINVAL;
+            break;
+        }
+        *value++ = '\0';
+        char *end;
+        unsigned long long n = strtoull(value, &end, strcmp(option, "mode") == 0 ? 8 : 10);
+        if (end == value) {
+            err = _EINVAL;
+            break;
+        }
+        if (strcmp(option, "size") == 0) {
+            switch (*end) {
+                case 'g': case 'G': n <<= 10; // fallthrough
+                case 'm': case 'M': n <<= 10; // fallthrough
+                case 'k': case 'K': n <<= 10; end++; break;
+                case '%': n = memory / 100 * n; end++; break;
+            }
+            tmp->size_max = n;
+        } else if (strcmp(option, "nr_inodes") == 0) {
+            tmp->inodes_max = n;
+        } else if (strcmp(option, "mode") == 0) {
+            *root_mode = n & 07777;
+        } else {
+            end = NULL;
+        }
+        if (end == NULL || *end != '\0') {
+            err = _EINVAL;
+            break;
+        }
+    }
+    free(copy);
+    return err;
+}
+
+static int tmpfs_mount(struct mount *mount) {
+    static int next_minor = 0;
+    struct tmpfs *tmp = calloc(1, sizeof(struct tmpfs));
+    if (tmp == NULL)
+        return _ENOMEM;
+    mode_t_ root_mode = 01777;
+    int err = parse_options(tmp, mount->options, &root_mode);
+    if (err < 0) {
+        free(tmp);
+        return err;
+    }
+    lock_init(&tmp->lock);
+    cond_init(&tmp->flock_cond);
+    tmp->next_inode = 1;
+    tmp->minor = __atomic_add_fetch(&next_minor, 1, __ATOMIC_SEQ_CST);
+    tmp->dirents_size = 256;
+    tmp->dirents = malloc(tmp->dirents_size * sizeof(struct list));
+    if (tmp->dirents == NULL) {
+        free(tmp);
+        return _ENOMEM;
+    }
+    for (size_t i = 0; i < tmp->dirents_size; i++)
+        list_init(&tmp->dirents[i]);
+    tmp->root = inode_new(tmp, S_IFDIR | root_mode);
+    if (IS_ERR(tmp->root)) {
+        err = PTR_ERR(tmp->root);
+        free(tmp->dirents);
+        free(tmp);
+        return err;
+    }
+    tmp->root->nlink++; // the mount point
+    mount->data = tmp;
+    return 0;
+}
+
+static void free_tree(struct tmpfs *tmp, struct tmp_inode *dir) {
+    struct tmp_dirent *dirent, *tmp_dirent;
+    list_for_each_entry_safe(&dir->children, dirent, tmp_dirent, siblings) {
+        struct tmp_inode *inode = dirent->inode;
+        if (S_ISDIR(inode->mode)) {
+            free_tree(tmp, inode);
+            inode->nlink--; // .
+        }
+        dirent_remove(tmp, dirent);
+        inode_put(tmp, inode);
+    }
+}
+
+static int tmpfs_umount(struct mount *mount) {
+    struct tmpfs *tmp = mount->data;
+    free_tree(tmp, tmp->root);
+    tmp->root->nlink = 0;
+    inode_put(tmp, tmp->root);
+    free(tmp->dirents);
+    free(tmp);
+    return 0;
+}
+
+const struct fs_ops tmpfs = {
+    .name = "tmpfs", .magic = TMPFS_MAGIC,
+    .cache_links = true,
+    .cache_not_links = true,
+    .private_storage = true,
+    .mount = tmpfs_mount,
+    .umount = tmpfs_umount,
+    .statfs = tmpfs_statfs,
+    .open = tmpfs_open,
+    .readlink = tmpfs_readlink,
+    .link = tmpfs_link,
+    .unlink = tmpfs_unlink,
+    .rmdir = tmpfs_rmdir,
+    .rename = tmpfs_rename,
+    .symlink = tmpfs_symlink,
+    .mknod = tmpfs_mknod,
+    .mkdir = tmpfs_mkdir,
+
+    .close = tmpfs_close,
+    .stat = tmpfs_stat,
+    .fstat = tmpfs_fstat,
+    .setattr = tmpfs_setattr,
+    .fsetattr = tmpfs_fsetattr,
+    .utime = tmpfs_utime,
+    .getpath = tmpfs_getpath,
+    .flock = tmpfs_flock,
+};
+
+// fd operations
+
+static ssize_t tmpfs_read(struct fd *fd, void *buf, size_t bufsize) {
+    struct tmpfs *tmp = fd->mount->data;
+    struct tmp_inode *inode = fd->tmp_inode;
+    if (S_ISDIR(inode->mode))
+        return _EISDIR;
+    lock(&tmp->lock);
+    size_t n = 0;
+    if (fd->offset < inode->size) {
+        n = inode->size - fd->offset;
+        if (n > bufsize)
+            n = bufsize;
+        memcpy(buf, inode->data + fd->offset, n);
+        fd->offset += n;
+    }
+    unlock(&tmp->lock);
+    return n;
+}
+
+static ssize_t tmpfs_write(struct fd *fd, const void *buf, size_t bufsize) {
+    struct tmpfs *tmp = fd->mount->data;
+    struct tmp_inode *inode = fd->tmp_inode;
+    if (S_ISDIR(inode->mode))
+        return _EISDIR;
+    lock(&tmp->lock);
+    if (fd->flags & O_APPEND_)
+        fd->offset = inode->size;
+    size_t end = fd->offset + bufsize;
+    if (end > inode->size) {
+        int err = data_reserve(tmp, inode, end);
+        if (err < 0) {
+            unlock(&tmp->lock);
+            return err;
+        }
+        if (fd->offset > inode->size)
+            memset(inode->data + inode->size, 0, fd->offset - inode->size);
+        inode->size = end;
+    }
+    memcpy(inode->data + fd->offset, buf, bufsize);
+    fd->offset = end;
+    inode->mtime = inode->ctime = tmp_now();
+    unlock(&tmp->lock);
+    return bufsize;
+}
+
+static off_t_ tmpfs_lseek(struct fd *fd, off_t_ off, int whence) {
+    struct tmpfs *tmp = fd->mount->data;
+    lock(&tmp->lock);
+    if (whence == LSEEK_CUR)
+        off += fd->offset;
+    else if (whence == LSEEK_END)
+        off += fd->tmp_inode->size;
+    else if (whence != LSEEK_SET)
+        off = -1;
+    if (off < 0) {
+        unlock(&tmp->lock);
+        return _EINVAL;
+    }
+    fd->offset = off;
+    unlock(&tmp->lock);
+    return off;
+}
+
+static int tmpfs_readdir_batch(struct fd *fd, struct dir_entry *entries, unsigned count) {
+    struct tmpfs *tmp = fd->mount->data;
+    struct tmp_inode *dir = fd->tmp_inode;
+    lock(&tmp->lock);
+    unsigned n = 0;
+    while (n < count && fd->offset < 2) {
+        struct dir_entry *entry = &entries[n++];
+        if (fd->offset == 0) {
+            strcpy(entry->name, ".");
+            entry->inode = dir->number;
+        } else {
+            strcpy(entry->name, "..");
+            entry->inode = dir->dirent != NULL ? dir->dirent->parent->number : dir->number;
+        }
+        entry->type = DT_DIR_;
+        entry->offset = ++fd->offset;
+    }
+    struct tmp_dirent *dirent;
+    list_for_each_entry(&dir->children, dirent, siblings) {
+        if (n >= count)
+            break;
+        if (dirent->cookie < fd->offset)
+            continue;
+        struct dir_entry *entry = &entries[n++];
+        strcpy(entry->name, dirent->name);
+        entry->inode = dirent->inode->number;
+        entry->type = mode_to_dt(dirent->inode->mode);
+        entry->offset = fd->offset = dirent->cookie + 1;
+    }
+    unlock(&tmp->lock);
+    return n;
+}
+
+static int tmpfs_readdir(struct fd *fd, struct dir_entry *entry) {
+    return tmpfs_readdir_batch(fd, entry, 1);
+}
+
+static int tmpfs_mmap(struct fd *fd, struct mem *mem, page_t start, pages_t pages, off_t offset, int prot, int flags) {
+    if (pages == 0)
+        return 0;
+    struct tmpfs *tmp = fd->mount->data;
+    struct tmp_inode *inode = fd->tmp_inode;
+    lock(&tmp->lock);
+    if (inode->data_fd < 0) {
+        int err = data_resize(tmp, inode, 0);
+        if (err < 0) {
+            unlock(&tmp->lock);
+            return err;
+        }
+    }
+    // the whole mapping has to be backed, even past the end of the file
+    size_t end = round_up_real_page(offset + (size_t) pages * PAGE_SIZE);
+    if (end > data_backing(inode, inode->capacity) && ftruncate(inode->data_fd, end) < 0) {
+        unlock(&tmp->lock);
+        return errno_map();
+    }
+    if (end > inode->mapped)
+        inode->mapped = end;
+
+    if (flags & MMAP_SHARED)
+        prot |= P_SHARED;
+    int err = pt_map_file(mem, start, pages, inode->data_fd, offset, prot);
+    unlock(&tmp->lock);
+    return err;
+}
+
+static int tmpfs_poll(struct fd *UNUSED(fd)) {
+    return POLLIN | POLLOUT;
+}
+
+static int tmpfs_fsync(struct fd *UNUSED(fd)) {
+    return 0;
+}
+
+const struct fd_ops tmpfs_fdops = {
+    .read = tmpfs_read,
+    .write = tmpfs_write,
+    .lseek = tmpfs_lseek,
+    .readdir = tmpfs_readdir,
+    .readdir_batch = tmpfs_readdir_batch,
+    .mmap = tmpfs_mmap,
+    .poll = tmpfs_poll,
+    .fsync = tmpfs_fsync,
+    .close = tmpfs_close,
+};
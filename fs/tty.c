@@ -21,6 +21,15 @@ struct tty *tty_alloc(struct tty_driver *driver, int num) {
     struct tty *tty = malloc(sizeof(struct tty));
     if (tty == NULL)
         return NULL;
+    size_t buf_size = driver->buf_size != 0 ? driver->buf_size : TTY_BUF_SIZE;
+    fifo_init(&tty->buf, buf_size);
+    tty->buf_flag = calloc(BITS_SIZE(buf_size), 1);
+    if (tty->buf.buf == NULL || tty->buf_flag == NULL) {
+        fifo_destroy(&tty->buf);
+        free(tty->buf_flag);
+        free(tty);
+        return NULL;
+    }
 
     tty->refcount = 0;
     tty->driver = driver;
@@ -42,8 +51,6 @@ struct tty *tty_alloc(struct tty_driver *driver, int num) {
     lock_init(&tty->fds_lock);
     cond_init(&tty->produced);
     cond_init(&tty->consumed);
-    memset(tty->buf_flag, false, sizeof(tty->buf_flag));
-    tty->bufsize = 0;
 
     return tty;
 }
@@ -55,7 +62,7 @@ struct tty *tty_get(struct tty_driver *driver, int num) {
         tty = tty_alloc(driver, num);
         if (tty == NULL) {
             unlock(&ttys_lock);
-            return NULL;
+            return ERR_PTR(_ENOMEM);
         }
 
         if (driver->ops->init) {
@@ -94,6 +101,8 @@ void tty_release(struct tty *tty) {
         driver->ttys[tty->num] = NULL;
         unlock(&tty->lock);
         cond_destroy(&tty->produced);
+        fifo_destroy(&tty->buf);
+        free(tty->buf_flag);
         free(tty);
     } else {
         // bit of a hack
@@ -193,18 +202,104 @@ static void tty_input_wakeup(struct tty *tty) {
     tty_poll_wakeup(tty);
 }
 
-static int tty_push_char(struct tty *tty, char ch, bool flag, int blocking) {
-    while (tty->bufsize >= sizeof(tty->buf)) {
-        if (!blocking)
-            return _EAGAIN;
-        if (wait_for(&tty->consumed, &tty->lock, NULL))
-            return _EINTR;
+// position in buf.buf of the i'th character in the queue
+static size_t tty_buf_pos(struct tty *tty, size_t i) {
+    return (tty->buf.start + i) & (tty->buf.capacity - 1);
+}
+static char tty_buf_char(struct tty *tty, size_t i) {
+    return tty->buf.buf[tty_buf_pos(tty, i)];
+}
+static bool tty_buf_flag(struct tty *tty, size_t i) {
+    return bit_test(tty_buf_pos(tty, i), tty->buf_flag);
+}
+
+static void tty_clear_flags(struct tty *tty, size_t pos, size_t count) {
+    size_t mask = tty->buf.capacity - 1;
+    char *flags = tty->buf_flag;
+    while (count > 0) {
+        if (pos % 8 == 0 && count >= 8) {
+            // whole bytes at once, which never wrap since the capacity is a power of two
+            size_t bytes = count / 8;
+            if (bytes > (tty->buf.capacity - pos) / 8)
+                bytes = (tty->buf.capacity - pos) / 8;
+            memset(flags + pos / 8, 0, bytes);
+            pos = (pos + bytes * 8) & mask;
+            count -= bytes * 8;
+        } else {
+            bit_clear(pos, tty->buf_flag);
+            pos = (pos + 1) & mask;
+            count--;
+        }
+    }
+}
+
+// Pushes a run of characters with no special meaning, waiting for room if
+// blocking. *pushed is set to how many made it in, even if this fails.
+static int tty_push_span(struct tty *tty, const char *data, size_t size, size_t *pushed, bool blocking) {
+    *pushed = 0;
+    while (*pushed < size) {
+        size_t room = fifo_remaining(&tty->buf);
+        if (room == 0) {
+            if (!blocking)
+                return _EAGAIN;
+            // readers need to hear about what's already there to make room
+            tty_input_wakeup(tty);
+            // that dropped the lock, so the room might be there already,
+            // along with the notify that said so
+            if (fifo_remaining(&tty->buf) != 0)
+                continue;
+            if (wait_for(&tty->consumed, &tty->lock, NULL))
+                return _EINTR;
+            continue;
+        }
+        size_t count = size - *pushed;
+        if (count > room)
+            count = room;
+        tty_clear_flags(tty, tty_buf_pos(tty, fifo_size(&tty->buf)), count);
+        fifo_write(&tty->buf, data + *pushed, count, 0);
+        *pushed += count;
     }
-    tty->buf[tty->bufsize] = ch;
-    tty->buf_flag[tty->bufsize++] = flag;
     return 0;
 }
 
+static int tty_push_char(struct tty *tty, char ch, bool flag, int blocking) {
+    size_t pushed;
+    int err = tty_push_span(tty, &ch, 1, &pushed, blocking);
+    if (err < 0)
+        return err;
+    if (flag)
+        bit_set(tty_buf_pos(tty, fifo_size(&tty->buf) - 1), tty->buf_flag);
+    return 0;
+}
+
+// Marks the characters tty_input can't just copy into the buffer.
+static void tty_special_chars(struct tty *tty, bool special[256]) {
+    dword_t lflags = tty->termios.lflags;
+    unsigned char *cc = tty->termios.cc;
+    memset(special, false, 256);
+    if (lflags & ISIG_) {
+        special[cc[VINTR_]] = true;
+        special[cc[VQUIT_]] = true;
+        special[cc[VSUSP_]] = true;
+    }
+    if (lflags & ICANON_) {
+        // all control characters, for newline handling and ECHOCTL
+        memset(special, true, ' ');
+        special['\x7f'] = true;
+        special[cc[VERASE_]] = true;
+        special[cc[VKILL_]] = true;
+        special[cc[VEOF_]] = true;
+        special[cc[VEOL_]] = true;
+    }
+}
+
+static size_t tty_ordinary_span(const char *data, size_t size, const bool special[256]) {
+    size_t i = 0;
+    while (i < size && !special[(unsigned char) data[i]])
+        i++;
+    return i;
+}
+
 static void tty_echo(struct tty *tty, const char *data, size_t size) {
     tty->driver->ops->write(tty, data, size, false);
 }
@@ -225,7 +320,7 @@ static bool tty_send_input_signal(struct tty *tty, char ch, sigset_t_ *queue) {
 
     if (tty->fg_group != 0) {
         if (!(tty->termios.lflags & NOFLSH_))
-            tty->bufsize = 0;
+            fifo_flush(&tty->buf);
         *queue |= 1l << sig;
     }
     return true;
@@ -244,8 +339,25 @@ int tty_input(struct tty *tty, const char *input, size_t size, bool blocking) {
      (ch < ' ' || ch == '\x7f') && \
      !(ch == '\t' || ch == '\n' || ch == cc[VSTART_] || ch == cc[VSTOP_]))
 
+    bool special[256];
+    tty_special_chars(tty, special);
+
     if (lflags & ICANON_) {
         for (size_t i = 0; i < size; i++) {
+            // fast path for runs of ordinary characters, like a big paste
+            size_t span = tty_ordinary_span(input + i, size - i, special);
+            if (span > 0) {
+                size_t pushed;
+                err = tty_push_span(tty, input + i, span, &pushed, blocking);
+                if (lflags & ECHO_ && pushed > 0)
+                    tty_echo(tty, input + i, pushed);
+                if (err < 0)
+                    break;
+                i += span;
+                if (i == size)
+                    break;
+            }
+
             char ch = input[i];
             bool echo = lflags & ECHO_;
 
@@ -260,21 +372,22 @@ int tty_input(struct tty *tty, const char *input, size_t size, bool blocking) {
                 // FIXME ECHOE and ECHOK are supposed to enable these
                 // ECHOKE enables erasing the line instead of echoing the kill char and outputting a newline
                 echo = lflags & ECHOK_;
-                int count = tty->bufsize;
-                if (ch == cc[VERASE_] && tty->bufsize > 0) {
+                int count = fifo_size(&tty->buf);
+                if (ch == cc[VERASE_] && count > 0) {
                     echo = lflags & ECHOE_;
                     count = 1;
                 }
                 if (!(lflags & ECHO_))
                     echo = false;
                 for (int i = 0; i < count; i++) {
+                    size_t last = fifo_size(&tty->buf) - 1;
                     // don't delete past a flag
-                    if (tty->buf_flag[tty->bufsize - 1])
+                    if (tty_buf_flag(tty, last))
                         break;
-                    tty->bufsize--;
+                    tty->buf.size--;
                     if (echo) {
                         tty_echo(tty, "\b \b", 3);
-                        if (SHOULD_ECHOCTL(tty->buf[tty->bufsize]))
+                        if (SHOULD_ECHOCTL(tty_buf_char(tty, last)))
                             tty_echo(tty, "\b \b", 3);
                     }
                 }
@@ -309,18 +422,16 @@ canon_wake:
             }
         }
     } else {
-        for (size_t i = 0; i < size; i++) {
-            if (tty_send_input_signal(tty, input[i], &queue))
-                continue;
-            tty->buf[tty->bufsize++] = input[i];
-            while (tty->bufsize >= sizeof(tty->buf)) {
-                err = _EAGAIN;
-                if (!blocking)
-                    break;
-                err = _EINTR;
-                if (wait_for(&tty->consumed, &tty->lock, NULL))
-                    break;
-            }
+        size_t i = 0;
+        while (i < size) {
+            size_t span = tty_ordinary_span(input + i, size - i, special);
+            size_t pushed;
+            err = tty_push_span(tty, input + i, span, &pushed, blocking);
+            if (err < 0)
+                break;
+            i += span;
+            if (i < size)
+                tty_send_input_signal(tty, input[i++], &queue);
         }
         tty_input_wakeup(tty);
     }
@@ -338,19 +449,28 @@ canon_wake:
     return err;
 }
 
-// expects bufsize <= tty->bufsize
+// expects bufsize <= the size of the queue
 static void tty_read_into_buf(struct tty *tty, void *buf, size_t bufsize) {
-    memcpy(buf, tty->buf, bufsize);
-    tty->bufsize -= bufsize;
-    memmove(tty->buf, tty->buf + bufsize, tty->bufsize); // magic!
-    memmove(tty->buf_flag, tty->buf_flag + bufsize, tty->bufsize);
+    fifo_read(&tty->buf, buf, bufsize, 0);
+    notify(&tty->consumed);
 }
 
 static size_t tty_canon_size(struct tty *tty) {
-    bool *flag_ptr = memchr(tty->buf_flag, true, tty->bufsize);
-    if (flag_ptr == NULL)
-        return -1;
-    return flag_ptr - tty->buf_flag + 1;
+    size_t size = fifo_size(&tty->buf);
+    const uint64_t *flag_words = tty->buf_flag;
+    size_t i = 0;
+    while (i < size) {
+        size_t pos = tty_buf_pos(tty, i);
+        // skip 64 characters at a time while there are no flags
+        if (pos % 64 == 0 && size - i >= 64 && flag_words[pos / 64] == 0) {
+            i += 64;
+            continue;
+        }
+        if (bit_test(pos, tty->buf_flag))
+            return i + 1;
+        i++;
+    }
+    return -1;
 }
 
 static bool pty_is_half_closed_master(struct tty *tty) {
@@ -388,7 +508,7 @@ static ssize_t tty_read(struct fd *fd, void *buf, size_t bufsize) {
                 goto out;
         }
         // null byte means eof was typed
-        if (tty->buf[canon_size-1] == '\0')
+        if (tty_buf_char(tty, canon_size - 1) == '\0')
             canon_size--;
 
         if (bufsize > canon_size)
@@ -405,9 +525,9 @@ static ssize_t tty_read(struct fd *fd, void *buf, size_t bufsize) {
         if (time == 0)
             timeout_ptr = NULL;
 
-        while (tty->bufsize < min) {
+        while (fifo_size(&tty->buf) < min) {
             // there should be no timeout for the first character read
-            err = wait_for(&tty->produced, &tty->lock, tty->bufsize == 0 ? NULL : timeout_ptr);
+            err = wait_for(&tty->produced, &tty->lock, fifo_size(&tty->buf) == 0 ? NULL : timeout_ptr);
             if (err == _ETIMEDOUT)
                 break;
             if (err == _EINTR)
@@ -415,10 +535,10 @@ static ssize_t tty_read(struct fd *fd, void *buf, size_t bufsize) {
         }
     }
 
-    if (bufsize > tty->bufsize)
-        bufsize = tty->bufsize;
+    if (bufsize > fifo_size(&tty->buf))
+        bufsize = fifo_size(&tty->buf);
     tty_read_into_buf(tty, buf, bufsize);
-    if (tty->bufsize > 0 && tty->buf[0] == '\0' && tty->buf_flag[0]) {
+    if (fifo_size(&tty->buf) > 0 && tty_buf_char(tty, 0) == '\0' && tty_buf_flag(tty, 0)) {
         // remove the eof so the next read can succeed
         char dummy;
         tty_read_into_buf(tty, &dummy, 1);
@@ -456,16 +576,37 @@ static ssize_t tty_write(struct fd *fd, const void *buf, size_t bufsize) {
     int err = 0;
     if (oflags & OPOST_) {
         const char *cbuf = buf;
-        for (size_t i = 0; i < bufsize; i++) {
-            char ch = cbuf[i];
+        bool map_cr = oflags & (ONLRET_ | OCRNL_);
+        bool map_nl = oflags & ONLCR_;
+        size_t i = 0;
+        while (i < bufsize) {
+            // write everything up to the next character that needs translating in one go
+            size_t span = bufsize - i;
+            const char *nl = map_nl ? memchr(cbuf + i, '\n', span) : NULL;
+            if (nl != NULL)
+                span = nl - (cbuf + i);
+            const char *cr = map_cr ? memchr(cbuf + i, '\r', span) : NULL;
+            if (cr != NULL)
+                span = cr - (cbuf + i);
+            if (span > 0) {
+                err = tty_driver_write(tty, cbuf + i, span, blocking);
+                if (err < 0)
+                    break;
+                i += span;
+                if (i == bufsize)
+                    break;
+            }
+
+            char ch = cbuf[i++];
             if (ch == '\r' && oflags & ONLRET_)
                 continue;
             else if (ch == '\r' && oflags & OCRNL_)
                 ch = '\n';
             else if (ch == '\n' && oflags & ONLCR_) {
-                err = tty_driver_write(tty, "\r", 1, blocking);
+                err = tty_driver_write(tty, "\r\n", 2, blocking);
                 if (err < 0)
                     break;
+                continue;
             }
             err = tty_driver_write(tty, &ch, 1, blocking);
             if (err < 0)
@@ -492,7 +633,7 @@ static int tty_poll(struct fd *fd) {
         if (tty_canon_size(tty) != (size_t) -1)
             types |= POLL_READ;
     } else {
-        if (tty->bufsize > 0)
+        if (fifo_size(&tty->buf) > 0)
             types |= POLL_READ;
     }
     unlock(&tty->lock);
@@ -575,7 +716,8 @@ static int tty_mode_ioctl(struct tty *in_tty, int cmd, void *arg) {
             *(struct termios_ *) arg = tty->termios;
             break;
         case TCSETSF_:
-            tty->bufsize = 0;
+            fifo_flush(&tty->buf);
+            notify(&tty->consumed);
         case TCSETSW_:
             // we have no output buffer currently
         case TCSETS_:
@@ -616,7 +758,8 @@ static int tty_ioctl(struct fd *fd, int cmd, void *arg) {
             switch ((dword_t) arg) {
                 case TCIFLUSH_:
                 case TCIOFLUSH_:
-                    tty->bufsize = 0;
+                    fifo_flush(&tty->buf);
+                    notify(&tty->consumed);
                     break;
                 case TCOFLUSH_:
                     break;
@@ -654,7 +797,7 @@ static int tty_ioctl(struct fd *fd, int cmd, void *arg) {
             break;
 
         case FIONREAD_:
-            *(dword_t *) arg = tty->bufsize;
+            *(dword_t *) arg = fifo_size(&tty->buf);
             break;
 
         default:
@@ -3,6 +3,8 @@
 
 #include "kernel/fs.h"
 #include "fs/dev.h"
+#include "util/bits.h"
+#include "util/fifo.h"
 
 struct winsize_ {
     word_t row;
@@ -85,11 +87,14 @@ struct tty_driver {
     const struct tty_driver_ops *ops;
     struct tty **ttys;
     unsigned limit;
+    // size of the input queue of each tty, a power of two, or 0 for TTY_BUF_SIZE
+    size_t buf_size;
 };
 
-#define DEFINE_TTY_DRIVER(name, driver_ops, size) \
+// extra arguments are more initializers, like .buf_size
+#define DEFINE_TTY_DRIVER(name, driver_ops, size, ...) \
     static struct tty *name##_ttys[size]; \
-    struct tty_driver name = {.ops = driver_ops, .ttys = name##_ttys, .limit = size}
+    struct tty_driver name = {.ops = driver_ops, .ttys = name##_ttys, .limit = size, __VA_ARGS__}
 
 struct tty_driver_ops {
     int (*init)(struct tty *tty);
@@ -109,11 +114,13 @@ struct tty {
     bool hung_up;
 
 #define TTY_BUF_SIZE 4096
-    char buf[TTY_BUF_SIZE];
+    // The input queue, a ring buffer.
+    struct fifo buf;
     // A flag is a marker indicating the end of a canonical mode input. Flags
     // are created by EOL and EOF characters. You can't backspace past a flag.
-    bool buf_flag[TTY_BUF_SIZE];
-    size_t bufsize;
+    // This is a bitmap indexed by position in buf.buf, and bits outside the
+    // queued data are garbage.
+    bits_t *buf_flag;
     cond_t produced;
     cond_t consumed;
 
@@ -0,0 +1,1243 @@
+#include <string.h>
+#include <sys/stat.h>
+#include "kernel/calls.h"
+#include "kernel/signal.h"
+#include "fs/fd.h"
+#include "fs/path.h"
+#include "fs/poll.h"
+#include "fs/unix.h"
+#include "debug.h"
+
+// Everything about every unix socket is protected by unix_lock. Each socket
+// has a cond for things waiting on it to change. poll_wakeup can't be called
+// with unix_lock held, since polling takes it, so wakeups happen afterwards
+// with unix_fds_lock held instead, which keeps sock->fd from being closed.
+// Copying to or from the guest can fault, so it isn't done with unix_lock held
+// either. Instead a stream sender holds the socket's send_lock, and a receiver
+// holds its recv_lock, which keeps the messages being copied in place.
+// Lock order is send_lock or recv_lock, unix_fds_lock, poll locks, unix_lock.
+static lock_t unix_lock = LOCK_INITIALIZER;
+static lock_t unix_fds_lock = LOCK_INITIALIZER;
+// sockets bound to an address
+static struct list unix_bound = LIST_INITIALIZER(unix_bound);
+
+#define UNIX_BUF_SIZE (256 * 1024)
+#define UNIX_DGRAM_QLEN 512
+#define UNIX_ADDR_BASE_LEN sizeof(uint16_t)
+
+enum unix_state {
+    UNIX_UNCONNECTED,
+    UNIX_LISTENING,
+    UNIX_CONNECTED,
+};
+
+struct unix_sock {
+    unsigned refcount;
+    int type;
+    enum unix_state state;
+    bool closed;
+    bool shut_rd; // nothing more will be received
+    bool shut_wr; // nothing more can be sent
+    struct unix_sock *peer;
+    struct ucred_ cred;
+    struct ucred_ peer_cred;
+
+    // received unix_msgs, or for listening sockets, connections waiting to be accepted
+    struct list queue;
+    size_t queued; // bytes, or connections
+    unsigned queued_msgs;
+    int backlog;
+    // in a listener's queue, or on a local list of sockets being freed
+    struct list link;
+    // on a local list of sockets to wake up
+    struct list wake;
+
+    struct sockaddr_un_ addr;
+    uint_t addr_len; // just the family if unbound
+    struct list bound;
+    // bound to a path, these identify the socket file
+    struct mount *bound_mount;
+    qword_t bound_inode;
+
+    cond_t cond;
+    struct fd *fd; // changed with unix_fds_lock held too
+    lock_t send_lock;
+    lock_t recv_lock;
+};
+
+struct unix_msg {
+    struct list queue;
+    size_t size;
+    size_t offset; // how much of a stream message has been read
+    struct fd **fds;
+    unsigned fds_count;
+    struct sockaddr_un_ from;
+    uint_t from_len;
+    char data[];
+};
+
+static bool unix_is_stream(struct unix_sock *sock) {
+    return sock->type == SOCK_STREAM_;
+}
+static bool unix_is_connection(struct unix_sock *sock) {
+    return sock->type == SOCK_STREAM_ || sock->type == SOCK_SEQPACKET_;
+}
+
+static void unix_get_cred(struct ucred_ *cred) {
+    cred->pid = current->tgid;
+    cred->uid = current->euid;
+    cred->gid = current->egid;
+}
+
+static struct unix_sock *unix_sock_new(int type) {
+    struct unix_sock *sock = malloc(sizeof(struct unix_sock));
+    if (sock == NULL)
+        return NULL;
+    *sock = (struct unix_sock) {.refcount = 1, .type = type};
+    list_init(&sock->queue);
+    list_init(&sock->bound);
+    sock->addr.family = AF_LOCAL_;
+    sock->addr_len = UNIX_ADDR_BASE_LEN;
+    unix_get_cred(&sock->cred);
+    cond_init(&sock->cond);
+    lock_init(&sock->send_lock);
+    lock_init(&sock->recv_lock);
+    return sock;
+}
+
+static void unix_msg_free(struct unix_msg *msg) {
+    for (unsigned i = 0; i < msg->fds_count; i++)
+        fd_close(msg->fds[i]);
+    free(msg->fds);
+    free(msg);
+}
+
+static void unix_msgs_move(struct list *to, struct list *from) {
+    struct unix_msg *msg, *tmp;
+    list_for_each_entry_safe(from, msg, tmp, queue) {
+        list_remove(&msg->queue);
+        list_add_before(to, &msg->queue);
+    }
+}
+
+static void unix_msgs_free(struct list *msgs) {
+    struct unix_msg *msg, *tmp;
+    list_for_each_entry_safe(msgs, msg, tmp, queue) {
+        list_remove(&msg->queue);
+        unix_msg_free(msg);
+    }
+}
+
+static void unix_get(struct unix_sock *sock) {
+    sock->refcount++;
+}
+
+// Drops a reference with unix_lock held. Freeing a socket can close fds, so
+// it goes on the dead list to be freed by unix_free_dead without the lock.
+static void unix_put(struct unix_sock *sock, struct list *dead) {
+    if (--sock->refcount == 0)
+        list_add(dead, &sock->link);
+}
+
+static void unix_free_dead(struct list *dead) {
+    struct unix_sock *sock, *tmp;
+    list_for_each_entry_safe(dead, sock, tmp, link) {
+        list_remove(&sock->link);
+        // closing a listener empties its queue, so this can only be messages
+        unix_msgs_free(&sock->queue);
+        cond_destroy(&sock->cond);
+        free(sock);
+    }
+}
+
+static void unix_release(struct unix_sock *sock) {
+    struct list dead;
+    list_init(&dead);
+    lock(&unix_lock);
+    unix_put(sock, &dead);
+    unlock(&unix_lock);
+    unix_free_dead(&dead);
+}
+
+// Wakes up anything polling the socket, which the caller has a reference to.
+static void unix_wakeup(struct unix_sock *sock) {
+    lock(&unix_fds_lock);
+    lock(&unix_lock);
+    struct fd *fd = sock->fd;
+    unlock(&unix_lock);
+    if (fd != NULL)
+        poll_wakeup(fd);
+    unlock(&unix_fds_lock);
+}
+
+// Wakes up and releases each socket on the list.
+static void unix_wakeup_list(struct list *socks) {
+    struct unix_sock *sock, *tmp;
+    list_for_each_entry_safe(socks, sock, tmp, wake) {
+        list_remove(&sock->wake);
+        unix_wakeup(sock);
+        unix_release(sock);
+    }
+}
+
+// Waits on a cond with unix_lock held, letting go of io (the socket's send or
+// recv lock) meanwhile so other threads using the socket don't get stuck
+// behind the wait. Both are held again afterwards.
+static int unix_wait_io(cond_t *cond, lock_t *io) {
+    unlock(io);
+    int err = wait_for(cond, &unix_lock, NULL);
+    unlock(&unix_lock);
+    lock(io);
+    lock(&unix_lock);
+    return err;
+}
+
+// Cuts a connection, with unix_lock held. The peer is added to the wake list.
+static void unix_disconnect(struct unix_sock *sock, struct list *wake, struct list *dead) {
+    struct unix_sock *peer = sock->peer;
+    if (peer == NULL)
+        return;
+    sock->peer = NULL;
+    if (unix_is_connection(sock) && peer->peer == sock) {
+        peer->peer = NULL;
+        peer->shut_rd = peer->shut_wr = true;
+        notify(&peer->cond);
+        unix_put(sock, dead);
+        list_add(wake, &peer->wake);
+        return;
+    }
+    unix_put(peer, dead);
+}
+
+// Data in struct unix_msghdr
+
+static size_t unix_msghdr_size(struct unix_msghdr *msg) {
+    if (msg->iov == NULL)
+        return msg->bufsize;
+    size_t size = 0;
+    for (uint_t i = 0; i < msg->iovlen; i++)
+        size += msg->iov[i].iov_len;
+    return size;
+}
+
+// Copies size bytes starting at off in the message's data to or from buf.
+static int unix_msghdr_copy(struct unix_msghdr *msg, size_t off, char *buf, size_t size, bool from_msg) {
+    if (msg->iov == NULL) {
+        if (from_msg)
+            memcpy(buf, msg->buf + off, size);
+        else
+            memcpy(msg->buf + off, buf, size);
+        return 0;
+    }
+    for (uint_t i = 0; i < msg->iovlen && size > 0; i++) {
+        struct iovec_ *iov = &msg->iov[i];
+        if (off >= iov->iov_len) {
+            off -= iov->iov_len;
+            continue;
+        }
+        size_t chunk = iov->iov_len - off;
+        if (chunk > size)
+            chunk = size;
+        int err = from_msg ? user_read(iov->iov_base + off, buf, chunk) : user_write(iov->iov_base + off, buf, chunk);
+        if (err)
+            return _EFAULT;
+        buf += chunk;
+        size -= chunk;
+        off = 0;
+    }
+    return 0;
+}
+
+static void unix_msghdr_drop_fds(struct unix_msghdr *msg) {
+    for (unsigned i = 0; i < msg->fds_count; i++)
+        fd_close(msg->fds[i]);
+    msg->fds_count = 0;
+}
+
+// Addresses
+
+static int unix_addr_check(struct sockaddr_un_ *addr, uint_t addr_len) {
+    if (addr_len < UNIX_ADDR_BASE_LEN || addr_len > sizeof(*addr))
+        return _EINVAL;
+    if (addr->family != AF_LOCAL_)
+        return _EINVAL;
+    return 0;
+}
+
+static bool unix_addr_is_abstract(struct sockaddr_un_ *addr, uint_t addr_len) {
+    return addr_len > UNIX_ADDR_BASE_LEN && addr->path[0] == '\0';
+}
+
+// Gets the path out of an address, NUL terminated.
+static void unix_addr_path(struct sockaddr_un_ *addr, uint_t addr_len, char path[sizeof(addr->path) + 1]) {
+    size_t len = addr_len - UNIX_ADDR_BASE_LEN;
+    memcpy(path, addr->path, len);
+    path[len] = '\0';
+}
+
+// Finds the socket file at a path, and returns its mount (retained) and inode.
+static int unix_path_lookup(const char *path_raw, struct mount **mount_out, qword_t *inode_out) {
+    char path[MAX_PATH];
+    int err = path_normalize(AT_PWD, path_raw, path, true);
+    if (err < 0)
+        return err;
+    struct mount *mount = find_mount_and_trim_path(path);
+    struct statbuf stat = {};
+    err = mount->fs->stat(mount, path, &stat, true);
+    if (err >= 0 && !S_ISSOCK(stat.mode))
+        err = _ECONNREFUSED;
+    if (err < 0) {
+        mount_release(mount);
+        return err;
+    }
+    *mount_out = mount;
+    *inode_out = stat.inode;
+    return 0;
+}
+
+// Where an address points, resolved without unix_lock since it touches the filesystem.
+struct unix_target {
+    struct sockaddr_un_ *addr;
+    uint_t addr_len;
+    struct mount *mount;
+    qword_t inode;
+};
+
+static int unix_target_resolve(struct unix_target *target, struct sockaddr_un_ *addr, uint_t addr_len) {
+    int err = unix_addr_check(addr, addr_len);
+    if (err < 0)
+        return err;
+    if (addr_len == UNIX_ADDR_BASE_LEN)
+        return _EINVAL;
+    *target = (struct unix_target) {.addr = addr, .addr_len = addr_len};
+    if (unix_addr_is_abstract(addr, addr_len))
+        return 0;
+    char path[sizeof(addr->path) + 1];
+    unix_addr_path(addr, addr_len, path);
+    return unix_path_lookup(path, &target->mount, &target->inode);
+}
+
+static void unix_target_done(struct unix_target *target) {
+    if (target->mount != NULL)
+        mount_release(target->mount);
+}
+
+// Finds the socket bound to the target, with unix_lock held.
+static struct unix_sock *unix_target_find(struct unix_target *target) {
+    struct unix_sock *sock;
+    list_for_each_entry(&unix_bound, sock, bound) {
+        if (target->mount != NULL) {
+            if (sock->bound_mount == target->mount && sock->bound_inode == target->inode)
+                return sock;
+        } else if (sock->bound_mount == NULL && sock->addr_len == target->addr_len &&
+                memcmp(sock->addr.path, target->addr->path, target->addr_len - UNIX_ADDR_BASE_LEN) == 0) {
+            return sock;
+        }
+    }
+    return NULL;
+}
+
+// Sockets
+
+static struct fd *unix_fd_create(struct unix_sock *sock) {
+    static atomic_uint next_inode = 1;
+    struct fd *fd = adhoc_fd_create(&unix_socket_fdops);
+    if (fd == NULL)
+        return NULL;
+    fd->stat.mode = S_IFSOCK | 0777;
+    fd->stat.inode = next_inode++;
+    fd->stat.uid = current->euid;
+    fd->stat.gid = current->egid;
+    fd->unix_sock = sock;
+    return fd;
+}
+
+struct fd *unix_socket_create(int type) {
+    if (type != SOCK_STREAM_ && type != SOCK_DGRAM_ && type != SOCK_SEQPACKET_)
+        return ERR_PTR(_EINVAL);
+    struct unix_sock *sock = unix_sock_new(type);
+    if (sock == NULL)
+        return ERR_PTR(_ENOMEM);
+    struct fd *fd = unix_fd_create(sock);
+    if (fd == NULL) {
+        unix_release(sock);
+        return ERR_PTR(_ENOMEM);
+    }
+    // not visible to anyone else yet
+    sock->fd = fd;
+    return fd;
+}
+
+int unix_socketpair(int type, struct fd *fds[2]) {
+    fds[0] = unix_socket_create(type);
+    if (IS_ERR(fds[0]))
+        return PTR_ERR(fds[0]);
+    fds[1] = unix_socket_create(type);
+    if (IS_ERR(fds[1])) {
+        fd_close(fds[0]);
+        return PTR_ERR(fds[1]);
+    }
+    struct unix_sock *a = fds[0]->unix_sock;
+    struct unix_sock *b = fds[1]->unix_sock;
+    a->peer = b;
+    b->peer = a;
+    unix_get(a);
+    unix_get(b);
+    a->state = b->state = UNIX_CONNECTED;
+    a->peer_cred = b->cred;
+    b->peer_cred = a->cred;
+    return 0;
+}
+
+static int unix_close(struct fd *fd) {
+    struct unix_sock *sock = fd->unix_sock;
+    struct list wake, dead, msgs;
+    list_init(&wake);
+    list_init(&dead);
+    list_init(&msgs);
+    struct mount *bound_mount = NULL;
+
+    lock(&unix_fds_lock);
+    lock(&unix_lock);
+    sock->fd = NULL;
+    sock->closed = true;
+    sock->shut_rd = sock->shut_wr = true;
+    if (!list_empty(&sock->bound)) {
+        list_remove(&sock->bound);
+        bound_mount = sock->bound_mount;
+    }
+    if (sock->state == UNIX_LISTENING) {
+        // nobody is going to accept these
+        struct unix_sock *pending, *tmp;
+        list_for_each_entry_safe(&sock->queue, pending, tmp, link) {
+            list_remove(&pending->link);
+            pending->closed = true;
+            unix_disconnect(pending, &wake, &dead);
+            unix_msgs_move(&msgs, &pending->queue);
+            unix_put(pending, &dead);
+        }
+        sock->queued = 0;
+    }
+    unix_disconnect(sock, &wake, &dead);
+    unix_msgs_move(&msgs, &sock->queue);
+    sock->queued = sock->queued_msgs = 0;
+    notify(&sock->cond);
+    unlock(&unix_lock);
+    unlock(&unix_fds_lock);
+
+    unix_wakeup_list(&wake);
+    unix_free_dead(&dead);
+    unix_msgs_free(&msgs);
+    if (bound_mount != NULL)
+        mount_release(bound_mount);
+    unix_release(sock);
+    return 0;
+}
+
+int unix_bind(struct fd *fd, struct sockaddr_un_ *addr, uint_t addr_len) {
+    struct unix_sock *sock = fd->unix_sock;
+    int err = unix_addr_check(addr, addr_len);
+    if (err < 0)
+        return err;
+
+    static unsigned next_autobind = 0;
+    struct sockaddr_un_ name = {.family = AF_LOCAL_};
+    uint_t name_len;
+    struct mount *mount = NULL;
+    qword_t inode = 0;
+    if (addr_len == UNIX_ADDR_BASE_LEN) {
+        // autobind, to five hex digits in the abstract namespace
+        lock(&unix_lock);
+        unsigned n = next_autobind++ & 0xfffff;
+        unlock(&unix_lock);
+        sprintf(name.path + 1, "%05x", n);
+        name_len = UNIX_ADDR_BASE_LEN + 6;
+    } else if (unix_addr_is_abstract(addr, addr_len)) {
+        name = *addr;
+        name_len = addr_len;
+    } else {
+        char path[sizeof(addr->path) + 1];
+        unix_addr_path(addr, addr_len, path);
+        size_t path_len = strlen(path);
+        memcpy(name.path, path, path_len);
+        name_len = UNIX_ADDR_BASE_LEN + path_len + 1;
+
+        lock(&unix_lock);
+        bool bound = sock->addr_len != UNIX_ADDR_BASE_LEN;
+        unlock(&unix_lock);
+        if (bound)
+            return _EINVAL;
+        err = generic_mknod(path, S_IFSOCK | (0777 & ~current->fs->umask), 0);
+        if (err == _EEXIST)
+            return _EADDRINUSE;
+        if (err < 0)
+            return err;
+        err = unix_path_lookup(path, &mount, &inode);
+        if (err < 0)
+            return err;
+    }
+
+    lock(&unix_lock);
+    err = _EINVAL;
+    if (sock->addr_len != UNIX_ADDR_BASE_LEN)
+        goto out;
+    if (mount == NULL) {
+        struct unix_target target = {.addr = &name, .addr_len = name_len};
+        err = _EADDRINUSE;
+        if (unix_target_find(&target) != NULL)
+            goto out;
+    }
+    sock->addr = name;
+    sock->addr_len = name_len;
+    sock->bound_mount = mount;
+    sock->bound_inode = inode;
+    list_add(&unix_bound, &sock->bound);
+    mount = NULL;
+    err = 0;
+out:
+    unlock(&unix_lock);
+    if (mount != NULL)
+        mount_release(mount);
+    return err;
+}
+
+int unix_connect(struct fd *fd, struct sockaddr_un_ *addr, uint_t addr_len) {
+    struct unix_sock *sock = fd->unix_sock;
+    struct unix_target target;
+    int err = unix_target_resolve(&target, addr, addr_len);
+    if (err < 0)
+        return err;
+    struct list wake, dead;
+    list_init(&wake);
+    list_init(&dead);
+
+    lock(&unix_lock);
+    struct unix_sock *listener = unix_target_find(&target);
+    err = _ECONNREFUSED;
+    if (listener == NULL || listener->closed)
+        goto out;
+    err = _EPROTOTYPE;
+    if (listener->type != sock->type)
+        goto out;
+
+    if (!unix_is_connection(sock)) {
+        // this just sets the default destination
+        unix_disconnect(sock, &wake, &dead);
+        unix_get(listener);
+        sock->peer = listener;
+        sock->state = UNIX_CONNECTED;
+        sock->peer_cred = listener->cred;
+        err = 0;
+        goto out;
+    }
+
+    err = _EISCONN;
+    if (sock->state == UNIX_CONNECTED)
+        goto out;
+    err = _EINVAL;
+    if (sock->state == UNIX_LISTENING)
+        goto out;
+
+    unix_get(listener);
+    while (true) {
+        err = _ECONNREFUSED;
+        if (listener->closed || listener->state != UNIX_LISTENING)
+            break;
+        err = 0;
+        if (listener->queued <= (size_t) listener->backlog)
+            break;
+        err = _EAGAIN;
+        if (fd->flags & O_NONBLOCK_)
+            break;
+        err = wait_for(&listener->cond, &unix_lock, NULL);
+        if (err < 0)
+            break;
+        // somebody else could have connected this socket meanwhile
+        err = _EISCONN;
+        if (sock->state != UNIX_UNCONNECTED)
+            break;
+    }
+    if (err < 0) {
+        unix_put(listener, &dead);
+        goto out;
+    }
+
+    struct unix_sock *server = unix_sock_new(sock->type);
+    if (server == NULL) {
+        unix_put(listener, &dead);
+        err = _ENOMEM;
+        goto out;
+    }
+    server->addr = listener->addr;
+    server->addr_len = listener->addr_len;
+    server->cred = listener->cred;
+    server->peer = sock;
+    server->peer_cred = sock->cred;
+    server->state = UNIX_CONNECTED;
+    unix_get(sock);
+    sock->peer = server;
+    sock->peer_cred = listener->cred;
+    sock->state = UNIX_CONNECTED;
+    unix_get(server);
+    // the listener's queue gets the first reference to the server
+    list_add_before(&listener->queue, &server->link);
+    listener->queued++;
+    notify(&listener->cond);
+    // the listener reference moves to the wake list
+    list_add(&wake, &listener->wake);
+
+out:
+    unlock(&unix_lock);
+    unix_target_done(&target);
+    unix_wakeup_list(&wake);
+    unix_free_dead(&dead);
+    return err;
+}
+
+int unix_listen(struct fd *fd, int backlog) {
+    struct unix_sock *sock = fd->unix_sock;
+    if (!unix_is_connection(sock))
+        return _EOPNOTSUPP;
+    if (backlog < 0)
+        backlog = 0;
+    if (backlog > 4096)
+        backlog = 4096;
+    int err = 0;
+    lock(&unix_lock);
+    if (sock->addr_len == UNIX_ADDR_BASE_LEN || sock->state == UNIX_CONNECTED)
+        err = _EINVAL;
+    else {
+        sock->state = UNIX_LISTENING;
+        sock->backlog = backlog;
+        notify(&sock->cond);
+    }
+    unlock(&unix_lock);
+    return err;
+}
+
+struct fd *unix_accept(struct fd *fd, struct sockaddr_un_ *addr, uint_t *addr_len) {
+    struct unix_sock *sock = fd->unix_sock;
+    if (!unix_is_connection(sock))
+        return ERR_PTR(_EOPNOTSUPP);
+
+    lock(&unix_lock);
+    int err = 0;
+    while (true) {
+        err = _EINVAL;
+        if (sock->state != UNIX_LISTENING)
+            break;
+        err = 0;
+        if (!list_empty(&sock->queue))
+            break;
+        err = _EAGAIN;
+        if (fd->flags & O_NONBLOCK_)
+            break;
+        err = wait_for(&sock->cond, &unix_lock, NULL);
+        if (err < 0)
+            break;
+    }
+    if (err < 0) {
+        unlock(&unix_lock);
+        return ERR_PTR(err);
+    }
+
+    struct unix_sock *client = list_first_entry(&sock->queue, struct unix_sock, link);
+    list_remove(&client->link);
+    sock->queued--;
+    notify(&sock->cond);
+    struct unix_sock *peer = client->peer;
+    if (peer != NULL) {
+        *addr = peer->addr;
+        *addr_len = peer->addr_len;
+    } else {
+        *addr = (struct sockaddr_un_) {.family = AF_LOCAL_};
+        *addr_len = UNIX_ADDR_BASE_LEN;
+    }
+    unlock(&unix_lock);
+
+    // the new fd gets the queue's reference
+    struct fd *client_fd = unix_fd_create(client);
+    lock(&unix_fds_lock);
+    lock(&unix_lock);
+    if (client_fd == NULL) {
+        list_add(&sock->queue, &client->link);
+        sock->queued++;
+    } else {
+        client->fd = client_fd;
+    }
+    unlock(&unix_lock);
+    unlock(&unix_fds_lock);
+    if (client_fd == NULL)
+        return ERR_PTR(_ENOMEM);
+    return client_fd;
+}
+
+int unix_getname(struct fd *fd, bool peer, struct sockaddr_un_ *addr, uint_t *addr_len) {
+    struct unix_sock *sock = fd->unix_sock;
+    int err = 0;
+    lock(&unix_lock);
+    if (peer) {
+        if (sock->peer == NULL) {
+            err = _ENOTCONN;
+        } else {
+            *addr = sock->peer->addr;
+            *addr_len = sock->peer->addr_len;
+        }
+    } else {
+        *addr = sock->addr;
+        *addr_len = sock->addr_len;
+    }
+    unlock(&unix_lock);
+    return err;
+}
+
+// Sending and receiving
+
+static struct unix_msg *unix_msg_new(struct unix_msghdr *msghdr, size_t off, size_t size) {
+    struct unix_msg *msg = malloc(sizeof(struct unix_msg) + size);
+    if (msg == NULL)
+        return ERR_PTR(_ENOMEM);
+    *msg = (struct unix_msg) {.size = size};
+    int err = unix_msghdr_copy(msghdr, off, msg->data, size, true);
+    if (err < 0) {
+        free(msg);
+        return ERR_PTR(err);
+    }
+    return msg;
+}
+
+// Hands the fds from msghdr over to msg, with unix_lock held.
+static int unix_msg_attach_fds(struct unix_msg *msg, struct unix_msghdr *msghdr) {
+    if (msghdr->fds_count == 0)
+        return 0;
+    msg->fds = malloc(msghdr->fds_count * sizeof(struct fd *));
+    if (msg->fds == NULL)
+        return _ENOMEM;
+    memcpy(msg->fds, msghdr->fds, msghdr->fds_count * sizeof(struct fd *));
+    msg->fds_count = msghdr->fds_count;
+    msghdr->fds_count = 0;
+    return 0;
+}
+
+static ssize_t unix_stream_send(struct fd *fd, struct unix_msghdr *msghdr, int flags) {
+    struct unix_sock *sock = fd->unix_sock;
+    size_t size = unix_msghdr_size(msghdr);
+    bool nonblock = (fd->flags & O_NONBLOCK_) || (flags & MSG_DONTWAIT_);
+    struct list dead;
+    list_init(&dead);
+
+    size_t sent = 0;
+    ssize_t err = 0;
+    lock(&sock->send_lock);
+    lock(&unix_lock);
+    if (sock->state != UNIX_CONNECTED && !sock->shut_wr)
+        err = _ENOTCONN;
+    while (err == 0 && sent < size) {
+        struct unix_sock *peer = sock->peer;
+        if (sock->shut_wr || peer == NULL) {
+            err = _EPIPE;
+            break;
+        }
+        if (peer->queued >= UNIX_BUF_SIZE) {
+            if (nonblock) {
+                err = _EAGAIN;
+                break;
+            }
+            unix_get(peer);
+            err = unix_wait_io(&peer->cond, &sock->send_lock);
+            unix_put(peer, &dead);
+            continue;
+        }
+
+        // only this socket sends to its peer, and send_lock keeps anyone else
+        // from doing that, so the room can't go away while copying
+        size_t count = size - sent;
+        if (count > UNIX_BUF_SIZE - peer->queued)
+            count = UNIX_BUF_SIZE - peer->queued;
+        unix_get(peer);
+        unlock(&unix_lock);
+        struct unix_msg *msg = unix_msg_new(msghdr, sent, count);
+        lock(&unix_lock);
+        unix_put(peer, &dead);
+        if (IS_ERR(msg)) {
+            err = PTR_ERR(msg);
+            break;
+        }
+        if (sock->shut_wr || sock->peer != peer) {
+            // disconnected meanwhile, the top of the loop sorts it out
+            free(msg);
+            continue;
+        }
+        err = unix_msg_attach_fds(msg, msghdr);
+        if (err < 0) {
+            free(msg);
+            break;
+        }
+        list_add_before(&peer->queue, &msg->queue);
+        peer->queued += count;
+        sent += count;
+        notify(&peer->cond);
+
+        // let a polling reader know before possibly blocking for more room
+        unix_get(peer);
+        unlock(&unix_lock);
+        unix_wakeup(peer);
+        lock(&unix_lock);
+        unix_put(peer, &dead);
+    }
+    unlock(&unix_lock);
+    unlock(&sock->send_lock);
+    unix_free_dead(&dead);
+
+    if (err == _EPIPE && !(flags & MSG_NOSIGNAL_))
+        send_signal(current, SIGPIPE_);
+    if (sent > 0)
+        return sent;
+    return err;
+}
+
+static ssize_t unix_dgram_send(struct fd *fd, struct unix_msghdr *msghdr, int flags) {
+    struct unix_sock *sock = fd->unix_sock;
+    size_t size = unix_msghdr_size(msghdr);
+    if (size > UNIX_BUF_SIZE)
+        return _EMSGSIZE;
+    bool nonblock = (fd->flags & O_NONBLOCK_) || (flags & MSG_DONTWAIT_);
+
+    struct unix_target target = {};
+    bool has_target = msghdr->namelen != 0 && sock->type == SOCK_DGRAM_;
+    if (has_target) {
+        int err = unix_target_resolve(&target, &msghdr->name, msghdr->namelen);
+        if (err < 0)
+            return err;
+    }
+    struct unix_msg *msg = unix_msg_new(msghdr, 0, size);
+    if (IS_ERR(msg)) {
+        unix_target_done(&target);
+        return PTR_ERR(msg);
+    }
+    struct list dead;
+    list_init(&dead);
+
+    lock(&unix_lock);
+    msg->from = sock->addr;
+    msg->from_len = sock->addr_len;
+    struct unix_sock *peer = has_target ? unix_target_find(&target) : sock->peer;
+    ssize_t err = 0;
+    if (peer == NULL) {
+        if (has_target)
+            err = _ECONNREFUSED;
+        else if (sock->type == SOCK_SEQPACKET_ && sock->state == UNIX_CONNECTED)
+            err = _EPIPE;
+        else
+            err = _ENOTCONN;
+        goto out;
+    }
+    unix_get(peer);
+    while (true) {
+        err = sock->type == SOCK_SEQPACKET_ ? _EPIPE : _ECONNREFUSED;
+        if (peer->closed || sock->shut_wr)
+            break;
+        err = _EPROTOTYPE;
+        if (peer->type != sock->type)
+            break;
+        err = _EPERM;
+        if (peer->peer != NULL && peer->peer != sock)
+            break;
+        err = _EPIPE;
+        if (peer->shut_rd)
+            break;
+        err = 0;
+        if (peer->queued_msgs < UNIX_DGRAM_QLEN && peer->queued + size <= UNIX_BUF_SIZE)
+            break;
+        err = _EAGAIN;
+        if (nonblock)
+            break;
+        err = wait_for(&peer->cond, &unix_lock, NULL);
+        if (err < 0)
+            break;
+    }
+    if (err == 0)
+        err = unix_msg_attach_fds(msg, msghdr);
+    if (err < 0) {
+        unix_put(peer, &dead);
+        goto out;
+    }
+    list_add_before(&peer->queue, &msg->queue);
+    msg = NULL;
+    peer->queued += size;
+    peer->queued_msgs++;
+    notify(&peer->cond);
+    unlock(&unix_lock);
+    unix_wakeup(peer);
+    unix_release(peer);
+    unix_target_done(&target);
+    return size;
+
+out:
+    unlock(&unix_lock);
+    unix_free_dead(&dead);
+    free(msg);
+    unix_target_done(&target);
+    if (err == _EPIPE && !(flags & MSG_NOSIGNAL_))
+        send_signal(current, SIGPIPE_);
+    return err;
+}
+
+ssize_t unix_sendmsg(struct fd *fd, struct unix_msghdr *msghdr, int flags) {
+    ssize_t res;
+    if (unix_is_stream(fd->unix_sock))
+        res = unix_stream_send(fd, msghdr, flags);
+    else
+        res = unix_dgram_send(fd, msghdr, flags);
+    unix_msghdr_drop_fds(msghdr);
+    return res;
+}
+
+// Waits for something to be received, with recv_lock and unix_lock held.
+// Returns 1 if there's a message, 0 at the end of the stream.
+static int unix_recv_wait(struct fd *fd, bool nonblock) {
+    struct unix_sock *sock = fd->unix_sock;
+    while (true) {
+        if (unix_is_connection(sock) && sock->state != UNIX_CONNECTED && !sock->closed)
+            return _EINVAL;
+        if (!list_empty(&sock->queue))
+            return 1;
+        if (sock->shut_rd)
+            return 0;
+        if (nonblock)
+            return _EAGAIN;
+        int err = unix_wait_io(&sock->cond, &sock->recv_lock);
+        if (err < 0)
+            return err;
+    }
+}
+
+// Takes the fds from a message being received, with unix_lock held.
+static void unix_recv_fds(struct unix_msghdr *msghdr, struct unix_msg *msg) {
+    if (msg->fds_count == 0)
+        return;
+    msghdr->fds = msg->fds;
+    msghdr->fds_count = msg->fds_count;
+    msg->fds = NULL;
+    msg->fds_count = 0;
+}
+
+static ssize_t unix_stream_recv(struct fd *fd, struct unix_msghdr *msghdr, int flags) {
+    struct unix_sock *sock = fd->unix_sock;
+    size_t size = unix_msghdr_size(msghdr);
+    bool nonblock = (fd->flags & O_NONBLOCK_) || (flags & MSG_DONTWAIT_);
+    bool peek = flags & MSG_PEEK_;
+    if (size == 0)
+        return 0;
+
+    size_t copied = 0;
+    ssize_t err = 0;
+    lock(&sock->recv_lock);
+    lock(&unix_lock);
+    while (copied < size) {
+        err = unix_recv_wait(fd, nonblock);
+        if (err <= 0)
+            break;
+
+        // with recv_lock held the queued messages can only be added to, so
+        // each one is copied out with unix_lock dropped
+        struct unix_msg *msg = list_first_entry(&sock->queue, struct unix_msg, queue);
+        while (true) {
+            size_t count = msg->size - msg->offset;
+            if (count > size - copied)
+                count = size - copied;
+            unlock(&unix_lock);
+            err = unix_msghdr_copy(msghdr, copied, msg->data + msg->offset, count, false);
+            lock(&unix_lock);
+            if (err < 0)
+                break;
+            copied += count;
+            // fds go with the data they were sent with
+            bool had_fds = msg->fds_count > 0;
+            struct unix_msg *next = NULL;
+            if (msg->queue.next != &sock->queue)
+                next = list_next_entry(msg, queue);
+            if (!peek) {
+                unix_recv_fds(msghdr, msg);
+                msg->offset += count;
+                sock->queued -= count;
+                if (msg->offset == msg->size) {
+                    list_remove(&msg->queue);
+                    free(msg);
+                }
+            }
+            if (had_fds || copied == size || next == NULL)
+                break;
+            msg = next;
+        }
+        if (err < 0 || peek || msghdr->fds_count > 0 || !(flags & MSG_WAITALL_))
+            break;
+    }
+    struct unix_sock *peer = sock->peer;
+    if (copied > 0 && !peek) {
+        notify(&sock->cond);
+        if (peer != NULL)
+            unix_get(peer);
+    } else {
+        peer = NULL;
+    }
+    unlock(&unix_lock);
+    unlock(&sock->recv_lock);
+
+    // the peer might have been waiting for room to write
+    if (peer != NULL) {
+        unix_wakeup(peer);
+        unix_release(peer);
+    }
+    if (copied > 0)
+        return copied;
+    return err;
+}
+
+static ssize_t unix_dgram_recv(struct fd *fd, struct unix_msghdr *msghdr, int flags) {
+    struct unix_sock *sock = fd->unix_sock;
+    size_t size = unix_msghdr_size(msghdr);
+    bool nonblock = (fd->flags & O_NONBLOCK_) || (flags & MSG_DONTWAIT_);
+
+    lock(&sock->recv_lock);
+    lock(&unix_lock);
+    ssize_t err = unix_recv_wait(fd, nonblock);
+    if (err <= 0)
+        goto out;
+    // recv_lock keeps the message at the front of the queue while it's copied
+    struct unix_msg *msg = list_first_entry(&sock->queue, struct unix_msg, queue);
+    size_t count = msg->size < size ? msg->size : size;
+    unlock(&unix_lock);
+    err = unix_msghdr_copy(msghdr, 0, msg->data, count, false);
+    lock(&unix_lock);
+    if (err < 0)
+        goto out;
+    msghdr->name = msg->from;
+    msghdr->namelen = msg->from_len;
+    if (count < msg->size)
+        msghdr->flags |= MSG_TRUNC_;
+    ssize_t res = (flags & MSG_TRUNC_) ? msg->size : count;
+    if (!(flags & MSG_PEEK_)) {
+        unix_recv_fds(msghdr, msg);
+        list_remove(&msg->queue);
+        sock->queued -= msg->size;
+        sock->queued_msgs--;
+        notify(&sock->cond);
+    } else {
+        msg = NULL;
+    }
+    unlock(&unix_lock);
+    unlock(&sock->recv_lock);
+    if (msg != NULL)
+        unix_msg_free(msg);
+    return res;
+
+out:
+    unlock(&unix_lock);
+    unlock(&sock->recv_lock);
+    return err;
+}
+
+ssize_t unix_recvmsg(struct fd *fd, struct unix_msghdr *msghdr, int flags) {
+    msghdr->namelen = 0;
+    msghdr->fds = NULL;
+    msghdr->fds_count = 0;
+    msghdr->flags = 0;
+    ssize_t res;
+    if (unix_is_stream(fd->unix_sock))
+        res = unix_stream_recv(fd, msghdr, flags);
+    else
+        res = unix_dgram_recv(fd, msghdr, flags);
+    if (res < 0) {
+        unix_msghdr_drop_fds(msghdr);
+        free(msghdr->fds);
+        msghdr->fds = NULL;
+    }
+    return res;
+}
+
+int unix_shutdown(struct fd *fd, int how) {
+    struct unix_sock *sock = fd->unix_sock;
+    if (how < 0 || how > 2)
+        return _EINVAL;
+    bool rd = how == 0 || how == 2;
+    bool wr = how == 1 || how == 2;
+    struct unix_sock *peer = NULL;
+    lock(&unix_lock);
+    if (rd)
+        sock->shut_rd = true;
+    if (wr)
+        sock->shut_wr = true;
+    notify(&sock->cond);
+    if (unix_is_connection(sock) && sock->peer != NULL) {
+        peer = sock->peer;
+        if (rd)
+            peer->shut_wr = true;
+        if (wr)
+            peer->shut_rd = true;
+        notify(&peer->cond);
+        unix_get(peer);
+    }
+    unix_get(sock);
+    unlock(&unix_lock);
+
+    unix_wakeup(sock);
+    unix_release(sock);
+    if (peer != NULL) {
+        unix_wakeup(peer);
+        unix_release(peer);
+    }
+    return 0;
+}
+
+int unix_setsockopt(struct fd *UNUSED(fd), int level, int option, const void *UNUSED(value), uint_t UNUSED(value_len)) {
+    if (level != SOL_SOCKET_)
+        return _ENOPROTOOPT;
+    switch (option) {
+        // the buffers are a fixed size and credentials aren't sent
+        case SO_REUSEADDR_:
+        case SO_SNDBUF_:
+        case SO_RCVBUF_:
+        case SO_PASSCRED_:
+            return 0;
+    }
+    return _ENOPROTOOPT;
+}
+
+int unix_getsockopt(struct fd *fd, int level, int option, void *value, uint_t *value_len) {
+    struct unix_sock *sock = fd->unix_sock;
+    if (level != SOL_SOCKET_)
+        return _ENOPROTOOPT;
+    dword_t result;
+    lock(&unix_lock);
+    switch (option) {
+        case SO_TYPE_:
+            result = sock->type;
+            break;
+        case SO_DOMAIN_:
+            result = AF_LOCAL_;
+            break;
+        case SO_PROTOCOL_:
+        case SO_ERROR_:
+        case SO_PASSCRED_:
+        case SO_REUSEADDR_:
+            result = 0;
+            break;
+        case SO_ACCEPTCONN_:
+            result = sock->state == UNIX_LISTENING;
+            break;
+        case SO_SNDBUF_:
+        case SO_RCVBUF_:
+            result = UNIX_BUF_SIZE;
+            break;
+        case SO_PEERCRED_: {
+            struct ucred_ cred = sock->peer_cred;
+            unlock(&unix_lock);
+            if (*value_len > sizeof(cred))
+                *value_len = sizeof(cred);
+            memcpy(value, &cred, *value_len);
+            return 0;
+        }
+        default:
+            unlock(&unix_lock);
+            return _ENOPROTOOPT;
+    }
+    unlock(&unix_lock);
+    if (*value_len > sizeof(result))
+        *value_len = sizeof(result);
+    memcpy(value, &result, *value_len);
+    return 0;
+}
+
+// fd ops
+
+// read() has nowhere to put fds, so they get closed like recvfrom does
+static ssize_t unix_read_msghdr(struct fd *fd, struct unix_msghdr *msghdr) {
+    ssize_t res = unix_recvmsg(fd, msghdr, 0);
+    if (res < 0)
+        return res;
+    unix_msghdr_drop_fds(msghdr);
+    free(msghdr->fds);
+    return res;
+}
+static ssize_t unix_read(struct fd *fd, void *buf, size_t bufsize) {
+    struct unix_msghdr msghdr = {.buf = buf, .bufsize = bufsize};
+    return unix_read_msghdr(fd, &msghdr);
+}
+static ssize_t unix_read_user(struct fd *fd, addr_t addr, size_t bufsize) {
+    struct iovec_ iov = {.iov_base = addr, .iov_len = bufsize};
+    struct unix_msghdr msghdr = {.iov = &iov, .iovlen = 1};
+    return unix_read_msghdr(fd, &msghdr);
+}
+static ssize_t unix_write(struct fd *fd, const void *buf, size_t bufsize) {
+    struct unix_msghdr msghdr = {.buf = (char *) buf, .bufsize = bufsize};
+    return unix_sendmsg(fd, &msghdr, 0);
+}
+static ssize_t unix_write_user(struct fd *fd, addr_t addr, size_t bufsize) {
+    struct iovec_ iov = {.iov_base = addr, .iov_len = bufsize};
+    struct unix_msghdr msghdr = {.iov = &iov, .iovlen = 1};
+    return unix_sendmsg(fd, &msghdr, 0);
+}
+
+static off_t_ unix_lseek(struct fd *UNUSED(fd), off_t_ UNUSED(off), int UNUSED(whence)) {
+    return _ESPIPE;
+}
+
+static int unix_poll(struct fd *fd) {
+    struct unix_sock *sock = fd->unix_sock;
+    int types = 0;
+    lock(&unix_lock);
+    if (!list_empty(&sock->queue) || sock->shut_rd)
+        types |= POLL_READ;
+    if (sock->state == UNIX_LISTENING) {
+        // only readable
+    } else if (unix_is_connection(sock)) {
+        struct unix_sock *peer = sock->peer;
+        if (sock->state != UNIX_CONNECTED || sock->shut_wr ||
+                (peer != NULL && peer->queued < UNIX_BUF_SIZE))
+            types |= POLL_WRITE;
+        if (sock->state != UNIX_CONNECTED || (sock->shut_rd && sock->shut_wr))
+            types |= POLL_HUP;
+    } else {
+        struct unix_sock *peer = sock->peer;
+        if (peer == NULL || peer->closed || peer->queued_msgs < UNIX_DGRAM_QLEN)
+            types |= POLL_WRITE;
+    }
+    unlock(&unix_lock);
+    return types;
+}
+
+static ssize_t unix_ioctl_size(int cmd) {
+    if (cmd == FIONREAD_)
+        return sizeof(dword_t);
+    return -1;
+}
+
+static int unix_ioctl(struct fd *fd, int cmd, void *arg) {
+    struct unix_sock *sock = fd->unix_sock;
+    if (cmd != FIONREAD_)
+        return _ENOTTY;
+    lock(&unix_lock);
+    dword_t count = 0;
+    if (sock->state != UNIX_LISTENING) {
+        if (unix_is_stream(sock))
+            count = sock->queued;
+        else if (!list_empty(&sock->queue))
+            count = list_first_entry(&sock->queue, struct unix_msg, queue)->size;
+    }
+    unlock(&unix_lock);
+    *(dword_t *) arg = count;
+    return 0;
+}
+
+const struct fd_ops unix_socket_fdops = {
+    .read = unix_read,
+    .write = unix_write,
+    .read_user = unix_read_user,
+    .write_user = unix_write_user,
+    .lseek = unix_lseek,
+    .poll = unix_poll,
+    .ioctl_size = unix_ioctl_size,
+    .ioctl = unix_ioctl,
+    .close = unix_close,
+};
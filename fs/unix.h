@@ -0,0 +1,54 @@
+#ifndef FS_UNIX_H
+#define FS_UNIX_H
+#include "fs/fd.h"
+#include "fs/sock.h"
+
+// Unix domain sockets, implemented entirely inside ish. Paths are bound in
+// the emulated filesystem, and data never goes near the host.
+
+struct sockaddr_un_ {
+    uint16_t family;
+    char path[108];
+};
+
+struct ucred_ {
+    pid_t_ pid;
+    uid_t_ uid;
+    uid_t_ gid;
+};
+
+// One message going in or out. The data comes from the iovecs, which point to
+// the guest's memory, or from buf if iov is NULL.
+struct unix_msghdr {
+    struct iovec_ *iov;
+    uint_t iovlen;
+    char *buf;
+    size_t bufsize;
+    // the destination for send if namelen isn't 0, the source for recv
+    struct sockaddr_un_ name;
+    uint_t namelen;
+    // SCM_RIGHTS. For send, references to these are consumed. For recv, fds_max
+    // is how many will fit, and the fds array is allocated with malloc.
+    struct fd **fds;
+    unsigned fds_count;
+    unsigned fds_max;
+    // MSG_* flags set by recv
+    int flags;
+};
+
+extern const struct fd_ops unix_socket_fdops;
+
+struct fd *unix_socket_create(int type);
+int unix_socketpair(int type, struct fd *fds[2]);
+int unix_bind(struct fd *sock, struct sockaddr_un_ *addr, uint_t addr_len);
+int unix_connect(struct fd *sock, struct sockaddr_un_ *addr, uint_t addr_len);
+int unix_listen(struct fd *sock, int backlog);
+struct fd *unix_accept(struct fd *sock, struct sockaddr_un_ *addr, uint_t *addr_len);
+int unix_getname(struct fd *sock, bool peer, struct sockaddr_un_ *addr, uint_t *addr_len);
+ssize_t unix_sendmsg(struct fd *sock, struct unix_msghdr *msg, int flags);
+ssize_t unix_recvmsg(struct fd *sock, struct unix_msghdr *msg, int flags);
+int unix_shutdown(struct fd *sock, int how);
+int unix_setsockopt(struct fd *sock, int level, int option, const void *value, uint_t value_len);
+int unix_getsockopt(struct fd *sock, int level, int option, void *value, uint_t *value_len);
+
+#endif
@@ -160,7 +160,8 @@ void cpu_run(struct cpu_state *cpu) {
 
         TRACE("%d %08x --- cycle %d\n", current->pid, ip, i);
         int interrupt = jit_enter(block, &frame, &tlb);
-        if (interrupt == INT_NONE && ++i % (1 << 10) == 0)
+        i++;
+        if (interrupt == INT_NONE && cpu_poked(cpu))
             interrupt = INT_TIMER;
         if (interrupt != INT_NONE) {
             *cpu = frame.cpu;
@@ -186,17 +187,14 @@ void cpu_run(struct cpu_state *cpu) {
 #else
 
 void cpu_run(struct cpu_state *cpu) {
-    int i = 0;
     struct tlb tlb = {.mem = cpu->mem};
     tlb_flush(&tlb);
     read_wrlock(&cpu->mem->lock);
     int changes = cpu->mem->changes;
     while (true) {
         int interrupt = cpu_step32(cpu, &tlb);
-        if (interrupt == INT_NONE && i++ >= 100000) {
-            i = 0;
+        if (interrupt == INT_NONE && cpu_poked(cpu))
             interrupt = INT_TIMER;
-        }
         if (interrupt != INT_NONE) {
             cpu->trapno = interrupt;
             read_wrunlock(&cpu->mem->lock);
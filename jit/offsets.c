@@ -48,7 +48,9 @@ void cpu() {
     OFFSET(LOCAL, jit_frame, value_addr);
     OFFSET(LOCAL, jit_frame, last_block);
     OFFSET(CPU, cpu_state, segfault_addr);
+    OFFSET(CPU, cpu_state, poked_ptr);
 
+    OFFSET(JIT_BLOCK, jit_block, addr);
     OFFSET(JIT_BLOCK, jit_block, code);
 
     OFFSET(TLB, tlb, entries);
@@ -32,6 +32,7 @@ syscall_t syscall_table[] = {
     [23]  = (syscall_t) sys_setuid,
     [24]  = (syscall_t) sys_getuid,
     [33]  = (syscall_t) sys_access,
+    [36]  = (syscall_t) sys_sync,
     [37]  = (syscall_t) sys_kill,
     [38]  = (syscall_t) sys_rename,
     [39]  = (syscall_t) sys_mkdir,
@@ -71,6 +72,7 @@ syscall_t syscall_table[] = {
     [102] = (syscall_t) sys_socketcall,
     [103] = (syscall_t) sys_syslog,
     [104] = (syscall_t) sys_setitimer,
+    [105] = (syscall_t) sys_getitimer,
     [114] = (syscall_t) sys_wait4,
     [116] = (syscall_t) sys_sysinfo,
     [118] = (syscall_t) sys_fsync,
@@ -140,6 +142,11 @@ syscall_t syscall_table[] = {
     [255] = (syscall_t) sys_epoll_ctl,
     [256] = (syscall_t) sys_epoll_wait,
     [258] = (syscall_t) sys_set_tid_address,
+    [259] = (syscall_t) sys_timer_create,
+    [260] = (syscall_t) sys_timer_settime,
+    [261] = (syscall_t) sys_timer_gettime,
+    [262] = (syscall_t) sys_timer_getoverrun,
+    [263] = (syscall_t) sys_timer_delete,
     [264] = (syscall_t) sys_clock_settime,
     [265] = (syscall_t) sys_clock_gettime,
     [266] = (syscall_t) sys_clock_getres,
@@ -165,10 +172,13 @@ syscall_t syscall_table[] = {
     [322] = (syscall_t) sys_timerfd_create,
     [323] = (syscall_t) sys_eventfd,
     [324] = (syscall_t) sys_fallocate,
+    [325] = (syscall_t) sys_timerfd_settime,
+    [326] = (syscall_t) sys_timerfd_gettime,
     [328] = (syscall_t) sys_eventfd2,
     [329] = (syscall_t) sys_epoll_create,
     [331] = (syscall_t) sys_pipe2,
     [340] = (syscall_t) sys_prlimit,
+    [344] = (syscall_t) sys_syncfs,
     [355] = (syscall_t) sys_getrandom,
     [377] = (syscall_t) sys_copy_file_range,
 };
@@ -176,6 +186,9 @@ syscall_t syscall_table[] = {
 void handle_interrupt(int interrupt) {
     TRACE_(instr, "\n");
     struct cpu_state *cpu = &current->cpu;
+    __atomic_store_n(&current->run_state, TASK_IN_KERNEL, __ATOMIC_SEQ_CST);
+    // everything since the last interrupt was spent running guest code
+    cpu_timers_charge(true);
     if (interrupt == INT_SYSCALL) {
         int syscall_num = cpu->eax;
         if (syscall_num >= NUM_SYSCALLS || syscall_table[syscall_num] == NULL) {
@@ -205,6 +218,7 @@ void handle_interrupt(int interrupt) {
         sys_exit(interrupt);
     }
 
+    cpu_timers_charge(false);
     while (receive_signals()) {
         struct tgroup *group = current->group;
         lock(&group->lock);
@@ -212,6 +226,8 @@ void handle_interrupt(int interrupt) {
             wait_for_ignore_signals(&group->stopped_cond, &group->lock, NULL);
         unlock(&group->lock);
     }
+    // a signal sent from now on will poke this task back out of guest code
+    __atomic_store_n(&current->run_state, TASK_IN_GUEST, __ATOMIC_SEQ_CST);
 }
 
 void dump_stack() {
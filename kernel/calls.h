@@ -81,6 +81,8 @@ dword_t sys_dup(fd_t fd);
 dword_t sys_dup2(fd_t fd, fd_t new_fd);
 dword_t sys_close(fd_t fd);
 dword_t sys_fsync(fd_t f);
+dword_t sys_syncfs(fd_t f);
+dword_t sys_sync(void);
 dword_t sys_flock(fd_t fd, dword_t operation);
 int_t sys_pipe(addr_t pipe_addr);
 int_t sys_pipe2(addr_t pipe_addr, int_t flags);
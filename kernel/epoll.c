@@ -28,6 +28,8 @@ struct epoll_event_ {
 #define EPOLL_CTL_MOD_ 3
 #define EPOLLET_ (1 << 31)
 #define EPOLLONESHOT_ (1 << 30)
+// always reported even if not asked for
+#define EPOLL_ALWAYS_LISTENING (POLL_ERR|POLL_HUP)
 
 int_t sys_epoll_ctl(fd_t epoll_f, int_t op, fd_t f, addr_t event_addr) {
     STRACE("epoll_ctl(%d, %d, %d, %#x)", epoll_f, op, f, event_addr);
@@ -47,15 +49,18 @@ int_t sys_epoll_ctl(fd_t epoll_f, int_t op, fd_t f, addr_t event_addr) {
     if (user_get(event_addr, event))
         return _EFAULT;
     STRACE(" {events: %#x, data: %#x}", event.events, event.data);
-    if (event.events & (EPOLLET_|EPOLLONESHOT_))
-        return _EINVAL;
+    int types = event.events | EPOLL_ALWAYS_LISTENING;
+    if (event.events & EPOLLET_)
+        types |= POLL_EDGE;
+    if (event.events & EPOLLONESHOT_)
+        types |= POLL_ONESHOT;
 
     if (op == EPOLL_CTL_ADD_) {
         if (poll_has_fd(epoll->poll, fd))
             return _EEXIST;
-        return poll_add_fd(epoll->poll, fd, event.events, (union poll_fd_info) event.data);
+        return poll_add_fd(epoll->poll, fd, types, (union poll_fd_info) event.data);
     } else {
-        return poll_mod_fd(epoll->poll, fd, event.events, (union poll_fd_info) event.data);
+        return poll_mod_fd(epoll->poll, fd, types, (union poll_fd_info) event.data);
     }
 }
 
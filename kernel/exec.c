@@ -161,10 +161,9 @@ static int elf_exec(struct fd *fd, const char *file, char *const argv[], char *c
     // from this point on, if any error occurs the process will have to be
     // killed before it even starts. please don't be too sad about it, it's
     // just a process.
-    mm_release(current->mm);
-    current->mm = mm_new();
-    current->mem = current->cpu.mem = &current->mm->mem;
-    write_wrlock(&current->mem->lock);
+    mm_remove_task(current);
+    mm_add_task(mm_new(), current);
+    mm_write_lock(current->mm);
 
     current->mm->exefile = fd_retain(fd);
 
@@ -542,6 +541,7 @@ int sys_execve(const char *file, char *const argv[], char *const envp[]) {
     // cloexec
     // consider putting this in fd.c?
     fdtable_do_cloexec(current->files);
+    tgroup_exec_timers(current->group);
 
     // reset signal handlers
     lock(&current->sighand->lock);
@@ -4,20 +4,22 @@
 #include "kernel/mm.h"
 #include "kernel/futex.h"
 #include "fs/fd.h"
+#include "fs/poll.h"
 
 static void halt_system(int status);
 
-static bool exit_tgroup(struct task *task) {
+static bool exit_tgroup(struct task *task, struct posix_timer **timers) {
     struct tgroup *group = task->group;
     list_remove(&task->group_links);
     bool group_dead = list_empty(&group->threads);
     if (group_dead) {
         lock(&group->lock);
-        if (group->timer)
-            timer_free(group->timer);
+        *timers = tgroup_orphan_timers(group);
         unlock(&group->lock);
         list_remove(&group->pgroup);
         list_remove(&group->session);
+        pid_release(group->pgid);
+        pid_release(group->sid);
     }
     return group_dead;
 }
@@ -32,23 +34,33 @@ noreturn void do_exit(int status) {
     }
 
     // release all our resources
-    mm_release(current->mm);
+    mm_remove_task(current);
+    if (current->poll != NULL)
+        poll_destroy(current->poll);
     fdtable_release(current->files);
     fs_info_release(current->fs);
-    sighand_release(current->sighand);
 
     // save things that our parent might be interested in
     current->exit_code = status; // FIXME locking
+
+    // the actual freeing needs pids_lock
+    lock(&pids_lock);
+    // send_signal looks at the sighand with pids_lock
+    sighand_release(current->sighand);
+    current->sighand = NULL;
+    // this thread's CPU time moves to the group at the same time it leaves
+    // the group, so the process CPU clock doesn't count it twice
     struct rusage_ rusage = rusage_get_current();
     lock(&current->group->lock);
     rusage_add(&current->group->rusage, &rusage);
     unlock(&current->group->lock);
-
-    // the actual freeing needs pids_lock
-    lock(&pids_lock);
+    // nothing left to wake up for
+    __atomic_store_n(&current->run_state, TASK_EXITED, __ATOMIC_SEQ_CST);
     struct task *leader = current->group->leader;
 
-    if (exit_tgroup(current)) {
+    // freeing the timers waits for their callbacks, which take pids_lock
+    struct posix_timer *timers = NULL;
+    if (exit_tgroup(current, &timers)) {
         // reparent children
         struct task *new_parent = pid_get_task(1);
         struct task *child;
@@ -62,7 +74,7 @@ noreturn void do_exit(int status) {
             // init died
             halt_system(status);
         } else {
-            leader->zombie = true;
+            task_make_zombie(leader);
             notify(&parent->group->child_exit);
             send_signal(parent, leader->exit_signal);
         }
@@ -72,6 +84,7 @@ noreturn void do_exit(int status) {
     if (current != leader)
         task_destroy(current);
     unlock(&pids_lock);
+    posix_timers_free(timers);
 
     pthread_exit(NULL);
 }
@@ -101,9 +114,13 @@ noreturn void do_exit_group(int status) {
 void (*exit_hook)(int code) = NULL;
 // always called from init process
 static void halt_system(int status) {
+    // flush filesystems while everything is still alive, since a mount can
+    // be too busy to unmount below
+    sys_sync();
+
     // brutally murder everything
     // which will leave everything in an inconsistent state. I will solve this problem later.
-    for (int i = 2; i < MAX_PID; i++) {
+    for (dword_t i = pid_next_task(1); i != 0; i = pid_next_task(i)) {
         struct task *task = pid_get_task(i);
         if (task != NULL)
             pthread_kill(task->thread, SIGKILL);
@@ -1,3 +1,4 @@
+#include <string.h>
 #include "debug.h"
 #include "kernel/task.h"
 #include "fs/fd.h"
@@ -40,7 +41,9 @@ static struct tgroup *tgroup_copy(struct tgroup *old_group) {
     list_add(&old_group->session, &group->session);
     if (group->tty)
         group->tty->refcount++;
-    group->timer = NULL;
+    memset(group->itimers, 0, sizeof(group->itimers));
+    memset(group->posix_timers, 0, sizeof(group->posix_timers));
+    group->cpu_timers_armed = 0;
     group->doing_group_exit = false;
     group->children_rusage = (struct rusage_) {};
     cond_init(&group->child_exit);
@@ -56,12 +59,11 @@ static int copy_task(struct task *task, dword_t flags, addr_t stack, addr_t ptid
 
     int err;
     struct mm *mm = task->mm;
-    if (flags & CLONE_VM_) {
+    if (flags & CLONE_VM_)
         mm_retain(mm);
-    } else {
-        task->mm = mm_copy(mm);
-        task->mem = task->cpu.mem = &task->mm->mem;
-    }
+    else
+        mm = mm_copy(mm);
+    mm_add_task(mm, task);
 
     if (flags & CLONE_FILES_) {
         task->files->refcount++;
@@ -129,7 +131,7 @@ fail_free_fs:
 fail_free_files:
     fdtable_release(task->files);
 fail_free_mem:
-    mm_release(task->mm);
+    mm_remove_task(task);
     return err;
 }
 
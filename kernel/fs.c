@@ -173,27 +173,24 @@ dword_t sys_mknod(addr_t path_addr, mode_t_ mode, dev_t_ dev) {
 
 dword_t sys_read(fd_t fd_no, addr_t buf_addr, dword_t size) {
     STRACE("read(%d, 0x%x, %d)", fd_no, buf_addr, size);
+    struct fd *fd = f_get(fd_no);
+    if (fd == NULL || fd->ops->read == NULL)
+        return _EBADF;
+    if (S_ISDIR(fd->type))
+        return _EISDIR;
+    if (fd->ops->read_user)
+        return fd->ops->read_user(fd, buf_addr, size);
+
     char *buf = (char *) malloc(size+1);
     if (buf == NULL)
         return _ENOMEM;
-    int_t res = 0;
-    struct fd *fd = f_get(fd_no);
-    if (fd == NULL || fd->ops->read == NULL) {
-        res = _EBADF;
-        goto out;
-    }
-    if (S_ISDIR(fd->type)) {
-        res = _EISDIR;
-        goto out;
-    }
-    res = fd->ops->read(fd, buf, size);
+    int_t res = fd->ops->read(fd, buf, size);
     if (res >= 0) {
         buf[res] = '\0';
         STRACE(" \"%.99s\"", buf);
         if (user_write(buf_addr, buf, res))
             res = _EFAULT;
     }
-out:
     free(buf);
     return res;
 }
@@ -226,6 +223,12 @@ err:
 }
 
 dword_t sys_write(fd_t fd_no, addr_t buf_addr, dword_t size) {
+    struct fd *fd = f_get(fd_no);
+    if (fd != NULL && fd->ops->write_user) {
+        STRACE("write(%d, %#x, %d)", fd_no, buf_addr, size);
+        return fd->ops->write_user(fd, buf_addr, size);
+    }
+
     // FIXME this is a DOS vector
     char *buf = malloc(size + 1);
     if (buf == NULL)
@@ -237,7 +240,6 @@ dword_t sys_write(fd_t fd_no, addr_t buf_addr, dword_t size) {
     }
     buf[size] = '\0';
     STRACE("write(%d, \"%.100s\", %d)", fd_no, buf, size);
-    struct fd *fd = f_get(fd_no);
     if (fd == NULL || fd->ops->write == NULL) {
         res = _EBADF;
         goto out;
@@ -679,9 +681,33 @@ dword_t sys_fsync(fd_t f) {
     int err = 0;
     if (fd->ops->fsync)
         err = fd->ops->fsync(fd);
+    if (err >= 0 && fd->mount && fd->mount->fs->sync)
+        err = fd->mount->fs->sync(fd->mount);
     return err;
 }
 
+dword_t sys_syncfs(fd_t f) {
+    STRACE("syncfs(%d)", f);
+    struct fd *fd = f_get(f);
+    if (fd == NULL)
+        return _EBADF;
+    if (fd->mount && fd->mount->fs->sync)
+        return fd->mount->fs->sync(fd->mount);
+    return 0;
+}
+
+dword_t sys_sync() {
+    STRACE("sync()");
+    lock(&mounts_lock);
+    struct mount *mount;
+    list_for_each_entry(&mounts, mount, mounts) {
+        if (mount->fs->sync)
+            mount->fs->sync(mount);
+    }
+    unlock(&mounts_lock);
+    return 0;
+}
+
 // a few stubs
 dword_t sys_sendfile(fd_t UNUSED(out_fd), fd_t UNUSED(in_fd), addr_t UNUSED(offset_addr), dword_t UNUSED(count)) {
     return _EINVAL;
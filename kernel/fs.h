@@ -67,6 +67,7 @@ int generic_mkdirat(struct fd *at, const char *path, mode_t_ mode);
 struct mount {
     const char *point;
     const char *source;
+    const char *options; // the data argument to mount, or NULL
     const struct fs_ops *fs;
     unsigned refcount;
     struct list mounts;
@@ -76,20 +77,48 @@ struct mount {
         void *data;
         struct {
             sqlite3 *db;
+            bool readonly; // opened with the ro option
             struct {
                 sqlite3_stmt *begin;
                 sqlite3_stmt *commit;
                 sqlite3_stmt *rollback;
+                sqlite3_stmt *savepoint;
+                sqlite3_stmt *release;
+                sqlite3_stmt *rollback_savepoint;
+                sqlite3_stmt *data_version;
                 sqlite3_stmt *path_get_inode;
                 sqlite3_stmt *path_read_stat;
                 sqlite3_stmt *path_create_stat;
                 sqlite3_stmt *path_create_path;
+                sqlite3_stmt *path_create_stat_inode;
                 sqlite3_stmt *inode_read_stat;
                 sqlite3_stmt *inode_write_stat;
                 sqlite3_stmt *path_link;
                 sqlite3_stmt *path_unlink;
                 sqlite3_stmt *path_rename;
             } stmt;
+            struct fakefs_cache *cache;
+            // bumped whenever the database is written
+            unsigned cache_gen;
+            // pragma data_version as of the last check, which changes when
+            // another connection commits
+            int64_t data_version;
+            bool in_transaction;
+            // the savepoint for the current operation in a batch
+            bool in_savepoint;
+            // read-only connections, see fake_lookup
+            struct list readers;
+            unsigned readers_count;
+            lock_t readers_lock;
+            // non-null while fake-rebuild.c is rebuilding in the background
+            struct fakefs_rebuild *rebuild;
+            pthread_t rebuild_thread;
+            bool rebuild_thread_running;
+            // group commit state, see db_commit
+            unsigned batch_ops;
+            struct timespec batch_start;
+            struct timer *batch_timer;
+            bool batch_timer_armed;
             lock_t lock;
         };
     };
@@ -99,9 +128,11 @@ extern lock_t mounts_lock;
 // returns a reference, which must be released
 struct mount *mount_find(char *path);
 void mount_release(struct mount *mount);
+// true if path or anything under it is a mount point
+bool contains_mount_point(const char *path);
 
 // must hold mounts_lock while calling these, or traversing mounts
-int do_mount(const struct fs_ops *fs, const char *source, const char *point);
+int do_mount(const struct fs_ops *fs, const char *source, const char *point, const char *options);
 int do_umount(const char *point);
 int mount_remove(struct mount *mount);
 extern struct list mounts;
@@ -111,6 +142,7 @@ extern struct list mounts;
 #define O_WRONLY_ (1 << 0)
 #define O_RDWR_ (1 << 1)
 #define O_CREAT_ (1 << 6)
+#define O_EXCL_ (1 << 7)
 #define O_NOCTTY_ (1 << 8)
 #define O_TRUNC_ (1 << 9)
 #define O_APPEND_ (1 << 10)
@@ -124,6 +156,16 @@ extern struct list mounts;
 struct fs_ops {
     const char *name;
     int magic;
+    // readlink results only change through the fs_ops below, so
+    // path_normalize may cache them
+    bool cache_links;
+    // nothing outside ish can make a path into a symlink either, so it may
+    // also cache that a path isn't one
+    bool cache_not_links;
+    // nothing but this mount can reach its files, unlike a host directory
+    // that may be mounted again or be an overlay's layer, so a change only
+    // has to be forgotten in this mount's cached links
+    bool private_storage;
 
     int (*mount)(struct mount *mount);
     int (*umount)(struct mount *mount);
@@ -155,6 +197,9 @@ struct fs_ops {
     int (*getpath)(struct fd *fd, char *buf);
 
     int (*flock)(struct fd *fd, int operation);
+
+    // Makes metadata changes durable, called by fsync, syncfs, and sync
+    int (*sync)(struct mount *mount);
 };
 
 struct mount *find_mount_and_trim_path(char *path);
@@ -175,6 +220,21 @@ int realfs_poll(struct fd *fd);
 int realfs_getflags(struct fd *fd);
 int realfs_setflags(struct fd *fd, dword_t arg);
 int realfs_close(struct fd *fd);
+int realfs_readdir_batch(struct fd *fd, struct dir_entry *entries, unsigned count);
+off_t realfs_lseek(struct fd *fd, off_t offset, int whence);
+
+// fake fs, shared by the sqlite and flat file metadata stores
+struct ish_stat {
+    dword_t mode;
+    dword_t uid;
+    dword_t gid;
+    dword_t rdev;
+};
+void fake_stat_setattr(struct ish_stat *ishstat, struct attr attr);
+// symlinks are stored as regular files containing the target
+int fake_symlink_file(struct mount *mount, const char *target, const char *link);
+ssize_t fake_file_readlink(struct mount *mount, const char *path, char *buf, size_t bufsize);
+int fakefs_create(const char *dir);
 
 // adhoc fs
 struct fd *adhoc_fd_create(const struct fd_ops *ops);
@@ -183,6 +243,9 @@ struct fd *adhoc_fd_create(const struct fd_ops *ops);
 extern const struct fs_ops realfs;
 extern const struct fs_ops procfs;
 extern const struct fs_ops fakefs;
+extern const struct fs_ops fakeflatfs;
 extern const struct fs_ops devptsfs;
+extern const struct fs_ops tmpfs;
+extern const struct fs_ops overlayfs;
 
 #endif
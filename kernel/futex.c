@@ -1,118 +1,490 @@
 #include "kernel/calls.h"
 
+// Private futexes are identified by address space and address. Shared ones
+// are identified by the memory backing them, so that every process mapping
+// the same pages finds the same futex: the file and offset for a mapping of
+// a file, or the struct data and offset for shared anonymous memory.
+struct futex_key {
+    void *object; // a struct mem, a struct data, or NULL for a file
+    uint64_t dev, ino; // the file, if it's one
+    uint64_t offset;
+    // For shared futexes, a reference to the memory, which keeps what the key
+    // names from going away and having the key reused while it's in use.
+    // Not part of the identity, since separate mappings of a file have
+    // different data.
+    struct data *data;
+};
+
+static bool futex_key_equal(struct futex_key a, struct futex_key b) {
+    return a.object == b.object && a.dev == b.dev && a.ino == b.ino && a.offset == b.offset;
+}
+
+static void futex_key_put(struct futex_key *key) {
+    if (key->data != NULL)
+        data_release(key->data);
+}
+
 struct futex {
-    atomic_uint refcount;
-    struct mem *mem;
-    addr_t addr;
+    unsigned refcount; // locked by the bucket lock
+    struct futex_key key; // holds its own reference to the data
+    struct list queue; // list of futex_wait, locked by the bucket lock
+    struct list chain; // locked by the bucket lock
+};
+
+// one of these lives on the stack of each thread sleeping in futex_wait
+struct futex_wait {
+    lock_t lock;
     cond_t cond;
-    struct list chain; // locked by futex_hash_lock
+    bool woken; // locked by lock
+    dword_t bitset;
+    // these can be changed by a requeue, and are locked by the bucket lock.
+    // the waiter holds a reference to futex.
+    struct futex *futex;
+    struct futex_bucket *bucket;
+    struct list queue;
 };
 
 #define FUTEX_HASH_BITS 12
 #define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
-static lock_t futex_lock = LOCK_INITIALIZER;
-static struct list futex_hash[FUTEX_HASH_SIZE];
+struct futex_bucket {
+    lock_t lock;
+    struct list chain;
+};
+static struct futex_bucket futex_hash[FUTEX_HASH_SIZE];
 
 static void __attribute__((constructor)) init_futex_hash() {
-    for (int i = 0; i < FUTEX_HASH_SIZE; i++)
-        list_init(&futex_hash[i]);
+    for (int i = 0; i < FUTEX_HASH_SIZE; i++) {
+        lock_init(&futex_hash[i].lock);
+        list_init(&futex_hash[i].chain);
+    }
+}
+
+static struct futex_bucket *futex_bucket(struct futex_key key) {
+    unsigned long hash = (key.offset >> 2) ^ ((unsigned long) key.object >> 4) ^ key.ino * 31;
+    return &futex_hash[hash % FUTEX_HASH_SIZE];
+}
+
+// On success, the key has to be given to futex_key_put when done with it.
+static int futex_key(addr_t addr, bool private, struct futex_key *key) {
+    if (addr % sizeof(dword_t) != 0)
+        return _EINVAL;
+    *key = (struct futex_key) {.object = current->mem, .offset = addr};
+    if (private)
+        return 0;
+
+    int err = 0;
+    read_wrlock(&current->mem->lock);
+    struct pt_entry *entry = mem_pt(current->mem, PAGE(addr));
+    if (entry == NULL) {
+        err = _EFAULT;
+    } else if (entry->flags & P_SHARED) {
+        struct data *data = entry->data;
+        data_retain(data);
+        key->data = data;
+        key->offset = entry->offset + PGOFFSET(addr);
+        if (data->file) {
+            key->object = NULL;
+            key->dev = data->file_dev;
+            key->ino = data->file_ino;
+            key->offset += data->file_offset;
+        } else {
+            key->object = data;
+        }
+    }
+    read_wrunlock(&current->mem->lock);
+    return err;
+}
+
+// Locks two buckets in a consistent order. They may be the same bucket.
+static void lock_buckets(struct futex_bucket *a, struct futex_bucket *b) {
+    if (a > b) {
+        struct futex_bucket *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    lock(&a->lock);
+    if (a != b)
+        lock(&b->lock);
+}
+static void unlock_buckets(struct futex_bucket *a, struct futex_bucket *b) {
+    unlock(&a->lock);
+    if (a != b)
+        unlock(&b->lock);
 }
 
-// returns the futex for the current process at the given addr, and locks it
-static struct futex *futex_get(addr_t addr) {
-    int hash = (addr ^ (unsigned long) current->mem) % FUTEX_HASH_SIZE;
-    lock(&futex_lock);
-    struct list *bucket = &futex_hash[hash];
+// returns the futex with the given key with a new reference, creating it if
+// create is set. the bucket must be locked.
+static struct futex *futex_find(struct futex_bucket *bucket, struct futex_key key, bool create) {
     struct futex *futex;
-    list_for_each_entry(bucket, futex, chain) {
-        if (futex->addr == addr && futex->mem == current->mem) {
+    list_for_each_entry(&bucket->chain, futex, chain) {
+        if (futex_key_equal(futex->key, key)) {
             futex->refcount++;
             return futex;
         }
     }
+    if (!create)
+        return NULL;
 
     futex = malloc(sizeof(struct futex));
-    if (futex == NULL) {
-        unlock(&futex_lock);
+    if (futex == NULL)
         return NULL;
-    }
     futex->refcount = 1;
-    futex->mem = current->mem;
-    futex->addr = addr;
-    cond_init(&futex->cond);
-    list_add(bucket, &futex->chain);
+    futex->key = key;
+    if (key.data != NULL)
+        data_retain(key.data);
+    list_init(&futex->queue);
+    list_add(&bucket->chain, &futex->chain);
     return futex;
 }
 
-// must be called on the result of futex_get when you're done with it
-static void futex_put(struct futex *futex) {
+// drops a reference from futex_find, the bucket must be locked
+static void futex_release(struct futex *futex) {
     if (--futex->refcount == 0) {
-        cond_destroy(&futex->cond);
+        assert(list_empty(&futex->queue));
         list_remove(&futex->chain);
+        futex_key_put(&futex->key);
         free(futex);
     }
-    unlock(&futex_lock);
 }
 
-static int futex_load(struct futex *futex, dword_t *out) {
-    assert(futex->mem == current->mem);
-    dword_t *ptr = mem_ptr(current->mem, futex->addr, MEM_READ);
+static int futex_load(addr_t addr, dword_t *out) {
+    dword_t *ptr = mem_ptr(current->mem, addr, MEM_READ);
     if (ptr == NULL)
         return 1;
-    *out = *ptr;
+    *out = __atomic_load_n(ptr, __ATOMIC_SEQ_CST);
     return 0;
 }
 
-int futex_wait(addr_t uaddr, dword_t val, struct timespec *timeout) {
-    struct futex *futex = futex_get(uaddr);
-    int err = 0;
+// wakes up to max waiters matching bitset, the bucket must be locked
+static int futex_wakelocked(struct futex *futex, dword_t max, dword_t bitset) {
+    int woken = 0;
+    struct futex_wait *wait, *tmp;
+    list_for_each_entry_safe(&futex->queue, wait, tmp, queue) {
+        if ((dword_t) woken >= max)
+            break;
+        if (!(wait->bitset & bitset))
+            continue;
+        list_remove(&wait->queue);
+        lock(&wait->lock);
+        wait->woken = true;
+        notify_once(&wait->cond);
+        unlock(&wait->lock);
+        woken++;
+    }
+    return woken;
+}
+
+// timeout is an absolute time on the monotonic clock
+static int futex_wait(addr_t uaddr, bool private, dword_t val, dword_t bitset, struct timespec *timeout) {
+    struct futex_key key;
+    int err = futex_key(uaddr, private, &key);
+    if (err < 0)
+        return err;
+    struct futex_bucket *bucket = futex_bucket(key);
+    lock(&bucket->lock);
+    struct futex *futex = futex_find(bucket, key, true);
+    futex_key_put(&key);
+    if (futex == NULL) {
+        unlock(&bucket->lock);
+        return _ENOMEM;
+    }
     dword_t tmp;
-    if (futex_load(futex, &tmp))
+    if (futex_load(uaddr, &tmp)) {
         err = _EFAULT;
-    else if (tmp != val)
+    } else if (tmp != val) {
         err = _EAGAIN;
-    else
-        err = wait_for(&futex->cond, &futex_lock, timeout);
-    futex_put(futex);
+    } else {
+        struct futex_wait wait;
+        lock_init(&wait.lock);
+        cond_init(&wait.cond);
+        wait.woken = false;
+        wait.bitset = bitset;
+        wait.futex = futex;
+        wait.bucket = bucket;
+        list_add_before(&futex->queue, &wait.queue);
+
+        // take the waiter's lock before dropping the bucket lock, so a wakeup
+        // can't get in between and be lost
+        lock(&wait.lock);
+        unlock(&bucket->lock);
+        while (!wait.woken && err == 0) {
+            if (timeout == NULL) {
+                err = wait_for(&wait.cond, &wait.lock, NULL);
+            } else {
+                struct timespec remaining = timespec_subtract(*timeout, timespec_now());
+                if (!timespec_positive(remaining))
+                    err = _ETIMEDOUT;
+                else
+                    err = wait_for(&wait.cond, &wait.lock, &remaining);
+            }
+        }
+        unlock(&wait.lock);
+
+        // a requeue may have moved us to another bucket while we were unlocked
+        while (true) {
+            bucket = __atomic_load_n(&wait.bucket, __ATOMIC_SEQ_CST);
+            lock(&bucket->lock);
+            if (bucket == wait.bucket)
+                break;
+            unlock(&bucket->lock);
+        }
+        futex = wait.futex;
+        // if a waker got to us first it already took us off the queue
+        if (list_null(&wait.queue))
+            err = 0;
+        else
+            list_remove(&wait.queue);
+        cond_destroy(&wait.cond);
+    }
+    futex_release(futex);
+    unlock(&bucket->lock);
     return err;
 }
 
+static int futex_wake_bitset(addr_t uaddr, bool private, dword_t val, dword_t bitset) {
+    struct futex_key key;
+    int err = futex_key(uaddr, private, &key);
+    if (err < 0)
+        return err;
+    struct futex_bucket *bucket = futex_bucket(key);
+    lock(&bucket->lock);
+    struct futex *futex = futex_find(bucket, key, false);
+    futex_key_put(&key);
+    int woken = 0;
+    if (futex != NULL) {
+        woken = futex_wakelocked(futex, val, bitset);
+        futex_release(futex);
+    }
+    unlock(&bucket->lock);
+    return woken;
+}
+
+#define FUTEX_BITSET_MATCH_ANY_ 0xffffffff
+
 int futex_wake(addr_t uaddr, dword_t val) {
-    struct futex *futex = futex_get(uaddr);
-    if (val == 1)
-        notify_once(&futex->cond);
-    else if (val == 0x7fffffff)
-        notify(&futex->cond);
-    else
-        TODO("invalid number of futex wakes %d", val);
-    futex_put(futex);
-    return val; // FIXME wrong if val is INT_MAX
+    return futex_wake_bitset(uaddr, false, val, FUTEX_BITSET_MATCH_ANY_);
+}
+
+// wakes up to wake_max waiters on uaddr and moves up to requeue_max of the
+// rest to uaddr2. if cmp is set, fails with EAGAIN unless *uaddr == cmpval.
+static int futex_requeue(addr_t uaddr, addr_t uaddr2, bool private, dword_t wake_max, dword_t requeue_max, bool cmp, dword_t cmpval) {
+    struct futex_key key, key2;
+    int err = futex_key(uaddr, private, &key);
+    if (err < 0)
+        return err;
+    err = futex_key(uaddr2, private, &key2);
+    if (err < 0) {
+        futex_key_put(&key);
+        return err;
+    }
+    struct futex_bucket *bucket = futex_bucket(key);
+    struct futex_bucket *bucket2 = futex_bucket(key2);
+    lock_buckets(bucket, bucket2);
+    struct futex *futex = futex_find(bucket, key, false);
+    struct futex *futex2 = NULL;
+
+    if (cmp) {
+        dword_t tmp;
+        err = _EFAULT;
+        if (futex_load(uaddr, &tmp))
+            goto out;
+        err = _EAGAIN;
+        if (tmp != cmpval)
+            goto out;
+    }
+    err = 0;
+    if (futex == NULL)
+        goto out;
+
+    err = futex_wakelocked(futex, wake_max, FUTEX_BITSET_MATCH_ANY_);
+    if (requeue_max == 0 || list_empty(&futex->queue))
+        goto out;
+    futex2 = futex_find(bucket2, key2, true);
+    if (futex2 == NULL) {
+        err = _ENOMEM;
+        goto out;
+    }
+    if (futex2 == futex)
+        goto out;
+
+    dword_t requeued = 0;
+    struct futex_wait *wait, *tmp;
+    list_for_each_entry_safe(&futex->queue, wait, tmp, queue) {
+        if (requeued >= requeue_max)
+            break;
+        list_remove(&wait->queue);
+        list_add_before(&futex2->queue, &wait->queue);
+        // the reference the waiter held moves over with it
+        futex_release(futex);
+        futex2->refcount++;
+        wait->futex = futex2;
+        __atomic_store_n(&wait->bucket, bucket2, __ATOMIC_SEQ_CST);
+        requeued++;
+    }
+    err += requeued;
+
+out:
+    if (futex2 != NULL)
+        futex_release(futex2);
+    if (futex != NULL)
+        futex_release(futex);
+    unlock_buckets(bucket, bucket2);
+    futex_key_put(&key);
+    futex_key_put(&key2);
+    return err;
+}
+
+#define FUTEX_OP_SET_ 0
+#define FUTEX_OP_ADD_ 1
+#define FUTEX_OP_OR_ 2
+#define FUTEX_OP_ANDN_ 3
+#define FUTEX_OP_XOR_ 4
+#define FUTEX_OP_OPARG_SHIFT_ 8
+#define FUTEX_OP_CMP_EQ_ 0
+#define FUTEX_OP_CMP_NE_ 1
+#define FUTEX_OP_CMP_LT_ 2
+#define FUTEX_OP_CMP_LE_ 3
+#define FUTEX_OP_CMP_GT_ 4
+#define FUTEX_OP_CMP_GE_ 5
+
+// does the operation encoded in encoded_op to *uaddr, and returns whether
+// the old value passes the comparison also encoded in it
+static int futex_atomic_op(addr_t uaddr, dword_t encoded_op) {
+    int op = (encoded_op >> 28) & 0xf;
+    int cmp = (encoded_op >> 24) & 0xf;
+    // both arguments are sign extended 12 bit numbers
+    int_t oparg = (int_t) (encoded_op << 8) >> 20;
+    int_t cmparg = (int_t) (encoded_op << 20) >> 20;
+    if (op & FUTEX_OP_OPARG_SHIFT_) {
+        if (oparg < 0 || oparg > 31)
+            return _EINVAL;
+        oparg = 1 << oparg;
+        op &= ~FUTEX_OP_OPARG_SHIFT_;
+    }
+
+    dword_t *ptr = mem_ptr(current->mem, uaddr, MEM_WRITE);
+    if (ptr == NULL)
+        return _EFAULT;
+    int_t old;
+    switch (op) {
+        case FUTEX_OP_SET_: old = __atomic_exchange_n(ptr, oparg, __ATOMIC_SEQ_CST); break;
+        case FUTEX_OP_ADD_: old = __atomic_fetch_add(ptr, oparg, __ATOMIC_SEQ_CST); break;
+        case FUTEX_OP_OR_: old = __atomic_fetch_or(ptr, oparg, __ATOMIC_SEQ_CST); break;
+        case FUTEX_OP_ANDN_: old = __atomic_fetch_and(ptr, ~oparg, __ATOMIC_SEQ_CST); break;
+        case FUTEX_OP_XOR_: old = __atomic_fetch_xor(ptr, oparg, __ATOMIC_SEQ_CST); break;
+        default: return _ENOSYS;
+    }
+
+    switch (cmp) {
+        case FUTEX_OP_CMP_EQ_: return old == cmparg;
+        case FUTEX_OP_CMP_NE_: return old != cmparg;
+        case FUTEX_OP_CMP_LT_: return old < cmparg;
+        case FUTEX_OP_CMP_LE_: return old <= cmparg;
+        case FUTEX_OP_CMP_GT_: return old > cmparg;
+        case FUTEX_OP_CMP_GE_: return old >= cmparg;
+        default: return _ENOSYS;
+    }
+}
+
+static int futex_wake_op(addr_t uaddr, addr_t uaddr2, bool private, dword_t wake_max, dword_t wake2_max, dword_t encoded_op) {
+    struct futex_key key, key2;
+    int woken = futex_key(uaddr, private, &key);
+    if (woken < 0)
+        return woken;
+    woken = futex_key(uaddr2, private, &key2);
+    if (woken < 0) {
+        futex_key_put(&key);
+        return woken;
+    }
+    struct futex_bucket *bucket = futex_bucket(key);
+    struct futex_bucket *bucket2 = futex_bucket(key2);
+    lock_buckets(bucket, bucket2);
+    woken = futex_atomic_op(uaddr2, encoded_op);
+    if (woken >= 0) {
+        bool wake2 = woken;
+        woken = 0;
+        struct futex *futex = futex_find(bucket, key, false);
+        if (futex != NULL) {
+            woken += futex_wakelocked(futex, wake_max, FUTEX_BITSET_MATCH_ANY_);
+            futex_release(futex);
+        }
+        if (wake2) {
+            struct futex *futex2 = futex_find(bucket2, key2, false);
+            if (futex2 != NULL) {
+                woken += futex_wakelocked(futex2, wake2_max, FUTEX_BITSET_MATCH_ANY_);
+                futex_release(futex2);
+            }
+        }
+    }
+    unlock_buckets(bucket, bucket2);
+    futex_key_put(&key);
+    futex_key_put(&key2);
+    return woken;
 }
 
 #define FUTEX_WAIT_ 0
 #define FUTEX_WAKE_ 1
+#define FUTEX_REQUEUE_ 3
+#define FUTEX_CMP_REQUEUE_ 4
+#define FUTEX_WAKE_OP_ 5
+#define FUTEX_WAIT_BITSET_ 9
+#define FUTEX_WAKE_BITSET_ 10
 #define FUTEX_PRIVATE_FLAG_ 128
-#define FUTEX_CMD_MASK_ ~(FUTEX_PRIVATE_FLAG_)
+#define FUTEX_CLOCK_REALTIME_ 256
+#define FUTEX_CMD_MASK_ ~(FUTEX_PRIVATE_FLAG_ | FUTEX_CLOCK_REALTIME_)
 
 dword_t sys_futex(addr_t uaddr, dword_t op, dword_t val, addr_t timeout_or_val2, addr_t uaddr2, dword_t val3) {
-    if (!(op & FUTEX_PRIVATE_FLAG_)) {
-        FIXME("no support for shared futexes");
-    }
+    bool private = op & FUTEX_PRIVATE_FLAG_;
+    int cmd = op & FUTEX_CMD_MASK_;
+    if (op & FUTEX_CLOCK_REALTIME_ && cmd != FUTEX_WAIT_BITSET_)
+        return _ENOSYS;
+
     struct timespec timeout = {0};
-    if ((op & (FUTEX_WAIT_)) > 0) {
+    if ((cmd == FUTEX_WAIT_ || cmd == FUTEX_WAIT_BITSET_) && timeout_or_val2) {
         struct timespec_ timeout_;
         if (user_get(timeout_or_val2, timeout_))
             return _EFAULT;
         timeout.tv_sec = timeout_.sec;
         timeout.tv_nsec = timeout_.nsec;
+        if (timeout.tv_sec < 0 || timeout.tv_nsec < 0 || timeout.tv_nsec >= 1000000000)
+            return _EINVAL;
+        if (cmd == FUTEX_WAIT_) {
+            // relative timeout
+            timeout = timespec_add(timespec_now(), timeout);
+        } else if (op & FUTEX_CLOCK_REALTIME_) {
+            // absolute timeout on the realtime clock, convert it to monotonic
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            timeout = timespec_add(timespec_now(), timespec_subtract(timeout, now));
+        }
     }
-    switch (op & FUTEX_CMD_MASK_) {
+
+    switch (cmd) {
         case FUTEX_WAIT_:
             STRACE("futex(FUTEX_WAIT, %#x, %d, 0x%x {%ds %dns})", uaddr, val, timeout_or_val2, timeout.tv_sec, timeout.tv_nsec);
-            return futex_wait(uaddr, val, timeout_or_val2 ? &timeout : NULL);
+            return futex_wait(uaddr, private, val, FUTEX_BITSET_MATCH_ANY_, timeout_or_val2 ? &timeout : NULL);
+        case FUTEX_WAIT_BITSET_:
+            STRACE("futex(FUTEX_WAIT_BITSET, %#x, %d, 0x%x {%ds %dns}, %#x)", uaddr, val, timeout_or_val2, timeout.tv_sec, timeout.tv_nsec, val3);
+            if (val3 == 0)
+                return _EINVAL;
+            return futex_wait(uaddr, private, val, val3, timeout_or_val2 ? &timeout : NULL);
         case FUTEX_WAKE_:
             STRACE("futex(FUTEX_WAKE, %#x, %d)", uaddr, val);
-            return futex_wake(uaddr, val);
+            return futex_wake_bitset(uaddr, private, val, FUTEX_BITSET_MATCH_ANY_);
+        case FUTEX_WAKE_BITSET_:
+            STRACE("futex(FUTEX_WAKE_BITSET, %#x, %d, %#x)", uaddr, val, val3);
+            if (val3 == 0)
+                return _EINVAL;
+            return futex_wake_bitset(uaddr, private, val, val3);
+        case FUTEX_REQUEUE_:
+            STRACE("futex(FUTEX_REQUEUE, %#x, %d, %d, %#x)", uaddr, val, timeout_or_val2, uaddr2);
+            return futex_requeue(uaddr, uaddr2, private, val, timeout_or_val2, false, 0);
+        case FUTEX_CMP_REQUEUE_:
+            STRACE("futex(FUTEX_CMP_REQUEUE, %#x, %d, %d, %#x, %d)", uaddr, val, timeout_or_val2, uaddr2, val3);
+            return futex_requeue(uaddr, uaddr2, private, val, timeout_or_val2, true, val3);
+        case FUTEX_WAKE_OP_:
+            STRACE("futex(FUTEX_WAKE_OP, %#x, %d, %d, %#x, %#x)", uaddr, val, timeout_or_val2, uaddr2, val3);
+            return futex_wake_op(uaddr, uaddr2, private, val, timeout_or_val2, val3);
     }
     STRACE("futex(%#x, %d, %d, timeout=%#x, %#x, %d) ", uaddr, op, val, timeout_or_val2, uaddr2, val3);
     FIXME("unsupported futex operation %d", op);
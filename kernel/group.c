@@ -41,9 +41,11 @@ dword_t sys_setpgid(pid_t_ id, pid_t_ pgid) {
     // TODO cannot set process group of a child that has done exec
 
     if (tgroup->pgid != pgid) {
+        pid_t_ old_pgid = tgroup->pgid;
         list_remove(&tgroup->pgroup);
         tgroup->pgid = pgid;
         list_add(&pid->pgroup, &tgroup->pgroup);
+        pid_release(old_pgid);
     }
 
     err = 0;
@@ -79,12 +81,16 @@ dword_t sys_setsid() {
     }
 
     struct pid *pid = pid_get(current->pid);
+    pid_t_ old_sid = group->sid;
+    pid_t_ old_pgid = group->pgid;
     list_remove_safe(&group->session);
     list_add(&pid->session, &group->session);
     group->sid = new_sid;
     list_remove_safe(&group->pgroup);
     list_add(&pid->pgroup, &group->pgroup);
     group->pgid = new_sid;
+    pid_release(old_sid);
+    pid_release(old_pgid);
 
     lock(&group->lock);
     group->tty = NULL;
@@ -6,11 +6,11 @@
 #include "fs/fd.h"
 #include "fs/tty.h"
 
-int mount_root(const struct fs_ops *fs, const char *source) {
+int mount_root(const struct fs_ops *fs, const char *source, const char *options) {
     char source_realpath[MAX_PATH + 1];
     if (realpath(source, source_realpath) == NULL)
         return errno_map();
-    int err = do_mount(fs, source_realpath, "");
+    int err = do_mount(fs, source_realpath, "", options);
     if (err < 0)
         return err;
     return 0;
@@ -39,8 +39,7 @@ void create_first_process() {
     signal(SIGPIPE, SIG_IGN);
 
     current = task_create_(NULL);
-    current->mm = mm_new();
-    current->mem = current->cpu.mem = &current->mm->mem;
+    mm_add_task(mm_new(), current);
     struct tgroup *group = init_tgroup();
     list_add(&group->threads, &current->group_links);
     group->leader = current;
@@ -3,7 +3,7 @@
 
 #include "fs/tty.h"
 
-int mount_root(const struct fs_ops *fs, const char *source);
+int mount_root(const struct fs_ops *fs, const char *source, const char *options);
 void create_first_process(void);
 int create_stdio(struct tty_driver *driver);
 
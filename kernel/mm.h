@@ -3,6 +3,9 @@
 
 #include "emu/memory.h"
 #include "misc.h"
+#include "util/list.h"
+
+struct task;
 
 // uses mem.lock instead of having a lock of its own
 struct mm {
@@ -19,6 +22,9 @@ struct mm {
     addr_t env_start;
     addr_t env_end;
     struct fd *exefile;
+
+    // tasks using this mm, locked by pids_lock
+    struct list tasks;
 };
 
 // Create a new address space
@@ -29,5 +35,12 @@ struct mm *mm_copy(struct mm *mm);
 void mm_retain(struct mm *mem);
 // Decrement the refcount, destroy everything in the space if 0
 void mm_release(struct mm *mem);
+// Makes task use mm, taking over a reference to it
+void mm_add_task(struct mm *mm, struct task *task);
+// Stops task using its mm and releases it
+void mm_remove_task(struct task *task);
+// Takes mm->mem.lock for writing. Threads running guest code hold the read
+// lock until they come out of it, so this pokes every task using the mm.
+void mm_write_lock(struct mm *mm);
 
 #endif
@@ -14,6 +14,7 @@ struct mm *mm_new() {
     mm->start_brk = mm->brk = 0; // should get overwritten by exec
     mm->exefile = NULL;
     mm->refcount = 1;
+    list_init(&mm->tasks);
     return mm;
 }
 
@@ -23,6 +24,7 @@ struct mm *mm_copy(struct mm *mm) {
         return NULL;
     *new_mm = *mm;
     mem_init(&new_mm->mem);
+    list_init(&new_mm->tasks);
     fd_retain(new_mm->exefile);
     read_wrlock(&mm->mem.lock);
     pt_copy_on_write(&mm->mem, 0, &new_mm->mem, 0, MEM_PAGES);
@@ -38,11 +40,42 @@ void mm_release(struct mm *mm) {
     if (--mm->refcount == 0) {
         if (mm->exefile != NULL)
             fd_close(mm->exefile);
+        mm_write_lock(mm);
         mem_destroy(&mm->mem);
         free(mm);
     }
 }
 
+void mm_add_task(struct mm *mm, struct task *task) {
+    lock(&pids_lock);
+    task->mm = mm;
+    task->mem = task->cpu.mem = &mm->mem;
+    list_add(&mm->tasks, &task->mm_links);
+    unlock(&pids_lock);
+}
+
+void mm_remove_task(struct task *task) {
+    lock(&pids_lock);
+    list_remove(&task->mm_links);
+    unlock(&pids_lock);
+    mm_release(task->mm);
+}
+
+// a loop of chained jit blocks never comes out of guest code on its own, and
+// the tasks using an mm aren't necessarily in one thread group (vfork, or
+// clone with CLONE_VM but not CLONE_THREAD)
+void mm_write_lock(struct mm *mm) {
+    if (write_wrtrylock(&mm->mem.lock))
+        return;
+    lock(&pids_lock);
+    struct task *task;
+    list_for_each_entry(&mm->tasks, task, mm_links) {
+        task_poke(task);
+    }
+    unlock(&pids_lock);
+    write_wrlock(&mm->mem.lock);
+}
+
 static addr_t do_mmap(addr_t addr, dword_t len, dword_t prot, dword_t flags, fd_t fd_no, dword_t offset) {
     int err;
     pages_t pages = PAGE_ROUND_UP(len);
@@ -57,10 +90,8 @@ static addr_t do_mmap(addr_t addr, dword_t len, dword_t prot, dword_t flags, fd_
         page = PAGE(addr);
     }
     if (flags & MMAP_ANONYMOUS) {
-        if (!(flags & MMAP_PRIVATE)) {
-            TODO("MMAP_SHARED");
-            return _EINVAL;
-        }
+        if (flags & MMAP_SHARED)
+            prot |= P_SHARED;
         if ((err = pt_map_nothing(current->mem, page, pages, prot)) < 0)
             return err;
     } else {
@@ -83,7 +114,7 @@ static addr_t mmap_common(addr_t addr, dword_t len, dword_t prot, dword_t flags,
     if (prot & ~(P_READ | P_WRITE | P_EXEC))
         return _EINVAL;
 
-    write_wrlock(&current->mem->lock);
+    mm_write_lock(current->mm);
     addr_t res = do_mmap(addr, len, prot, flags, fd_no, offset);
     write_wrunlock(&current->mem->lock);
     return res;
@@ -103,7 +134,7 @@ int_t sys_munmap(addr_t addr, uint_t len) {
         return _EINVAL;
     if (len == 0)
         return _EINVAL;
-    write_wrlock(&current->mem->lock);
+    mm_write_lock(current->mm);
     int err = pt_unmap(current->mem, PAGE(addr), PAGE_ROUND_UP(len), 0);
     write_wrunlock(&current->mem->lock);
     if (err < 0)
@@ -144,8 +175,8 @@ int_t sys_mremap(addr_t addr, dword_t old_len, dword_t new_len, dword_t flags) {
         if (entry == NULL && entry->flags != pt_flags)
             return _EFAULT;
     }
-    if (!(pt_flags & P_ANON)) {
-        FIXME("mremap grow on file mappings");
+    if (!(pt_flags & P_ANON) || pt_flags & P_SHARED) {
+        FIXME("mremap grow on file or shared mappings");
         return _EFAULT;
     }
     page_t extra_start = PAGE(addr) + old_pages;
@@ -165,7 +196,7 @@ int_t sys_mprotect(addr_t addr, uint_t len, int_t prot) {
     if (prot & ~(P_READ | P_WRITE | P_EXEC))
         return _EINVAL;
     pages_t pages = PAGE_ROUND_UP(len);
-    write_wrlock(&current->mem->lock);
+    mm_write_lock(current->mm);
     int err = pt_set_flags(current->mem, PAGE(addr), pages, prot);
     write_wrunlock(&current->mem->lock);
     return err;
@@ -191,7 +222,7 @@ addr_t sys_brk(addr_t new_brk) {
 
     if (new_brk != 0 && new_brk < mm->start_brk)
         return _EINVAL;
-    write_wrlock(&mm->mem.lock);
+    mm_write_lock(mm);
     addr_t old_brk = mm->brk;
     if (new_brk == 0) {
         write_wrunlock(&mm->mem.lock);
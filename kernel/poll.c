@@ -13,6 +13,13 @@ static int user_read_or_zero(addr_t addr, void *data, size_t size) {
     return 0;
 }
 
+// the poll used by this thread's select and poll calls
+static struct poll *task_poll(void) {
+    if (current->poll == NULL)
+        current->poll = poll_create();
+    return current->poll;
+}
+
 #define SELECT_READ (POLL_READ | POLL_HUP | POLL_ERR)
 #define SELECT_WRITE (POLL_WRITE | POLL_ERR)
 #define SELECT_EX (POLL_PRI)
@@ -55,7 +62,7 @@ dword_t sys_select(fd_t nfds, addr_t readfds_addr, addr_t writefds_addr, addr_t
         timeout_ts.tv_nsec = timeout_timeval.usec * 1000;
     }
 
-    struct poll *poll = poll_create();
+    struct poll *poll = task_poll();
     if (poll == NULL)
         return _ENOMEM;
 
@@ -70,19 +77,19 @@ dword_t sys_select(fd_t nfds, addr_t readfds_addr, addr_t writefds_addr, addr_t
         if (events != 0) {
             struct fd *fd = f_get(i);
             if (fd == NULL) {
-                poll_destroy(poll);
+                poll_keep_done(poll);
                 return _EBADF;
             }
-            poll_add_fd(poll, fd, events, (union poll_fd_info) i);
+            poll_keep_fd(poll, fd, events, (union poll_fd_info) i);
         }
     }
+    poll_keep_done(poll);
 
     memset(readfds, 0, fdset_size);
     memset(writefds, 0, fdset_size);
     memset(exceptfds, 0, fdset_size);
     struct select_context context = {readfds, writefds, exceptfds};
     int err = poll_wait(poll, select_event_callback, &context, timeout_addr == 0 ? NULL : &timeout_ts);
-    poll_destroy(poll);
     if (err < 0)
         return err;
 
@@ -120,7 +127,7 @@ dword_t sys_poll(addr_t fds, dword_t nfds, int_t timeout) {
     if (fds != 0 || nfds != 0)
         if (user_read(fds, polls, sizeof(struct pollfd_) * nfds))
             return _EFAULT;
-    struct poll *poll = poll_create();
+    struct poll *poll = task_poll();
     if (poll == NULL)
         return _ENOMEM;
 
@@ -134,7 +141,7 @@ dword_t sys_poll(addr_t fds, dword_t nfds, int_t timeout) {
         polls[i].revents = 0;
     }
 
-    // convert polls array into poll_add_fd calls
+    // convert polls array into poll_keep_fd calls
     // FIXME this is quadratic
     for (unsigned i = 0; i < nfds; i++) {
         if (polls[i].fd < 0 || polls[i].revents)
@@ -154,8 +161,9 @@ dword_t sys_poll(addr_t fds, dword_t nfds, int_t timeout) {
             }
         }
 
-        poll_add_fd(poll, files[i], events | POLL_ALWAYS_LISTENING, (union poll_fd_info) (void *) files[i]);
+        poll_keep_fd(poll, files[i], events | POLL_ALWAYS_LISTENING, (union poll_fd_info) (void *) files[i]);
     }
+    poll_keep_done(poll);
 
     for (unsigned i = 0; i < nfds; i++) {
         polls[i].revents = 0;
@@ -169,7 +177,6 @@ dword_t sys_poll(addr_t fds, dword_t nfds, int_t timeout) {
         timeout_ts.tv_nsec = (timeout % 1000) * 1000000;
     }
     int res = poll_wait(poll, poll_event_callback, &context, timeout == -1 ? NULL : &timeout_ts);
-    poll_destroy(poll);
     for (unsigned i = 0; i < nfds; i++) {
         if (files[i] != NULL)
             fd_close(files[i]);
@@ -122,13 +122,8 @@ dword_t sys_getrusage(dword_t who, addr_t rusage_addr) {
 }
 
 dword_t sys_sched_getaffinity(pid_t_ pid, dword_t cpusetsize, addr_t cpuset_addr) {
-    if (pid != 0) {
-        lock(&pids_lock);
-        struct task *task = pid_get_task(pid);
-        unlock(&pids_lock);
-        if (task == NULL)
-            return _ESRCH;
-    }
+    if (pid != 0 && !pid_task_exists(pid))
+        return _ESRCH;
 
     unsigned cpus = sysconf(_SC_NPROCESSORS_ONLN);
     if (cpus > cpusetsize * 8)
@@ -40,47 +40,56 @@ static int signal_action(struct sighand *sighand, int sig) {
     }
 }
 
-void deliver_signal(struct task *task, int sig) {
-    task->pending |= 1l << sig;
-    if (task != current) {
-        // actual madness, I hope to god it's correct
-retry:
-        lock(&task->waiting_cond_lock);
-        if (task->waiting_cond != NULL) {
-            bool mine = false;
-            if (pthread_mutex_trylock(&task->waiting_lock->m) == EBUSY) {
-                if (pthread_equal(task->waiting_lock->owner, pthread_self()))
-                    mine = true;
-                if (!mine) {
-                    unlock(&task->waiting_cond_lock);
-                    goto retry;
-                }
-            }
-            notify(task->waiting_cond);
-            if (!mine)
-                unlock(task->waiting_lock);
-        }
-        unlock(&task->waiting_cond_lock);
-        pthread_kill(task->thread, SIGUSR1);
+// Gets the task to look at its pending signals. What that takes depends on
+// what it's doing, and if the state changes while this is looking at it, the
+// task will see the signal on its own.
+static void task_wake(struct task *task) {
+    task_poke(task);
+    // a wait that's over by the time this gets to it mustn't wake the next one
+    unsigned generation = waiter_generation(&task->waiter);
+    switch (__atomic_load_n(&task->run_state, __ATOMIC_SEQ_CST)) {
+        case TASK_WAITING:
+            waiter_wake_generation(&task->waiter, generation);
+            break;
+        case TASK_IN_KERNEL:
+            // might be blocked in a host syscall
+            pthread_kill(task->thread, SIGUSR1);
+            break;
     }
 }
 
+static void signal_pend(struct task *task, int sig) {
+    __atomic_fetch_or(&task->pending, 1l << sig, __ATOMIC_SEQ_CST);
+    if (task != current)
+        task_wake(task);
+}
+
+void deliver_signal(struct task *task, int sig) {
+    // only the task itself changes its blocked set
+    if (task == current)
+        current->blocked &= ~(1l << sig);
+    signal_pend(task, sig);
+}
+
 void send_signal(struct task *task, int sig) {
     // signal zero is for testing whether a process exists
     if (sig == 0)
         return;
     if (task->zombie)
         return;
-
+    // an exiting task drops this with pids_lock held
     struct sighand *sighand = task->sighand;
-    lock(&sighand->lock);
-    if (signal_action(sighand, sig) != SIGNAL_IGNORE) {
-        if (task->blocked & (1l << sig) && signal_is_blockable(sig))
-            task->queued |= (1l << sig);
-        else
-            deliver_signal(task, sig);
-    }
-    unlock(&sighand->lock);
+    if (sighand == NULL)
+        return;
+
+    // No lock here, if the action or the blocked set changes at the same time
+    // the signal might be pended when it would've been ignored, which
+    // receive_signal deals with.
+    // Blocked signals stay pending even if they're ignored now, since the
+    // action could change before they're unblocked.
+    sigset_t_ blocked = __atomic_load_n(&task->blocked, __ATOMIC_RELAXED);
+    if (blocked & (1l << sig) || signal_action(sighand, sig) != SIGNAL_IGNORE)
+        signal_pend(task, sig);
 
     if (sig == SIGCONT_ || sig == SIGKILL_) {
         lock(&task->group->lock);
@@ -107,7 +116,7 @@ int send_group_signal(dword_t pgid, int sig) {
 
 static void receive_signal(struct sighand *sighand, int sig) {
     STRACE("%d receiving signal %d\n", current->pid, sig);
-    current->pending &= ~(1l << sig);
+    __atomic_fetch_and(&current->pending, ~(1l << sig), __ATOMIC_SEQ_CST);
 
     switch (signal_action(sighand, sig)) {
         case SIGNAL_IGNORE:
@@ -194,12 +203,11 @@ bool receive_signals() {
 
     struct sighand *sighand = current->sighand;
     lock(&sighand->lock);
-    bool any_left = current->pending != 0;
-    if (any_left) {
-        for (int sig = 0; sig < NUM_SIGS; sig++)
-            if (current->pending & (1l << sig))
-                receive_signal(sighand, sig);
-    }
+    sigset_t_ deliverable = task_signal_pending(current);
+    bool any_left = deliverable != 0;
+    for (int sig = 0; sig < NUM_SIGS; sig++)
+        if (deliverable & (1l << sig))
+            receive_signal(sighand, sig);
     unlock(&sighand->lock);
 
     // this got moved out of the switch case in receive_signal to fix locking problems
@@ -210,8 +218,8 @@ bool receive_signals() {
         if (now_stopped) {
             lock(&pids_lock);
             notify(&current->parent->group->child_exit);
-            unlock(&pids_lock);
             send_signal(current->parent, current->group->leader->exit_signal);
+            unlock(&pids_lock);
         }
     }
 
@@ -314,23 +322,19 @@ dword_t sys_sigaction(dword_t signum, addr_t action_addr, addr_t oldaction_addr)
 static int do_sigprocmask_unlocked(dword_t how, sigset_t_ set, sigset_t_ *oldset_out) {
     sigset_t_ oldset = current->blocked;
 
+    sigset_t_ blocked;
     if (how == SIG_BLOCK_)
-        current->blocked |= set;
+        blocked = oldset | set;
     else if (how == SIG_UNBLOCK_)
-        current->blocked &= ~set;
+        blocked = oldset & ~set;
     else if (how == SIG_SETMASK_)
-        current->blocked = set;
+        blocked = set;
     else
         return _EINVAL;
-
-    // transfer unblocked signals from queued to pending
-    sigset_t_ unblocked = oldset & ~current->blocked;
-    current->pending |= current->queued & unblocked;
-    current->queued &= ~unblocked;
-    // transfer blocked signals from pending to queued
-    sigset_t_ blocked = current->blocked & ~oldset;
-    current->queued |= current->pending & blocked;
-    current->pending &= ~blocked;
+    blocked &= ~(1l << SIGKILL_ | 1l << SIGSTOP_);
+    // signals that get unblocked are already pending, receive_signals will
+    // pick them up
+    __atomic_store_n(&current->blocked, blocked, __ATOMIC_SEQ_CST);
 
     if (oldset_out != NULL)
         *oldset_out = oldset;
@@ -372,7 +376,8 @@ dword_t sys_rt_sigprocmask(dword_t how, addr_t set_addr, addr_t oldset_addr, dwo
 
 int_t sys_rt_sigpending(addr_t set_addr) {
     STRACE("rt_sigpending(%#x)");
-    if (user_put(set_addr, current->pending))
+    sigset_t_ pending = __atomic_load_n(&current->pending, __ATOMIC_SEQ_CST) & current->blocked;
+    if (user_put(set_addr, pending))
         return _EFAULT;
     return 0;
 }
@@ -426,7 +431,7 @@ int_t sys_rt_sigsuspend(addr_t mask_addr, uint_t size) {
 
     lock(&current->sighand->lock);
     do_sigprocmask_unlocked(SIG_SETMASK_, mask, &oldmask);
-    while (!current->pending)
+    while (!task_signal_pending(current))
         wait_for(&current->pause, &current->sighand->lock, NULL);
     do_sigprocmask_unlocked(SIG_SETMASK_, oldmask, NULL);
     unlock(&current->sighand->lock);
@@ -442,6 +447,9 @@ dword_t sys_kill(pid_t_ pid, dword_t sig) {
         pid = -current->group->pgid;
     if (pid < 0)
         return send_group_signal(-pid, sig);
+    // signal zero only checks that the process exists
+    if (sig == 0)
+        return pid_task_exists(pid) ? 0 : _ESRCH;
 
     lock(&pids_lock);
     struct task *task = pid_get_task(pid);
@@ -52,7 +52,7 @@ struct sigaction_ {
 #define SIGSYS_    31
 #define SIGUNUSED_ 31
 
-// send a signal
+// send a signal, must be called with pids_lock unless task is current
 void send_signal(struct task *task, int sig);
 // send a signal without regard for whether the signal is blocked or ignored
 void deliver_signal(struct task *task, int sig);
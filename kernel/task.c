@@ -7,18 +7,35 @@
 
 __thread struct task *current;
 
-static struct pid pids[MAX_PID + 1] = {};
 lock_t pids_lock = LOCK_INITIALIZER;
 
+// The pid table is split into chunks that are allocated when a pid in them is
+// first used, and never freed, so a struct pid never moves.
+#define PID_CHUNK_SIZE 1024
+#define PID_WORDS ((MAX_PID + 1) / 64)
+static struct pid *pid_chunks[(MAX_PID + 1) / PID_CHUNK_SIZE];
+// pids that are in use by anything, i.e. not pid_empty
+static uint64_t pids_used[PID_WORDS];
+// pids of tasks that aren't zombies, readable without pids_lock
+static uint64_t pids_live[PID_WORDS];
+static dword_t last_pid = 0;
+
 static bool pid_empty(struct pid *pid) {
     return pid->task == NULL && list_empty(&pid->session) && list_empty(&pid->pgroup);
 }
 
-struct pid *pid_get(dword_t id) {
-    if (id > sizeof(pids)/sizeof(pids[0]))
+static struct pid *pid_slot(dword_t id) {
+    if (id > MAX_PID)
         return NULL;
-    struct pid *pid = &pids[id];
-    if (pid_empty(pid))
+    struct pid *chunk = __atomic_load_n(&pid_chunks[id / PID_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+    if (chunk == NULL)
+        return NULL;
+    return &chunk[id % PID_CHUNK_SIZE];
+}
+
+struct pid *pid_get(dword_t id) {
+    struct pid *pid = pid_slot(id);
+    if (pid == NULL || pid_empty(pid))
         return NULL;
     return pid;
 }
@@ -38,29 +55,104 @@ struct task *pid_get_task(dword_t id) {
     return task;
 }
 
-struct task *task_create_(struct task *parent) {
-    lock(&pids_lock);
-    static int cur_pid = 0;
-    do {
-        cur_pid++;
-        if (cur_pid > MAX_PID) cur_pid = 0;
-    } while (!pid_empty(&pids[cur_pid]));
-    struct pid *pid = &pids[cur_pid];
-    pid->id = cur_pid;
-    list_init(&pid->session);
-    list_init(&pid->pgroup);
+static void pid_set_live(dword_t id, bool live) {
+    uint64_t bit = 1ull << (id % 64);
+    if (live)
+        __atomic_fetch_or(&pids_live[id / 64], bit, __ATOMIC_RELEASE);
+    else
+        __atomic_fetch_and(&pids_live[id / 64], ~bit, __ATOMIC_RELEASE);
+}
+
+bool pid_task_exists(dword_t id) {
+    if (id > MAX_PID)
+        return false;
+    return __atomic_load_n(&pids_live[id / 64], __ATOMIC_ACQUIRE) & (1ull << (id % 64));
+}
+
+dword_t pid_next_task(dword_t id) {
+    for (id++; id <= MAX_PID; id = (id | 63) + 1) {
+        uint64_t word = __atomic_load_n(&pids_live[id / 64], __ATOMIC_ACQUIRE) >> (id % 64);
+        if (word != 0)
+            return id + __builtin_ctzll(word);
+    }
+    return 0;
+}
 
+// Finds the next unused pid after the last one handed out, like Linux does,
+// so a pid isn't reused right after it's freed. Returns 0 if they're all used.
+static dword_t pid_alloc() {
+    dword_t start = last_pid + 1;
+    if (start > MAX_PID)
+        start = 1;
+    // one extra word at the end to get back around to the start
+    for (unsigned i = 0; i <= PID_WORDS; i++) {
+        unsigned w = (start / 64 + i) % PID_WORDS;
+        uint64_t free = ~pids_used[w];
+        if (i == 0)
+            free &= ~0ull << (start % 64);
+        if (w == 0)
+            free &= ~1ull; // pid 0 isn't a real pid
+        if (free == 0)
+            continue;
+        dword_t id = w * 64 + __builtin_ctzll(free);
+
+        struct pid **chunk = &pid_chunks[id / PID_CHUNK_SIZE];
+        if (*chunk == NULL) {
+            struct pid *new_chunk = malloc(PID_CHUNK_SIZE * sizeof(struct pid));
+            if (new_chunk == NULL)
+                return 0;
+            for (dword_t j = 0; j < PID_CHUNK_SIZE; j++) {
+                new_chunk[j] = (struct pid) {.id = id - id % PID_CHUNK_SIZE + j};
+                list_init(&new_chunk[j].session);
+                list_init(&new_chunk[j].pgroup);
+            }
+            __atomic_store_n(chunk, new_chunk, __ATOMIC_RELEASE);
+        }
+        pids_used[w] |= 1ull << (id % 64);
+        last_pid = id;
+        return id;
+    }
+    return 0;
+}
+
+void pid_release(dword_t id) {
+    struct pid *pid = pid_slot(id);
+    if (pid != NULL && pid_empty(pid))
+        pids_used[id / 64] &= ~(1ull << (id % 64));
+}
+
+void task_make_zombie(struct task *task) {
+    task->zombie = true;
+    pid_set_live(task->pid, false);
+}
+
+struct task *task_create_(struct task *parent) {
     struct task *task = malloc(sizeof(struct task));
     if (task == NULL)
         return NULL;
+
+    lock(&pids_lock);
+    dword_t id = pid_alloc();
+    if (id == 0) {
+        unlock(&pids_lock);
+        free(task);
+        return NULL;
+    }
+    struct pid *pid = pid_slot(id);
+
     *task = (struct task) {};
     if (parent != NULL)
         *task = *parent;
     task->pid = pid->id;
     pid->task = task;
+    pid_set_live(id, true);
     unlock(&pids_lock);
 
+    task->poked = false;
+    task->cpu.poked_ptr = &task->poked;
+
     task->did_exec = false;
+    task->cpu_timers_epoch = 0;
     list_init(&task->children);
     list_init(&task->siblings);
     if (parent != NULL) {
@@ -70,17 +162,20 @@ struct task *task_create_(struct task *parent) {
 
     task->sockrestart = (struct task_sockrestart) {};
     list_init(&task->sockrestart.listen);
+    task->poll = NULL;
 
-    task->waiting_cond = NULL;
-    task->waiting_lock = NULL;
-    lock_init(&task->waiting_cond_lock);
+    task->run_state = TASK_IN_KERNEL;
+    waiter_init(&task->waiter);
     cond_init(&task->pause);
     return task;
 }
 
 void task_destroy(struct task *task) {
     list_remove(&task->siblings);
-    pid_get(task->pid)->task = NULL;
+    pid_set_live(task->pid, false);
+    pid_slot(task->pid)->task = NULL;
+    pid_release(task->pid);
+    waiter_destroy(&task->waiter);
     free(task);
 }
 
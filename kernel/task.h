@@ -17,9 +17,11 @@
 struct task {
     struct cpu_state cpu;
     struct mm *mm;
+    struct list mm_links; // locked by pids_lock
     struct mem *mem; // copy of cpu.mem, for convenience
     pthread_t thread;
     uint64_t threadid;
+    bool poked; // cpu.poked_ptr points here, see task_poke
 
     struct tgroup *group; // immutable
     struct list group_links;
@@ -37,8 +39,9 @@ struct task {
     struct fs_info *fs;
 
     struct sighand *sighand;
+    // pending is set atomically by whoever sends the signal and cleared by
+    // the task when it receives it, blocked is only written by the task
     sigset_t_ blocked;
-    sigset_t_ queued; // where blocked signals go when they're sent
     sigset_t_ pending;
     cond_t pause; // please don't signal this
 
@@ -66,11 +69,23 @@ struct task {
     lock_t general_lock;
 
     struct task_sockrestart sockrestart;
-
-    // current condition/lock, so it can be notified in case of a signal
-    cond_t *waiting_cond;
-    lock_t *waiting_lock;
-    lock_t waiting_cond_lock;
+    // reused by every select and poll call, so a loop waiting on the same fds
+    // doesn't have to set up a host poll each time
+    struct poll *poll;
+
+    // host CPU time of this thread when it last charged its group's CPU
+    // timers, only valid if cpu_timers_epoch matches the group's
+    uint64_t cpu_time_charged;
+    uint64_t cpu_timers_epoch;
+
+    // what the thread is doing, so a signal sender knows how to wake it
+    int run_state;
+#define TASK_IN_KERNEL 0 // pthread_kill interrupts a blocking host call
+#define TASK_IN_GUEST 1 // a poke gets it into handle_interrupt
+#define TASK_WAITING 2 // in wait_for, waking the waiter is enough
+#define TASK_EXITED 3
+    // what wait_for sleeps on
+    struct waiter waiter;
 };
 
 // current will always give the process that is currently executing
@@ -86,6 +101,18 @@ void task_destroy(struct task *task);
 
 void vfork_notify(struct task *task);
 
+// Makes the task come out of guest code and into handle_interrupt soon, even
+// if it's going around a loop of chained jit blocks. Doesn't wake it up if
+// it's blocked.
+static inline void task_poke(struct task *task) {
+    __atomic_store_n(&task->poked, true, __ATOMIC_SEQ_CST);
+}
+
+// Signals that are pending and not blocked, i.e. that would interrupt a wait
+static inline sigset_t_ task_signal_pending(struct task *task) {
+    return __atomic_load_n(&task->pending, __ATOMIC_SEQ_CST) & ~task->blocked;
+}
+
 // struct thread_group is way too long to type comfortably
 struct tgroup {
     struct list threads;
@@ -101,7 +128,15 @@ struct tgroup {
     cond_t stopped_cond;
 
     struct tty *tty;
-    struct timer *timer;
+    // indexed by ITIMER_*_, created on first use
+    struct posix_timer *itimers[3];
+    // indexed by timer_create id
+#define POSIX_TIMERS_MAX 64
+    struct posix_timer *posix_timers[POSIX_TIMERS_MAX];
+    // how many timers on CPU time clocks are armed, and a count of how many
+    // times that went up from zero, which tells threads their last charge is stale
+    atomic_uint cpu_timers_armed;
+    uint64_t cpu_timers_epoch;
 
     struct rlimit_ limits[RLIMIT_NLIMITS_];
 
@@ -134,8 +169,21 @@ extern lock_t pids_lock;
 struct pid *pid_get(dword_t pid);
 struct task *pid_get_task(dword_t pid);
 struct task *pid_get_task_zombie(dword_t id); // don't return null if the task exists as a zombie
-
-#define MAX_PID (1 << 10) // oughta be enough
+// Lets the pid be reused if nothing refers to it anymore. Call after removing
+// a tgroup from a pid's session or pgroup list.
+void pid_release(dword_t id);
+// Sets the zombie flag. Must be called with pids_lock.
+void task_make_zombie(struct task *task);
+
+// These don't need pids_lock, but the answer can be out of date by the time
+// they return, so only use them where that's fine.
+// Whether there's a task with this pid that isn't a zombie, i.e. whether
+// pid_get_task would find one.
+bool pid_task_exists(dword_t id);
+// The lowest pid after id that pid_task_exists, or 0 if there isn't one.
+dword_t pid_next_task(dword_t id);
+
+#define MAX_PID ((1 << 15) - 1) // same as linux's default pid_max of 32768
 
 // When a thread is created to run a new process, this function is used.
 extern void (*task_run_hook)(void);
@@ -1,6 +1,8 @@
 #ifdef __linux__
 #define _GNU_SOURCE
 #include <sys/resource.h>
+#elif __APPLE__
+#include <mach/mach.h>
 #endif
 #include "debug.h"
 #include <time.h>
@@ -19,26 +21,86 @@ dword_t sys_time(addr_t time_out) {
     return now;
 }
 
+static struct timespec timespec_from_fake(struct timespec_ ts) {
+    return (struct timespec) {.tv_sec = ts.sec, .tv_nsec = ts.nsec};
+}
+static struct timespec_ timespec_to_fake(struct timespec ts) {
+    return (struct timespec_) {.sec = ts.tv_sec, .nsec = ts.tv_nsec};
+}
+
+static uint64_t timespec_to_ns(struct timespec ts) {
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+static struct timespec timespec_from_ns(uint64_t ns) {
+    return (struct timespec) {.tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000};
+}
+
+static uint64_t thread_cpu_time() {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return timespec_to_ns(now);
+}
+
+// host CPU time of another thread
+static uint64_t task_cpu_time(struct task *task) {
+    if (task == current)
+        return thread_cpu_time();
+#if __linux__
+    clockid_t clock;
+    struct timespec ts;
+    if (pthread_getcpuclockid(task->thread, &clock) != 0 || clock_gettime(clock, &ts) < 0)
+        return 0;
+    return timespec_to_ns(ts);
+#elif __APPLE__
+    thread_basic_info_data_t info;
+    mach_msg_type_number_t count = THREAD_BASIC_INFO_COUNT;
+    if (thread_info(pthread_mach_thread_np(task->thread), THREAD_BASIC_INFO, (thread_info_t) &info, &count) != KERN_SUCCESS)
+        return 0;
+    return (info.user_time.seconds + info.system_time.seconds) * 1000000000ull +
+        (info.user_time.microseconds + info.system_time.microseconds) * 1000ull;
+#endif
+}
+
+// what the threads that exited left in the group's rusage, plus what every
+// live thread has used so far
+static uint64_t group_cpu_time(struct tgroup *group) {
+    uint64_t total = 0;
+    lock(&pids_lock);
+    struct task *task;
+    list_for_each_entry(&group->threads, task, group_links) {
+        total += task_cpu_time(task);
+    }
+    lock(&group->lock);
+    total += (group->rusage.utime.sec + group->rusage.stime.sec) * 1000000000ull +
+        (group->rusage.utime.usec + group->rusage.stime.usec) * 1000ull;
+    unlock(&group->lock);
+    unlock(&pids_lock);
+    return total;
+}
+
+static int clock_now(dword_t clock, struct timespec *ts) {
+    clockid_t clock_id;
+    switch (clock) {
+        case CLOCK_REALTIME_: clock_id = CLOCK_REALTIME; break;
+        case CLOCK_MONOTONIC_: clock_id = CLOCK_MONOTONIC; break;
+        case CLOCK_PROCESS_CPUTIME_ID_:
+            *ts = timespec_from_ns(group_cpu_time(current->group));
+            return 0;
+        case CLOCK_THREAD_CPUTIME_ID_: clock_id = CLOCK_THREAD_CPUTIME_ID; break;
+        default: return _EINVAL;
+    }
+    if (clock_gettime(clock_id, ts) < 0)
+        return errno_map();
+    return 0;
+}
+
 dword_t sys_clock_gettime(dword_t clock, addr_t tp) {
     STRACE("clock_gettime(%d, 0x%x)", clock, tp);
 
     struct timespec ts;
-    if (clock == CLOCK_PROCESS_CPUTIME_ID_) {
-        // FIXME this is thread usage, not process usage
-        struct rusage_ rusage = rusage_get_current();
-        ts.tv_sec = rusage.utime.sec;
-        ts.tv_nsec = rusage.utime.usec * 1000;
-    } else {
-        clockid_t clock_id;
-        switch (clock) {
-            case CLOCK_REALTIME_: clock_id = CLOCK_REALTIME; break;
-            case CLOCK_MONOTONIC_: clock_id = CLOCK_MONOTONIC; break;
-            default: return _EINVAL;
-        }
-        int err = clock_gettime(clock_id, &ts);
-        if (err < 0)
-            return errno_map();
-    }
+    int err = clock_now(clock, &ts);
+    if (err < 0)
+        return err;
     struct timespec_ t;
     t.sec = ts.tv_sec;
     t.nsec = ts.tv_nsec;
@@ -53,6 +115,8 @@ dword_t sys_clock_getres(dword_t clock, addr_t res_addr) {
     switch (clock) {
         case CLOCK_REALTIME_: clock_id = CLOCK_REALTIME; break;
         case CLOCK_MONOTONIC_: clock_id = CLOCK_MONOTONIC; break;
+        case CLOCK_PROCESS_CPUTIME_ID_:
+        case CLOCK_THREAD_CPUTIME_ID_: clock_id = CLOCK_THREAD_CPUTIME_ID; break;
         default: return _EINVAL;
     }
 
@@ -72,53 +136,452 @@ dword_t sys_clock_settime(dword_t UNUSED(clock), addr_t UNUSED(tp)) {
     return _EPERM;
 }
 
-static void itimer_notify(struct task *task) {
-    send_signal(task, SIGALRM_);
+static bool clock_is_cpu_time(int_t clock) {
+    return clock == CLOCK_PROCESS_CPUTIME_ID_ || clock == CLOCK_THREAD_CPUTIME_ID_;
 }
 
-dword_t sys_setitimer(dword_t which, addr_t new_val_addr, addr_t old_val_addr) {
-    if (which != ITIMER_REAL_) {
-        FIXME("unimplemented setitimer %d", which);
-        return _EINVAL;
+// Runs on the timer thread, so the target has to be looked up each time
+static void posix_timer_fire(struct posix_timer *timer) {
+    lock(&pids_lock);
+    if (!timer->orphaned && timer->signal != 0) {
+        struct task *task = pid_get_task(timer->target);
+        if (task != NULL && task->group == timer->group)
+            send_signal(task, timer->signal);
     }
+    unlock(&pids_lock);
+}
 
-    struct itimerval_ val;
-    if (user_get(new_val_addr, val))
-        return _EFAULT;
+// Threads running guest code only charge CPU timers when something brings them
+// into the kernel, so an armed CPU timer pokes them every so often. A thread
+// can't use more CPU time than real time passes, so poking once per period
+// keeps the timer from firing more than a period late.
+static void cpu_timer_tick(struct posix_timer *timer) {
+    lock(&pids_lock);
+    if (!timer->orphaned) {
+        struct task *task;
+        list_for_each_entry(&timer->group->threads, task, group_links) {
+            if (timer->clock != CLOCK_THREAD_CPUTIME_ID_ || task->pid == timer->thread)
+                task_poke(task);
+        }
+    }
+    unlock(&pids_lock);
+}
+#define CPU_TIMER_MIN_TICK 1000000
+
+static struct posix_timer *posix_timer_new(int_t clock, int_t signal, pid_t_ target) {
+    struct posix_timer *timer = malloc(sizeof(struct posix_timer));
+    if (timer == NULL)
+        return NULL;
+    *timer = (struct posix_timer) {
+        .clock = clock,
+        .group = current->group,
+        .thread = current->pid,
+        .signal = signal,
+        .target = target,
+    };
+    timer->timer = timer_new(clock_is_cpu_time(clock) ?
+            (timer_callback_t) cpu_timer_tick : (timer_callback_t) posix_timer_fire, timer);
+    if (timer->timer == NULL) {
+        free(timer);
+        return NULL;
+    }
+    timer->timer->coalesce = clock_is_cpu_time(clock);
+    return timer;
+}
+
+// Must not be called with pids_lock or the group lock, since it waits for a
+// firing callback to finish. CPU timers have to be disarmed first.
+static void posix_timer_free(struct posix_timer *timer) {
+    timer_free(timer->timer);
+    free(timer);
+}
 
-    STRACE("setitimer({%ds %dus, %ds %dus}, 0x%x)", val.value.sec, val.value.usec, val.interval.sec, val.interval.usec, old_val_addr);
+// these two must be called with the group lock
+static void cpu_timer_arm(struct tgroup *group, struct posix_timer *timer, uint64_t value, uint64_t interval) {
+    bool was_armed = timer->value != 0;
+    timer->value = value;
+    timer->interval = interval;
+    timer->overrun = 0;
+
+    struct timer_spec tick = {};
+    if (value != 0) {
+        uint64_t period = interval != 0 ? interval : value;
+        if (period < CPU_TIMER_MIN_TICK)
+            period = CPU_TIMER_MIN_TICK;
+        tick.value = tick.interval = timespec_from_ns(period);
+    }
+    timer_set(timer->timer, tick, NULL);
+
+    if (value != 0 && !was_armed) {
+        if (group->cpu_timers_armed++ == 0)
+            group->cpu_timers_epoch++;
+    } else if (value == 0 && was_armed) {
+        group->cpu_timers_armed--;
+    }
+}
+static bool cpu_timer_charge(struct tgroup *group, struct posix_timer *timer, uint64_t used) {
+    if (timer->value > used) {
+        timer->value -= used;
+        return false;
+    }
+    if (timer->interval == 0) {
+        cpu_timer_arm(group, timer, 0, 0);
+        return true;
+    }
+    // every interval that fits in the overshoot is an expiration that got lost
+    uint64_t over = used - timer->value;
+    timer->overrun = over / timer->interval;
+    timer->value = timer->interval - over % timer->interval;
+    return true;
+}
+
+void cpu_timers_charge(bool user) {
     struct tgroup *group = current->group;
+    if (group->cpu_timers_armed == 0)
+        return;
+    uint64_t now = thread_cpu_time();
+
+    struct {
+        pid_t_ target;
+        int_t signal;
+    } fired[3 + POSIX_TIMERS_MAX];
+    int fired_count = 0;
     lock(&group->lock);
-    if (!group->timer) {
-        struct timer *timer = timer_new((timer_callback_t) itimer_notify, current);
-        if (IS_ERR(timer)) {
-            unlock(&group->lock);
-            return PTR_ERR(timer);
+    if (current->cpu_timers_epoch != group->cpu_timers_epoch) {
+        // this thread hasn't charged since the timers were armed
+        current->cpu_timers_epoch = group->cpu_timers_epoch;
+        current->cpu_time_charged = now;
+        unlock(&group->lock);
+        return;
+    }
+    uint64_t used = now - current->cpu_time_charged;
+    current->cpu_time_charged = now;
+    for (int i = 0; i < 3 + POSIX_TIMERS_MAX; i++) {
+        struct posix_timer *timer = i < 3 ? group->itimers[i] : group->posix_timers[i - 3];
+        if (timer == NULL || !clock_is_cpu_time(timer->clock) || timer->value == 0)
+            continue;
+        if (timer->user_only && !user)
+            continue;
+        if (timer->clock == CLOCK_THREAD_CPUTIME_ID_ && timer->thread != current->pid)
+            continue;
+        if (cpu_timer_charge(group, timer, used) && timer->signal != 0) {
+            fired[fired_count].target = timer->target;
+            fired[fired_count].signal = timer->signal;
+            fired_count++;
         }
-        group->timer = timer;
     }
+    unlock(&group->lock);
 
-    struct timer_spec spec;
-    spec.interval.tv_sec = val.interval.sec;
-    spec.interval.tv_nsec = val.interval.usec * 1000;
-    spec.value.tv_sec = val.value.sec;
-    spec.value.tv_nsec = val.value.usec * 1000;
-    struct timer_spec old_spec;
-    int err = timer_set(group->timer, spec, &old_spec);
+    for (int i = 0; i < fired_count; i++) {
+        if (fired[i].target == current->pid || fired[i].target == current->tgid) {
+            send_signal(current, fired[i].signal);
+            continue;
+        }
+        lock(&pids_lock);
+        struct task *task = pid_get_task(fired[i].target);
+        if (task != NULL && task->group == group)
+            send_signal(task, fired[i].signal);
+        unlock(&pids_lock);
+    }
+}
+
+struct posix_timer *tgroup_orphan_timers(struct tgroup *group) {
+    struct posix_timer *orphans = NULL;
+    for (int i = 0; i < 3 + POSIX_TIMERS_MAX; i++) {
+        struct posix_timer **slot = i < 3 ? &group->itimers[i] : &group->posix_timers[i - 3];
+        if (*slot == NULL)
+            continue;
+        (*slot)->orphaned = true;
+        (*slot)->next_orphan = orphans;
+        orphans = *slot;
+        *slot = NULL;
+    }
+    group->cpu_timers_armed = 0;
+    return orphans;
+}
+
+void posix_timers_free(struct posix_timer *timers) {
+    while (timers != NULL) {
+        struct posix_timer *next = timers->next_orphan;
+        posix_timer_free(timers);
+        timers = next;
+    }
+}
+
+// Takes the timer out of its slot with the group lock held, then frees it
+static void posix_timer_delete(struct tgroup *group, struct posix_timer **slot) {
+    lock(&group->lock);
+    struct posix_timer *timer = *slot;
+    *slot = NULL;
+    if (timer != NULL && clock_is_cpu_time(timer->clock))
+        cpu_timer_arm(group, timer, 0, 0);
     unlock(&group->lock);
+    if (timer != NULL)
+        posix_timer_free(timer);
+}
+
+void tgroup_exec_timers(struct tgroup *group) {
+    for (int i = 0; i < POSIX_TIMERS_MAX; i++)
+        posix_timer_delete(group, &group->posix_timers[i]);
+}
+
+// These two must be called with the group lock, which keeps the timer from
+// being deleted. spec.value is relative.
+static int posix_timer_set(struct posix_timer *timer, struct timer_spec spec, struct timer_spec *old_spec) {
+    if (!clock_is_cpu_time(timer->clock))
+        return timer_set(timer->timer, spec, old_spec);
+    if (old_spec != NULL) {
+        old_spec->value = timespec_from_ns(timer->value);
+        old_spec->interval = timespec_from_ns(timer->interval);
+    }
+    cpu_timer_arm(timer->group, timer, timespec_to_ns(spec.value), timespec_to_ns(spec.interval));
+    return 0;
+}
+static void posix_timer_get(struct posix_timer *timer, struct timer_spec *spec) {
+    if (!clock_is_cpu_time(timer->clock)) {
+        timer_get(timer->timer, spec);
+        return;
+    }
+    spec->value = timespec_from_ns(timer->value);
+    spec->interval = timespec_from_ns(timer->interval);
+}
+
+// Returns with the group lock held if the timer exists
+static struct posix_timer *posix_timer_lookup(dword_t timerid) {
+    struct tgroup *group = current->group;
+    lock(&group->lock);
+    struct posix_timer *timer = timerid < POSIX_TIMERS_MAX ? group->posix_timers[timerid] : NULL;
+    if (timer == NULL)
+        unlock(&group->lock);
+    return timer;
+}
+
+static struct timer_spec timer_spec_from_itimerval(struct itimerval_ val) {
+    return (struct timer_spec) {
+        .value = {.tv_sec = val.value.sec, .tv_nsec = val.value.usec * 1000},
+        .interval = {.tv_sec = val.interval.sec, .tv_nsec = val.interval.usec * 1000},
+    };
+}
+static struct itimerval_ itimerval_from_timer_spec(struct timer_spec spec) {
+    // a timer that's about to fire shouldn't look disarmed
+    if (spec.value.tv_sec == 0 && spec.value.tv_nsec > 0 && spec.value.tv_nsec < 1000)
+        spec.value.tv_nsec = 1000;
+    return (struct itimerval_) {
+        .value = {.sec = spec.value.tv_sec, .usec = spec.value.tv_nsec / 1000},
+        .interval = {.sec = spec.interval.tv_sec, .usec = spec.interval.tv_nsec / 1000},
+    };
+}
+
+static struct posix_timer *itimer_get(dword_t which, bool create) {
+    static const int_t signals[] = {
+        [ITIMER_REAL_] = SIGALRM_,
+        [ITIMER_VIRTUAL_] = SIGVTALRM_,
+        [ITIMER_PROF_] = SIGPROF_,
+    };
+    struct tgroup *group = current->group;
+    lock(&group->lock);
+    struct posix_timer *timer = group->itimers[which];
+    unlock(&group->lock);
+    if (timer != NULL || !create)
+        return timer;
+
+    timer = posix_timer_new(which == ITIMER_REAL_ ? CLOCK_REALTIME_ : CLOCK_PROCESS_CPUTIME_ID_,
+            signals[which], current->tgid);
+    if (timer == NULL)
+        return ERR_PTR(_ENOMEM);
+    timer->user_only = which == ITIMER_VIRTUAL_;
+    lock(&group->lock);
+    struct posix_timer *other = group->itimers[which];
+    if (other == NULL)
+        group->itimers[which] = timer;
+    unlock(&group->lock);
+    // another thread got there first
+    if (other != NULL) {
+        posix_timer_free(timer);
+        timer = other;
+    }
+    return timer;
+}
+
+dword_t sys_getitimer(dword_t which, addr_t val_addr) {
+    STRACE("getitimer(%d, %#x)", which, val_addr);
+    if (which > ITIMER_PROF_)
+        return _EINVAL;
+    struct timer_spec spec = {};
+    struct posix_timer *timer = itimer_get(which, false);
+    if (timer != NULL) {
+        lock(&current->group->lock);
+        posix_timer_get(timer, &spec);
+        unlock(&current->group->lock);
+    }
+    struct itimerval_ val = itimerval_from_timer_spec(spec);
+    if (user_put(val_addr, val))
+        return _EFAULT;
+    return 0;
+}
+
+dword_t sys_setitimer(dword_t which, addr_t new_val_addr, addr_t old_val_addr) {
+    if (which > ITIMER_PROF_)
+        return _EINVAL;
+    struct itimerval_ val;
+    if (user_get(new_val_addr, val))
+        return _EFAULT;
+    STRACE("setitimer(%d, {%ds %dus, %ds %dus}, 0x%x)", which, val.value.sec, val.value.usec, val.interval.sec, val.interval.usec, old_val_addr);
+    if (val.value.usec >= 1000000 || val.interval.usec >= 1000000)
+        return _EINVAL;
+
+    struct posix_timer *timer = itimer_get(which, true);
+    if (IS_ERR(timer))
+        return PTR_ERR(timer);
+    struct timer_spec old_spec;
+    lock(&current->group->lock);
+    int err = posix_timer_set(timer, timer_spec_from_itimerval(val), &old_spec);
+    unlock(&current->group->lock);
     if (err < 0)
         return err;
 
     if (old_val_addr != 0) {
-        struct itimerval_ old_val;
-        old_val.interval.sec = old_spec.interval.tv_sec;
-        old_val.interval.usec = old_spec.interval.tv_nsec / 1000;
-        old_val.value.sec = old_spec.value.tv_sec;
-        old_val.value.usec = old_spec.value.tv_nsec / 1000;
+        struct itimerval_ old_val = itimerval_from_timer_spec(old_spec);
         if (user_put(old_val_addr, old_val))
             return _EFAULT;
     }
+    return 0;
+}
+
+int_t sys_timer_create(dword_t clock, addr_t sevp_addr, addr_t timerid_addr) {
+    STRACE("timer_create(%d, %#x, %#x)", clock, sevp_addr, timerid_addr);
+    struct timespec unused;
+    if (clock_now(clock, &unused) < 0)
+        return _EINVAL;
+
+    struct sigevent_ sev = {.signo = SIGALRM_, .notify = SIGEV_SIGNAL_};
+    if (sevp_addr != 0 && user_get(sevp_addr, sev))
+        return _EFAULT;
+    pid_t_ target = current->tgid;
+    switch (sev.notify) {
+        case SIGEV_NONE_:
+            sev.signo = 0;
+            break;
+        case SIGEV_THREAD_ID_:
+            lock(&pids_lock);
+            struct task *task = pid_get_task(sev.tid);
+            bool ours = task != NULL && task->group == current->group;
+            unlock(&pids_lock);
+            if (!ours)
+                return _EINVAL;
+            target = sev.tid;
+            // fallthrough
+        case SIGEV_SIGNAL_:
+            if (sev.signo <= 0 || sev.signo > NUM_SIGS)
+                return _EINVAL;
+            break;
+        default:
+            // SIGEV_THREAD is done by libc with SIGEV_THREAD_ID
+            return _EINVAL;
+    }
+
+    struct posix_timer *timer = posix_timer_new(clock, sev.signo, target);
+    if (timer == NULL)
+        return _ENOMEM;
+    struct tgroup *group = current->group;
+    lock(&group->lock);
+    int id;
+    for (id = 0; id < POSIX_TIMERS_MAX; id++)
+        if (group->posix_timers[id] == NULL)
+            break;
+    if (id < POSIX_TIMERS_MAX)
+        group->posix_timers[id] = timer;
+    unlock(&group->lock);
+    if (id == POSIX_TIMERS_MAX) {
+        posix_timer_free(timer);
+        return _EAGAIN;
+    }
 
+    if (user_put(timerid_addr, id)) {
+        posix_timer_delete(group, &group->posix_timers[id]);
+        return _EFAULT;
+    }
+    STRACE(" [%d]", id);
+    return 0;
+}
+
+int_t sys_timer_settime(dword_t timerid, int_t flags, addr_t new_value_addr, addr_t old_value_addr) {
+    STRACE("timer_settime(%d, %#x, %#x, %#x)", timerid, flags, new_value_addr, old_value_addr);
+    struct itimerspec_ value;
+    if (user_get(new_value_addr, value))
+        return _EFAULT;
+    if (value.value.nsec >= 1000000000 || value.interval.nsec >= 1000000000)
+        return _EINVAL;
+    struct timer_spec spec = {
+        .value = timespec_from_fake(value.value),
+        .interval = timespec_from_fake(value.interval),
+    };
+
+    struct posix_timer *timer = posix_timer_lookup(timerid);
+    if (timer == NULL)
+        return _EINVAL;
+    if (flags & TIMER_ABSTIME_ && !timespec_is_zero(spec.value)) {
+        struct timespec now;
+        clock_now(timer->clock, &now);
+        spec.value = timespec_subtract(spec.value, now);
+        // already passed, so fire right away
+        if (!timespec_positive(spec.value))
+            spec.value = (struct timespec) {.tv_nsec = 1};
+    }
+    struct timer_spec old_spec;
+    int err = posix_timer_set(timer, spec, &old_spec);
+    unlock(&current->group->lock);
+    if (err < 0)
+        return err;
+    if (old_value_addr != 0) {
+        struct itimerspec_ old_value = {
+            .value = timespec_to_fake(old_spec.value),
+            .interval = timespec_to_fake(old_spec.interval),
+        };
+        if (user_put(old_value_addr, old_value))
+            return _EFAULT;
+    }
+    return 0;
+}
+
+int_t sys_timer_gettime(dword_t timerid, addr_t value_addr) {
+    STRACE("timer_gettime(%d, %#x)", timerid, value_addr);
+    struct posix_timer *timer = posix_timer_lookup(timerid);
+    if (timer == NULL)
+        return _EINVAL;
+    struct timer_spec spec;
+    posix_timer_get(timer, &spec);
+    unlock(&current->group->lock);
+    struct itimerspec_ value = {
+        .value = timespec_to_fake(spec.value),
+        .interval = timespec_to_fake(spec.interval),
+    };
+    if (user_put(value_addr, value))
+        return _EFAULT;
+    return 0;
+}
+
+int_t sys_timer_getoverrun(dword_t timerid) {
+    STRACE("timer_getoverrun(%d)", timerid);
+    struct posix_timer *timer = posix_timer_lookup(timerid);
+    if (timer == NULL)
+        return _EINVAL;
+    int_t overrun = timer->overrun;
+    unlock(&current->group->lock);
+    return overrun;
+}
+
+int_t sys_timer_delete(dword_t timerid) {
+    STRACE("timer_delete(%d)", timerid);
+    if (timerid >= POSIX_TIMERS_MAX)
+        return _EINVAL;
+    struct tgroup *group = current->group;
+    lock(&group->lock);
+    bool exists = group->posix_timers[timerid] != NULL;
+    unlock(&group->lock);
+    if (!exists)
+        return _EINVAL;
+    posix_timer_delete(group, &group->posix_timers[timerid]);
     return 0;
 }
 
@@ -193,7 +656,7 @@ static void timerfd_callback(struct fd *fd) {
 
 fd_t sys_timerfd_create(int_t clockid, int_t flags) {
     STRACE("timerfd_create(%d, %#x)", clockid, flags);
-    if (clockid != ITIMER_REAL_) {
+    if (clockid != CLOCK_REALTIME_ && clockid != CLOCK_MONOTONIC_) {
         FIXME("timerfd %d", clockid);
         return _EINVAL;
     }
@@ -203,9 +666,76 @@ fd_t sys_timerfd_create(int_t clockid, int_t flags) {
         return _ENOMEM;
 
     fd->timer = timer_new((timer_callback_t) timerfd_callback, fd);
+    if (fd->timer == NULL) {
+        fd_close(fd);
+        return _ENOMEM;
+    }
+    fd->timerfd_clock = clockid;
     return f_install(fd, flags);
 }
 
+int_t sys_timerfd_settime(fd_t f, int_t flags, addr_t new_value_addr, addr_t old_value_addr) {
+    STRACE("timerfd_settime(%d, %#x, %#x, %#x)", f, flags, new_value_addr, old_value_addr);
+    struct fd *fd = f_get(f);
+    if (fd == NULL)
+        return _EBADF;
+    if (fd->ops != &timerfd_ops)
+        return _EINVAL;
+    struct itimerspec_ value;
+    if (user_get(new_value_addr, value))
+        return _EFAULT;
+    if (value.value.nsec >= 1000000000 || value.interval.nsec >= 1000000000)
+        return _EINVAL;
+
+    struct timer_spec spec = {
+        .value = timespec_from_fake(value.value),
+        .interval = timespec_from_fake(value.interval),
+    };
+    if (flags & TFD_TIMER_ABSTIME_ && !timespec_is_zero(spec.value)) {
+        struct timespec now;
+        clock_gettime(fd->timerfd_clock == CLOCK_REALTIME_ ? CLOCK_REALTIME : CLOCK_MONOTONIC, &now);
+        spec.value = timespec_subtract(spec.value, now);
+        // already passed, so fire right away
+        if (!timespec_positive(spec.value))
+            spec.value = (struct timespec) {.tv_nsec = 1};
+    }
+
+    lock(&fd->lock);
+    fd->expirations = 0;
+    unlock(&fd->lock);
+    struct timer_spec old_spec;
+    int err = timer_set(fd->timer, spec, &old_spec);
+    if (err < 0)
+        return err;
+    if (old_value_addr != 0) {
+        struct itimerspec_ old_value = {
+            .value = timespec_to_fake(old_spec.value),
+            .interval = timespec_to_fake(old_spec.interval),
+        };
+        if (user_put(old_value_addr, old_value))
+            return _EFAULT;
+    }
+    return 0;
+}
+
+int_t sys_timerfd_gettime(fd_t f, addr_t value_addr) {
+    STRACE("timerfd_gettime(%d, %#x)", f, value_addr);
+    struct fd *fd = f_get(f);
+    if (fd == NULL)
+        return _EBADF;
+    if (fd->ops != &timerfd_ops)
+        return _EINVAL;
+    struct timer_spec spec;
+    timer_get(fd->timer, &spec);
+    struct itimerspec_ value = {
+        .value = timespec_to_fake(spec.value),
+        .interval = timespec_to_fake(spec.interval),
+    };
+    if (user_put(value_addr, value))
+        return _EFAULT;
+    return 0;
+}
+
 static ssize_t timerfd_read(struct fd *fd, void *buf, size_t bufsize) {
     if (bufsize < sizeof(uint64_t))
         return _EINVAL;
@@ -226,7 +756,7 @@ static ssize_t timerfd_read(struct fd *fd, void *buf, size_t bufsize) {
 static int timerfd_poll(struct fd *fd) {
     int res = 0;
     lock(&fd->lock);
-    if (fd->expirations == 0)
+    if (fd->expirations != 0)
         res |= POLL_READ;
     unlock(&fd->lock);
     return res;
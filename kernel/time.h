@@ -6,6 +6,7 @@ dword_t sys_time(addr_t time_out);
 #define CLOCK_REALTIME_ 0
 #define CLOCK_MONOTONIC_ 1
 #define CLOCK_PROCESS_CPUTIME_ID_ 2
+#define CLOCK_THREAD_CPUTIME_ID_ 3
 dword_t sys_clock_gettime(dword_t clock, addr_t tp);
 dword_t sys_clock_settime(dword_t clock, addr_t tp);
 dword_t sys_clock_getres(dword_t clock, addr_t res_addr);
@@ -30,6 +31,57 @@ struct itimerval_ {
     struct timeval_ interval;
     struct timeval_ value;
 };
+struct itimerspec_ {
+    struct timespec_ interval;
+    struct timespec_ value;
+};
+
+#define TFD_TIMER_ABSTIME_ (1 << 0)
+#define TIMER_ABSTIME_ (1 << 0)
+
+struct sigevent_ {
+    dword_t value;
+    int_t signo;
+    int_t notify;
+    pid_t_ tid;
+};
+#define SIGEV_SIGNAL_ 0
+#define SIGEV_NONE_ 1
+#define SIGEV_THREAD_ 2
+#define SIGEV_THREAD_ID_ 4
+
+// Timers from setitimer and timer_create. Ones on the real time clocks are run
+// by a struct timer. Ones on the CPU time clocks are counted down by the
+// group's threads as they use CPU time, in cpu_timers_charge.
+struct posix_timer {
+    int_t clock;
+    bool user_only; // ITIMER_VIRTUAL, only counts time spent in guest code
+    struct tgroup *group;
+    pid_t_ thread; // whose time counts for CLOCK_THREAD_CPUTIME_ID_
+    int_t signal; // 0 for SIGEV_NONE
+    pid_t_ target; // a thread for SIGEV_THREAD_ID, otherwise the process
+    struct timer *timer; // on CPU time clocks, pokes the threads to charge it
+
+    // nanoseconds, value is 0 when disarmed, locked by group->lock
+    uint64_t value;
+    uint64_t interval;
+    dword_t overrun;
+
+    // locked by pids_lock, set when the group dies so nothing more is sent
+    bool orphaned;
+    struct posix_timer *next_orphan;
+};
+
+// Charges the CPU time the current thread used since the last call to its
+// group's CPU timers, as guest time if user is set, and sends the signals of
+// the ones that run out. Does nothing if none are armed.
+void cpu_timers_charge(bool user);
+// Must be called with pids_lock when the group dies. Returns its timers linked
+// by next_orphan, to be given to posix_timers_free once pids_lock is released.
+struct posix_timer *tgroup_orphan_timers(struct tgroup *group);
+void posix_timers_free(struct posix_timer *timers);
+// timer_create timers don't survive exec, setitimer ones do
+void tgroup_exec_timers(struct tgroup *group);
 
 struct tms_ {
     dword_t tms_utime;  /* user time */
@@ -40,11 +92,18 @@ struct tms_ {
 
 dword_t sys_getitimer(dword_t which, addr_t val);
 dword_t sys_setitimer(dword_t which, addr_t new_val, addr_t old_val);
+int_t sys_timer_create(dword_t clock, addr_t sevp_addr, addr_t timerid_addr);
+int_t sys_timer_settime(dword_t timerid, int_t flags, addr_t new_value_addr, addr_t old_value_addr);
+int_t sys_timer_gettime(dword_t timerid, addr_t value_addr);
+int_t sys_timer_getoverrun(dword_t timerid);
+int_t sys_timer_delete(dword_t timerid);
 dword_t sys_times( addr_t tbuf);
 dword_t sys_nanosleep(addr_t req, addr_t rem);
 dword_t sys_gettimeofday(addr_t tv, addr_t tz);
 dword_t sys_settimeofday(addr_t tv, addr_t tz);
 
 fd_t sys_timerfd_create(int_t clockid, int_t flags);
+int_t sys_timerfd_settime(fd_t f, int_t flags, addr_t new_value_addr, addr_t old_value_addr);
+int_t sys_timerfd_gettime(fd_t f, addr_t value_addr);
 
 #endif
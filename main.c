@@ -13,7 +13,7 @@ int main(int argc, char *const argv[]) {
         fprintf(stderr, "%s\n", strerror(-err));
         return err;
     }
-    do_mount(&procfs, "proc", "/proc");
-    do_mount(&devptsfs, "devpts", "/dev/pts");
+    do_mount(&procfs, "proc", "/proc", NULL);
+    do_mount(&devptsfs, "devpts", "/dev/pts", NULL);
     cpu_run(&current->cpu);
 }
@@ -0,0 +1,124 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+
+// older glibcs don't have a name for it
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        perror(what);
+        abort();
+    }
+}
+
+static volatile int profs, vtalrms, usr1, usr2;
+static void on_prof(int sig) {
+    (void) sig;
+    profs++;
+}
+static void on_vtalrm(int sig) {
+    (void) sig;
+    vtalrms++;
+}
+static void on_usr1(int sig) {
+    (void) sig;
+    usr1++;
+}
+static void on_usr2(int sig) {
+    (void) sig;
+    usr2++;
+}
+
+// Uses cpu time until the counter gets to want, or a long time goes by.
+static volatile unsigned long spin;
+static void burn(volatile int *counter, int want) {
+    for (long i = 0; i < 2000000000 && *counter < want; i++)
+        spin++;
+}
+
+static long long cpu_clock(clockid_t clock) {
+    struct timespec ts;
+    check(clock_gettime(clock, &ts) == 0, "clock_gettime");
+    return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static void *burn_thread(void *arg) {
+    long long start = cpu_clock(CLOCK_THREAD_CPUTIME_ID);
+    while (cpu_clock(CLOCK_THREAD_CPUTIME_ID) - start < 200000000)
+        spin++;
+    return arg;
+}
+
+int main() {
+    signal(SIGPROF, on_prof);
+    signal(SIGVTALRM, on_vtalrm);
+    signal(SIGUSR1, on_usr1);
+    signal(SIGUSR2, on_usr2);
+
+    struct itimerval itv = {{0, 10000}, {0, 10000}}, got, zero = {{0, 0}, {0, 0}};
+    check(setitimer(ITIMER_PROF, &itv, NULL) == 0, "ITIMER_PROF");
+    check(setitimer(ITIMER_VIRTUAL, &itv, NULL) == 0, "ITIMER_VIRTUAL");
+    check(getitimer(ITIMER_PROF, &got) == 0 && got.it_interval.tv_usec == 10000 &&
+            (got.it_value.tv_sec > 0 || got.it_value.tv_usec > 0), "getitimer");
+    burn(&profs, 5);
+    burn(&vtalrms, 5);
+    check(profs >= 5, "SIGPROF");
+    check(vtalrms >= 5, "SIGVTALRM");
+    check(setitimer(ITIMER_PROF, &zero, &got) == 0 && got.it_interval.tv_usec == 10000, "disarm ITIMER_PROF");
+    check(setitimer(ITIMER_VIRTUAL, &zero, NULL) == 0, "disarm ITIMER_VIRTUAL");
+    check(setitimer(3, &zero, NULL) == -1 && errno == EINVAL, "bad itimer");
+
+    // sleeping doesn't use cpu time
+    struct itimerval once = {{0, 0}, {0, 20000}};
+    check(setitimer(ITIMER_PROF, &once, NULL) == 0, "one shot");
+    int before = profs;
+    usleep(100000);
+    check(profs == before, "no SIGPROF while asleep");
+    burn(&profs, before + 1);
+    check(profs == before + 1, "one shot fired");
+    check(getitimer(ITIMER_PROF, &got) == 0 && got.it_value.tv_sec == 0 && got.it_value.tv_usec == 0, "one shot disarmed");
+
+    // the process clock counts every thread, including ones that are gone
+    long long process_before = cpu_clock(CLOCK_PROCESS_CPUTIME_ID);
+    long long thread_before = cpu_clock(CLOCK_THREAD_CPUTIME_ID);
+    pthread_t thread;
+    check(pthread_create(&thread, NULL, burn_thread, NULL) == 0, "pthread_create");
+    pthread_join(thread, NULL);
+    check(cpu_clock(CLOCK_THREAD_CPUTIME_ID) - thread_before < 100000000, "joining used cpu time");
+    check(cpu_clock(CLOCK_PROCESS_CPUTIME_ID) - process_before >= 200000000, "process clock missed a thread");
+
+    // posix timers on the cpu clocks
+    struct sigevent sev = {.sigev_notify = SIGEV_SIGNAL, .sigev_signo = SIGUSR1};
+    timer_t timer;
+    check(timer_create(CLOCK_PROCESS_CPUTIME_ID, &sev, &timer) == 0, "process cpu timer");
+    struct itimerspec every = {{0, 5000000}, {0, 5000000}};
+    check(timer_settime(timer, 0, &every, NULL) == 0, "timer_settime");
+    burn(&usr1, 3);
+    check(usr1 >= 3, "process cpu timer fired");
+    struct itimerspec cur;
+    check(timer_gettime(timer, &cur) == 0 && cur.it_interval.tv_nsec == 5000000, "timer_gettime");
+    check(timer_delete(timer) == 0, "timer_delete");
+
+    struct sigevent tsev = {.sigev_notify = SIGEV_THREAD_ID, .sigev_signo = SIGUSR2};
+    tsev.sigev_notify_thread_id = syscall(SYS_gettid);
+    check(timer_create(CLOCK_THREAD_CPUTIME_ID, &tsev, &timer) == 0, "thread cpu timer");
+    struct itimerspec soon = {{0, 0}, {0, 5000000}};
+    check(timer_settime(timer, 0, &soon, NULL) == 0, "thread timer_settime");
+    burn(&usr2, 1);
+    check(usr2 == 1, "thread cpu timer fired once");
+    check(timer_create(100, &sev, &timer) == -1 && errno == EINVAL, "bad clock");
+
+    // exiting with timers still armed is fine
+    check(setitimer(ITIMER_PROF, &itv, NULL) == 0, "armed at exit");
+    printf("ok\n");
+}
@@ -0,0 +1,135 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        perror(what);
+        abort();
+    }
+}
+
+static long futex(int *uaddr, int op, int val, long val2, int *uaddr2, int val3) {
+    return syscall(SYS_futex, uaddr, op, val, val2, uaddr2, val3);
+}
+
+static int word, word2;
+static int started, done;
+
+static void *waiter(void *bitset) {
+    __atomic_add_fetch(&started, 1, __ATOMIC_SEQ_CST);
+    futex(&word, FUTEX_WAIT_BITSET_PRIVATE, 0, 0, NULL, (int) (long) bitset);
+    __atomic_add_fetch(&done, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+static void spawn(int n, int bitset) {
+    started = done = 0;
+    for (int i = 0; i < n; i++) {
+        pthread_t t;
+        check(pthread_create(&t, NULL, waiter, (void *) (long) bitset) == 0, "pthread_create");
+        pthread_detach(t);
+    }
+    while (__atomic_load_n(&started, __ATOMIC_SEQ_CST) < n)
+        usleep(1000);
+    // give them time to actually get into the wait
+    usleep(50000);
+}
+static void wait_done(int n) {
+    while (__atomic_load_n(&done, __ATOMIC_SEQ_CST) < n)
+        usleep(1000);
+}
+
+static int *shared_word;
+static void *shared_waiter(void *arg) {
+    __atomic_add_fetch(&started, 1, __ATOMIC_SEQ_CST);
+    futex(shared_word, FUTEX_WAIT, 0, 0, NULL, 0);
+    __atomic_add_fetch(&done, 1, __ATOMIC_SEQ_CST);
+    return arg;
+}
+
+static int *map_file(int fd) {
+    int *map = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    check(map != MAP_FAILED, "mmap");
+    return map;
+}
+
+int main() {
+    check(futex(&word, FUTEX_WAIT_PRIVATE, 1, 0, NULL, 0) == -1 && errno == EAGAIN, "wait on the wrong value");
+    struct timespec timeout = {0, 50000000};
+    check(futex(&word, FUTEX_WAIT_PRIVATE, 0, (long) &timeout, NULL, 0) == -1 && errno == ETIMEDOUT, "relative timeout");
+    clock_gettime(CLOCK_MONOTONIC, &timeout);
+    timeout.tv_nsec += 50000000;
+    if (timeout.tv_nsec >= 1000000000) {
+        timeout.tv_nsec -= 1000000000;
+        timeout.tv_sec++;
+    }
+    check(futex(&word, FUTEX_WAIT_BITSET_PRIVATE, 0, (long) &timeout, NULL, -1) == -1 && errno == ETIMEDOUT, "absolute timeout");
+    check(futex(&word, FUTEX_WAIT_BITSET_PRIVATE, 0, 0, NULL, 0) == -1 && errno == EINVAL, "empty bitset");
+
+    // wake counts
+    spawn(4, -1);
+    check(futex(&word, FUTEX_WAKE_PRIVATE, 2, 0, NULL, 0) == 2, "wake 2");
+    check(futex(&word, FUTEX_WAKE_PRIVATE, 10, 0, NULL, 0) == 2, "wake the rest");
+    wait_done(4);
+
+    // bitset wakes only wake matching waiters
+    spawn(2, 1);
+    check(futex(&word, FUTEX_WAKE_BITSET_PRIVATE, 10, 0, NULL, 2) == 0, "bitset mismatch woke someone");
+    check(futex(&word, FUTEX_WAKE_BITSET_PRIVATE, 10, 0, NULL, 1) == 2, "bitset match");
+    wait_done(2);
+
+    // cmp_requeue wakes one and moves the rest
+    spawn(4, -1);
+    check(futex(&word, FUTEX_CMP_REQUEUE_PRIVATE, 1, 3, &word2, 5) == -1 && errno == EAGAIN, "cmp_requeue with the wrong value");
+    check(futex(&word, FUTEX_CMP_REQUEUE_PRIVATE, 1, 3, &word2, 0) == 4, "cmp_requeue count");
+    usleep(50000);
+    check(done == 1, "cmp_requeue woke more than one");
+    check(futex(&word, FUTEX_WAKE_PRIVATE, 10, 0, NULL, 0) == 0, "requeued waiters still on the old word");
+
+    // word2 += 1, and wake waiters on word2 if it was 0
+    int op = FUTEX_OP(FUTEX_OP_ADD, 1, FUTEX_OP_CMP_EQ, 0);
+    check(futex(&word, FUTEX_WAKE_OP_PRIVATE, 1, 10, &word2, op) == 3, "wake_op count");
+    check(word2 == 1, "wake_op didn't do the op");
+    wait_done(4);
+
+    // shared futexes in separate mappings of the same file are the same futex
+    int fd = open("futex-test-file", O_RDWR | O_CREAT, 0644);
+    check(fd >= 0, "open");
+    unlink("futex-test-file");
+    check(ftruncate(fd, 4096) == 0, "ftruncate");
+    int *map1 = map_file(fd);
+    int *map2 = map_file(fd);
+    check(map1 != map2, "same mapping twice");
+    shared_word = map1;
+    started = done = 0;
+    pthread_t t;
+    check(pthread_create(&t, NULL, shared_waiter, NULL) == 0, "pthread_create");
+    while (__atomic_load_n(&started, __ATOMIC_SEQ_CST) < 1)
+        usleep(1000);
+    usleep(50000);
+    check(futex(map2, FUTEX_WAKE, 1, 0, NULL, 0) == 1, "wake through another mapping of the file");
+    pthread_join(t, NULL);
+
+    // and across processes
+    pid_t pid = fork();
+    if (pid == 0) {
+        int *child_map = map_file(fd);
+        _exit(futex(child_map, FUTEX_WAIT, 0, 0, NULL, 0) == 0 ? 0 : 1);
+    }
+    usleep(100000);
+    check(futex(map2, FUTEX_WAKE, 1, 0, NULL, 0) == 1, "wake a waiter in another process");
+    int status;
+    check(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0, "child's wait");
+
+    printf("ok\n");
+}
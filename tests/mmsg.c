@@ -0,0 +1,71 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        perror(what);
+        abort();
+    }
+}
+
+// Sends three datagrams in one sendmmsg and gets them back with recvmmsg.
+static void batch(int from, int to, struct sockaddr_in *addr) {
+    socklen_t addr_len = addr != NULL ? sizeof(*addr) : 0;
+    struct iovec s0 = {"hello", 5}, s1[2] = {{"wor", 3}, {"ld!", 3}}, s2 = {"x", 1};
+    struct mmsghdr out[3] = {
+        {{addr, addr_len, &s0, 1, NULL, 0, 0}, 0},
+        {{addr, addr_len, s1, 2, NULL, 0, 0}, 0},
+        {{addr, addr_len, &s2, 1, NULL, 0, 0}, 0},
+    };
+    check(sendmmsg(from, out, 3, 0) == 3, "sendmmsg");
+    check(out[0].msg_len == 5 && out[1].msg_len == 6 && out[2].msg_len == 1, "sent lengths");
+
+    // there's room for four, but waiting for one means not waiting for the fourth
+    char r0[8], r1a[2], r1b[10], r2[8];
+    struct sockaddr_in names[3];
+    struct iovec d0 = {r0, 8}, d1[2] = {{r1a, 2}, {r1b, 10}}, d2 = {r2, 8};
+    struct mmsghdr in[4] = {
+        {{&names[0], sizeof(names[0]), &d0, 1, NULL, 0, 0}, 0},
+        {{&names[1], sizeof(names[1]), d1, 2, NULL, 0, 0}, 0},
+        {{&names[2], sizeof(names[2]), &d2, 1, NULL, 0, 0}, 0},
+        {{NULL, 0, &d2, 1, NULL, 0, 0}, 0},
+    };
+    check(recvmmsg(to, in, 4, MSG_WAITFORONE, NULL) == 3, "recvmmsg with MSG_WAITFORONE");
+    check(in[0].msg_len == 5 && r0[0] == 'h' && r0[4] == 'o', "first message");
+    check(in[1].msg_len == 6 && r1a[0] == 'w' && r1a[1] == 'o' && r1b[0] == 'r' && r1b[3] == '!', "scattered message");
+    check(in[2].msg_len == 1 && r2[0] == 'x', "last message");
+    if (addr != NULL)
+        check(in[0].msg_hdr.msg_namelen == sizeof(*addr) && names[0].sin_family == AF_INET, "source address");
+    check(recvmmsg(to, in, 2, MSG_DONTWAIT, NULL) == -1 && errno == EAGAIN, "nothing left");
+
+    // a timeout is only checked after each message, so one message is enough
+    check(sendmmsg(from, out, 1, 0) == 1, "sendmmsg one");
+    struct timespec timeout = {1, 0};
+    check(recvmmsg(to, in, 1, 0, &timeout) == 1 && in[0].msg_len == 5, "recvmmsg with a timeout");
+}
+
+int main() {
+    int sv[2];
+    check(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == 0, "socketpair");
+    batch(sv[0], sv[1], NULL);
+
+    // udp goes through the host's sockets
+    int u1 = socket(AF_INET, SOCK_DGRAM, 0);
+    int u2 = socket(AF_INET, SOCK_DGRAM, 0);
+    check(u1 >= 0 && u2 >= 0, "udp sockets");
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    check(bind(u2, (struct sockaddr *) &addr, sizeof(addr)) == 0, "bind");
+    socklen_t addr_len = sizeof(addr);
+    check(getsockname(u2, (struct sockaddr *) &addr, &addr_len) == 0, "getsockname");
+    batch(u1, u2, &addr);
+
+    printf("ok\n");
+}
@@ -0,0 +1,123 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <dirent.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        perror(what);
+        abort();
+    }
+}
+
+#define MAX_PID 32767 // same as ish, and linux without a bigger pid_max
+#define CHILDREN 20
+
+static void *get_tid(void *arg) {
+    *(pid_t *) arg = syscall(SYS_gettid);
+    return NULL;
+}
+
+static pid_t children[CHILDREN];
+static int p[2];
+
+// Forks a child that waits for the pipe to close before exiting.
+static pid_t fork_waiter(void) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        char c;
+        close(p[1]);
+        read(p[0], &c, 1);
+        _exit(0);
+    }
+    check(pid > 0, "fork");
+    return pid;
+}
+
+static bool is_taken(pid_t id) {
+    if (id == getpid())
+        return true;
+    for (int i = 0; i < CHILDREN; i++)
+        if (children[i] == id)
+            return true;
+    return false;
+}
+
+int main() {
+    // going through a bigger range would take forever
+    FILE *pid_max = fopen("/proc/sys/kernel/pid_max", "r");
+    if (pid_max != NULL) {
+        int max;
+        if (fscanf(pid_max, "%d", &max) == 1 && max > MAX_PID + 1) {
+            printf("skipped, pid_max is %d\n", max);
+            return 0;
+        }
+        fclose(pid_max);
+    }
+
+    check(pipe(p) == 0, "pipe");
+    for (int i = 0; i < CHILDREN; i++)
+        children[i] = fork_waiter();
+
+    // threads get ids from the same place as processes, and they're cheap, so
+    // go through the whole range until the ids wrap around
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 65536);
+    pid_t last = 0, highest = 0, wrapped = 0;
+    for (int i = 0; i < MAX_PID + CHILDREN && wrapped == 0; i++) {
+        pthread_t thread;
+        pid_t id = 0;
+        check(pthread_create(&thread, &attr, get_tid, &id) == 0, "pthread_create");
+        pthread_join(thread, NULL);
+        check(id > 0 && id <= MAX_PID, "thread id in range");
+        check(!is_taken(id), "thread got an id that's in use");
+        if (id < last)
+            wrapped = id;
+        if (id > highest)
+            highest = id;
+        last = id;
+    }
+    check(wrapped != 0, "ids wrapped around");
+    check(highest > MAX_PID - CHILDREN, "ids went up to the limit");
+
+    // the children kept their pids the whole time, and are still there
+    for (int i = 0; i < CHILDREN; i++)
+        check(kill(children[i], 0) == 0, "child alive after wrapping");
+    pid_t pid = fork();
+    if (pid == 0)
+        _exit(0);
+    check(pid > 0 && !is_taken(pid), "fork after wrapping");
+    check(waitpid(pid, NULL, 0) == pid, "waitpid after wrapping");
+    check(kill(pid, 0) == -1 && errno == ESRCH, "reaped pid is gone");
+
+    // they all show up in /proc
+    DIR *proc = opendir("/proc");
+    check(proc != NULL, "opendir /proc");
+    int found = 0;
+    struct dirent *entry;
+    while ((entry = readdir(proc)) != NULL) {
+        pid_t id = atoi(entry->d_name);
+        for (int i = 0; i < CHILDREN; i++)
+            if (id == children[i])
+                found++;
+    }
+    closedir(proc);
+    check(found == CHILDREN, "children listed in /proc");
+
+    close(p[0]);
+    close(p[1]);
+    for (int i = 0; i < CHILDREN; i++) {
+        check(waitpid(children[i], NULL, 0) == children[i], "waitpid");
+        check(kill(children[i], 0) == -1 && errno == ESRCH, "reaped child is gone");
+    }
+
+    printf("ok\n");
+}
@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        perror(what);
+        abort();
+    }
+}
+
+static int p[2];
+static char buf[65536];
+
+#define CHUNK 3000
+#define CHUNKS 1000
+static void *writer(void *arg) {
+    static char chunk[CHUNK];
+    for (int i = 0; i < CHUNKS; i++) {
+        for (int j = 0; j < CHUNK; j++)
+            chunk[j] = (char) (i + j);
+        check(write(p[1], chunk, CHUNK) == CHUNK, "short write");
+    }
+    close(p[1]);
+    return arg;
+}
+
+int main() {
+    check(pipe(p) == 0, "pipe");
+    check(write(p[1], "hello", 5) == 5, "write");
+    check(read(p[0], buf, sizeof(buf)) == 5 && buf[0] == 'h' && buf[4] == 'o', "read");
+
+    // each end only goes one way
+    check(read(p[1], buf, 1) == -1 && errno == EBADF, "read from the write end");
+    check(write(p[0], "x", 1) == -1 && errno == EBADF, "write to the read end");
+
+    // everything a writer thread sends arrives in order, then eof
+    pthread_t t;
+    check(pthread_create(&t, NULL, writer, NULL) == 0, "pthread_create");
+    long total = 0;
+    bool bad = false;
+    for (;;) {
+        ssize_t n = read(p[0], buf, 7777);
+        check(n >= 0, "read while the writer runs");
+        if (n == 0)
+            break;
+        for (ssize_t k = 0; k < n; k++) {
+            long pos = total + k;
+            if (buf[k] != (char) (pos / CHUNK + pos % CHUNK))
+                bad = true;
+        }
+        total += n;
+    }
+    pthread_join(t, NULL);
+    check(total == CHUNK * CHUNKS && !bad, "data through the pipe");
+    check(read(p[0], buf, 1) == 0, "eof stays eof");
+    struct pollfd rfd = {p[0], POLLIN, 0};
+    check(poll(&rfd, 1, 0) == 1 && rfd.revents & POLLHUP, "POLLHUP after the writer closed");
+    close(p[0]);
+
+    // nonblocking ends and sizes
+    check(pipe2(p, O_NONBLOCK) == 0, "pipe2");
+    check(read(p[0], buf, 10) == -1 && errno == EAGAIN, "read from an empty pipe");
+    check(fcntl(p[0], F_GETPIPE_SZ) == 65536, "default size");
+    check(fcntl(p[1], F_SETPIPE_SZ, 5000) == 8192, "size rounds up to pages");
+    check(write(p[1], buf, 10000) == 8192, "partial write into a full pipe");
+    check(write(p[1], buf, 10) == -1 && errno == EAGAIN, "write to a full pipe");
+    struct pollfd wfd = {p[1], POLLOUT, 0};
+    check(poll(&wfd, 1, 0) == 0, "full pipe isn't writable");
+    check(read(p[0], buf, 5000) == 5000, "drain some");
+    check(poll(&wfd, 1, 0) == 1, "writable after draining");
+
+    // with SIGPIPE ignored, writing with no reader is just EPIPE
+    signal(SIGPIPE, SIG_IGN);
+    close(p[0]);
+    check(write(p[1], "x", 1) == -1 && errno == EPIPE, "EPIPE with no reader");
+    check(poll(&wfd, 1, 0) == 1 && wfd.revents & POLLERR, "POLLERR with no reader");
+    close(p[1]);
+
+    // and otherwise it's fatal
+    check(pipe(p) == 0, "pipe");
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGPIPE, SIG_DFL);
+        close(p[0]);
+        write(p[1], "x", 1);
+        _exit(0);
+    }
+    close(p[0]);
+    close(p[1]);
+    int status;
+    check(waitpid(pid, &status, 0) == pid, "waitpid");
+    check(WIFSIGNALED(status) && WTERMSIG(status) == SIGPIPE, "killed by SIGPIPE");
+
+    printf("ok\n");
+}
@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        perror(what);
+        abort();
+    }
+}
+
+static volatile int usr1, usr2, chld;
+static void on_usr1(int sig) {
+    (void) sig;
+    __atomic_fetch_add(&usr1, 1, __ATOMIC_SEQ_CST);
+}
+static void on_usr2(int sig) {
+    (void) sig;
+    __atomic_fetch_add(&usr2, 1, __ATOMIC_SEQ_CST);
+}
+static void on_chld(int sig) {
+    (void) sig;
+    __atomic_fetch_add(&chld, 1, __ATOMIC_SEQ_CST);
+}
+
+// without SA_RESTART, so blocking calls come back with EINTR
+static void handle(int sig, void (*handler)(int)) {
+    struct sigaction action = {.sa_handler = handler};
+    check(sigaction(sig, &action, NULL) == 0, "sigaction");
+}
+
+static pid_t gettid_(void) {
+    return syscall(SYS_gettid);
+}
+
+static volatile pid_t tids[4];
+static volatile int done;
+static volatile long result;
+static int p[2];
+
+// Waits for a thread to get going, and then a bit more so it can block.
+static pid_t started(volatile pid_t *tid) {
+    while (*tid == 0)
+        usleep(1000);
+    usleep(100000);
+    return *tid;
+}
+
+static void finish(long res) {
+    result = res;
+    __atomic_fetch_add(&done, 1, __ATOMIC_SEQ_CST);
+}
+
+static void wait_done(int count, const char *what) {
+    for (int i = 0; done < count; i++) {
+        check(i < 5000, what);
+        usleep(1000);
+    }
+}
+
+static void tkill(pid_t tid, int sig) {
+    check(syscall(SYS_tgkill, getpid(), tid, sig) == 0, "tgkill");
+}
+
+// running guest code, the signal has to interrupt it
+static void *spinner(void *arg) {
+    int before = usr2;
+    tids[0] = gettid_();
+    while (usr2 == before)
+        ;
+    finish(0);
+    return arg;
+}
+
+// blocked in the kernel waiting on a condition
+static void *pipe_reader(void *arg) {
+    char c;
+    tids[0] = gettid_();
+    finish(read(p[0], &c, 1) < 0 ? -errno : 0);
+    return arg;
+}
+
+// blocked in a host syscall
+static void *sleeper(void *arg) {
+    struct timespec ts = {10, 0};
+    tids[0] = gettid_();
+    finish(nanosleep(&ts, NULL) < 0 ? -errno : 0);
+    return arg;
+}
+
+static void *storm(void *arg) {
+    int me = (int) (long) arg;
+    tids[me] = gettid_();
+    while (!tids[0] || !tids[1] || !tids[2] || !tids[3])
+        ;
+    for (int i = 0; i < 2000; i++)
+        syscall(SYS_tgkill, getpid(), tids[(me + 1 + i % 3) % 4], SIGUSR1);
+    finish(0);
+    return arg;
+}
+
+static pid_t main_tid;
+static void *waker(void *arg) {
+    tids[0] = gettid_();
+    usleep(100000);
+    tkill(main_tid, SIGUSR1);
+    return arg;
+}
+
+static pthread_t start(void *(*fn)(void *), void *arg) {
+    tids[0] = 0;
+    done = 0;
+    pthread_t thread;
+    check(pthread_create(&thread, NULL, fn, arg) == 0, "pthread_create");
+    return thread;
+}
+
+int main() {
+    handle(SIGUSR1, on_usr1);
+    handle(SIGUSR2, on_usr2);
+    handle(SIGCHLD, on_chld);
+    main_tid = gettid_();
+
+    // blocked signals stay pending and come in when unblocked
+    sigset_t set, pending;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+    kill(getpid(), SIGUSR2);
+    check(usr2 == 0, "blocked signal delivered");
+    sigpending(&pending);
+    check(sigismember(&pending, SIGUSR2), "blocked signal pending");
+    sigprocmask(SIG_UNBLOCK, &set, NULL);
+    check(usr2 == 1, "delivered when unblocked");
+    sigpending(&pending);
+    check(!sigismember(&pending, SIGUSR2), "still pending after delivery");
+
+    pthread_t thread = start(spinner, NULL);
+    tkill(started(&tids[0]), SIGUSR2);
+    wait_done(1, "signal to a thread running guest code");
+    pthread_join(thread, NULL);
+
+    check(pipe(p) == 0, "pipe");
+    thread = start(pipe_reader, NULL);
+    tkill(started(&tids[0]), SIGUSR2);
+    wait_done(1, "signal to a thread reading a pipe");
+    check(result == -EINTR, "pipe read interrupted");
+    pthread_join(thread, NULL);
+
+    thread = start(sleeper, NULL);
+    tkill(started(&tids[0]), SIGUSR2);
+    wait_done(1, "signal to a thread in nanosleep");
+    check(result == -EINTR, "nanosleep interrupted");
+    pthread_join(thread, NULL);
+
+    // threads signalling each other as fast as they can
+    done = 0;
+    for (int i = 0; i < 4; i++)
+        tids[i] = 0;
+    pthread_t storms[4];
+    for (int i = 0; i < 4; i++)
+        check(pthread_create(&storms[i], NULL, storm, (void *) (long) i) == 0, "pthread_create");
+    wait_done(4, "signal storm");
+    for (int i = 0; i < 4; i++)
+        pthread_join(storms[i], NULL);
+    check(usr1 > 0, "storm signals delivered");
+
+    // sigsuspend with the signal blocked until then
+    sigprocmask(SIG_BLOCK, &set, NULL);
+    int before = usr1;
+    thread = start(waker, NULL);
+    sigset_t empty;
+    sigemptyset(&empty);
+    check(sigsuspend(&empty) == -1 && errno == EINTR, "sigsuspend");
+    sigprocmask(SIG_UNBLOCK, &set, NULL);
+    check(usr1 == before + 1, "sigsuspend ran the handler");
+    pthread_join(thread, NULL);
+
+    // lots of children exiting at once
+    for (int i = 0; i < 30; i++)
+        if (fork() == 0)
+            _exit(0);
+    int reaped = 0;
+    while (reaped < 30) {
+        if (wait(NULL) > 0)
+            reaped++;
+        else
+            check(errno == EINTR, "wait");
+    }
+    check(chld > 0, "SIGCHLD delivered");
+
+    printf("ok\n");
+}
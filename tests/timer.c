@@ -0,0 +1,100 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        perror(what);
+        abort();
+    }
+}
+
+static volatile int alarms, usr1;
+static void on_alarm(int sig) {
+    (void) sig;
+    alarms++;
+}
+static void on_usr1(int sig) {
+    (void) sig;
+    usr1++;
+}
+
+// lots of timers due around the same time, all served by the same thread
+#define TIMERS 200
+static int fds[TIMERS];
+static struct pollfd polls[TIMERS];
+
+int main() {
+    for (int i = 0; i < TIMERS; i++) {
+        fds[i] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        check(fds[i] >= 0, "timerfd_create");
+        struct itimerspec value = {{0, 0}, {0, 5000000 + (i % 20) * 1000000}};
+        check(timerfd_settime(fds[i], 0, &value, NULL) == 0, "timerfd_settime");
+    }
+    struct itimerspec cur;
+    check(timerfd_gettime(fds[0], &cur) == 0, "timerfd_gettime");
+    check(cur.it_value.tv_sec == 0 && cur.it_value.tv_nsec > 0 && cur.it_value.tv_nsec <= 5000000, "time left");
+    uint64_t count;
+    check(read(fds[TIMERS - 1], &count, 8) == -1 && errno == EAGAIN, "not expired yet");
+    usleep(60000);
+    for (int i = 0; i < TIMERS; i++)
+        polls[i] = (struct pollfd) {fds[i], POLLIN, 0};
+    check(poll(polls, TIMERS, 0) == TIMERS, "all expired");
+    for (int i = 0; i < TIMERS; i++)
+        check(read(fds[i], &count, 8) == 8 && count == 1, "one expiration each");
+
+    // an interval keeps counting while nobody reads
+    struct itimerspec interval = {{0, 2000000}, {0, 2000000}};
+    check(timerfd_settime(fds[0], 0, &interval, NULL) == 0, "interval");
+    usleep(50000);
+    check(read(fds[0], &count, 8) == 8 && count >= 15 && count <= 30, "interval expirations");
+    struct itimerspec off = {{0, 0}, {0, 0}}, old;
+    check(timerfd_settime(fds[0], 0, &off, &old) == 0 && old.it_interval.tv_nsec == 2000000, "disarm");
+    check(timerfd_gettime(fds[0], &cur) == 0 && cur.it_value.tv_sec == 0 && cur.it_value.tv_nsec == 0, "disarmed");
+
+    // absolute times
+    struct itimerspec abs = {{0, 0}, {0, 0}};
+    clock_gettime(CLOCK_MONOTONIC, &abs.it_value);
+    abs.it_value.tv_nsec += 10000000;
+    if (abs.it_value.tv_nsec >= 1000000000) {
+        abs.it_value.tv_nsec -= 1000000000;
+        abs.it_value.tv_sec++;
+    }
+    check(timerfd_settime(fds[1], TFD_TIMER_ABSTIME, &abs, NULL) == 0, "absolute");
+    polls[0] = (struct pollfd) {fds[1], POLLIN, 0};
+    check(poll(polls, 1, 1000) == 1, "absolute timer fired");
+    for (int i = 0; i < TIMERS; i++)
+        close(fds[i]);
+
+    // signals from the same thread
+    signal(SIGALRM, on_alarm);
+    struct itimerval itv = {{0, 10000}, {0, 10000}};
+    check(setitimer(ITIMER_REAL, &itv, NULL) == 0, "setitimer");
+    for (int i = 0; i < 100 && alarms < 5; i++)
+        usleep(10000);
+    check(alarms >= 5, "SIGALRMs");
+    struct itimerval zero = {{0, 0}, {0, 0}}, got;
+    check(setitimer(ITIMER_REAL, &zero, NULL) == 0, "disarm setitimer");
+    check(getitimer(ITIMER_REAL, &got) == 0 && got.it_value.tv_sec == 0 && got.it_value.tv_usec == 0, "getitimer");
+
+    signal(SIGUSR1, on_usr1);
+    struct sigevent sev = {.sigev_notify = SIGEV_SIGNAL, .sigev_signo = SIGUSR1};
+    timer_t timer;
+    check(timer_create(CLOCK_MONOTONIC, &sev, &timer) == 0, "timer_create");
+    struct itimerspec once = {{0, 0}, {0, 10000000}};
+    check(timer_settime(timer, 0, &once, NULL) == 0, "timer_settime");
+    for (int i = 0; i < 100 && usr1 == 0; i++)
+        usleep(5000);
+    check(usr1 == 1, "posix timer fired once");
+    check(timer_delete(timer) == 0, "timer_delete");
+
+    printf("ok\n");
+}
@@ -0,0 +1,86 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <pthread.h>
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        perror(what);
+        abort();
+    }
+}
+
+// bigger than the pty input queue, so it wraps around a few times
+#define BIG 200000
+static char big[BIG], out[BIG];
+static int master, slave;
+
+static void *writer(void *arg) {
+    check(write(master, big, BIG) == BIG, "big write");
+    return arg;
+}
+
+int main() {
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 && errno == ENOENT) {
+        // not every root filesystem has the device node
+        printf("skipped, no /dev/ptmx\n");
+        return 0;
+    }
+    check(master >= 0, "open /dev/ptmx");
+    check(grantpt(master) == 0 && unlockpt(master) == 0, "unlock");
+    slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    check(slave >= 0, "open the slave");
+
+    struct termios t;
+    check(tcgetattr(slave, &t) == 0, "tcgetattr");
+    t.c_lflag &= ~ECHO;
+    check(tcsetattr(slave, TCSANOW, &t) == 0, "turn off echo");
+
+    // lines keep going in and out until the queue has wrapped around, and
+    // erasing never eats into a line that's already finished
+    char line[44];
+    for (int i = 0; i < 2000; i++) {
+        for (int j = 0; j < 39; j++)
+            line[j] = 'a' + (i + j) % 26;
+        line[39] = '\x7f';
+        line[40] = '\n';
+        line[41] = '\x7f';
+        line[42] = 'o';
+        line[43] = '\n';
+        check(write(master, line, 44) == 44, "write lines");
+        char got[64];
+        check(read(slave, got, sizeof(got)) == 39, "read a line");
+        for (int j = 0; j < 38; j++)
+            check(got[j] == 'a' + (i + j) % 26, "line data");
+        check(got[38] == '\n', "erase");
+        check(read(slave, got, sizeof(got)) == 2 && got[0] == 'o' && got[1] == '\n', "erase stops at the end of a line");
+    }
+
+    // raw, a big write has to wait for the reader, and comes out in order
+    t.c_iflag = 0;
+    t.c_lflag &= ~(ISIG | ICANON);
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+    check(tcsetattr(slave, TCSANOW, &t) == 0, "raw mode");
+    for (int i = 0; i < BIG; i++)
+        big[i] = (char) (i * 7);
+    pthread_t thread;
+    check(pthread_create(&thread, NULL, writer, NULL) == 0, "pthread_create");
+    long total = 0;
+    while (total < BIG) {
+        ssize_t r = read(slave, out + total, BIG - total);
+        check(r > 0, "raw read");
+        total += r;
+    }
+    pthread_join(thread, NULL);
+    for (int i = 0; i < BIG; i++)
+        check(out[i] == big[i], "raw data");
+
+    printf("ok\n");
+}
@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        perror(what);
+        abort();
+    }
+}
+
+static ssize_t send_fd(int sock, int fd) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = {"f", 1};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(sock, &msg, 0);
+}
+
+static char buf[65536];
+static int sv[2];
+void *bad_address = (void *) 16;
+
+#define CHUNK 10000
+#define CHUNKS 400
+static void *writer(void *arg) {
+    static char chunk[CHUNK];
+    for (int i = 0; i < CHUNKS; i++) {
+        for (int j = 0; j < CHUNK; j++)
+            chunk[j] = (char) (i * 7 + j);
+        check(write(sv[0], chunk, CHUNK) == CHUNK, "short write");
+    }
+    close(sv[0]);
+    return arg;
+}
+
+int main() {
+    signal(SIGPIPE, SIG_IGN);
+
+    check(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair");
+    check(write(sv[0], "ping", 4) == 4, "write");
+    check(write(sv[0], "pong", 4) == 4, "write again");
+    check(read(sv[1], buf, sizeof(buf)) == 8 && buf[4] == 'p', "stream writes coalesce");
+    check(shutdown(sv[0], SHUT_WR) == 0, "shutdown");
+    check(read(sv[1], buf, sizeof(buf)) == 0, "eof after shutdown");
+    check(write(sv[0], "x", 1) == -1 && errno == EPIPE, "write after shutdown");
+    close(sv[0]);
+    close(sv[1]);
+
+    // a writer thread outrunning the reader fills the buffer and waits, and
+    // everything still arrives in order
+    check(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair");
+    pthread_t t;
+    check(pthread_create(&t, NULL, writer, NULL) == 0, "pthread_create");
+    usleep(50000);
+    check(read(sv[1], bad_address, 100) == -1 && errno == EFAULT, "read to a bad address");
+    long total = 0;
+    bool bad = false;
+    for (;;) {
+        ssize_t n = read(sv[1], buf, 30000);
+        check(n >= 0, "read while the writer runs");
+        if (n == 0)
+            break;
+        for (ssize_t k = 0; k < n; k++) {
+            long pos = total + k;
+            if (buf[k] != (char) ((pos / CHUNK) * 7 + pos % CHUNK))
+                bad = true;
+        }
+        total += n;
+    }
+    pthread_join(t, NULL);
+    check(total == CHUNK * CHUNKS && !bad, "data through the socket");
+    close(sv[1]);
+
+    // a pipe passed with SCM_RIGHTS works on the other side
+    int p[2];
+    check(pipe(p) == 0, "pipe");
+    check(write(p[1], "through", 7) == 7, "write to the pipe");
+    check(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair");
+    check(send_fd(sv[0], p[0]) == 1, "send the read end");
+    close(p[0]);
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = {buf, sizeof(buf)};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+    check(recvmsg(sv[1], &msg, 0) == 1 && buf[0] == 'f', "recvmsg");
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    check(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS, "cmsg");
+    int passed;
+    memcpy(&passed, CMSG_DATA(cmsg), sizeof(int));
+    check(read(passed, buf, sizeof(buf)) == 7 && buf[0] == 't', "read the passed pipe");
+
+    // with no room for the fds they get closed and the message says so
+    check(send_fd(sv[0], p[1]) == 1, "send the write end");
+    msg.msg_control = NULL;
+    msg.msg_controllen = 0;
+    check(recvmsg(sv[1], &msg, 0) == 1 && msg.msg_flags & MSG_CTRUNC, "MSG_CTRUNC");
+
+    // read() has nowhere to put fds either, so it has to close them too
+    check(close(passed) == 0, "close the passed read end");
+    check(pipe2(p, O_NONBLOCK) == 0, "pipe2");
+    check(send_fd(sv[0], p[1]) == 1, "send the write end again");
+    close(p[1]);
+    check(read(sv[1], buf, sizeof(buf)) == 1 && buf[0] == 'f', "read drops the fds");
+    check(read(p[0], buf, sizeof(buf)) == 0, "no write end left after read");
+    close(p[0]);
+
+    // and so does closing a socket with fds still queued
+    check(pipe2(p, O_NONBLOCK) == 0, "pipe2");
+    check(send_fd(sv[0], p[1]) == 1, "send the write end once more");
+    close(p[1]);
+    close(sv[1]);
+    check(read(p[0], buf, sizeof(buf)) == 0, "no write end left after close");
+    close(p[0]);
+    close(sv[0]);
+
+    // datagrams keep their boundaries, and fds go with them
+    check(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == 0, "datagram socketpair");
+    check(pipe2(p, O_NONBLOCK) == 0, "pipe2");
+    check(send_fd(sv[0], p[1]) == 1, "send over a datagram socket");
+    close(p[1]);
+    check(write(sv[0], "abc", 3) == 3, "datagram write");
+    check(read(sv[1], buf, sizeof(buf)) == 1, "first datagram");
+    check(read(sv[1], buf, sizeof(buf)) == 3 && buf[2] == 'c', "second datagram");
+    check(read(p[0], buf, sizeof(buf)) == 0, "no write end left after a datagram read");
+
+    printf("ok\n");
+}
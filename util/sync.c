@@ -2,74 +2,154 @@
 #include <limits.h>
 #include "kernel/task.h"
 #include "util/sync.h"
+#include "util/timer.h"
 #include "debug.h"
 #include "kernel/errno.h"
 
-void cond_init(cond_t *cond) {
+void waiter_init(struct waiter *waiter) {
+    pthread_mutex_init(&waiter->lock, NULL);
     pthread_condattr_t attr;
     pthread_condattr_init(&attr);
 #if __linux__
     pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
 #endif
-    pthread_cond_init(&cond->cond, &attr);
+    pthread_cond_init(&waiter->cond, &attr);
+    waiter->woken = false;
+    waiter->generation = 0;
+    list_init(&waiter->links);
 }
-void cond_destroy(cond_t *cond) {
-    pthread_cond_destroy(&cond->cond);
+void waiter_destroy(struct waiter *waiter) {
+    pthread_cond_destroy(&waiter->cond);
+    pthread_mutex_destroy(&waiter->lock);
 }
 
-int wait_for(cond_t *cond, lock_t *lock, struct timespec *timeout) {
-    if (current && current->pending)
-        return _EINTR;
-    int err = wait_for_ignore_signals(cond, lock, timeout);
-    if (err < 0)
-        return _ETIMEDOUT;
-    if (current && current->pending)
-        return _EINTR;
-    return 0;
+void waiter_wake(struct waiter *waiter) {
+    pthread_mutex_lock(&waiter->lock);
+    waiter->woken = true;
+    pthread_cond_signal(&waiter->cond);
+    pthread_mutex_unlock(&waiter->lock);
 }
-int wait_for_ignore_signals(cond_t *cond, lock_t *lock, struct timespec *timeout) {
-    if (current) {
-        lock(&current->waiting_cond_lock);
-        current->waiting_cond = cond;
-        current->waiting_lock = lock;
-        unlock(&current->waiting_cond_lock);
+
+void waiter_wake_generation(struct waiter *waiter, unsigned generation) {
+    pthread_mutex_lock(&waiter->lock);
+    if (waiter->generation == generation) {
+        waiter->woken = true;
+        pthread_cond_signal(&waiter->cond);
     }
-    int rc = 0;
-    if (!timeout) {
-        pthread_cond_wait(&cond->cond, &lock->m);
+    pthread_mutex_unlock(&waiter->lock);
+}
+
+void cond_init(cond_t *cond) {
+    lock_init(&cond->lock);
+    list_init(&cond->waiters);
+}
+void cond_destroy(cond_t *cond) {
+    pthread_mutex_destroy(&cond->lock.m);
+}
+
+// threads that aren't running a task, like the timer thread, use this one
+static __thread struct waiter thread_waiter;
+static __thread bool thread_waiter_ready;
+
+// With signals set, also stops waiting when the task has a signal to receive.
+// The waiter goes on the condition's list before the lock is released, so a
+// notify that happens with the lock held after that can't be missed.
+static int wait_on(cond_t *cond, lock_t *lock, struct timespec *timeout, bool signals) {
+    struct waiter *waiter = NULL;
+    if (current != NULL) {
+        waiter = &current->waiter;
     } else {
-#if __linux__
-        struct timespec abs_timeout;
-        clock_gettime(CLOCK_MONOTONIC, &abs_timeout);
-        abs_timeout.tv_sec += timeout->tv_sec;
-        abs_timeout.tv_nsec += timeout->tv_nsec;
-        if (abs_timeout.tv_nsec > 1000000000) {
-            abs_timeout.tv_sec++;
-            abs_timeout.tv_nsec -= 1000000000;
+        if (!thread_waiter_ready) {
+            waiter_init(&thread_waiter);
+            thread_waiter_ready = true;
         }
-        rc = pthread_cond_timedwait(&cond->cond, &lock->m, &abs_timeout);
+        waiter = &thread_waiter;
+        signals = false;
+    }
+    struct timespec deadline = {0};
+    if (timeout != NULL)
+        deadline = timespec_add(timespec_now(), *timeout);
+
+    pthread_mutex_lock(&waiter->lock);
+    waiter->woken = false;
+    __atomic_store_n(&waiter->generation, waiter->generation + 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&waiter->lock);
+    lock(&cond->lock);
+    list_add_before(&cond->waiters, &waiter->links);
+    unlock(&cond->lock);
+    if (signals)
+        __atomic_store_n(&current->run_state, TASK_WAITING, __ATOMIC_SEQ_CST);
+    unlock(lock);
+
+    int rc = 0;
+    pthread_mutex_lock(&waiter->lock);
+    while (!waiter->woken && !(signals && task_signal_pending(current))) {
+        if (timeout == NULL) {
+            pthread_cond_wait(&waiter->cond, &waiter->lock);
+            continue;
+        }
+#if __linux__
+        rc = pthread_cond_timedwait(&waiter->cond, &waiter->lock, &deadline);
 #elif __APPLE__
-        rc = pthread_cond_timedwait_relative_np(&cond->cond, &lock->m, timeout);
+        struct timespec remaining = timespec_subtract(deadline, timespec_now());
+        rc = ETIMEDOUT;
+        if (timespec_positive(remaining))
+            rc = pthread_cond_timedwait_relative_np(&waiter->cond, &waiter->lock, &remaining);
 #else
 #error Unimplemented pthread_cond_wait relative timeout.
 #endif
+        if (rc == ETIMEDOUT)
+            break;
     }
-    if (current) {
-        lock(&current->waiting_cond_lock);
-        current->waiting_cond = NULL;
-        current->waiting_lock = NULL;
-        unlock(&current->waiting_cond_lock);
-    }
+    pthread_mutex_unlock(&waiter->lock);
+
+    if (signals)
+        __atomic_store_n(&current->run_state, TASK_IN_KERNEL, __ATOMIC_SEQ_CST);
+    lock(&cond->lock);
+    list_remove(&waiter->links);
+    unlock(&cond->lock);
+    lock(lock);
     if (rc == ETIMEDOUT)
         return _ETIMEDOUT;
     return 0;
 }
 
+int wait_for(cond_t *cond, lock_t *lock, struct timespec *timeout) {
+    if (current && task_signal_pending(current))
+        return _EINTR;
+    int err = wait_on(cond, lock, timeout, true);
+    if (err < 0)
+        return _ETIMEDOUT;
+    if (current && task_signal_pending(current))
+        return _EINTR;
+    return 0;
+}
+int wait_for_ignore_signals(cond_t *cond, lock_t *lock, struct timespec *timeout) {
+    return wait_on(cond, lock, timeout, false);
+}
+
 void notify(cond_t *cond) {
-    pthread_cond_broadcast(&cond->cond);
+    lock(&cond->lock);
+    struct waiter *waiter;
+    list_for_each_entry(&cond->waiters, waiter, links) {
+        waiter_wake(waiter);
+    }
+    unlock(&cond->lock);
 }
 void notify_once(cond_t *cond) {
-    pthread_cond_signal(&cond->cond);
+    lock(&cond->lock);
+    struct waiter *waiter;
+    list_for_each_entry(&cond->waiters, waiter, links) {
+        // one that's already been woken doesn't count
+        pthread_mutex_lock(&waiter->lock);
+        bool was_woken = waiter->woken;
+        waiter->woken = true;
+        pthread_cond_signal(&waiter->cond);
+        pthread_mutex_unlock(&waiter->lock);
+        if (!was_woken)
+            break;
+    }
+    unlock(&cond->lock);
 }
 
 __thread sigjmp_buf unwind_buf;
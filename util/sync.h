@@ -5,6 +5,7 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include <setjmp.h>
+#include "util/list.h"
 
 // locks, implemented using pthread
 
@@ -45,14 +46,41 @@ static inline void unlock(lock_t *lock) {
 #endif
 }
 #define unlock(lock) pthread_mutex_unlock(&(lock)->m)
+static inline bool trylock(lock_t *lock) {
+    if (pthread_mutex_trylock(&lock->m) != 0)
+        return false;
+    lock->owner = pthread_self();
+    return true;
+}
 
-// conditions, implemented using pthread conditions but hacked so you can also
-// be woken by a signal
+// conditions, implemented as a list of waiting threads that each sleep on a
+// pthread condition of their own, so a signal can wake a task up without
+// knowing what it's waiting for
 
-typedef struct {
+struct waiter {
+    pthread_mutex_t lock;
     pthread_cond_t cond;
+    bool woken;
+    // goes up every time the thread starts waiting
+    unsigned generation;
+    struct list links;
+};
+void waiter_init(struct waiter *waiter);
+void waiter_destroy(struct waiter *waiter);
+// Wakes up the waiter's thread if it's waiting on something
+void waiter_wake(struct waiter *waiter);
+// For waking a waiter that isn't on a condition's list, so the wait it was
+// in could be over by the time this gets to it. Take the generation before
+// deciding to wake it, and only the wait it was in then gets woken.
+static inline unsigned waiter_generation(struct waiter *waiter) {
+    return __atomic_load_n(&waiter->generation, __ATOMIC_SEQ_CST);
+}
+void waiter_wake_generation(struct waiter *waiter, unsigned generation);
+
+typedef struct {
+    lock_t lock;
+    struct list waiters;
 } cond_t;
-#define COND_INITIALIZER {PTHREAD_COND_INITIALIZER}
 
 // Must call before using the condition
 void cond_init(cond_t *cond);
@@ -88,6 +116,7 @@ static inline void wrlock_init(wrlock_t *lock) {
 #define read_wrlock(lock) pthread_rwlock_rdlock(lock)
 #define read_wrunlock(lock) pthread_rwlock_unlock(lock)
 #define write_wrlock(lock) pthread_rwlock_wrlock(lock)
+#define write_wrtrylock(lock) (pthread_rwlock_trywrlock(lock) == 0)
 #define write_wrunlock(lock) pthread_rwlock_unlock(lock)
 
 extern __thread sigjmp_buf unwind_buf;
@@ -1,84 +1,207 @@
 #include <stdlib.h>
-#include <signal.h>
 #include <time.h>
 #include "util/timer.h"
+#include "kernel/errno.h"
 #include "misc.h"
 
-struct timer *timer_new(timer_callback_t callback, void *data) {
-    struct timer *timer = malloc(sizeof(struct timer));
-    timer->callback = callback;
-    timer->data = data;
-    timer->running = false;
-    timer->dead = false;
-    lock_init(&timer->lock);
-    return timer;
+// protects every timer and the heap
+static lock_t timers_lock = LOCK_INITIALIZER;
+// notified when the first timer in the heap changes, and when a callback returns
+static cond_t timers_cond;
+static struct timer **timers_heap;
+static size_t timers_count;
+static size_t timers_capacity;
+// whose callback is running right now
+static struct timer *timers_firing;
+static pthread_t timers_thread;
+static bool timers_thread_started;
+
+static bool timespec_before(struct timespec x, struct timespec y) {
+    return x.tv_sec < y.tv_sec || (x.tv_sec == y.tv_sec && x.tv_nsec < y.tv_nsec);
 }
 
-void timer_free(struct timer *timer) {
-    lock(&timer->lock);
-    if (timer->running) {
-        timer->running = false;
-        timer->dead = true;
-        pthread_kill(timer->thread, SIGUSR1);
-        unlock(&timer->lock);
-    } else {
-        unlock(&timer->lock);
-        if (!timer->dead)
-            free(timer);
+static void timers_heap_place(struct timer *timer, size_t i) {
+    timers_heap[i] = timer;
+    timer->heap_index = i;
+}
+
+static void timers_sift_up(size_t i) {
+    struct timer *timer = timers_heap[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!timespec_before(timer->fire, timers_heap[parent]->fire))
+            break;
+        timers_heap_place(timers_heap[parent], i);
+        i = parent;
     }
+    timers_heap_place(timer, i);
 }
 
-static void *timer_thread(void *param) {
-    struct timer *timer = param;
-    lock(&timer->lock);
+static void timers_sift_down(size_t i) {
+    struct timer *timer = timers_heap[i];
     while (true) {
-        struct timespec remaining = timespec_subtract(timer->end, timespec_now());
-        while (timer->running && timespec_positive(remaining)) {
-            unlock(&timer->lock);
-            nanosleep(&remaining, NULL);
-            lock(&timer->lock);
-            remaining = timespec_subtract(timer->end, timespec_now());
+        size_t child = i * 2 + 1;
+        if (child >= timers_count)
+            break;
+        if (child + 1 < timers_count && timespec_before(timers_heap[child + 1]->fire, timers_heap[child]->fire))
+            child++;
+        if (!timespec_before(timers_heap[child]->fire, timer->fire))
+            break;
+        timers_heap_place(timers_heap[child], i);
+        i = child;
+    }
+    timers_heap_place(timer, i);
+}
+
+static int timers_heap_insert(struct timer *timer) {
+    if (timers_count == timers_capacity) {
+        size_t new_capacity = timers_capacity ? timers_capacity * 2 : 16;
+        struct timer **new_heap = realloc(timers_heap, new_capacity * sizeof(struct timer *));
+        if (new_heap == NULL)
+            return _ENOMEM;
+        timers_heap = new_heap;
+        timers_capacity = new_capacity;
+    }
+    timers_heap_place(timer, timers_count++);
+    timers_sift_up(timer->heap_index);
+    return 0;
+}
+
+static void timers_heap_remove(struct timer *timer) {
+    size_t i = timer->heap_index;
+    struct timer *last = timers_heap[--timers_count];
+    if (last == timer)
+        return;
+    timers_heap_place(last, i);
+    timers_sift_down(i);
+    timers_sift_up(last->heap_index);
+}
+
+static void timer_update_fire(struct timer *timer) {
+    timer->fire = timer->end;
+    if (timer->coalesce) {
+        long slot = timer->fire.tv_nsec % TIMER_COALESCE_NS;
+        if (slot != 0)
+            timer->fire = timespec_add(timer->fire, (struct timespec) {.tv_nsec = TIMER_COALESCE_NS - slot});
+    }
+}
+
+static void *timer_service(void *UNUSED(param)) {
+    lock(&timers_lock);
+    while (true) {
+        if (timers_count == 0) {
+            wait_for_ignore_signals(&timers_cond, &timers_lock, NULL);
+            continue;
         }
-        if (timer->running)
-            timer->callback(timer->data);
+        struct timer *timer = timers_heap[0];
+        struct timespec remaining = timespec_subtract(timer->fire, timespec_now());
+        if (timespec_positive(remaining)) {
+            wait_for_ignore_signals(&timers_cond, &timers_lock, &remaining);
+            continue;
+        }
+
+        timers_heap_remove(timer);
         if (timespec_positive(timer->interval)) {
             timer->start = timer->end;
             timer->end = timespec_add(timer->start, timer->interval);
+            timer_update_fire(timer);
+            // the heap just shrank, so there's room
+            timers_heap_insert(timer);
         } else {
-            break;
+            timer->running = false;
         }
+        timers_firing = timer;
+        unlock(&timers_lock);
+        timer->callback(timer->data);
+        lock(&timers_lock);
+        timers_firing = NULL;
+        if (timer->dead)
+            free(timer);
+        notify(&timers_cond);
     }
-    timer->running = false;
-    if (timer->dead)
-        free(timer);
-    else
-        unlock(&timer->lock);
     return NULL;
 }
 
+struct timer *timer_new(timer_callback_t callback, void *data) {
+    struct timer *timer = malloc(sizeof(struct timer));
+    if (timer == NULL)
+        return NULL;
+    *timer = (struct timer) {.callback = callback, .data = data};
+    return timer;
+}
+
+void timer_free(struct timer *timer) {
+    lock(&timers_lock);
+    if (timer->running) {
+        timers_heap_remove(timer);
+        timer->running = false;
+    }
+    if (timers_firing == timer) {
+        // the callback is freeing its own timer, so the service thread has to do it after
+        if (pthread_equal(pthread_self(), timers_thread)) {
+            timer->dead = true;
+            unlock(&timers_lock);
+            return;
+        }
+        while (timers_firing == timer)
+            wait_for_ignore_signals(&timers_cond, &timers_lock, NULL);
+    }
+    unlock(&timers_lock);
+    free(timer);
+}
+
+// must hold timers_lock
+static void timer_get_locked(struct timer *timer, struct timespec now, struct timer_spec *spec) {
+    spec->value = (struct timespec) {};
+    spec->interval = (struct timespec) {};
+    if (timer->running) {
+        if (timespec_before(now, timer->end))
+            spec->value = timespec_subtract(timer->end, now);
+        else
+            spec->value.tv_nsec = 1; // about to fire
+        spec->interval = timer->interval;
+    }
+}
+
+void timer_get(struct timer *timer, struct timer_spec *spec) {
+    lock(&timers_lock);
+    timer_get_locked(timer, timespec_now(), spec);
+    unlock(&timers_lock);
+}
+
 int timer_set(struct timer *timer, struct timer_spec spec, struct timer_spec *oldspec) {
-    lock(&timer->lock);
+    lock(&timers_lock);
     struct timespec now = timespec_now();
-    if (oldspec != NULL) {
-        oldspec->value = timespec_subtract(timer->end, now);
-        oldspec->interval = timer->interval;
+    if (oldspec != NULL)
+        timer_get_locked(timer, now, oldspec);
+
+    if (!timers_thread_started) {
+        cond_init(&timers_cond);
+        if (pthread_create(&timers_thread, NULL, timer_service, NULL) != 0) {
+            unlock(&timers_lock);
+            return _ENOMEM;
+        }
+        pthread_detach(timers_thread);
+        timers_thread_started = true;
     }
 
+    if (timer->running) {
+        timers_heap_remove(timer);
+        timer->running = false;
+    }
     timer->start = now;
     timer->end = timespec_add(timer->start, spec.value);
     timer->interval = spec.interval;
+    int err = 0;
     if (!timespec_is_zero(spec.value)) {
-        if (!timer->running) {
+        timer_update_fire(timer);
+        err = timers_heap_insert(timer);
+        if (err >= 0) {
             timer->running = true;
-            pthread_create(&timer->thread, NULL, timer_thread, timer);
-            pthread_detach(timer->thread);
-        }
-    } else {
-        if (timer->running) {
-            timer->running = false;
-            pthread_kill(timer->thread, SIGUSR1);
+            if (timer->heap_index == 0)
+                notify(&timers_cond);
         }
     }
-    unlock(&timer->lock);
-    return 0;
+    unlock(&timers_lock);
+    return err;
 }
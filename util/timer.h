@@ -42,18 +42,26 @@ static inline bool timespec_positive(struct timespec ts) {
 }
 
 typedef void (*timer_callback_t)(void *data);
+// All timers are serviced by one thread, which keeps the armed ones in a heap
+// ordered by when they fire. Callbacks run on that thread with no locks held,
+// so they shouldn't block for long.
 struct timer {
     struct timespec start;
     struct timespec end;
     struct timespec interval;
+    // when the service thread will fire it, later than end if coalescing
+    struct timespec fire;
 
     bool running;
-    pthread_t thread;
+    // fire on the next TIMER_COALESCE_NS boundary instead of exactly at the
+    // end, so timers that don't need to be precise can share wakeups
+    bool coalesce;
     timer_callback_t callback;
     void *data;
-    lock_t lock;
+    size_t heap_index;
     bool dead;
 };
+#define TIMER_COALESCE_NS 4000000
 
 struct timer *timer_new(timer_callback_t callback, void *data);
 void timer_free(struct timer *timer);
@@ -66,5 +74,7 @@ struct timer_spec {
     struct timespec interval;
 };
 int timer_set(struct timer *timer, struct timer_spec spec, struct timer_spec *oldspec);
+// what timer_set would put in oldspec
+void timer_get(struct timer *timer, struct timer_spec *spec);
 
 #endif
@@ -1,6 +1,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/stat.h>
 #include "kernel/init.h"
 #include "kernel/fs.h"
 
@@ -19,15 +20,23 @@ static inline int xX_main_Xx(int argc, char *const argv[], char *const *envp) {
     int opt;
     const char *root = "";
     bool has_root = false;
+    const char *upper = NULL;
     const struct fs_ops *fs = &realfs;
-    while ((opt = getopt(argc, argv, "+r:f:")) != -1) {
+    while ((opt = getopt(argc, argv, "+r:f:F:u:")) != -1) {
         switch (opt) {
             case 'r':
             case 'f':
+            case 'F':
                 root = optarg;
                 has_root = true;
                 if (opt == 'f')
                     fs = &fakefs;
+                else if (opt == 'F')
+                    fs = &fakeflatfs;
+                break;
+            case 'u':
+                // changes go here, and the root becomes a read-only lower layer
+                upper = optarg;
                 break;
         }
     }
@@ -37,9 +46,21 @@ static inline int xX_main_Xx(int argc, char *const argv[], char *const *envp) {
         perror(root);
         exit(1);
     }
-    if (fs == &fakefs)
+    char options[MAX_PATH + 16] = "";
+    if (upper != NULL) {
+        // an empty or missing directory is fine, it becomes a new fakefs
+        mkdir(upper, 0777);
+        char upper_realpath[MAX_PATH + 1];
+        if (realpath(upper, upper_realpath) == NULL) {
+            perror(upper);
+            exit(1);
+        }
+        snprintf(options, sizeof(options), "upperdir=%s", upper_realpath);
+        fs = &overlayfs;
+    }
+    if (fs == &fakefs || fs == &fakeflatfs)
         strcat(root_realpath, "/data");
-    int err = mount_root(fs, root_realpath);
+    int err = mount_root(fs, root_realpath, upper != NULL ? options : NULL);
     if (err < 0)
         return err;
 